@@ -226,6 +226,33 @@ int auth_change_mailboxsize(uint64_t user_idnr, uint64_t new_size);
  */
 int auth_validate(ClientBase_T *ci, const char *username, const char *password, uint64_t * user_idnr);
 
+/**
+ * \brief as auth_validate, but without consulting the login cache.
+ * For callers that already did the auth_cache_lookup themselves.
+ */
+int auth_validate_uncached(ClientBase_T *ci, const char *username, const char *password, uint64_t * user_idnr);
+
+/**
+ * \brief look up a recent successful validation of these credentials
+ * \param user_idnr will hold the user_idnr on a hit
+ * \return TRUE on a hit, FALSE otherwise
+ */
+int auth_cache_lookup(ClientBase_T *ci, const char *username, const char *password, uint64_t *user_idnr);
+/**
+ * \brief remember a successful validation; called by the auth modules
+ * for plain username/password logins only.
+ */
+void auth_cache_insert(ClientBase_T *ci, const char *username, const char *password, uint64_t user_idnr);
+/**
+ * \brief forget cached validations for a user, or for everybody if
+ * user_idnr is 0. Called whenever credentials change.
+ */
+void auth_cache_invalidate(uint64_t user_idnr);
+/**
+ * \brief report how many validations were served from the cache
+ */
+void auth_cache_stats(unsigned *hits, unsigned *misses);
+
 /** 
  * \brief try tp validate a user using md5 hash
  * \param username
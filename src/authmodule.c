@@ -117,6 +117,204 @@ int auth_load_driver(void)
 	return 0;
 }
 
+/*
+ * Authentication result cache
+ *
+ * Verifying a password costs a users query and, for crypt and friends,
+ * a deliberately slow hash. Clients reconnect all the time and POP3
+ * pollers log in every minute with the same credentials, so successful
+ * verifications are remembered for auth_cache_ttl seconds. Entries are
+ * keyed by an HMAC of username and password under a random per-process
+ * key, so no password is kept in memory. Changes made through this
+ * process drop the user's entries right away; changes made by other
+ * processes, like dbmail-users, are noticed through the auth generation
+ * counter that every password, username or active state change bumps,
+ * checked at most once a second.
+ */
+
+#define AUTH_CACHE_TTL 60
+#define AUTH_CACHE_SIZE 4096
+
+typedef struct {
+	uint64_t user_idnr;
+	time_t expires;
+} AuthCacheEntry;
+
+static GHashTable *auth_cache = NULL;
+static int auth_cache_ttl = AUTH_CACHE_TTL;
+static guint32 auth_cache_key[8];
+static GOnce auth_cache_once = G_ONCE_INIT;
+static time_t auth_cache_checked = 0;
+static uint64_t auth_cache_generation = 0;
+static unsigned auth_cache_hits = 0;
+static unsigned auth_cache_misses = 0;
+G_LOCK_DEFINE_STATIC(auth_cache_mutex);
+
+static gpointer auth_cache_init(gpointer UNUSED data)
+{
+	Field_T val;
+	unsigned i;
+
+	memset(val, 0, sizeof(Field_T));
+	config_get_value("auth_cache_ttl", "DBMAIL", val);
+	if (strlen(val))
+		auth_cache_ttl = atoi(val);
+
+	TRACE(TRACE_DEBUG, "auth cache ttl [%d]", auth_cache_ttl);
+
+	for (i = 0; i < G_N_ELEMENTS(auth_cache_key); i++)
+		auth_cache_key[i] = g_random_int();
+
+	auth_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	return (gpointer)NULL;
+}
+
+static gboolean auth_cache_usable(ClientBase_T *ci, const char *username, const char *password)
+{
+	g_once(&auth_cache_once, auth_cache_init, NULL);
+
+	if (auth_cache_ttl <= 0)
+		return FALSE;
+	if (ci && ci->auth) // CRAM-MD5
+		return FALSE;
+	if ((! username) || (! username[0]) || (! password) || (! password[0]))
+		return FALSE;
+	return TRUE;
+}
+
+static char * auth_cache_digest(const char *username, const char *password)
+{
+	GHmac *hmac;
+	char *digest;
+
+	hmac = g_hmac_new(G_CHECKSUM_SHA256, (const guchar *)auth_cache_key, sizeof(auth_cache_key));
+	/* include the terminating NUL to separate username and password */
+	g_hmac_update(hmac, (const guchar *)username, strlen(username) + 1);
+	g_hmac_update(hmac, (const guchar *)password, strlen(password));
+	digest = g_strdup(g_hmac_get_string(hmac));
+	g_hmac_unref(hmac);
+
+	return digest;
+}
+
+static gboolean auth_cache_expired(gpointer UNUSED key, gpointer value, gpointer data)
+{
+	return ((AuthCacheEntry *)value)->expires <= *(time_t *)data;
+}
+
+static gboolean auth_cache_match_user(gpointer UNUSED key, gpointer value, gpointer data)
+{
+	return ((AuthCacheEntry *)value)->user_idnr == *(uint64_t *)data;
+}
+
+/* drop everything if credentials changed elsewhere */
+static void auth_cache_check(time_t now)
+{
+	uint64_t generation = 0;
+
+	if (MATCH(db_params.authdriver, "LDAP"))
+		return;
+
+	G_LOCK(auth_cache_mutex);
+	if (auth_cache_checked == now) {
+		G_UNLOCK(auth_cache_mutex);
+		return;
+	}
+	auth_cache_checked = now;
+	G_UNLOCK(auth_cache_mutex);
+
+	if (db_auth_generation(&generation) != DM_SUCCESS)
+		return;
+
+	G_LOCK(auth_cache_mutex);
+	if (generation != auth_cache_generation) {
+		TRACE(TRACE_DEBUG, "credentials changed; flushing auth cache");
+		auth_cache_generation = generation;
+		g_hash_table_remove_all(auth_cache);
+	}
+	G_UNLOCK(auth_cache_mutex);
+}
+
+int auth_cache_lookup(ClientBase_T *ci, const char *username, const char *password, uint64_t *user_idnr)
+{
+	AuthCacheEntry *e;
+	time_t now = time(NULL);
+	char *key;
+	int found = FALSE;
+
+	if (! auth_cache_usable(ci, username, password))
+		return FALSE;
+
+	auth_cache_check(now);
+
+	key = auth_cache_digest(username, password);
+
+	G_LOCK(auth_cache_mutex);
+	if ((e = g_hash_table_lookup(auth_cache, key))) {
+		if (e->expires > now) {
+			*user_idnr = e->user_idnr;
+			found = TRUE;
+		} else {
+			g_hash_table_remove(auth_cache, key);
+		}
+	}
+	if (found)
+		auth_cache_hits++;
+	else
+		auth_cache_misses++;
+	G_UNLOCK(auth_cache_mutex);
+
+	g_free(key);
+
+	if (found)
+		TRACE(TRACE_DEBUG, "[%s] validated from cache", username);
+
+	return found;
+}
+
+void auth_cache_insert(ClientBase_T *ci, const char *username, const char *password, uint64_t user_idnr)
+{
+	AuthCacheEntry *e;
+	time_t now = time(NULL);
+
+	if (! auth_cache_usable(ci, username, password))
+		return;
+
+	e = g_new0(AuthCacheEntry, 1);
+	e->user_idnr = user_idnr;
+	e->expires = now + auth_cache_ttl;
+
+	G_LOCK(auth_cache_mutex);
+	if (g_hash_table_size(auth_cache) >= AUTH_CACHE_SIZE) {
+		g_hash_table_foreach_remove(auth_cache, auth_cache_expired, &now);
+		if (g_hash_table_size(auth_cache) >= AUTH_CACHE_SIZE)
+			g_hash_table_remove_all(auth_cache);
+	}
+	g_hash_table_replace(auth_cache, auth_cache_digest(username, password), e);
+	G_UNLOCK(auth_cache_mutex);
+}
+
+void auth_cache_invalidate(uint64_t user_idnr)
+{
+	g_once(&auth_cache_once, auth_cache_init, NULL);
+
+	G_LOCK(auth_cache_mutex);
+	if (user_idnr)
+		g_hash_table_foreach_remove(auth_cache, auth_cache_match_user, &user_idnr);
+	else
+		g_hash_table_remove_all(auth_cache);
+	G_UNLOCK(auth_cache_mutex);
+}
+
+void auth_cache_stats(unsigned *hits, unsigned *misses)
+{
+	G_LOCK(auth_cache_mutex);
+	*hits = auth_cache_hits;
+	*misses = auth_cache_misses;
+	G_UNLOCK(auth_cache_mutex);
+}
+
 /* This is the first auth_* call anybody should make. */
 int auth_connect(void)
 {
@@ -154,20 +352,24 @@ int auth_check_user_ext(const char *username, GList **userids, GList **fwds, int
 	{ return auth->check_user_ext(username, userids, fwds, checks); }
 int auth_adduser(const char *username, const char *password, const char *enctype,
 		uint64_t clientid, uint64_t maxmail, uint64_t * user_idnr)
-	{ return auth->adduser(username, password, enctype,
-			clientid, maxmail, user_idnr); }
+	{ int r = auth->adduser(username, password, enctype,
+			clientid, maxmail, user_idnr);
+	  dsnuser_cache_invalidate(); return r; }
 int auth_delete_user(const char *username)
-	{ return auth->delete_user(username); }
+	{ int r = auth->delete_user(username); dsnuser_cache_invalidate(); auth_cache_invalidate(0); return r; }
 int auth_change_username(uint64_t user_idnr, const char *new_name)
-	{ return auth->change_username(user_idnr, new_name); }
+	{ int r = auth->change_username(user_idnr, new_name); dsnuser_cache_invalidate(); auth_cache_invalidate(user_idnr); return r; }
 int auth_change_password(uint64_t user_idnr,
 		const char *new_pass, const char *enctype)
-	{ return auth->change_password(user_idnr, new_pass, enctype); }
+	{ int r = auth->change_password(user_idnr, new_pass, enctype); auth_cache_invalidate(user_idnr); return r; }
 int auth_change_clientid(uint64_t user_idnr, uint64_t new_cid)
 	{ return auth->change_clientid(user_idnr, new_cid); }
 int auth_change_mailboxsize(uint64_t user_idnr, uint64_t new_size)
 	{ return auth->change_mailboxsize(user_idnr, new_size); }
 int auth_validate(ClientBase_T *ci, const char *username, const char *password, uint64_t * user_idnr)
+	{ if (auth_cache_lookup(ci, username, password, user_idnr)) return 1;
+	  return auth->validate(ci, username, password, user_idnr); }
+int auth_validate_uncached(ClientBase_T *ci, const char *username, const char *password, uint64_t * user_idnr)
 	{ return auth->validate(ci, username, password, user_idnr); }
 uint64_t auth_md5_validate(ClientBase_T *ci, char *username,
 		unsigned char *md5_apop_he, char *apop_stamp)
@@ -178,14 +380,14 @@ GList * auth_get_user_aliases(uint64_t user_idnr)
 GList * auth_get_aliases_ext(const char *alias)
 	{ return auth->get_aliases_ext(alias); }
 int auth_addalias(uint64_t user_idnr, const char *alias, uint64_t clientid)
-	{ return auth->addalias(user_idnr, alias, clientid); }
+	{ int r = auth->addalias(user_idnr, alias, clientid); dsnuser_cache_invalidate(); return r; }
 int auth_addalias_ext(const char *alias, const char *deliver_to,
 		uint64_t clientid)
-	{ return auth->addalias_ext(alias, deliver_to, clientid); }
+	{ int r = auth->addalias_ext(alias, deliver_to, clientid); dsnuser_cache_invalidate(); return r; }
 int auth_removealias(uint64_t user_idnr, const char *alias)
-	{ return auth->removealias(user_idnr, alias); }
+	{ int r = auth->removealias(user_idnr, alias); dsnuser_cache_invalidate(); return r; }
 int auth_removealias_ext(const char *alias, const char *deliver_to)
-	{ return auth->removealias_ext(alias, deliver_to); }
+	{ int r = auth->removealias_ext(alias, deliver_to); dsnuser_cache_invalidate(); return r; }
 gboolean auth_requires_shadow_user(void)
 	{ return auth->requires_shadow_user(); }
 
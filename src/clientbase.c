@@ -128,6 +128,134 @@ static int client_error_cb(int sock, int error, void *arg)
 	return r;
 }
 
+/*
+ * reverse lookups
+ *
+ * with resolve_ip enabled client names are resolved through evdns,
+ * so a slow nameserver never blocks the event loop. Results, both
+ * positive and negative, are kept for a while so reconnecting clients
+ * don't cause new lookups.
+ */
+
+#define DNS_CACHE_TTL 600
+#define DNS_CACHE_NEGATIVE_TTL 60
+#define DNS_CACHE_SIZE 4096
+
+typedef struct {
+	Field_T name;
+	time_t expires;
+} DnsCacheEntry;
+
+static GHashTable *dns_cache = NULL;
+G_LOCK_DEFINE_STATIC(dns_cache_mutex);
+
+static gboolean dns_cache_lookup(const char *ip, char *name)
+{
+	DnsCacheEntry *e;
+	gboolean found = FALSE;
+
+	G_LOCK(dns_cache_mutex);
+	if (dns_cache && (e = g_hash_table_lookup(dns_cache, ip))) {
+		if (e->expires > time(NULL)) {
+			g_strlcpy(name, e->name, NI_MAXHOST);
+			found = TRUE;
+		} else {
+			g_hash_table_remove(dns_cache, ip);
+		}
+	}
+	G_UNLOCK(dns_cache_mutex);
+
+	return found;
+}
+
+static void dns_cache_insert(const char *ip, const char *name, int ttl)
+{
+	DnsCacheEntry *e = g_new0(DnsCacheEntry, 1);
+
+	if (name)
+		g_strlcpy(e->name, name, NI_MAXHOST);
+	e->expires = time(NULL) + ttl;
+
+	G_LOCK(dns_cache_mutex);
+	if (! dns_cache)
+		dns_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	if (g_hash_table_size(dns_cache) >= DNS_CACHE_SIZE)
+		g_hash_table_remove_all(dns_cache);
+	g_hash_table_replace(dns_cache, g_strdup(ip), e);
+	G_UNLOCK(dns_cache_mutex);
+}
+
+static void client_resolve_cb(int result, char type, int count, int ttl, void *addresses, void *arg)
+{
+	ClientBase_T *client = (ClientBase_T *)arg;
+	const char *name = NULL;
+
+	if (result == DNS_ERR_CANCEL)
+		return; // client is gone
+
+	client->dns = NULL;
+
+	if ((result == DNS_ERR_NONE) && (type == DNS_PTR) && (count > 0))
+		name = ((char **)addresses)[0];
+
+	if (name) {
+		g_strlcpy(client->clientname, name, NI_MAXHOST);
+		dns_cache_insert(client->src_ip, name, min(max(ttl, DNS_CACHE_NEGATIVE_TTL), DNS_CACHE_TTL));
+	} else {
+		TRACE(TRACE_INFO, "reverse lookup failed for [%s]: %s", 
+				client->src_ip, evdns_err_to_string(result));
+		dns_cache_insert(client->src_ip, NULL, DNS_CACHE_NEGATIVE_TTL);
+	}
+
+	TRACE(TRACE_NOTICE, "[%p] client [%s:%s] resolved to [%s]", client,
+			client->src_ip, client->src_port,
+			client->clientname[0] ? client->clientname : "Lookup failed");
+}
+
+static void client_resolve(ClientBase_T *client)
+{
+	client_sock *c = client->sock;
+	int serr;
+
+	if (dns_cache_lookup(client->src_ip, client->clientname))
+		return;
+
+	if (! (client->reactor && client->reactor->dnsbase)) {
+		if ((serr = getnameinfo(&c->caddr, c->caddr_len, client->clientname,
+						NI_MAXHOST-1, NULL, 0, NI_NAMEREQD))) {
+			TRACE(TRACE_INFO, "getnameinfo:error [%s]", gai_strerror(serr));
+		}
+		dns_cache_insert(client->src_ip, client->clientname, 
+				client->clientname[0] ? DNS_CACHE_TTL : DNS_CACHE_NEGATIVE_TTL);
+		return;
+	}
+
+	if (c->caddr.sa_family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&c->caddr;
+		client->dns = evdns_base_resolve_reverse(client->reactor->dnsbase, &sin->sin_addr, 0,
+				client_resolve_cb, client);
+	} else if (c->caddr.sa_family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&c->caddr;
+		client->dns = evdns_base_resolve_reverse_ipv6(client->reactor->dnsbase, &sin6->sin6_addr, 0,
+				client_resolve_cb, client);
+	}
+}
+
+static void client_log_latency(ClientBase_T *client, const char *what)
+{
+	struct timeval now;
+	double ms;
+
+	if (! client->sock->accepted.tv_sec)
+		return;
+
+	gettimeofday(&now, NULL);
+	ms = (now.tv_sec - client->sock->accepted.tv_sec) * 1000.0 + 
+		(now.tv_usec - client->sock->accepted.tv_usec) / 1000.0;
+
+	TRACE(TRACE_INFO, "[%p] accept-to-%s [%.3f] ms", client, what, ms);
+}
+
 ClientBase_T * client_init(client_sock *c)
 {
 	int serr;
@@ -137,6 +265,7 @@ ClientBase_T * client_init(client_sock *c)
 	client           = mempool_pop(pool, sizeof(ClientBase_T));
 	client->pool     = pool;
 	client->sock     = c;
+	client->reactor  = server_reactor();
 	client->cb_error = client_error_cb;
 
 	pthread_mutex_init(&client->lock, NULL);
@@ -158,24 +287,21 @@ ClientBase_T * client_init(client_sock *c)
 		}
 
 		/* client-side */
-		if (server_conf->resolveIP) {
-			if ((serr = getnameinfo(&c->caddr, c->caddr_len, client->clientname,
-						       	NI_MAXHOST-1, NULL, 0, NI_NAMEREQD))) {
-				TRACE(TRACE_INFO, "getnameinfo:error [%s]", gai_strerror(serr));
-			} 
+		if ((serr = getnameinfo(&c->caddr, c->caddr_len, client->src_ip,
+						NI_MAXHOST-1, client->src_port,
+						NI_MAXSERV-1, NI_NUMERICHOST | NI_NUMERICSERV))) {
+			TRACE(TRACE_INFO, "getnameinfo:error [%s]", gai_strerror(serr));
+		} 
 
+		if (server_conf->resolveIP)
+			client_resolve(client);
+
+		if (client->clientname[0]) {
 			TRACE(TRACE_NOTICE, "incoming connection on [%s:%s] from [%s:%s (%s)]",
 					client->dst_ip, client->dst_port,
 					client->src_ip, client->src_port,
-					client->clientname[0] ? client->clientname : "Lookup failed");
+					client->clientname);
 		} else {
-
-			if ((serr = getnameinfo(&c->caddr, c->caddr_len, client->src_ip,
-						       	NI_MAXHOST-1, client->src_port,
-						       	NI_MAXSERV-1, NI_NUMERICHOST | NI_NUMERICSERV))) {
-				TRACE(TRACE_INFO, "getnameinfo:error [%s]", gai_strerror(serr));
-			} 
-
 			TRACE(TRACE_NOTICE, "incoming connection on [%s:%s] from [%s:%s]", 
 					client->dst_ip, client->dst_port,
 					client->src_ip, client->src_port);
@@ -197,9 +323,12 @@ ClientBase_T * client_init(client_sock *c)
 	return client;
 }
 
+static int ci_deflate(ClientBase_T *client, const char *s, size_t n, int flush);
+
 void ci_cork(ClientBase_T *s)
 {
 	TRACE(TRACE_DEBUG,"[%p] [%d] [%d]", s, s->rx, s->tx);
+	s->corked = TRUE;
 	if (s->rev) event_del(s->rev);
 	if (s->wev) event_del(s->wev);
 }
@@ -216,14 +345,98 @@ void ci_uncork(ClientBase_T *s)
 	if (state & CLIENT_ERR)
 		return;
 
-	if (! (state & CLIENT_EOF))
+	s->corked = FALSE;
+
+	/* replies written while corked were deflated without flushing */
+	if (s->zout && s->zpending && ci_deflate(s, NULL, 0, Z_SYNC_FLUSH) < 0) {
+		PLOCK(s->lock);
+		s->client_state |= CLIENT_ERR;
+		PUNLOCK(s->lock);
+		return;
+	}
+
+	if (s->tls_pending)
+		return; // resumed when the handshake completes
+
+	if (s->rev && ! (state & CLIENT_EOF))
 		event_add(s->rev, &s->timeout);
-	event_add(s->wev, NULL);
+	if (s->wev)
+		event_add(s->wev, NULL);
+}
+
+/*
+ * TLS handshakes are driven by the event loop as a non-blocking
+ * state machine: SSL_accept is retried whenever the socket becomes
+ * readable or writable, and regular IO on the client is suspended
+ * until the handshake has completed.
+ */
+static int ci_tls_accept(ClientBase_T *client);
+
+static void ci_tls_accept_cb(int UNUSED fd, short what, void *arg)
+{
+	ClientBase_T *client = (ClientBase_T *)arg;
+
+	if (what & EV_TIMEOUT) {
+		TRACE(TRACE_NOTICE, "[%p] TLS handshake timed out", client);
+		client->tls_pending = FALSE;
+		PLOCK(client->lock);
+		client->client_state |= CLIENT_ERR;
+		PUNLOCK(client->lock);
+	} else if (ci_tls_accept(client) > 0) {
+		return; // still pending
+	}
+
+	if (client->client_state & CLIENT_ERR) {
+		// let the session notice and clean up
+		if (client->rev)
+			event_active(client->rev, EV_READ, 1);
+		return;
+	}
+
+	ci_uncork(client);
+}
+
+static int ci_tls_accept(ClientBase_T *client)
+{
+	int e, err;
+	short what;
+	struct timeval timeout;
+
+	if ((e = SSL_accept(client->sock->ssl)) == 1) {
+		client->tls_pending = FALSE;
+		client->sock->ssl_state = TRUE;
+		client_log_latency(client, "tls");
+		return DM_SUCCESS;
+	}
+
+	err = SSL_get_error(client->sock->ssl, e);
+	if ((err == SSL_ERROR_WANT_READ) || (err == SSL_ERROR_WANT_WRITE)) {
+		what = (err == SSL_ERROR_WANT_READ) ? EV_READ : EV_WRITE;
+		if (client->tev)
+			event_free(client->tev);
+		client->tev = event_new(client->reactor->base, client->rx, what, ci_tls_accept_cb, client);
+		timeout.tv_sec = server_conf->login_timeout;
+		timeout.tv_usec = 0;
+		event_add(client->tev, &timeout);
+		client->tls_pending = TRUE;
+		return 1;
+	}
+
+	client->cb_error(client->rx, e, (void *)client);
+	SSL_shutdown(client->sock->ssl);
+	SSL_free(client->sock->ssl);
+	client->sock->ssl = NULL;
+	client->tls_pending = FALSE;
+	PLOCK(client->lock);
+	client->client_state |= CLIENT_ERR;
+	PUNLOCK(client->lock);
+	TRACE(TRACE_DEBUG, "[%p] SSL_accept hard failure", client);
+
+	return DM_EGENERAL;
 }
 
 int ci_starttls(ClientBase_T *client)
 {
-	int e;
 	TRACE(TRACE_DEBUG,"[%p] ssl_state [%d]", client, client->sock->ssl_state);
 	if (client->sock->ssl && client->sock->ssl_state > 0) {
 		TRACE(TRACE_WARNING, "ssl already initialized");
@@ -239,28 +452,172 @@ int ci_starttls(ClientBase_T *client)
 	}
 
 	if (! client->sock->ssl_state) {
-		if ((e = SSL_accept(client->sock->ssl)) != 1) {
-			int e2;
-			if ((e2 = client->cb_error(client->rx, e, (void *)client))) {
-				SSL_shutdown(client->sock->ssl);
-				SSL_free(client->sock->ssl);
-				client->sock->ssl = NULL;
-				TRACE(TRACE_DEBUG, "[%p] SSL_accept hard failure",
-						client);
-				return DM_EGENERAL;
-			}
-		}
+		if (ci_tls_accept(client) == DM_EGENERAL)
+			return DM_EGENERAL;
+
+		// TLS is active from the session's point of view,
+		// even while the handshake is still in progress
 		client->sock->ssl_state = TRUE;
-		ci_write(client,NULL);
+		if (! client->tls_pending)
+			ci_write(client,NULL);
+	}
+
+	return DM_SUCCESS;
+}
+
+/*
+ * COMPRESS=DEFLATE (RFC 4978)
+ *
+ * Once active, output is run through a raw deflate stream before it
+ * is handed to TLS or the socket, and input is inflated as soon as it
+ * has been read. While the client is corked (a command is running)
+ * replies are deflated without flushing, so pipelined responses share
+ * one compression window; the sync flush happens on uncork, or on
+ * any write-out while uncorked, so responses including IDLE updates
+ * are never held back inside zlib.
+ */
+
+#define ZBUFLEN 16384
+
+static uint64_t ci_usec_since(struct timeval *before)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - before->tv_sec) * 1000000 + (now.tv_usec - before->tv_usec);
+}
+
+static int ci_deflate(ClientBase_T *client, const char *s, size_t n, int flush)
+{
+	char zbuf[ZBUFLEN];
+	z_stream *z = client->zout;
+	struct timeval before;
+
+	gettimeofday(&before, NULL);
+
+	z->next_in = (Bytef *)s;
+	z->avail_in = n;
+	do {
+		z->next_out = (Bytef *)zbuf;
+		z->avail_out = sizeof(zbuf);
+		if (deflate(z, flush) == Z_STREAM_ERROR) {
+			TRACE(TRACE_ERR, "[%p] deflate failed", client);
+			return -1;
+		}
+		p_string_append_len(client->write_buffer, zbuf, sizeof(zbuf) - z->avail_out);
+	} while (z->avail_out == 0);
+
+	client->zpending = (flush == Z_NO_FLUSH);
+
+	client->zbytes_tx += n;
+	client->zusec += ci_usec_since(&before);
+
+	return 0;
+}
+
+static int ci_inflate(ClientBase_T *client, const char *s, size_t n)
+{
+	char zbuf[ZBUFLEN];
+	z_stream *z = client->zin;
+	struct timeval before;
+	size_t have;
+	int r;
+
+	gettimeofday(&before, NULL);
+
+	z->next_in = (Bytef *)s;
+	z->avail_in = n;
+	do {
+		z->next_out = (Bytef *)zbuf;
+		z->avail_out = sizeof(zbuf);
+		r = inflate(z, Z_SYNC_FLUSH);
+		if (r != Z_OK && r != Z_BUF_ERROR && r != Z_STREAM_END) {
+			TRACE(TRACE_INFO, "[%p] inflate failed [%s]", client, z->msg ? z->msg : "");
+			return -1;
+		}
+		have = sizeof(zbuf) - z->avail_out;
+		p_string_append_len(client->read_buffer, zbuf, have);
+		client->zbytes_rx += have;
+	} while (z->avail_out == 0 && r != Z_STREAM_END);
+
+	client->zusec += ci_usec_since(&before);
+
+	return 0;
+}
+
+int ci_compress(ClientBase_T *client)
+{
+	z_stream *zin, *zout;
+	uint64_t pending;
+
+	if (client->zout) {
+		TRACE(TRACE_WARNING, "[%p] compression already active", client);
+		return DM_EGENERAL;
+	}
+
+	zout = g_new0(z_stream, 1);
+	if (deflateInit2(zout, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		TRACE(TRACE_ERR, "[%p] deflateInit2 failed", client);
+		g_free(zout);
+		return DM_EGENERAL;
+	}
+	zin = g_new0(z_stream, 1);
+	if (inflateInit2(zin, -MAX_WBITS) != Z_OK) {
+		TRACE(TRACE_ERR, "[%p] inflateInit2 failed", client);
+		deflateEnd(zout);
+		g_free(zout);
+		g_free(zin);
+		return DM_EGENERAL;
 	}
 
+	client->zin = zin;
+	client->zout = zout;
+
+	/* anything the client sent after the COMPRESS command
+	 * is already compressed */
+	pending = p_string_len(client->read_buffer) - client->read_buffer_offset;
+	if (pending) {
+		char *rest = g_strndup(p_string_str(client->read_buffer) + client->read_buffer_offset, pending);
+		p_string_truncate(client->read_buffer, 0);
+		client->read_buffer_offset = 0;
+		if (ci_inflate(client, rest, pending) < 0) {
+			PLOCK(client->lock);
+			client->client_state |= CLIENT_ERR;
+			PUNLOCK(client->lock);
+		}
+		g_free(rest);
+	}
+
+	TRACE(TRACE_DEBUG, "[%p] DEFLATE active", client);
+
 	return DM_SUCCESS;
 }
 
+static void ci_compress_close(ClientBase_T *client)
+{
+	if (! client->zout)
+		return;
+
+	TRACE(TRACE_INFO, "[%p] DEFLATE tx [%" PRIu64 "] -> [%" PRIu64 "] rx [%" PRIu64 "] <- [%" PRIu64 "] zlib [%" PRIu64 "] usec",
+			client, client->zbytes_tx, client->bytes_tx,
+			client->zbytes_rx, client->bytes_rx, client->zusec);
+
+	deflateEnd(client->zout);
+	inflateEnd(client->zin);
+	g_free(client->zout);
+	g_free(client->zin);
+	client->zout = NULL;
+	client->zin = NULL;
+}
+
 void ci_write_cb(ClientBase_T *client)
 {
-	uint64_t rest = ci_wbuf_len(client);
+	uint64_t rest;
 	int result = 0;
+
+	if (client->tls_pending)
+		return;
+
+	rest = ci_wbuf_len(client);
 	if (rest) {
 	       result = ci_write(client,NULL);
 	       switch(result) {
@@ -299,11 +656,36 @@ int ci_write(ClientBase_T *client, char * msg, ...)
 	if (msg) {
 		va_start(ap, msg);
 		va_copy(cp, ap);
-		p_string_append_vprintf(client->write_buffer, msg, cp);
+		if (client->zout) {
+			char *plain = g_strdup_vprintf(msg, cp);
+			e = ci_deflate(client, plain, strlen(plain),
+					client->corked ? Z_NO_FLUSH : Z_SYNC_FLUSH);
+			g_free(plain);
+		} else {
+			p_string_append_vprintf(client->write_buffer, msg, cp);
+		}
 		va_end(cp);
 		va_end(ap);
+		if (e < 0) {
+			PLOCK(client->lock);
+			client->client_state |= CLIENT_ERR;
+			PUNLOCK(client->lock);
+			return -1;
+		}
 	}
 
+	if (client->zout && client->zpending && ! client->corked) {
+		if (ci_deflate(client, NULL, 0, Z_SYNC_FLUSH) < 0) {
+			PLOCK(client->lock);
+			client->client_state |= CLIENT_ERR;
+			PUNLOCK(client->lock);
+			return -1;
+		}
+	}
+
+	if (client->tls_pending)
+		return 0; // flushed when the handshake completes
+
 	left = ci_wbuf_len(client);
 	while (left > 0) {
 		n = left;
@@ -312,11 +694,11 @@ int ci_write(ClientBase_T *client, char * msg, ...)
 		s = (char *)p_string_str(client->write_buffer) + client->write_buffer_offset;
 
 		if (client->sock->ssl) {
-			if (! client->tls_wbuf_n) {
-				strncpy(client->tls_wbuf, s, n);
+			/* a retry must use the same length; the data at
+			 * the write offset is never changed in between */
+			if (! client->tls_wbuf_n)
 				client->tls_wbuf_n = n;
-			}
-			t = (int64_t)SSL_write(client->sock->ssl, (gconstpointer)client->tls_wbuf, client->tls_wbuf_n);
+			t = (int64_t)SSL_write(client->sock->ssl, (gconstpointer)s, client->tls_wbuf_n);
 		} else {
 			t = (int64_t)write(client->tx, (gconstpointer)s, n);
 		}
@@ -346,13 +728,14 @@ int ci_write(ClientBase_T *client, char * msg, ...)
 
 		TRACE(TRACE_DEBUG, "[%p] S > [%" PRId64 "/%" PRIu64 ":%s]", client, t, left, s);
 
+		if ((! client->bytes_tx) && (t > 0))
+			client_log_latency(client, "greeting");
+
 		client->bytes_tx += t;	// Update our byte counter
 		client->write_buffer_offset += t;
 		client_wbuf_scale(client);
-		if (client->sock->ssl) {
-			memset(client->tls_wbuf, '\0', TLS_SEGMENT);
+		if (client->sock->ssl)
 			client->tls_wbuf_n = 0;
-		}
 
 		left = ci_wbuf_len(client);
 	}
@@ -391,6 +774,13 @@ void ci_read_cb(ClientBase_T *client)
 	char ibuf[IBUFLEN];
 	int state;
 
+	PLOCK(client->lock);
+	state = client->client_state;
+	PUNLOCK(client->lock);
+
+	if ((state & CLIENT_ERR) || client->tls_pending)
+		return;
+
 	while (TRUE) {
 		memset(ibuf, 0, sizeof(ibuf));
 		if (client->sock->ssl) {
@@ -432,7 +822,16 @@ void ci_read_cb(ClientBase_T *client)
 			PLOCK(client->lock);
 			client->client_state = CLIENT_OK; 
 			PUNLOCK(client->lock);
-			p_string_append_len(client->read_buffer, ibuf, t);
+			if (client->zin) {
+				if (ci_inflate(client, ibuf, t) < 0) {
+					PLOCK(client->lock);
+					client->client_state |= CLIENT_ERR;
+					PUNLOCK(client->lock);
+					break;
+				}
+			} else {
+				p_string_append_len(client->read_buffer, ibuf, t);
+			}
 		}
 	}
 }
@@ -461,6 +860,30 @@ int ci_read(ClientBase_T *client, char *buffer, size_t n)
 	return client->len;
 }
 
+int ci_read_stream(ClientBase_T *client, GMimeStream *stream, size_t n)
+{
+	// move up to n bytes from the read buffer into a stream
+	size_t avail;
+	char *s;
+
+	assert(stream);
+
+	client->len = 0;
+	s = (char *)p_string_str(client->read_buffer) + client->read_buffer_offset;
+	avail = p_string_len(client->read_buffer) - client->read_buffer_offset;
+	if (n > avail)
+		n = avail;
+	if (n) {
+		if (g_mime_stream_write(stream, s, n) < 0)
+			return -1;
+		client->read_buffer_offset += n;
+		client->len = n;
+		client_rbuf_scale(client);
+	}
+
+	return client->len;
+}
+
 int ci_readln(ClientBase_T *client, char * buffer)
 {
 	// fetch a line from the read buffer
@@ -558,6 +981,16 @@ void ci_close(ClientBase_T *client)
 
 	ci_cork(client);
 
+	if (client->dns) {
+		evdns_cancel_request(client->reactor->dnsbase, client->dns);
+		client->dns = NULL;
+	}
+
+	if (client->tev) {
+		event_free(client->tev);
+		client->tev = NULL;
+	}
+
 	if (client->rev) {
 		event_free(client->rev);
 	       	client->rev = NULL;
@@ -581,6 +1014,7 @@ void ci_close(ClientBase_T *client)
 	}
 
 	ci_authlog_close(client);
+	ci_compress_close(client);
 
 	if (client->auth) {
 		Cram_T c = client->auth;
@@ -28,6 +28,7 @@
 ClientBase_T * client_init(client_sock *);
 
 int    ci_starttls(ClientBase_T *);
+int    ci_compress(ClientBase_T *);
 void   ci_cork(ClientBase_T *);
 void   ci_uncork(ClientBase_T *);
 void   ci_authlog_init(ClientBase_T *, const char *, const char *, const char *);
@@ -37,6 +38,7 @@ void   ci_write_cb(ClientBase_T *);
 
 int    ci_read(ClientBase_T *, char *, size_t);
 int    ci_readln(ClientBase_T *, char *);
+int    ci_read_stream(ClientBase_T *, GMimeStream *, size_t);
 int    ci_write(ClientBase_T *, char *, ...);
 
 size_t ci_wbuf_len(ClientBase_T *);
@@ -27,7 +27,6 @@
 #define THIS_MODULE "clientsession"
 
 extern ServerConfig_T *server_conf;
-extern struct event_base *evbase;
 
 ClientSession_T * client_session_new(client_sock *c)
 {
@@ -53,9 +52,9 @@ ClientSession_T * client_session_new(client_sock *c)
 	create_unique_id(unique_id, 0);
 	session->apop_stamp = g_strdup_printf("<%s@%s>", unique_id, session->hostname);
 
-	assert(evbase);
-        ci->rev = event_new(evbase, ci->rx, EV_READ|EV_PERSIST, socket_read_cb, (void *)session);
-        ci->wev = event_new(evbase, ci->tx, EV_WRITE, socket_write_cb, (void *)session);
+	assert(ci->reactor);
+        ci->rev = event_new(ci->reactor->base, ci->rx, EV_READ|EV_PERSIST, socket_read_cb, (void *)session);
+        ci->wev = event_new(ci->reactor->base, ci->tx, EV_WRITE, socket_write_cb, (void *)session);
 	ci_cork(ci);
 
 	session->ci = ci;
@@ -85,6 +84,14 @@ void client_session_reset(ClientSession_T * session)
 
 	session->from = p_list_new(session->pool);
 
+	if (session->spool) {
+		g_object_unref(session->spool);
+		session->spool = NULL;
+	}
+	session->chunk_size = 0;
+	session->chunk_last = FALSE;
+	session->binarymime = FALSE;
+
 	if (session->apop_stamp) {
 		g_free(session->apop_stamp);
 		session->apop_stamp = NULL;
@@ -38,5 +38,7 @@ int pop3_handle_connection(client_sock *c);
 int imap_handle_connection(client_sock *c);
 int tims_handle_connection(client_sock *c);
 int lmtp_handle_connection(client_sock *c);
+int lmtp_tokenizer(ClientSession_T *session, char *buffer);
+int lmtp(ClientSession_T *session);
 
 #endif
@@ -161,6 +161,9 @@ typedef struct {
 	int part_key;
 	int part_depth;
 	int part_order;
+	Connection_T store_c;		/* caller's transaction, or NULL */
+	gboolean store_failed;
+	GHashTable *store_headers;	/* header rows linked in store_c */
 
 } DbmailMessage;
 
@@ -223,7 +226,8 @@ enum IMAP_COMMAND_TYPES {
 	IMAP_COMM_IDLE,                 // 37
 	IMAP_COMM_STARTTLS,             // 38
 	IMAP_COMM_ID,                   // 39
-	IMAP_COMM_LAST                  // 40
+	IMAP_COMM_COMPRESS,             // 40
+	IMAP_COMM_LAST                  // 41
 };
 
 typedef enum { 
@@ -287,9 +291,29 @@ typedef struct  {
 	socklen_t caddr_len;
 	struct sockaddr saddr;
 	socklen_t saddr_len;
+	struct timeval accepted;	/* time of accept() */
 	void (*cb_close) (void *);	/* termination callback */
 } client_sock;
 
+// event loop; one per reactor thread
+typedef struct {
+	int id;
+	pthread_t thread;
+	struct event_base *base;
+	struct evdns_base *dnsbase;	/* async reverse lookups */
+	struct event *heartbeat;	/* self-pipe event */
+	int selfpipe[2];
+	pthread_mutex_t lock;		/* protects selfpipe */
+	GAsyncQueue *queue;		/* completions from worker threads */
+	int socketcount;
+	int ssl_socketcount;
+	int *listenSockets;
+	int *ssl_listenSockets;
+	struct event **evsock;		/* listen events */
+	gboolean running;		/* thread started and not joined */
+	unsigned reloads;		/* SIGHUP reloads handled */
+} Reactor_T;
+
 //
 
 #define TLS_SEGMENT	262144
@@ -313,6 +337,10 @@ typedef struct {
 	void (*cb_pipe) (void *);	/* callback for self-pipe events */
 
 	struct event *rev, *wev;  	/* read event, write event */
+	struct event *tev;		/* tls handshake event */
+	gboolean tls_pending;		/* tls handshake in progress */
+	struct evdns_request *dns;	/* pending reverse lookup */
+	Reactor_T *reactor;		/* owning event loop */
 	void (*cb_time) (void *);
 	void (*cb_write) (void *);
 	int (*cb_error) (int fd, int error, void *);
@@ -332,8 +360,14 @@ typedef struct {
 
 	int service_before_smtp;
 
-	char tls_wbuf[TLS_SEGMENT];	/* buffer to write during tls session */
-	uint64_t tls_wbuf_n;		/* number of octets to write during tls session */
+	uint64_t tls_wbuf_n;		/* number of octets to retry during tls session */
+
+	z_stream *zin, *zout;		/* COMPRESS=DEFLATE streams, NULL if not active */
+	uint64_t zbytes_rx;		/* inflated octets received */
+	uint64_t zbytes_tx;		/* octets handed to deflate */
+	uint64_t zusec;			/* time spent in zlib */
+	gboolean zpending;		/* deflated input not yet sync flushed */
+	gboolean corked;		/* events removed by ci_cork */
 
 	uint64_t rbuff_size;              /* size of string-literals */
 	String_T read_buffer;		/* input buffer */
@@ -381,6 +415,10 @@ typedef struct {
 	List_T messagelst;		/** list of messages */
 	List_T from;			// lmtp senders
 	List_T rcpt;			// lmtp recipients
+	GMimeStream *spool;		// lmtp message data (DATA or BDAT)
+	uint64_t chunk_size;		// lmtp BDAT octets still to be read
+	gboolean chunk_last;		// lmtp BDAT ... LAST
+	gboolean binarymime;		// lmtp MAIL FROM ... BODY=BINARYMIME
 } ClientSession_T;
 
 typedef struct {
@@ -402,6 +440,7 @@ typedef struct {
 	gboolean ssl;
 	int backlog;
 	int resolveIP;
+	int reactors;			// number of event loops
 	struct evhttp **evhs;           // http server sockets list
 	Field_T service_name;
         Field_T process_name;
@@ -415,6 +454,9 @@ typedef struct {
         Field_T tls_cert;
         Field_T tls_key;
         Field_T tls_ciphers;
+	Field_T tls_ticket_keyfile;
+	int tls_ticket_rotation;
+	gboolean tls_ktls;
 	int (*ClientHandler) (client_sock *);
 	void (*cb) (struct evhttp_request *, void *);
 	GTree *security_actions;
@@ -537,6 +579,9 @@ typedef struct {
 	bool vanished;
 
 	List_T   bodyfetch;
+
+	/* implicit \Seen updates waiting for the end of the command */
+	gpointer seen;
 } fetch_items;
 
 typedef struct {
@@ -554,21 +599,62 @@ typedef struct {
 
 /*
  * cached message info
+ *
+ * MailboxState keeps these records packed in chunks,
+ * in uid order. Keep them small.
  */
 #define IMAP_NFLAGS 6
 typedef struct { // map dbmail_messages
-	uint64_t mailbox_id;
-	uint64_t msn;
 	uint64_t uid;
+	uint64_t msn;
 	uint64_t rfcsize;
 	uint64_t seq;
-	int status;
-	char internaldate[IMAP_INTERNALDATE_LEN];
-	int flags[IMAP_NFLAGS];
-	// reference dbmail_keywords
+	time_t internaldate;		// seconds since the epoch (UTC)
+	uint8_t status;
+	uint8_t flags;			// one bit per IMAP_FLAG_*
+	// reference dbmail_keywords; interned strings
 	GList *keywords;
 } MessageInfo;
 
+/*
+ * one entry of a paged mailbox listing
+ */
+typedef struct {
+	MessageInfo info;
+	char *envelope;			// cached IMAP envelope, if any
+} MessageSummary;
+
+#define MSGINFO_FLAG(m, f) (((m)->flags >> (f)) & 1)
+#define MSGINFO_SET_FLAG(m, f, v) \
+	((m)->flags = (v) ? ((m)->flags | (1 << (f))) : ((m)->flags & ~(1 << (f))))
+
+/* one message of an APPEND or MULTIAPPEND */
+typedef struct {
+	const char *msgdata;		// raw message
+	const char *internal_date;	// optional IMAP date-time
+	int flags[IMAP_NFLAGS];
+	GList *keywords;
+	uint64_t msg_idnr;		// set when stored
+	time_t internaldate;		// set when stored, as in the database
+} AppendMessage_T;
+
+/* one mailbox a delivered message is linked into */
+typedef struct {
+	uint64_t useridnr;
+	uint64_t mailbox_idnr;
+	int result;			// DM_SUCCESS, DM_EQUERY or -2 (quotum)
+	gpointer data;			// caller's context
+} DeliveryTarget_T;
+
+/* change to the message counters of a mailbox, summed up per command */
+typedef struct {
+	uint64_t mailbox_idnr;
+	int64_t exists;			// messages with status NEW or SEEN
+	int64_t unseen;			// of those, without the seen flag
+	int64_t recent;			// of those, with the recent flag
+	uint64_t uidnext;		// lower bound for the next uid, or 0
+} MailboxCounters_T;
+
 
 /*************************************************************************
 *                                 SIEVE
@@ -622,6 +708,8 @@ typedef enum {
 	ACL_RIGHT_NONE
 } ACLRight;
 
+#define ACL_RIGHTS_ALL ((1 << ACL_RIGHT_NONE) - 1)
+
 struct  ACLMap {
 	int lookup_flag;
 	int read_flag;
@@ -671,6 +759,7 @@ typedef enum {
 	SQL_RETURNING,
 	SQL_TABLE_EXISTS,
 	SQL_ESCAPE_COLUMN,
-	SQL_COMPARE_BLOB
+	SQL_COMPARE_BLOB,
+	SQL_SUBSTRING
 } sql_fragment;
 #endif
@@ -56,10 +56,151 @@ static int acl_get_rightsstring(uint64_t userid, uint64_t mboxid,
 				/*@out@*/ char *rightsstring);
 
 
+/*
+ * ACL decision cache
+ *
+ * acl_has_right is called several times for every COPY, APPEND, SELECT
+ * and delivery. Rather than querying owner, acl and 'anyone' rows for
+ * each right, the full rights mask for a (user, mailbox) pair is loaded
+ * once and kept for acl_cache_ttl seconds. Changes made through this
+ * process invalidate the cache immediately.
+ */
+
+#define ACL_CACHE_TTL 30
+#define ACL_CACHE_SIZE 4096
+
+typedef struct {
+	uint64_t userid;
+	uint64_t mboxid;
+	unsigned rights;
+	time_t expires;
+} ACLCacheEntry;
+
+static GHashTable *acl_cache = NULL;
+static int acl_cache_ttl = ACL_CACHE_TTL;
+static GOnce acl_cache_once = G_ONCE_INIT;
+G_LOCK_DEFINE_STATIC(acl_cache_mutex);
+
+static guint acl_cache_hash(gconstpointer key)
+{
+	const ACLCacheEntry *e = (const ACLCacheEntry *)key;
+	uint64_t h = (e->userid * 2654435761U) ^ e->mboxid;
+	return (guint)(h ^ (h >> 32));
+}
+
+static gboolean acl_cache_equal(gconstpointer a, gconstpointer b)
+{
+	const ACLCacheEntry *x = (const ACLCacheEntry *)a;
+	const ACLCacheEntry *y = (const ACLCacheEntry *)b;
+	return (x->userid == y->userid) && (x->mboxid == y->mboxid);
+}
+
+static gpointer acl_cache_init(gpointer UNUSED data)
+{
+	Field_T val;
+
+	memset(val, 0, sizeof(Field_T));
+	GETCONFIGVALUE("acl_cache_ttl", "DBMAIL", val);
+	if (strlen(val))
+		acl_cache_ttl = atoi(val);
+
+	TRACE(TRACE_DEBUG, "ACL cache ttl [%d]", acl_cache_ttl);
+
+	acl_cache = g_hash_table_new_full(acl_cache_hash, acl_cache_equal, g_free, NULL);
+
+	return (gpointer)NULL;
+}
+
+static gboolean acl_cache_expired(gpointer key, gpointer UNUSED value, gpointer data)
+{
+	return ((ACLCacheEntry *)key)->expires <= *(time_t *)data;
+}
+
+static gboolean acl_cache_mailbox(gpointer key, gpointer UNUSED value, gpointer data)
+{
+	return ((ACLCacheEntry *)key)->mboxid == *(uint64_t *)data;
+}
+
+static int acl_cache_lookup(uint64_t userid, uint64_t mboxid, unsigned *rights)
+{
+	ACLCacheEntry k, *e;
+	int found = FALSE;
+
+	k.userid = userid;
+	k.mboxid = mboxid;
+
+	G_LOCK(acl_cache_mutex);
+	if ((e = g_hash_table_lookup(acl_cache, &k))) {
+		if (e->expires > time(NULL)) {
+			*rights = e->rights;
+			found = TRUE;
+		} else {
+			g_hash_table_remove(acl_cache, &k);
+		}
+	}
+	G_UNLOCK(acl_cache_mutex);
+
+	return found;
+}
+
+static void acl_cache_insert(uint64_t userid, uint64_t mboxid, unsigned rights)
+{
+	time_t now = time(NULL);
+	ACLCacheEntry *e = g_new0(ACLCacheEntry, 1);
+
+	e->userid = userid;
+	e->mboxid = mboxid;
+	e->rights = rights;
+	e->expires = now + acl_cache_ttl;
+
+	G_LOCK(acl_cache_mutex);
+	if (g_hash_table_size(acl_cache) >= ACL_CACHE_SIZE) {
+		g_hash_table_foreach_remove(acl_cache, acl_cache_expired, &now);
+		if (g_hash_table_size(acl_cache) >= ACL_CACHE_SIZE)
+			g_hash_table_remove_all(acl_cache);
+	}
+	g_hash_table_replace(acl_cache, e, e);
+	G_UNLOCK(acl_cache_mutex);
+}
+
+void acl_cache_invalidate(uint64_t mboxid)
+{
+	g_once(&acl_cache_once, acl_cache_init, NULL);
+
+	G_LOCK(acl_cache_mutex);
+	if (mboxid)
+		g_hash_table_foreach_remove(acl_cache, acl_cache_mailbox, &mboxid);
+	else
+		g_hash_table_remove_all(acl_cache);
+	G_UNLOCK(acl_cache_mutex);
+}
+
+int acl_get_rights(MailboxState_T S, uint64_t userid, unsigned *rights)
+{
+	uint64_t mboxid, anyone_userid = 0;
+
+	g_once(&acl_cache_once, acl_cache_init, NULL);
+
+	mboxid = MailboxState_getId(S);
+
+	if (acl_cache_ttl > 0 && acl_cache_lookup(userid, mboxid, rights))
+		return DM_SUCCESS;
+
+	if (! auth_user_exists(DBMAIL_ACL_ANYONE_USER, &anyone_userid))
+		anyone_userid = 0;
+
+	if (MailboxState_getRights(S, userid, anyone_userid, rights) == DM_EQUERY)
+		return DM_EQUERY;
+
+	if (acl_cache_ttl > 0)
+		acl_cache_insert(userid, mboxid, *rights);
+
+	return DM_SUCCESS;
+}
+
 int acl_has_right(MailboxState_T S, uint64_t userid, ACLRight right)
 {
-	uint64_t anyone_userid;
-	int test;
+	unsigned rights = 0;
 	
 	switch(right) {
 		case ACL_RIGHT_SEEN:
@@ -84,27 +225,33 @@ int acl_has_right(MailboxState_T S, uint64_t userid, ACLRight right)
 		break;
 	}
 
-	const char *right_flag = acl_right_strings[right];
+	TRACE(TRACE_DEBUG, "checking ACL [%s] for user [%" PRIu64 "] on mailbox [%" PRIu64 "]",
+			acl_right_strings[right], userid, MailboxState_getId(S));
 
-	/* Check if the user has the right; this will also
-	 * return true if the user is the mailbox owner. */
-	if ((test = MailboxState_hasPermission(S, userid, right_flag)))
-		return TRUE;
+	/* The mask includes the rights of the 'anyone' user, and
+	 * all rights if the user is the mailbox owner. */
+	if (acl_get_rights(S, userid, &rights) == DM_EQUERY)
+		return DM_EQUERY;
 
-	/* else check the 'anyone' user */
-	if (auth_user_exists(DBMAIL_ACL_ANYONE_USER, &anyone_userid))
-		return MailboxState_hasPermission(S, anyone_userid, right_flag);
-	
-	return FALSE;
+	return (rights & (1 << right)) ? TRUE : FALSE;
 }
 
 int acl_set_rights(uint64_t userid, uint64_t mboxid, const char *rightsstring)
 {
+	int result;
+
 	if (rightsstring[0] == '-')
-		return acl_change_rights(userid, mboxid, rightsstring, 0);
-	if (rightsstring[0] == '+')
-		return acl_change_rights(userid, mboxid, rightsstring, 1);
-	return acl_replace_rights(userid, mboxid, rightsstring);
+		result = acl_change_rights(userid, mboxid, rightsstring, 0);
+	else if (rightsstring[0] == '+')
+		result = acl_change_rights(userid, mboxid, rightsstring, 1);
+	else
+		result = acl_replace_rights(userid, mboxid, rightsstring);
+
+	/* only after the change is committed, or a concurrent lookup
+	 * could cache the old rights again */
+	acl_cache_invalidate(mboxid);
+
+	return result;
 }
 
 ACLRight acl_get_right_from_char(char right_char)
@@ -206,12 +353,12 @@ acl_set_one_right(uint64_t userid, uint64_t mboxid, ACLRight right, int set)
 }
 
 
-/*
 int acl_delete_acl(uint64_t userid, uint64_t mboxid)
 {
-	return db_acl_delete_acl(userid, mboxid);
+	int result = db_acl_delete_acl(userid, mboxid);
+	acl_cache_invalidate(mboxid);
+	return result;
 }
-*/
 
 char *acl_get_acl(uint64_t mboxid)
 {
@@ -56,8 +56,7 @@ int acl_set_rights(uint64_t userid, uint64_t mboxid, const char *rightsstring);
  *      -  0 if nothing removed (i.e. no acl was found)
  *      -  1 if acl removed
  */
-//int acl_delete_acl(uint64_t userid, uint64_t mboxid);
-#define acl_delete_acl(a,b) db_acl_delete_acl((a),(b))
+int acl_delete_acl(uint64_t userid, uint64_t mboxid);
 
 /**
  * \brief checks if a user has a certain right to a mailbox 
@@ -71,6 +70,25 @@ int acl_set_rights(uint64_t userid, uint64_t mboxid, const char *rightsstring);
  */
 int acl_has_right(MailboxState_T S, uint64_t userid, ACLRight right);
 
+/**
+ * \brief get the rights bitmask of a user on a mailbox
+ *
+ * Served from the per-process ACL cache when possible.
+ * \param S mailbox state
+ * \param userid id of user
+ * \param rights will hold (1 << ACLRight) for every right granted
+ * \return
+ *     - DM_EQUERY on db error
+ *     - DM_SUCCESS otherwise
+ */
+int acl_get_rights(MailboxState_T S, uint64_t userid, unsigned *rights);
+
+/**
+ * \brief drop cached rights for a mailbox
+ * \param mboxid id of mailbox, or 0 to flush the complete cache
+ */
+void acl_cache_invalidate(uint64_t mboxid);
+
 /**
  * \brief get complete acl for a mailbox
  * \param mboxid id of mailbox
@@ -36,6 +36,8 @@ char configFile[PATH_MAX];
 /** dictionary which holds the configuration */
 static GKeyFile *config_dict = NULL;
 static int configured = 0;
+/* a reload swaps the dictionary while other threads read it */
+G_LOCK_DEFINE_STATIC(config_lock);
 
 
 void config_get_file(void)
@@ -87,8 +89,7 @@ int config_create(const char *config_filename)
  */
 int config_read(const char *config_filename)
 {
-	if (configured) 
-		config_free();
+	GKeyFile *dict, *old;
 
 	assert(config_filename != NULL);
 
@@ -96,16 +97,25 @@ int config_read(const char *config_filename)
 	if (stat(config_filename, &buf) == -1)
 		config_create(config_filename);
 
-        config_dict = g_key_file_new();
-	if (! g_key_file_load_from_file(config_dict, config_filename, G_KEY_FILE_NONE, NULL)) {
-		g_key_file_free(config_dict);
+        dict = g_key_file_new();
+	if (! g_key_file_load_from_file(dict, config_filename, G_KEY_FILE_NONE, NULL)) {
+		g_key_file_free(dict);
                 TRACE(TRACE_EMERG, "error reading config [%s]", config_filename);
 		_exit(1);
 		return -1;
 	}
+
+	G_LOCK(config_lock);
+	old = config_dict;
+	config_dict = dict;
+	configured = 1;
+	G_UNLOCK(config_lock);
+
+	if (old)
+		g_key_file_free(old);
+
 	// silence the glib logger
 	g_log_set_default_handler((GLogFunc)null_logger, NULL);
-	configured = 1;
         return 0;
 }
 
@@ -114,10 +124,13 @@ int config_read(const char *config_filename)
  */
 void config_free(void) 
 {
-	if (!configured) return;
-	g_key_file_free(config_dict);
-	config_dict = NULL;
-	configured = 0;
+	G_LOCK(config_lock);
+	if (configured) {
+		g_key_file_free(config_dict);
+		config_dict = NULL;
+		configured = 0;
+	}
+	G_UNLOCK(config_lock);
 }
 
 /* Return 1 if found, 0 if not. */
@@ -131,9 +144,11 @@ static int config_get_value_once(const Field_T field_name,
 	int retval = 0;
 
 	assert(service_name);
-	assert(config_dict);
 
+	G_LOCK(config_lock);
+	assert(config_dict);
 	dict_value = g_key_file_get_value(config_dict, service_name, field_name, NULL);
+	G_UNLOCK(config_lock);
         if (dict_value) {
 		char *end;
 		end = g_strstr_len(dict_value, FIELDSIZE, "#");
@@ -157,11 +157,13 @@ void mailbox_match_free(struct mailbox_match *m)
 
 
 /** list of tables used in dbmail */
-#define DB_NTABLES 20
+#define DB_NTABLES 21
 const char *DB_TABLENAMES[DB_NTABLES] = {
 	"acl",
 	"aliases",
+	"bodystructure",
 	"envelope",
+	"generations",
 	"header",
 	"headername",
 	"headervalue",
@@ -352,6 +354,16 @@ void db_con_clear(Connection_T c)
 	return;
 }
 
+/*
+ * number of statements sent to the database by this process
+ */
+static volatile gint db_statements = 0;
+
+unsigned db_statement_count(void)
+{
+	return (unsigned)g_atomic_int_get(&db_statements);
+}
+
 void log_query_time(char *query, struct timeval before, struct timeval after)
 {
 	unsigned int elapsed = (unsigned int)diff_time(before, after);
@@ -379,6 +391,7 @@ gboolean db_exec(Connection_T c, const char *q, ...)
         va_end(ap);
 
 	TRACE(TRACE_DATABASE,"[%p] [%s]", c, query);
+	g_atomic_int_inc(&db_statements);
 	TRY
 		gettimeofday(&before, NULL);
 		Connection_execute(c, "%s", (const char *)query);
@@ -412,6 +425,7 @@ ResultSet_T db_query(Connection_T c, const char *q, ...)
 	g_strstrip(query);
 
 	TRACE(TRACE_DATABASE,"[%p] [%s]", c, query);
+	g_atomic_int_inc(&db_statements);
 	TRY
 		gettimeofday(&before, NULL);
 		r = Connection_executeQuery(c, "%s", (const char *)query);
@@ -443,6 +457,7 @@ gboolean db_update(const char *q, ...)
 
 	c = db_con_get();
 	TRACE(TRACE_DATABASE,"[%p] [%s]", c, query);
+	g_atomic_int_inc(&db_statements);
 	TRY
 		gettimeofday(&before, NULL);
 		db_begin_transaction(c);
@@ -475,6 +490,7 @@ PreparedStatement_T db_stmt_prepare(Connection_T c, const char *q, ...)
 	va_end(ap);
 
 	TRACE(TRACE_DATABASE,"[%p] [%s]", c, query);
+	g_atomic_int_inc(&db_statements);
 	s = Connection_prepareStatement(c, "%s", (const char *)query);
 	g_free(query);
 	return s;
@@ -681,6 +697,9 @@ static const char * db_get_sqlite_sql(sql_fragment frag)
 		case SQL_COMPARE_BLOB:
 			return "%s=?";
 		break;
+		case SQL_SUBSTRING:
+			return "SUBSTR(%s,?,?)";
+		break;
 	}
 	return NULL;
 }
@@ -737,6 +756,9 @@ static const char * db_get_mysql_sql(sql_fragment frag)
 		case SQL_COMPARE_BLOB:
 			return "%s=?";
 		break;
+		case SQL_SUBSTRING:
+			return "SUBSTRING(%s,?,?)";
+		break;
 	}
 	return NULL;
 }
@@ -796,6 +818,9 @@ static const char * db_get_pgsql_sql(sql_fragment frag)
 		case SQL_COMPARE_BLOB:
 			return "%s=?";
 		break;
+		case SQL_SUBSTRING:
+			return "SUBSTRING(%s FROM ?::int FOR ?::int)";
+		break;
 	}
 	return NULL;
 }
@@ -852,6 +877,8 @@ static const char * db_get_oracle_sql(sql_fragment frag)
 		case SQL_COMPARE_BLOB:
 			return "DBMS_LOB.COMPARE(%s,?) = 0";
 		break;
+		case SQL_SUBSTRING:
+		break;
 	}
 	return NULL;
 }
@@ -934,18 +961,27 @@ static int check_upgrade_step(int from_version, int to_version)
 			if (to_version == 32002) query = DM_SQLITE_32002;
 			if (to_version == 32003) query = DM_SQLITE_32003;
 			if (to_version == 32004) query = DM_SQLITE_32004;
+			if (to_version == 32005) query = DM_SQLITE_32005;
+			if (to_version == 32006) query = DM_SQLITE_32006;
+			if (to_version == 32007) query = DM_SQLITE_32007;
 		break;
 		case DM_DRIVER_MYSQL:
 			if (to_version == 32001) query = DM_MYSQL_32001;
 			if (to_version == 32002) query = DM_MYSQL_32002;
 			if (to_version == 32003) query = DM_MYSQL_32003;
 			if (to_version == 32004) query = DM_MYSQL_32004;
+			if (to_version == 32005) query = DM_MYSQL_32005;
+			if (to_version == 32006) query = DM_MYSQL_32006;
+			if (to_version == 32007) query = DM_MYSQL_32007;
 		break;
 		case DM_DRIVER_POSTGRESQL:
 			if (to_version == 32001) query = DM_PGSQL_32001;
 			if (to_version == 32002) query = DM_PGSQL_32002;
 			if (to_version == 32003) query = DM_MYSQL_32003;
 			if (to_version == 32004) query = DM_MYSQL_32004;
+			if (to_version == 32005) query = DM_PGSQL_32005;
+			if (to_version == 32006) query = DM_PGSQL_32006;
+			if (to_version == 32007) query = DM_PGSQL_32007;
 		break;
 		default:
 			TRACE(TRACE_WARNING, "Migrations not supported for database driver");
@@ -1028,12 +1064,18 @@ int db_check_version(void)
 			break;
 		if ((ok = check_upgrade_step(32001, 32004)) == DM_EQUERY)
 			break;
+		if ((ok = check_upgrade_step(32001, 32005)) == DM_EQUERY)
+			break;
+		if ((ok = check_upgrade_step(32001, 32006)) == DM_EQUERY)
+			break;
+		if ((ok = check_upgrade_step(32001, 32007)) == DM_EQUERY)
+			break;
 		break;
 	} while (true);
 
 	db_con_close(c);
 
-	if (ok == 32004) {
+	if (ok == 32007) {
 		TRACE(TRACE_DEBUG, "Schema check successful");
 	} else {
 		TRACE(TRACE_WARNING,"Schema version incompatible [%d]. Bailing out",
@@ -1093,6 +1135,79 @@ int db_get_physmessage_id(uint64_t message_idnr, uint64_t * physmessage_id)
 	return t;
 }
 
+int db_get_physmessage_size(uint64_t physmessage_id, uint64_t * rfcsize)
+{
+	PreparedStatement_T stmt;
+	Connection_T c;
+       	ResultSet_T r; 
+	volatile int t = DM_SUCCESS;
+	assert(rfcsize != NULL);
+	*rfcsize = 0;
+
+	c = db_con_get();
+	TRY
+		stmt = db_stmt_prepare(c,
+			       	"SELECT rfcsize FROM %sphysmessage WHERE id = ?", 
+				DBPFX);
+		db_stmt_set_u64(stmt, 1, physmessage_id);
+		r = db_stmt_query(stmt);
+
+		if (db_result_next(r))
+			*rfcsize = db_result_get_u64(r, 0);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if ((t == DM_SUCCESS) && (! *rfcsize)) return DM_EGENERAL;
+
+	return t;
+}
+
+int db_get_cached_header(uint64_t physmessage_id, const char *header, GList **values)
+{
+	PreparedStatement_T stmt;
+	Connection_T c;
+       	ResultSet_T r; 
+	volatile int t = DM_SUCCESS;
+	gchar *case_header, *safe_header;
+
+	assert(values != NULL);
+	safe_header = g_ascii_strdown(header, -1);
+	case_header = g_strdup_printf(db_get_sql(SQL_STRCASE), "n.headername");
+
+	c = db_con_get();
+	TRY
+		stmt = db_stmt_prepare(c,
+				"SELECT v.headervalue FROM %sheader h "
+				"JOIN %sheadername n ON h.headername_id = n.id "
+				"JOIN %sheadervalue v ON h.headervalue_id = v.id "
+				"WHERE h.physmessage_id = ? AND %s = ?",
+				DBPFX, DBPFX, DBPFX, case_header);
+		db_stmt_set_u64(stmt, 1, physmessage_id);
+		db_stmt_set_str(stmt, 2, safe_header);
+		r = db_stmt_query(stmt);
+
+		while (db_result_next(r)) {
+			int l;
+			const void *blob = db_result_get_blob(r, 0, &l);
+			*values = g_list_append(*values, g_strndup(blob, l));
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_free(case_header);
+	g_free(safe_header);
+
+	return t;
+}
+
 
 /**
  * check if the user_idnr is the same as that of the DBMAIL_DELIVERY_USERNAME
@@ -1178,11 +1293,76 @@ int dm_quota_user_dec(uint64_t user_idnr, uint64_t size)
 	return db_update("UPDATE %susers SET curmail_size = CASE WHEN curmail_size >= %" PRIu64 " THEN curmail_size - %" PRIu64 " ELSE 0 END WHERE user_idnr = %" PRIu64 "", 
 			DBPFX, size, size, user_idnr);
 }
+int dm_quota_user_delta(Connection_T c, uint64_t user_idnr, int64_t delta)
+{
+	uint64_t size;
+	NOT_DELIVERY_USER
+	if (! delta)
+		return TRUE;
+	if (delta > 0) {
+		size = (uint64_t)delta;
+		return db_exec(c, "UPDATE %susers SET curmail_size = curmail_size + %" PRIu64 " WHERE user_idnr = %" PRIu64 "",
+				DBPFX, size, user_idnr);
+	}
+	size = (uint64_t)(-delta);
+	return db_exec(c, "UPDATE %susers SET curmail_size = CASE WHEN curmail_size >= %" PRIu64 " THEN curmail_size - %" PRIu64 " ELSE 0 END WHERE user_idnr = %" PRIu64 "",
+			DBPFX, size, size, user_idnr);
+}
 
-static int dm_quota_user_validate(uint64_t user_idnr, uint64_t msg_size)
+int db_mailbox_counters_delta(Connection_T c, const MailboxCounters_T *m)
+{
+	if (! m->mailbox_idnr)
+		return TRUE;
+	if (! (m->exists || m->unseen || m->recent || m->uidnext))
+		return TRUE;
+	return db_exec(c, "UPDATE %smailboxes SET "
+			"exists_count = CASE WHEN exists_count + (%" PRId64 ") > 0 THEN exists_count + (%" PRId64 ") ELSE 0 END, "
+			"unseen_count = CASE WHEN unseen_count + (%" PRId64 ") > 0 THEN unseen_count + (%" PRId64 ") ELSE 0 END, "
+			"recent_count = CASE WHEN recent_count + (%" PRId64 ") > 0 THEN recent_count + (%" PRId64 ") ELSE 0 END, "
+			"uidnext = CASE WHEN uidnext < %" PRIu64 " THEN %" PRIu64 " ELSE uidnext END "
+			"WHERE mailbox_idnr = %" PRIu64 "",
+			DBPFX, m->exists, m->exists, m->unseen, m->unseen, m->recent, m->recent,
+			m->uidnext, m->uidnext, m->mailbox_idnr);
+}
+
+int db_mailbox_counters_count(Connection_T c, uint64_t mailbox_idnr, const char *where, MailboxCounters_T *m)
+{
+	ResultSet_T r;
+
+	memset(m, 0, sizeof(MailboxCounters_T));
+	m->mailbox_idnr = mailbox_idnr;
+	r = db_query(c, "SELECT COUNT(*), "
+			"SUM(CASE WHEN seen_flag = 0 THEN 1 ELSE 0 END), "
+			"SUM(CASE WHEN recent_flag = 1 THEN 1 ELSE 0 END) "
+			"FROM %smessages WHERE mailbox_idnr = %" PRIu64 " AND status < %d AND (%s)",
+			DBPFX, mailbox_idnr, MESSAGE_STATUS_DELETE, where);
+	if (! r)
+		return FALSE;
+	if (db_result_next(r)) {
+		m->exists = (int64_t)db_result_get_u64(r, 0);
+		m->unseen = (int64_t)db_result_get_u64(r, 1);
+		m->recent = (int64_t)db_result_get_u64(r, 2);
+	}
+	return TRUE;
+}
+
+int db_mailbox_counters_remove(Connection_T c, uint64_t mailbox_idnr, const char *where)
+{
+	MailboxCounters_T m;
+	if (! db_mailbox_counters_count(c, mailbox_idnr, where, &m))
+		return FALSE;
+	m.exists = -m.exists;
+	m.unseen = -m.unseen;
+	m.recent = -m.recent;
+	return db_mailbox_counters_delta(c, &m);
+}
+
+/* check the quotum on a connection that may be inside the transaction
+ * which charges it, so earlier copies in that transaction count too */
+static int dm_quota_user_validate_c(Connection_T c, uint64_t user_idnr, uint64_t msg_size)
 {
 	uint64_t maxmail_size;
-	Connection_T c; ResultSet_T r; volatile gboolean t = TRUE;
+	ResultSet_T r;
 
 	if (auth_getmaxmailsize(user_idnr, &maxmail_size) == -1) {
 		TRACE(TRACE_ERR, "auth_getmaxmailsize() failed\n");
@@ -1191,17 +1371,24 @@ static int dm_quota_user_validate(uint64_t user_idnr, uint64_t msg_size)
 
 	if (maxmail_size <= 0)
 		return TRUE;
- 
-	c = db_con_get();
 
+	r = db_query(c, "SELECT 1 FROM %susers WHERE user_idnr = %" PRIu64 " "
+			"AND (curmail_size + %" PRIu64 " > %" PRIu64 ")", 
+			DBPFX, user_idnr, msg_size, maxmail_size);
+	if (! r)
+		return DM_EQUERY;
+	if (db_result_next(r))
+		return FALSE;
+	return TRUE;
+}
+
+static int dm_quota_user_validate(uint64_t user_idnr, uint64_t msg_size)
+{
+	Connection_T c; volatile int t = TRUE;
+
+	c = db_con_get();
 	TRY
-		r = db_query(c, "SELECT 1 FROM %susers WHERE user_idnr = %" PRIu64 " "
-				"AND (curmail_size + %" PRIu64 " > %" PRIu64 ")", 
-				DBPFX, user_idnr, msg_size, maxmail_size);
-		if (! r)
-			t = DM_EQUERY;
-		else if (db_result_next(r))
-			t = FALSE;
+		t = dm_quota_user_validate_c(c, user_idnr, msg_size);
 	CATCH(SQLException)
 		LOG_SQLERROR;
 	FINALLY
@@ -1246,61 +1433,98 @@ int dm_quota_rebuild_user(uint64_t user_idnr)
 	return DM_SUCCESS;
 }
 
+#define QUOTA_REBUILD_SLICE 100
+
 struct used_quota {
 	uint64_t user_id;
 	uint64_t curmail;
 };
 
-int dm_quota_rebuild()
+/* collect the users in (first, last] whose stored usage is wrong */
+static int _quota_rebuild_slice(uint64_t first, uint64_t last, GList **quota)
 {
-	Connection_T c; ResultSet_T r;
-
-	GList *quota = NULL;
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
 	struct used_quota *q;
-	volatile int i = 0;
-	int result;
 
 	c = db_con_get();
 	TRY
-		r = db_query(c, "SELECT usr.user_idnr, SUM(pm.messagesize), usr.curmail_size FROM %susers usr "
+		r = db_query(c, "SELECT usr.user_idnr, COALESCE(SUM(pm.messagesize),0), usr.curmail_size FROM %susers usr "
 				"LEFT JOIN %smailboxes mbx ON mbx.owner_idnr = usr.user_idnr "
 				"LEFT JOIN %smessages msg ON msg.mailbox_idnr = mbx.mailbox_idnr "
-				"LEFT JOIN %sphysmessage pm ON pm.id = msg.physmessage_id "
 				"AND msg.status < %d "
-				"GROUP BY usr.user_idnr, usr.curmail_size "
-				"HAVING ((SUM(pm.messagesize) <> usr.curmail_size) OR "
-				"(NOT (SUM(pm.messagesize) IS NOT NULL) "
-				"AND usr.curmail_size <> 0))", DBPFX,DBPFX,
-				DBPFX,DBPFX,MESSAGE_STATUS_DELETE);
-
+				"LEFT JOIN %sphysmessage pm ON pm.id = msg.physmessage_id "
+				"WHERE usr.user_idnr > %" PRIu64 " AND usr.user_idnr <= %" PRIu64 " "
+				"GROUP BY usr.user_idnr, usr.curmail_size",
+				DBPFX, DBPFX, DBPFX, MESSAGE_STATUS_DELETE, DBPFX, first, last);
 		while (db_result_next(r)) {
-			i++;
+			if (db_result_get_u64(r, 1) == db_result_get_u64(r, 2))
+				continue;
 			q = g_new0(struct used_quota,1);
 			q->user_id = db_result_get_u64(r, 0);
 			q->curmail = db_result_get_u64(r, 1);
-			quota = g_list_prepend(quota, q);
+			TRACE(TRACE_INFO, "user [%" PRIu64 "] curmail_size [%" PRIu64 "] should be [%" PRIu64 "]",
+					q->user_id, db_result_get_u64(r, 2), q->curmail);
+			*quota = g_list_prepend(*quota, q);
 		}
 	CATCH(SQLException)
 		LOG_SQLERROR;
+		t = DM_EQUERY;
 	FINALLY
 		db_con_close(c);
 	END_TRY;
 
-	result = i;
-	if (! i) {
+	return t;
+}
+
+int dm_quota_rebuild(gboolean repair)
+{
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+	GList *quota = NULL, *l;
+	volatile uint64_t last = 0;
+	uint64_t first;
+	int result = 0;
+
+	/* walk the users table in slices, so the verification never
+	 * aggregates more than QUOTA_REBUILD_SLICE users at a time */
+	while (t == DM_SUCCESS) {
+		first = last;
+		c = db_con_get();
+		TRY
+			r = db_query(c, "SELECT user_idnr FROM %susers WHERE user_idnr > %" PRIu64 " "
+					"ORDER BY user_idnr LIMIT %d", DBPFX, first, QUOTA_REBUILD_SLICE);
+			while (db_result_next(r))
+				last = db_result_get_u64(r, 0);
+		CATCH(SQLException)
+			LOG_SQLERROR;
+			t = DM_EQUERY;
+		FINALLY
+			db_con_close(c);
+		END_TRY;
+
+		if (t != DM_SUCCESS || last == first)
+			break;
+
+		t = _quota_rebuild_slice(first, last, &quota);
+	}
+
+	if (t == DM_EQUERY) {
+		g_list_destroy(quota);
+		return DM_EQUERY;
+	}
+
+	result = g_list_length(quota);
+	if (! result) {
 		TRACE(TRACE_DEBUG, "quotum is already up to date");
 		return DM_SUCCESS;
 	}
 
 	/* now update the used quotum for all users that need to be updated */
-	quota = g_list_first(quota);
-	while (quota) {
-		q = (struct used_quota *)quota->data;	
-		if (! dm_quota_user_set(q->user_id, q->curmail))
-			result = DM_EQUERY;
-
-		if (! g_list_next(quota)) break;
-		quota = g_list_next(quota);
+	if (repair) {
+		for (l = g_list_first(quota); l; l = g_list_next(l)) {
+			struct used_quota *q = (struct used_quota *)l->data;
+			if (! dm_quota_user_set(q->user_id, q->curmail))
+				result = DM_EQUERY;
+		}
 	}
 
 	/* free allocated memory */
@@ -1669,6 +1893,75 @@ int db_icheck_headervalues(gboolean cleanup)
 	return t;
 }
 
+int db_icheck_mailbox_counters(gboolean cleanup)
+{
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+	GList *ids = NULL;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT b.mailbox_idnr, COALESCE(m.n,1) FROM %smailboxes b "
+				"LEFT JOIN (SELECT mailbox_idnr, "
+				"SUM(CASE WHEN status IN (%d,%d) THEN 1 ELSE 0 END) AS e, "
+				"SUM(CASE WHEN status IN (%d,%d) AND seen_flag = 0 THEN 1 ELSE 0 END) AS u, "
+				"SUM(CASE WHEN status IN (%d,%d) AND recent_flag = 1 THEN 1 ELSE 0 END) AS r, "
+				"MAX(message_idnr)+1 AS n "
+				"FROM %smessages GROUP BY mailbox_idnr) m ON b.mailbox_idnr = m.mailbox_idnr "
+				"WHERE b.exists_count <> COALESCE(m.e,0) "
+				"OR b.unseen_count <> COALESCE(m.u,0) "
+				"OR b.recent_count <> COALESCE(m.r,0) "
+				"OR b.uidnext < COALESCE(m.n,1)",
+				DBPFX,
+				MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN,
+				MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN,
+				MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN,
+				DBPFX);
+		while(db_result_next(r)) {
+			MailboxCounters_T *m = g_new0(MailboxCounters_T, 1);
+			m->mailbox_idnr = db_result_get_u64(r, 0);
+			m->uidnext = db_result_get_u64(r, 1);
+			TRACE(TRACE_INFO, "counters drifted for mailbox [%" PRIu64 "]", m->mailbox_idnr);
+			ids = g_list_prepend(ids, m);
+		}
+		t = g_list_length(ids);
+		if (cleanup) {
+			while(ids) {
+				MailboxCounters_T *m = (MailboxCounters_T *)ids->data;
+				db_begin_transaction(c);
+				db_exec(c, "UPDATE %smailboxes SET "
+						"exists_count = (SELECT COUNT(*) FROM %smessages "
+						"WHERE mailbox_idnr = %" PRIu64 " AND status IN (%d,%d)), "
+						"unseen_count = (SELECT COUNT(*) FROM %smessages "
+						"WHERE mailbox_idnr = %" PRIu64 " AND status IN (%d,%d) AND seen_flag = 0), "
+						"recent_count = (SELECT COUNT(*) FROM %smessages "
+						"WHERE mailbox_idnr = %" PRIu64 " AND status IN (%d,%d) AND recent_flag = 1) "
+						"WHERE mailbox_idnr = %" PRIu64 "",
+						DBPFX,
+						DBPFX, m->mailbox_idnr, MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN,
+						DBPFX, m->mailbox_idnr, MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN,
+						DBPFX, m->mailbox_idnr, MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN,
+						m->mailbox_idnr);
+				/* uidnext may only ever move forward */
+				db_exec(c, "UPDATE %smailboxes SET uidnext = %" PRIu64 " "
+						"WHERE mailbox_idnr = %" PRIu64 " AND uidnext < %" PRIu64 "",
+						DBPFX, m->uidnext, m->mailbox_idnr, m->uidnext);
+				db_commit_transaction(c);
+				if (! g_list_next(ids)) break;
+				ids = g_list_next(ids);
+			}
+		}
+		g_list_destroy(ids);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
 int db_icheck_rfcsize(GList  **lost)
 {
 	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
@@ -1867,78 +2160,309 @@ int db_icheck_envelope(GList **lost)
 	return t;
 }
 
-
-int db_set_message_status(uint64_t message_idnr, MessageStatus_T status)
+int db_set_bodystructure(GList *lost)
 {
-	return db_update("UPDATE %smessages SET status = %d WHERE message_idnr = %" PRIu64 "", 
-			DBPFX, status, message_idnr);
-}
+	uint64_t pmsgid;
+	uint64_t *id;
+	DbmailMessage *msg;
+	Mempool_T pool;
+	if (! lost)
+		return DM_SUCCESS;
 
-int db_delete_message(uint64_t message_idnr)
-{
-	return db_update("DELETE FROM %smessages WHERE message_idnr = %" PRIu64 "", 
-			DBPFX, message_idnr);
-}
+	pool = mempool_open();
+	lost = g_list_first(lost);
+	while (lost) {
+		id = (uint64_t *)lost->data;
+		pmsgid = *id;
+		
+		msg = dbmail_message_new(pool);
+		if (! msg) {
+			mempool_close(&pool);
+			return DM_EQUERY;
+		}
 
-static int mailbox_delete(uint64_t mailbox_idnr)
-{
-	return db_update("DELETE FROM %smailboxes WHERE mailbox_idnr = %" PRIu64 "", 
-			DBPFX, mailbox_idnr);
-}
+		if (! (msg = dbmail_message_retrieve(msg, pmsgid))) {
+			TRACE(TRACE_WARNING,"error retrieving physmessage: [%" PRIu64 "]", pmsgid);
+			fprintf(stderr,"E");
+		} else {
+			dbmail_message_cache_bodystructure(msg);
+			fprintf(stderr,".");
+		}
+		dbmail_message_free(msg);
+		if (! g_list_next(lost)) break;
+		lost = g_list_next(lost);
+	}
 
-static int mailbox_empty(uint64_t mailbox_idnr)
-{
-	return db_update("DELETE FROM %smessages WHERE mailbox_idnr = %" PRIu64 "", 
-			DBPFX, mailbox_idnr);
+	mempool_close(&pool);
+	return DM_SUCCESS;
 }
 
-/** get the total size of messages in a mailbox. Does not work recursively! */
-int db_get_mailbox_size(uint64_t mailbox_idnr, int only_deleted, uint64_t * mailbox_size)
+int db_icheck_bodystructure(GList **lost)
 {
-	PreparedStatement_T stmt;
-	Connection_T c;
-       	ResultSet_T r = NULL;
-       	volatile int t = DM_SUCCESS;
-	assert(mailbox_size != NULL);
-	*mailbox_size = 0;
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+	uint64_t *id;
 
 	c = db_con_get();
 	TRY
-		stmt = db_stmt_prepare(c,
-			       	"SELECT COALESCE(SUM(pm.messagesize),0) FROM %smessages msg, %sphysmessage pm "
-				"WHERE msg.physmessage_id = pm.id AND msg.mailbox_idnr = ? "
-				"AND msg.status < %d %s", DBPFX,DBPFX, MESSAGE_STATUS_DELETE,
-				only_deleted?"AND msg.deleted_flag = 1":"");
-		db_stmt_set_u64(stmt, 1, mailbox_idnr);
-		r = db_stmt_query(stmt);
-
-		if (db_result_next(r))
-			*mailbox_size = db_result_get_u64(r, 0);
+		r = db_query(c, "SELECT p.id FROM %sphysmessage p LEFT JOIN %sbodystructure b "
+			"ON p.id = b.physmessage_id WHERE b.physmessage_id IS NULL", DBPFX, DBPFX);
+		while (db_result_next(r)) {
+			id = g_new0(uint64_t,1);
+			*id = db_result_get_u64(r, 0);
+			*(GList **)lost = g_list_prepend(*(GList **)lost,id);
+		}
 	CATCH(SQLException)
-		; // pass
+		LOG_SQLERROR;
+		t = DM_EQUERY;
 	FINALLY
 		db_con_close(c);
 	END_TRY;
-	
+
 	return t;
 }
 
-int db_delete_mailbox(uint64_t mailbox_idnr, int only_empty, int update_curmail_size)
+
+/* run a statement against a single message and move the counters of
+ * its mailbox by the difference, within one transaction */
+static int db_message_update_counted(uint64_t message_idnr, const char *query)
 {
-	uint64_t user_idnr = 0;
-	int result;
-	uint64_t mailbox_size = 0;
+	Connection_T c; ResultSet_T r; volatile int t = TRUE;
+	uint64_t mailbox_idnr = 0;
+	MailboxCounters_T before, after;
+	char where[DEF_FRAGSIZE];
 
-	TRACE(TRACE_DEBUG,"mailbox_idnr [%" PRIu64 "] only_empty [%d] update_curmail_size [%d]", mailbox_idnr, only_empty, update_curmail_size);
-	/* get the user_idnr of the owner of the mailbox */
-	result = db_get_mailbox_owner(mailbox_idnr, &user_idnr);
-	if (result == DM_EQUERY) {
-		TRACE(TRACE_ERR, "cannot find owner of mailbox for mailbox [%" PRIu64 "]", mailbox_idnr);
-		return DM_EQUERY;
-	}
-	if (result == 0) {
-		TRACE(TRACE_ERR, "unable to find owner of mailbox [%" PRIu64 "]", mailbox_idnr);
-		return DM_EGENERAL;
+	memset(where, 0, sizeof(where));
+	snprintf(where, DEF_FRAGSIZE-1, "message_idnr = %" PRIu64 "", message_idnr);
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		r = db_query(c, "SELECT mailbox_idnr FROM %smessages WHERE %s", DBPFX, where);
+		if (r && db_result_next(r))
+			mailbox_idnr = db_result_get_u64(r, 0);
+		if (mailbox_idnr)
+			t = db_mailbox_counters_count(c, mailbox_idnr, where, &before);
+		if (t)
+			t = db_exec(c, "%s", query);
+		if (t && mailbox_idnr)
+			t = db_mailbox_counters_count(c, mailbox_idnr, where, &after);
+		if (t && mailbox_idnr) {
+			after.exists -= before.exists;
+			after.unseen -= before.unseen;
+			after.recent -= before.recent;
+			t = db_mailbox_counters_delta(c, &after);
+		}
+		if (t)
+			db_commit_transaction(c);
+		else
+			db_rollback_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = FALSE;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+int db_set_message_status(uint64_t message_idnr, MessageStatus_T status)
+{
+	int t;
+	char *query = g_strdup_printf("UPDATE %smessages SET status = %d WHERE message_idnr = %" PRIu64 "", 
+			DBPFX, status, message_idnr);
+	t = db_message_update_counted(message_idnr, query);
+	g_free(query);
+	return t;
+}
+
+int db_delete_message(uint64_t message_idnr)
+{
+	int t;
+	char *query = g_strdup_printf("DELETE FROM %smessages WHERE message_idnr = %" PRIu64 "", 
+			DBPFX, message_idnr);
+	t = db_message_update_counted(message_idnr, query);
+	g_free(query);
+	return t;
+}
+
+static int mailbox_delete(uint64_t mailbox_idnr)
+{
+	return db_update("DELETE FROM %smailboxes WHERE mailbox_idnr = %" PRIu64 "", 
+			DBPFX, mailbox_idnr);
+}
+
+static int mailbox_empty(uint64_t mailbox_idnr)
+{
+	Connection_T c; volatile int t = FALSE;
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		if (db_mailbox_counters_remove(c, mailbox_idnr, "1=1")
+				&& db_exec(c, "DELETE FROM %smessages WHERE mailbox_idnr = %" PRIu64 "",
+					DBPFX, mailbox_idnr)) {
+			db_commit_transaction(c);
+			t = TRUE;
+		} else {
+			db_rollback_transaction(c);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+	return t;
+}
+
+/** get the total size of messages in a mailbox. Does not work recursively! */
+int db_get_mailbox_size(uint64_t mailbox_idnr, int only_deleted, uint64_t * mailbox_size)
+{
+	PreparedStatement_T stmt;
+	Connection_T c;
+       	ResultSet_T r = NULL;
+       	volatile int t = DM_SUCCESS;
+	assert(mailbox_size != NULL);
+	*mailbox_size = 0;
+
+	c = db_con_get();
+	TRY
+		stmt = db_stmt_prepare(c,
+			       	"SELECT COALESCE(SUM(pm.messagesize),0) FROM %smessages msg, %sphysmessage pm "
+				"WHERE msg.physmessage_id = pm.id AND msg.mailbox_idnr = ? "
+				"AND msg.status < %d %s", DBPFX,DBPFX, MESSAGE_STATUS_DELETE,
+				only_deleted?"AND msg.deleted_flag = 1":"");
+		db_stmt_set_u64(stmt, 1, mailbox_idnr);
+		r = db_stmt_query(stmt);
+
+		if (db_result_next(r))
+			*mailbox_size = db_result_get_u64(r, 0);
+	CATCH(SQLException)
+		; // pass
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+	
+	return t;
+}
+
+/** fetch one page of message summaries, keyset-paged by uid.
+ * \Recent only means something to an IMAP session, so only the
+ * flags before IMAP_FLAG_RECENT are read */
+int db_mailbox_summary(uint64_t mailbox_idnr, uint64_t after, uint64_t changedsince,
+		unsigned limit, uint64_t *modseq, GList **summaries)
+{
+	PreparedStatement_T stmt;
+	Connection_T c;
+       	ResultSet_T r = NULL;
+       	volatile int t = DM_EGENERAL;
+	MessageSummary *last = NULL;
+	Field_T frag;
+	unsigned j;
+
+	assert(modseq != NULL);
+	assert(summaries != NULL);
+	*modseq = 0;
+
+	date2char_str("p.internal_date", &frag);
+
+	c = db_con_get();
+	TRY
+		/* the mailboxes row comes back even for an empty page */
+		stmt = db_stmt_prepare(c,
+				"SELECT b.seq, m.message_idnr, m.seen_flag, m.answered_flag, "
+				"m.deleted_flag, m.flagged_flag, m.draft_flag, "
+				"%s, p.rfcsize, m.seq, m.status, e.envelope, k.keyword "
+				"FROM %smailboxes b "
+				"LEFT JOIN (SELECT message_idnr, mailbox_idnr, physmessage_id, "
+				"seen_flag, answered_flag, deleted_flag, flagged_flag, draft_flag, "
+				"seq, status FROM %smessages "
+				"WHERE mailbox_idnr = ? AND message_idnr > ? AND seq > ? "
+				"AND status < %d ORDER BY message_idnr LIMIT %u) m "
+				"ON m.mailbox_idnr = b.mailbox_idnr "
+				"LEFT JOIN %sphysmessage p ON p.id = m.physmessage_id "
+				"LEFT JOIN %senvelope e ON e.physmessage_id = m.physmessage_id "
+				"LEFT JOIN %skeywords k ON k.message_idnr = m.message_idnr "
+				"WHERE b.mailbox_idnr = ? ORDER BY m.message_idnr",
+				frag, DBPFX, DBPFX, MESSAGE_STATUS_DELETE, limit,
+				DBPFX, DBPFX, DBPFX);
+		db_stmt_set_u64(stmt, 1, mailbox_idnr);
+		db_stmt_set_u64(stmt, 2, after);
+		db_stmt_set_u64(stmt, 3, changedsince);
+		db_stmt_set_u64(stmt, 4, mailbox_idnr);
+		r = db_stmt_query(stmt);
+
+		while (db_result_next(r)) {
+			uint64_t uid;
+			const char *s;
+
+			t = DM_SUCCESS;
+			*modseq = db_result_get_u64(r, 0);
+			if (! (uid = db_result_get_u64(r, 1)))
+				continue;
+
+			if ((! last) || (last->info.uid != uid)) {
+				last = g_new0(MessageSummary, 1);
+				last->info.uid = uid;
+				for (j = 0; j < IMAP_FLAG_RECENT; j++)
+					MSGINFO_SET_FLAG(&last->info, j, db_result_get_bool(r, j + 2));
+				s = db_result_get(r, IMAP_FLAG_RECENT + 2);
+				last->info.internaldate = s ? date_sql2time(s) : 0;
+				last->info.rfcsize = db_result_get_u64(r, IMAP_FLAG_RECENT + 3);
+				last->info.seq = db_result_get_u64(r, IMAP_FLAG_RECENT + 4);
+				last->info.status = db_result_get_int(r, IMAP_FLAG_RECENT + 5);
+				if ((s = db_result_get(r, IMAP_FLAG_RECENT + 6)))
+					last->envelope = g_strdup(s);
+				*summaries = g_list_prepend(*summaries, last);
+			}
+			if ((s = db_result_get(r, IMAP_FLAG_RECENT + 7)))
+				last->info.keywords = g_list_append(last->info.keywords, g_strdup(s));
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	*summaries = g_list_reverse(*summaries);
+	if (t == DM_EQUERY) {
+		db_mailbox_summary_free(*summaries);
+		*summaries = NULL;
+	}
+
+	return t;
+}
+
+void db_mailbox_summary_free(GList *summaries)
+{
+	GList *l;
+	for (l = summaries; l; l = g_list_next(l)) {
+		MessageSummary *s = (MessageSummary *)l->data;
+		g_list_destroy(s->info.keywords);
+		g_free(s->envelope);
+		g_free(s);
+	}
+	g_list_free(summaries);
+}
+
+int db_delete_mailbox(uint64_t mailbox_idnr, int only_empty, int update_curmail_size)
+{
+	uint64_t user_idnr = 0;
+	int result;
+	uint64_t mailbox_size = 0;
+
+	TRACE(TRACE_DEBUG,"mailbox_idnr [%" PRIu64 "] only_empty [%d] update_curmail_size [%d]", mailbox_idnr, only_empty, update_curmail_size);
+	/* get the user_idnr of the owner of the mailbox */
+	result = db_get_mailbox_owner(mailbox_idnr, &user_idnr);
+	if (result == DM_EQUERY) {
+		TRACE(TRACE_ERR, "cannot find owner of mailbox for mailbox [%" PRIu64 "]", mailbox_idnr);
+		return DM_EQUERY;
+	}
+	if (result == 0) {
+		TRACE(TRACE_ERR, "unable to find owner of mailbox [%" PRIu64 "]", mailbox_idnr);
+		return DM_EGENERAL;
 	}
 
 	if (update_curmail_size) {
@@ -2010,12 +2534,15 @@ char * db_get_message_lines(uint64_t message_idnr, long lines)
 
 int db_update_pop(ClientSession_T * session_ptr)
 {
-	Connection_T c; volatile int t = DM_SUCCESS;
-	uint64_t user_idnr = 0;
-	INIT_QUERY;
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+	volatile uint64_t user_idnr = 0, size = 0;
+	MailboxCounters_T counters;
+
+	memset(&counters, 0, sizeof(counters));
 
 	c = db_con_get();
 	TRY
+		db_begin_transaction(c);
 		session_ptr->messagelst = p_list_first(session_ptr->messagelst);
 		while (session_ptr->messagelst) {
 			/* check if they need an update in the database */
@@ -2024,6 +2551,25 @@ int db_update_pop(ClientSession_T * session_ptr)
 				/* use one message to get the user_idnr that goes with the messages */
 				if (user_idnr == 0) user_idnr = db_get_useridnr(msg->realmessageid);
 
+				/* messages leaving the mailbox are subtracted from the quotum
+				 * and from the counters of the (single) pop3 mailbox */
+				if (msg->virtual_messagestatus >= MESSAGE_STATUS_DELETE) {
+					r = db_query(c, "SELECT pm.messagesize, m.mailbox_idnr, m.seen_flag, m.recent_flag "
+							"FROM %smessages m "
+							"JOIN %sphysmessage pm ON m.physmessage_id = pm.id "
+							"WHERE m.message_idnr=%" PRIu64 " AND m.status < %d",
+							DBPFX, DBPFX, msg->realmessageid, MESSAGE_STATUS_DELETE);
+					if (db_result_next(r)) {
+						size += db_result_get_u64(r, 0);
+						counters.mailbox_idnr = db_result_get_u64(r, 1);
+						counters.exists--;
+						if (! db_result_get_int(r, 2))
+							counters.unseen--;
+						if (db_result_get_int(r, 3))
+							counters.recent--;
+					}
+				}
+
 				/* yes they need an update, do the query */
 				db_exec(c, "UPDATE %smessages set status=%d WHERE message_idnr=%" PRIu64 " AND status < %d",
 						DBPFX, msg->virtual_messagestatus, msg->realmessageid, 
@@ -2035,25 +2581,25 @@ int db_update_pop(ClientSession_T * session_ptr)
 
 			session_ptr->messagelst = p_list_next(session_ptr->messagelst);
 		}
+		if (size && ! dm_quota_user_delta(c, user_idnr, -(int64_t)size)) {
+			TRACE(TRACE_ERR, "Could not update quotum used for user [%" PRIu64 "]", user_idnr);
+			t = DM_EQUERY;
+			db_rollback_transaction(c);
+		} else if (! db_mailbox_counters_delta(c, &counters)) {
+			t = DM_EQUERY;
+			db_rollback_transaction(c);
+		} else {
+			db_commit_transaction(c);
+		}
 	CATCH(SQLException)
 		LOG_SQLERROR;
+		db_rollback_transaction(c);
 		t = DM_EQUERY;
 	FINALLY
 		db_con_close(c);
 	END_TRY;
 
-	if (t == DM_EQUERY) return t;
-
-	/* because the status of some messages might have changed (for instance
-	 * to status >= MESSAGE_STATUS_DELETE, the quotum has to be 
-	 * recalculated */
-	if (user_idnr != 0) {
-		if (dm_quota_rebuild_user(user_idnr) == -1) {
-			TRACE(TRACE_ERR, "Could not calculate quotum used for user [%" PRIu64 "]", user_idnr);
-			return DM_EQUERY;
-		}
-	}
-	return DM_SUCCESS;
+	return t;
 }
 
 static int db_findmailbox_owner(const char *name, uint64_t owner_idnr,
@@ -2834,16 +3380,47 @@ int db_noinferiors(uint64_t mailbox_idnr)
 
 int db_movemsg(uint64_t mailbox_to, uint64_t mailbox_from)
 {
-	Connection_T c; volatile long long int count = 0;
+	Connection_T c; ResultSet_T r; volatile long long int count = 0;
+	MailboxCounters_T counters;
+	uint64_t uidnext = 0;
 	c = db_con_get();
 	TRY
 		db_begin_transaction(c);
-		db_exec(c, "UPDATE %smessages SET mailbox_idnr=%" PRIu64 " WHERE mailbox_idnr=%" PRIu64 "", 
-				DBPFX, mailbox_to, mailbox_from);
-		count = Connection_rowsChanged(c);
-		db_commit_transaction(c);
+		r = db_query(c, "SELECT MAX(message_idnr) FROM %smessages WHERE mailbox_idnr=%" PRIu64 "",
+				DBPFX, mailbox_from);
+		if (db_result_next(r) && (uidnext = db_result_get_u64(r, 0)))
+			uidnext++;
+		if (! db_mailbox_counters_count(c, mailbox_from, "1=1", &counters)
+				|| ! db_exec(c, "UPDATE %smessages SET mailbox_idnr=%" PRIu64 " WHERE mailbox_idnr=%" PRIu64 "", 
+				DBPFX, mailbox_to, mailbox_from)) {
+			count = DM_EQUERY;
+		} else {
+			count = Connection_rowsChanged(c);
+			counters.mailbox_idnr = mailbox_to;
+			counters.uidnext = uidnext;
+			if (! db_mailbox_counters_delta(c, &counters))
+				count = DM_EQUERY;
+		}
+		if (count != DM_EQUERY) {
+			counters.mailbox_idnr = mailbox_from;
+			counters.exists = -counters.exists;
+			counters.unseen = -counters.unseen;
+			counters.recent = -counters.recent;
+			counters.uidnext = 0;
+			if (! db_mailbox_counters_delta(c, &counters))
+				count = DM_EQUERY;
+		}
+		if (count > 0) {
+			db_mailbox_seq_update_c(c, mailbox_to, 0);
+			db_mailbox_seq_update_c(c, mailbox_from, 0);
+		}
+		if (count == DM_EQUERY)
+			db_rollback_transaction(c);
+		else
+			db_commit_transaction(c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
+		db_rollback_transaction(c);
 		count = DM_EQUERY;
 	FINALLY
 		db_con_close(c);
@@ -2851,11 +3428,6 @@ int db_movemsg(uint64_t mailbox_to, uint64_t mailbox_from)
 
 	if (count == DM_EQUERY) return count;
 
-	if (count > 0) {
-		db_mailbox_seq_update(mailbox_to, 0);
-		db_mailbox_seq_update(mailbox_from, 0);
-	}
-
 	return DM_SUCCESS;		/* success */
 }
 
@@ -2906,44 +3478,38 @@ int db_mailbox_has_message_id(uint64_t mailbox_idnr, const char *messageid)
 	return rows;
 }
 
-static uint64_t message_get_size(uint64_t message_idnr)
+int db_copymsg(uint64_t msg_idnr, uint64_t mailbox_to, uint64_t user_idnr,
+	       uint64_t * newmsg_idnr, gboolean recent)
 {
-	Connection_T c; ResultSet_T r;
-	volatile uint64_t size = 0;
-
-	c = db_con_get();
-	TRY
-		r = db_query(c, "SELECT pm.messagesize FROM %sphysmessage pm, %smessages msg "
-				"WHERE pm.id = msg.physmessage_id "
-				"AND message_idnr = %" PRIu64 "",DBPFX,DBPFX, message_idnr);
-		if (db_result_next(r))
-			size = db_result_get_u64(r, 0);
-	CATCH(SQLException)
-		LOG_SQLERROR;
-	FINALLY
-		db_con_close(c);
-	END_TRY;
-
-	return size;
+	return db_copymsg_seq(msg_idnr, mailbox_to, user_idnr, newmsg_idnr, recent, 0);
 }
 
-int db_copymsg(uint64_t msg_idnr, uint64_t mailbox_to, uint64_t user_idnr,
-	       uint64_t * newmsg_idnr, gboolean recent)
+int db_copymsg_c(Connection_T c, uint64_t msg_idnr, uint64_t mailbox_to, uint64_t user_idnr,
+		uint64_t * newmsg_idnr, gboolean recent, uint64_t seq, MailboxCounters_T *counters)
 {
-	Connection_T c; ResultSet_T r;
-	uint64_t msgsize;
+	ResultSet_T r;
+	uint64_t msgsize = 0;
 	char *frag;
-	int valid=FALSE;
+	int valid = FALSE, status = MESSAGE_STATUS_DELETE, seen = 0;
 	char unique_id[UID_SIZE];
 
-	/* Get the size of the message to be copied. */
-	if (! (msgsize = message_get_size(msg_idnr))) {
+	/* Get the size and state of the message to be copied. */
+	r = db_query(c, "SELECT pm.messagesize, msg.status, msg.seen_flag "
+			"FROM %sphysmessage pm, %smessages msg "
+			"WHERE pm.id = msg.physmessage_id "
+			"AND message_idnr = %" PRIu64 "",DBPFX,DBPFX, msg_idnr);
+	if (r && db_result_next(r)) {
+		msgsize = db_result_get_u64(r, 0);
+		status = db_result_get_int(r, 1);
+		seen = db_result_get_int(r, 2);
+	}
+	if (! msgsize) {
 		TRACE(TRACE_ERR, "error getting size for message [%" PRIu64 "]", msg_idnr);
 		return DM_EQUERY;
 	}
 
 	/* Check to see if the user has room for the message. */
-	if ((valid = dm_quota_user_validate(user_idnr, msgsize)) == DM_EQUERY)
+	if ((valid = dm_quota_user_validate_c(c, user_idnr, msgsize)) == DM_EQUERY)
 		return DM_EQUERY;
 
 	if (! valid) {
@@ -2954,56 +3520,252 @@ int db_copymsg(uint64_t msg_idnr, uint64_t mailbox_to, uint64_t user_idnr,
 	/* Copy the message table entry of the message. */
 	frag = db_returning("message_idnr");
 	memset(unique_id,0,sizeof(unique_id));
+	create_unique_id(unique_id, msg_idnr);
+
+	if (db_params.db_driver == DM_DRIVER_ORACLE) {
+		db_exec(c, "INSERT INTO %smessages ("
+			"mailbox_idnr,physmessage_id,seen_flag,answered_flag,deleted_flag,flagged_flag,recent_flag,draft_flag,unique_id,status,seq)"
+			" SELECT %" PRIu64 ",physmessage_id,seen_flag,answered_flag,deleted_flag,flagged_flag,%d,draft_flag,'%s',status,%" PRIu64
+			" FROM %smessages WHERE message_idnr = %" PRIu64 " %s",DBPFX, mailbox_to, recent, unique_id, seq, DBPFX, msg_idnr, frag);
+		*newmsg_idnr = db_get_pk(c, "messages");
+	} else {
+		r = db_query(c, "INSERT INTO %smessages ("
+			"mailbox_idnr,physmessage_id,seen_flag,answered_flag,deleted_flag,flagged_flag,recent_flag,draft_flag,unique_id,status,seq)"
+			" SELECT %" PRIu64 ",physmessage_id,seen_flag,answered_flag,deleted_flag,flagged_flag,%d,draft_flag,'%s',status,%" PRIu64
+			" FROM %smessages WHERE message_idnr = %" PRIu64 " %s",DBPFX, mailbox_to, recent, unique_id, seq, DBPFX, msg_idnr, frag);
+		*newmsg_idnr = db_insert_result(c, r);
+	}
+	g_free(frag);
+
+	if (! *newmsg_idnr)
+		return DM_EQUERY;
+
+	/* charge the copy in the same transaction that creates it */
+	if (! dm_quota_user_delta(c, user_idnr, (int64_t)msgsize))
+		return DM_EQUERY;
+
+	/* Copy the message keywords */
+	if (! db_exec(c, "INSERT INTO %skeywords (message_idnr, keyword) "
+		"SELECT %" PRIu64 ",keyword from %skeywords WHERE message_idnr=%" PRIu64 "", 
+		DBPFX, *newmsg_idnr, DBPFX, msg_idnr))
+		return DM_EQUERY;
+
+	counters->mailbox_idnr = mailbox_to;
+	if (status < MESSAGE_STATUS_DELETE) {
+		counters->exists++;
+		if (! seen)
+			counters->unseen++;
+		if (recent)
+			counters->recent++;
+	}
+	if (counters->uidnext <= *newmsg_idnr)
+		counters->uidnext = *newmsg_idnr + 1;
+
+	return DM_EGENERAL;
+}
+
+int db_copymsg_seq(uint64_t msg_idnr, uint64_t mailbox_to, uint64_t user_idnr,
+	       uint64_t * newmsg_idnr, gboolean recent, uint64_t seq)
+{
+	Connection_T c;
+	MailboxCounters_T counters;
+	volatile int t = DM_EGENERAL;
+
+	memset(&counters, 0, sizeof(counters));
 
 	c = db_con_get();
 	TRY
 		db_begin_transaction(c);
-		create_unique_id(unique_id, msg_idnr);
-		if (db_params.db_driver == DM_DRIVER_ORACLE) {
-			db_exec(c, "INSERT INTO %smessages ("
-				"mailbox_idnr,physmessage_id,seen_flag,answered_flag,deleted_flag,flagged_flag,recent_flag,draft_flag,unique_id,status)"
-				" SELECT %" PRIu64 ",physmessage_id,seen_flag,answered_flag,deleted_flag,flagged_flag,%d,draft_flag,'%s',status"
-				" FROM %smessages WHERE message_idnr = %" PRIu64 " %s",DBPFX, mailbox_to, recent, unique_id, DBPFX, msg_idnr, frag);
-			*newmsg_idnr = db_get_pk(c, "messages");
-		} else {
-			r = db_query(c, "INSERT INTO %smessages ("
-				"mailbox_idnr,physmessage_id,seen_flag,answered_flag,deleted_flag,flagged_flag,recent_flag,draft_flag,unique_id,status)"
-				" SELECT %" PRIu64 ",physmessage_id,seen_flag,answered_flag,deleted_flag,flagged_flag,%d,draft_flag,'%s',status"
-				" FROM %smessages WHERE message_idnr = %" PRIu64 " %s",DBPFX, mailbox_to, recent, unique_id, DBPFX, msg_idnr, frag);
-			*newmsg_idnr = db_insert_result(c, r);
-		}
-		db_commit_transaction(c);
+		/* callers copying a batch allocate one modseq up front */
+		if (! seq)
+			seq = db_mailbox_seq_update_c(c, mailbox_to, 0);
+		t = db_copymsg_c(c, msg_idnr, mailbox_to, user_idnr, newmsg_idnr, recent, seq, &counters);
+		if (t == DM_EGENERAL && ! db_mailbox_counters_delta(c, &counters))
+			t = DM_EQUERY;
+		if (t == DM_EGENERAL)
+			db_commit_transaction(c);
+		else
+			db_rollback_transaction(c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
 		db_rollback_transaction(c);
+		t = DM_EQUERY;
 	FINALLY
 		db_con_close(c);
 	END_TRY;
 
-	g_free(frag);
+	return t;
+}
 
-	/* Copy the message keywords */
+#define COPY_BATCH_SLICE 500
+
+static gboolean _quota_inc_batch(uint64_t *useridnr, gpointer count, GString *single)
+{
+	if (GPOINTER_TO_UINT(count) == 1)
+		g_string_append_printf(single, "%s%" PRIu64, single->len ? "," : "", *useridnr);
+	return FALSE;
+}
+
+/* the number of copies a slice linked into a mailbox, as a CASE arm */
+static gboolean _copies_batch(uint64_t *mailbox_idnr, gpointer count, GString *copies[2])
+{
+	g_string_append_printf(copies[0], " WHEN %" PRIu64 " THEN %u", *mailbox_idnr, GPOINTER_TO_UINT(count));
+	g_string_append_printf(copies[1], "%s%" PRIu64, copies[1]->len ? "," : "", *mailbox_idnr);
+	return FALSE;
+}
+
+int db_copymsg_batch(uint64_t physmessage_id, uint64_t msgsize, GList *targets)
+{
+	Connection_T c;
+	GTree *users, *checked;
+	GList *t, *valid = NULL, *slices, *slice;
+	GString *values, *copies[2], *single;
+	GTree *linked;
+	DeliveryTarget_T *target;
+	char unique_id[UID_SIZE];
+	int i;
+	volatile int res = DM_SUCCESS;
+
+	/* one quotum check per user, for all copies it receives */
+	users = g_tree_new((GCompareFunc)ucmp);
+	checked = g_tree_new((GCompareFunc)ucmp);
+	for (t = g_list_first(targets); t; t = g_list_next(t)) {
+		target = (DeliveryTarget_T *)t->data;
+		unsigned count = GPOINTER_TO_UINT(g_tree_lookup(users, &target->useridnr));
+		g_tree_insert(users, &target->useridnr, GUINT_TO_POINTER(count + 1));
+	}
+	for (t = g_list_first(targets); t; t = g_list_next(t)) {
+		gpointer v;
+		target = (DeliveryTarget_T *)t->data;
+		if (! (v = g_tree_lookup(checked, &target->useridnr))) {
+			unsigned count = GPOINTER_TO_UINT(g_tree_lookup(users, &target->useridnr));
+			int r = dm_quota_user_validate(target->useridnr, msgsize * count);
+			if (r != DM_EQUERY)
+				r = r ? DM_SUCCESS : -2;
+			v = GINT_TO_POINTER(r + 10);
+			g_tree_insert(checked, &target->useridnr, v);
+		}
+		target->result = GPOINTER_TO_INT(v) - 10;
+		if (target->result == DM_SUCCESS)
+			valid = g_list_append(valid, target);
+		else
+			g_tree_remove(users, &target->useridnr);
+	}
+	g_tree_destroy(checked);
+
+	/* link the message into all mailboxes in one transaction */
 	c = db_con_get();
 	TRY
 		db_begin_transaction(c);
-		db_exec(c, "INSERT INTO %skeywords (message_idnr, keyword) "
-			"SELECT %" PRIu64 ",keyword from %skeywords WHERE message_idnr=%" PRIu64 "", 
-			DBPFX, *newmsg_idnr, DBPFX, msg_idnr);
-		db_commit_transaction(c);
+		t = g_list_first(valid);
+		while (t && res == DM_SUCCESS) {
+			values = g_string_new("");
+			linked = g_tree_new((GCompareFunc)ucmp);
+			for (i = 0; t && i < COPY_BATCH_SLICE; i++, t = g_list_next(t)) {
+				unsigned count;
+				target = (DeliveryTarget_T *)t->data;
+				memset(unique_id, 0, sizeof(unique_id));
+				create_unique_id(unique_id, target->mailbox_idnr);
+				if (db_params.db_driver == DM_DRIVER_ORACLE) {
+					if (! db_exec(c, "INSERT INTO %smessages "
+							"(mailbox_idnr,physmessage_id,unique_id,recent_flag,status) "
+							"VALUES (%" PRIu64 ",%" PRIu64 ",'%s',1,%d)",
+							DBPFX, target->mailbox_idnr, physmessage_id,
+							unique_id, MESSAGE_STATUS_NEW))
+						res = DM_EQUERY;
+				} else {
+					g_string_append_printf(values, "%s(%" PRIu64 ",%" PRIu64 ",'%s',1,%d)",
+							i ? "," : "", target->mailbox_idnr, physmessage_id,
+							unique_id, MESSAGE_STATUS_NEW);
+				}
+				count = GPOINTER_TO_UINT(g_tree_lookup(linked, &target->mailbox_idnr));
+				g_tree_insert(linked, &target->mailbox_idnr, GUINT_TO_POINTER(count + 1));
+			}
+			copies[0] = g_string_new("");
+			copies[1] = g_string_new("");
+			g_tree_foreach(linked, (GTraverseFunc)_copies_batch, copies);
+			g_tree_destroy(linked);
+
+			if (res == DM_SUCCESS && values->len && ! db_exec(c, "INSERT INTO %smessages "
+						"(mailbox_idnr,physmessage_id,unique_id,recent_flag,status) VALUES %s",
+						DBPFX, values->str))
+				res = DM_EQUERY;
+			/* modseq and message counters of all mailboxes in the
+			 * slice move in one statement, by the copies this slice
+			 * linked in; every copy is new, unseen and recent */
+			if (res == DM_SUCCESS && ! db_exec(c, "UPDATE %smailboxes SET seq=seq+1, "
+						"exists_count = exists_count + (CASE mailbox_idnr%s END), "
+						"unseen_count = unseen_count + (CASE mailbox_idnr%s END), "
+						"recent_count = recent_count + (CASE mailbox_idnr%s END), "
+						"uidnext = (SELECT MAX(m.message_idnr)+1 FROM %smessages m "
+						"WHERE m.physmessage_id = %" PRIu64 " AND m.mailbox_idnr = %smailboxes.mailbox_idnr) "
+						"WHERE mailbox_idnr IN (%s)", DBPFX,
+						copies[0]->str, copies[0]->str, copies[0]->str,
+						DBPFX, physmessage_id, DBPFX,
+						copies[1]->str))
+				res = DM_EQUERY;
+			if (res == DM_SUCCESS && ! db_exec(c, "UPDATE %smessages SET seq="
+						"(SELECT seq FROM %smailboxes b WHERE b.mailbox_idnr = %smessages.mailbox_idnr) "
+						"WHERE physmessage_id = %" PRIu64 " AND mailbox_idnr IN (%s)",
+						DBPFX, DBPFX, DBPFX, physmessage_id, copies[1]->str))
+				res = DM_EQUERY;
+
+			g_string_free(values, TRUE);
+			g_string_free(copies[0], TRUE);
+			g_string_free(copies[1], TRUE);
+		}
+
+		/* quotum is charged in the same transaction: users receiving
+		 * a single copy are updated together */
+		if (res == DM_SUCCESS) {
+			single = g_string_new("");
+			g_tree_foreach(users, (GTraverseFunc)_quota_inc_batch, single);
+			if (single->len) {
+				GList *ids = g_string_split(single, ",");
+				slices = g_list_slices(ids, COPY_BATCH_SLICE);
+				for (slice = g_list_first(slices); slice && res == DM_SUCCESS; slice = g_list_next(slice))
+					if (! db_exec(c, "UPDATE %susers SET curmail_size = curmail_size + %" PRIu64 " "
+							"WHERE user_idnr IN (%s)", DBPFX, msgsize, (char *)slice->data))
+						res = DM_EQUERY;
+				g_list_destroy(slices);
+				g_list_destroy(ids);
+			}
+			g_string_free(single, TRUE);
+
+			for (t = g_list_first(valid); t && res == DM_SUCCESS; t = g_list_next(t)) {
+				target = (DeliveryTarget_T *)t->data;
+				unsigned count = GPOINTER_TO_UINT(g_tree_lookup(users, &target->useridnr));
+				if (count > 1) {
+					if (! dm_quota_user_delta(c, target->useridnr, (int64_t)(msgsize * count)))
+						res = DM_EQUERY;
+					g_tree_remove(users, &target->useridnr);
+				}
+			}
+		}
+		if (res == DM_SUCCESS)
+			db_commit_transaction(c);
+		else
+			db_rollback_transaction(c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
 		db_rollback_transaction(c);
+		res = DM_EQUERY;
 	FINALLY
 		db_con_close(c);
 	END_TRY;
 
-	db_mailbox_seq_update(mailbox_to, *newmsg_idnr);
-
-	/* update quotum */
-	if (! dm_quota_user_inc(user_idnr, msgsize))
+	if (res == DM_EQUERY) {
+		for (t = g_list_first(valid); t; t = g_list_next(t))
+			((DeliveryTarget_T *)t->data)->result = DM_EQUERY;
+		g_list_free(valid);
+		g_tree_destroy(users);
 		return DM_EQUERY;
+	}
 
-	return DM_EGENERAL;
+	g_list_free(valid);
+	g_tree_destroy(users);
+
+	return DM_SUCCESS;
 }
 
 int db_getmailboxname(uint64_t mailbox_idnr, uint64_t user_idnr, char *name)
@@ -3209,11 +3971,24 @@ static long long int db_set_msgkeywords(Connection_T c, uint64_t msg_idnr, GList
 	return count;
 }
 
-int db_set_msgflag(uint64_t msg_idnr, int *flags, GList *keywords, int action_type, uint64_t seq, MessageInfo *msginfo)
+/* move one of the counted flags to value with a conditional update:
+ * the rows it changed are the counter delta, also when another
+ * session changes the same flag concurrently */
+static int _set_counted_flag(Connection_T c, int flag, int value, const char *where)
 {
-	Connection_T c;
+	if (! db_exec(c, "UPDATE %smessages SET %s=%d%s AND %s<>%d", DBPFX,
+				db_flag_desc[flag], value, where, db_flag_desc[flag], value))
+		return DM_EQUERY;
+	return (int)Connection_rowsChanged(c);
+}
+
+int db_set_msgflag_c(Connection_T c, uint64_t msg_idnr, int *flags, GList *keywords, int action_type, uint64_t seq, MessageInfo *msginfo, MailboxCounters_T *counters)
+{
+	ResultSet_T r;
 	size_t i, pos = 0;
-	volatile int seen = 0, count = 0;
+	int seen = 0, count = 0;
+	int set_seen = -1, set_recent = -1, changed_seen = 0, changed_recent = 0;
+	char where[DEF_FRAGSIZE];
 	INIT_QUERY;
 
 	memset(query,0,DEF_QUERYSIZE);
@@ -3226,57 +4001,104 @@ int db_set_msgflag(uint64_t msg_idnr, int *flags, GList *keywords, int action_ty
 		switch (action_type) {
 		case IMAPFA_ADD:
 			if (flags[i]) {
-				if (msginfo) msginfo->flags[i] = 1;
+				if (msginfo) MSGINFO_SET_FLAG(msginfo, i, 1);
 				pos += snprintf(query + pos, DEF_QUERYSIZE - pos - 1, "%s%s=1", seen?",":"", db_flag_desc[i]); 
 				seen++;
+				if (i == IMAP_FLAG_SEEN) set_seen = 1;
+				if (i == IMAP_FLAG_RECENT) set_recent = 1;
 			}
 			break;
 		case IMAPFA_REMOVE:
 			if (flags[i]) {
-				if (msginfo) msginfo->flags[i] = 0;
+				if (msginfo) MSGINFO_SET_FLAG(msginfo, i, 0);
 				pos += snprintf(query + pos, DEF_QUERYSIZE - pos - 1, "%s%s=0", seen?",":"", db_flag_desc[i]); 
 				seen++;
+				if (i == IMAP_FLAG_SEEN) set_seen = 0;
+				if (i == IMAP_FLAG_RECENT) set_recent = 0;
 			}
 			break;
 
 		case IMAPFA_REPLACE:
 			if (flags[i]) {
-				if (msginfo) msginfo->flags[i] = 1;
+				if (msginfo) MSGINFO_SET_FLAG(msginfo, i, 1);
 				pos += snprintf(query + pos, DEF_QUERYSIZE - pos - 1, "%s%s=1", seen?",":"", db_flag_desc[i]); 
+				if (i == IMAP_FLAG_RECENT) set_recent = 1;
 			} else if (i != IMAP_FLAG_RECENT) {
-				if (msginfo) msginfo->flags[i] = 0;
+				if (msginfo) MSGINFO_SET_FLAG(msginfo, i, 0);
 				pos += snprintf(query + pos, DEF_QUERYSIZE - pos - 1, "%s%s=0", seen?",":"", db_flag_desc[i]); 
 			}
+			if (i == IMAP_FLAG_SEEN) set_seen = flags[i] ? 1 : 0;
 			seen++;
 			break;
 		}
 	}
 
+	memset(where, 0, sizeof(where));
 	if (seq) {
-		snprintf(query + pos, DEF_QUERYSIZE - pos - 1,
+		snprintf(where, DEF_FRAGSIZE - 1,
 				" WHERE message_idnr = %" PRIu64 " AND status < %d AND seq <= %" PRIu64,
 				msg_idnr, MESSAGE_STATUS_DELETE, seq);
 	} else {
-		snprintf(query + pos, DEF_QUERYSIZE - pos - 1,
+		snprintf(where, DEF_FRAGSIZE - 1,
 				" WHERE message_idnr = %" PRIu64 " AND status < %d",
 				msg_idnr, MESSAGE_STATUS_DELETE);
 	}
+	snprintf(query + pos, DEF_QUERYSIZE - pos - 1, "%s", where);
 
+	/* the counters only care about seen and recent: change those
+	 * first, only where they differ, and count what changed */
+	if (set_seen >= 0 && (changed_seen = _set_counted_flag(c, IMAP_FLAG_SEEN, set_seen, where)) < 0)
+		return DM_EQUERY;
+	if (set_recent >= 0 && (changed_recent = _set_counted_flag(c, IMAP_FLAG_RECENT, set_recent, where)) < 0)
+		return DM_EQUERY;
 
-	c = db_con_get();
-	TRY
-		db_begin_transaction(c);
-		if (seen) {
-			db_exec(c, query);
-			if (Connection_rowsChanged(c))
-				count = 1;
+	if (changed_seen || changed_recent) {
+		if (! counters->mailbox_idnr) {
+			r = db_query(c, "SELECT mailbox_idnr FROM %smessages WHERE message_idnr = %" PRIu64 "",
+					DBPFX, msg_idnr);
+			if (! r)
+				return DM_EQUERY;
+			if (db_result_next(r))
+				counters->mailbox_idnr = db_result_get_u64(r, 0);
 		}
-		if (db_set_msgkeywords(c, msg_idnr, keywords, action_type, msginfo))
+		counters->unseen += set_seen ? -changed_seen : changed_seen;
+		counters->recent += set_recent ? changed_recent : -changed_recent;
+		count = 1;
+	}
+
+	if (seen) {
+		if (! db_exec(c, query))
+			return DM_EQUERY;
+		if (Connection_rowsChanged(c))
 			count = 1;
+	}
+	if (db_set_msgkeywords(c, msg_idnr, keywords, action_type, msginfo))
+		count = 1;
 
-		db_commit_transaction(c);
+	return count;
+}
+
+int db_set_msgflag(uint64_t msg_idnr, int *flags, GList *keywords, int action_type, uint64_t seq, MessageInfo *msginfo)
+{
+	Connection_T c;
+	MailboxCounters_T counters;
+	volatile int count = 0;
+
+	memset(&counters, 0, sizeof(counters));
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		count = db_set_msgflag_c(c, msg_idnr, flags, keywords, action_type, seq, msginfo, &counters);
+		if (count >= 0 && ! db_mailbox_counters_delta(c, &counters))
+			count = DM_EQUERY;
+		if (count >= 0)
+			db_commit_transaction(c);
+		else
+			db_rollback_transaction(c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
+		db_rollback_transaction(c);
 		count = DM_EQUERY;
 	FINALLY
 		db_con_close(c);
@@ -3571,18 +4393,23 @@ int db_user_set_active(uint64_t user_idnr, bool active)
 	volatile int t = DM_SUCCESS;
 	c = db_con_get();
 	TRY
+		db_begin_transaction(c);
 		s = db_stmt_prepare(c, 
 				"UPDATE %susers SET active = ? WHERE user_idnr = ?",
 				DBPFX);
 		db_stmt_set_int(s, 1, (int)active);
 		db_stmt_set_u64(s, 2, user_idnr);
 		db_stmt_exec(s);
+		db_auth_generation_bump(c);
+		db_commit_transaction(c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
+		db_rollback_transaction(c);
 		t = DM_EQUERY;
 	FINALLY
 		db_con_close(c);
 	END_TRY;
+	auth_cache_invalidate(user_idnr);
 	return t;
 }
 
@@ -3764,9 +4591,12 @@ int db_user_delete_messages(uint64_t user_idnr, char *flags)
 	char **parts;
 	GList *keywords = NULL;
 	int sysflags[IMAP_NFLAGS];
-	String_T query = NULL;
+	String_T query = NULL, where = NULL;
 	Mempool_T pool = NULL;
-	Connection_T c; PreparedStatement_T st;
+	Connection_T c; PreparedStatement_T st, sz; ResultSet_T r;
+	volatile uint64_t size = 0;
+	volatile gboolean ok;
+	GList *counters = NULL, *l;
 
 	memset(sysflags, 0, sizeof(sysflags));
 	parts = g_strsplit(flags, " ", 0);
@@ -3788,49 +4618,76 @@ int db_user_delete_messages(uint64_t user_idnr, char *flags)
 		return 0;
 
 	pool = mempool_open();
-	query = p_string_new(pool, "");
-	p_string_printf(query, "UPDATE %smessages SET status=%d "
-			"WHERE message_idnr IN ("
-			"SELECT m.message_idnr FROM %smessages m "
+	where = p_string_new(pool, "");
+	p_string_printf(where, "SELECT m.message_idnr FROM %smessages m "
 			"JOIN %smailboxes b ON m.mailbox_idnr=b.mailbox_idnr "
 			"LEFT OUTER JOIN %skeywords k ON k.message_idnr=m.message_idnr "
 			"WHERE b.owner_idnr=? AND status IN (%d,%d) AND (1=0",
-			DBPFX, MESSAGE_STATUS_DELETE, DBPFX, DBPFX, DBPFX,
+			DBPFX, DBPFX, DBPFX,
 			MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
 
 
 	for (j = 0; j < IMAP_NFLAGS; j++) {
 		if (! sysflags[j])
 			continue;
-		p_string_append_printf(query, " OR m.%s=1", db_flag_desc[j]);
+		p_string_append_printf(where, " OR m.%s=1", db_flag_desc[j]);
 	}
 
 	keywords = g_list_first(keywords);
 	while (keywords) {
-		p_string_append_printf(query, " OR lower(k.keyword)=lower(?)");
+		p_string_append_printf(where, " OR lower(k.keyword)=lower(?)");
 		if (! g_list_next(keywords))
 			break;
 		keywords = g_list_next(keywords);
 	}
 
-	p_string_append(query, "))");
+	p_string_append(where, ")");
+
+	query = p_string_new(pool, "");
+	p_string_printf(query, "UPDATE %smessages SET status=%d WHERE message_idnr IN (%s)",
+			DBPFX, MESSAGE_STATUS_DELETE, p_string_str(where));
 
 	c = db_con_get();
 	TRY
 		db_begin_transaction(c);
+		sz = db_stmt_prepare(c, "SELECT m.mailbox_idnr, COALESCE(SUM(pm.messagesize),0), COUNT(*), "
+				"SUM(CASE WHEN m.seen_flag = 0 THEN 1 ELSE 0 END), "
+				"SUM(CASE WHEN m.recent_flag = 1 THEN 1 ELSE 0 END) "
+				"FROM %smessages m "
+				"JOIN %sphysmessage pm ON m.physmessage_id = pm.id "
+				"WHERE m.message_idnr IN (%s) GROUP BY m.mailbox_idnr",
+				DBPFX, DBPFX, p_string_str(where));
 		st = db_stmt_prepare(c, p_string_str(query));
+		db_stmt_set_u64(sz, 1, user_idnr);
 		db_stmt_set_u64(st, 1, user_idnr);
 		i = 2;
 		keywords = g_list_first(keywords);
 		while (keywords) {
 			char *label = (char *)keywords->data;
+			db_stmt_set_str(sz, i, label);
 			db_stmt_set_str(st, i++, label);
 			if (! g_list_next(keywords))
 				break;
 			keywords = g_list_next(keywords);
 		}
+		r = db_stmt_query(sz);
+		while (db_result_next(r)) {
+			MailboxCounters_T *m = g_new0(MailboxCounters_T, 1);
+			m->mailbox_idnr = db_result_get_u64(r, 0);
+			size += db_result_get_u64(r, 1);
+			m->exists = -(int64_t)db_result_get_u64(r, 2);
+			m->unseen = -(int64_t)db_result_get_u64(r, 3);
+			m->recent = -(int64_t)db_result_get_u64(r, 4);
+			counters = g_list_prepend(counters, m);
+		}
 		db_stmt_exec(st);
-		db_commit_transaction(c);
+		ok = (! size) || dm_quota_user_delta(c, user_idnr, -(int64_t)size);
+		for (l = counters; ok && l; l = g_list_next(l))
+			ok = db_mailbox_counters_delta(c, (MailboxCounters_T *)l->data);
+		if (ok)
+			db_commit_transaction(c);
+		else
+			db_rollback_transaction(c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
 		db_rollback_transaction(c);
@@ -3838,6 +4695,9 @@ int db_user_delete_messages(uint64_t user_idnr, char *flags)
 		db_con_close(c);
 	END_TRY;
 
+	g_list_destroy(counters);
+
+	p_string_free(where, TRUE);
 	p_string_free(query, TRUE);
 	g_list_destroy(keywords);
 	mempool_close(&pool);
@@ -3882,7 +4742,6 @@ int db_user_security_trigger(uint64_t user_idnr)
 		db_empty_mailbox(user_idnr, 0);
 	} else if (flags) {
 		db_user_delete_messages(user_idnr, flags);
-		dm_quota_rebuild_user(user_idnr);
 	} else {
 		TRACE(TRACE_INFO, "NotFound: user_idnr [%" PRIu64 "] security_action [%" PRIu64 "]",
 				user_idnr, action);
@@ -3915,6 +4774,54 @@ int db_user_exists(const char *username, uint64_t * user_idnr)
 	return (*user_idnr) ? 1 : 0;
 }
 
+static void db_generation_bump(Connection_T c, const char *name)
+{
+	db_exec(c, "UPDATE %sgenerations SET generation = generation + 1 "
+			"WHERE name = '%s'", DBPFX, name);
+}
+
+static int db_generation(const char *name, uint64_t *generation)
+{
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+
+	*generation = 0;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT generation FROM %sgenerations "
+				"WHERE name = '%s'", DBPFX, name);
+		if (db_result_next(r))
+			*generation = db_result_get_u64(r, 0);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+void db_alias_generation_bump(Connection_T c)
+{
+	db_generation_bump(c, "aliases");
+}
+
+int db_alias_generation(uint64_t *generation)
+{
+	return db_generation("aliases", generation);
+}
+
+void db_auth_generation_bump(Connection_T c)
+{
+	db_generation_bump(c, "auth");
+}
+
+int db_auth_generation(uint64_t *generation)
+{
+	return db_generation("auth", generation);
+}
+
 int db_user_create_shadow(const char *username, uint64_t * user_idnr)
 {
 	return db_user_create(username, "UNUSED", "md5", 0xffff, 0, user_idnr);
@@ -3982,6 +4889,7 @@ int db_user_create(const char *username, const char *password, const char *encty
 			id = db_insert_result(c, r);
 		}
 		if (*user_idnr == 0) *user_idnr = id;
+		db_alias_generation_bump(c);
 		db_commit_transaction(c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
@@ -4012,6 +4920,8 @@ int db_user_delete(const char * username)
 		s = db_stmt_prepare(c, "DELETE FROM %susers WHERE userid = ?", DBPFX);
 		db_stmt_set_str(s, 1, username);
 		db_stmt_exec(s);
+		db_alias_generation_bump(c);
+		db_auth_generation_bump(c);
 		db_commit_transaction(c);
 		t = TRUE;
 	CATCH(SQLException)
@@ -4033,6 +4943,8 @@ int db_user_rename(uint64_t user_idnr, const char *new_name)
 		db_stmt_set_str(s, 1, new_name);
 		db_stmt_set_u64(s, 2, user_idnr);
 		db_stmt_exec(s);
+		db_alias_generation_bump(c);
+		db_auth_generation_bump(c);
 		db_commit_transaction(c);
 		t = TRUE;
 	CATCH(SQLException)
@@ -4241,13 +5153,18 @@ int db_user_log_login(uint64_t user_idnr)
 	return db_update("UPDATE %susers SET last_login = '%s' WHERE user_idnr = %" PRIu64 "",DBPFX, timestring, user_idnr);
 }
 
-uint64_t db_mailbox_seq_update(uint64_t mailbox_id, uint64_t message_id)
+uint64_t db_mailbox_seq_update_c(Connection_T c, uint64_t mailbox_id, uint64_t message_id)
 {
-	Connection_T c; ResultSet_T r; PreparedStatement_T st1, st2, st3;
-	volatile uint64_t seq = 0;
-	c = db_con_get();
-	TRY
-		db_begin_transaction(c);
+	ResultSet_T r; PreparedStatement_T st1, st2, st3;
+	uint64_t seq = 0;
+
+	if (db_params.db_driver == DM_DRIVER_POSTGRESQL) {
+		/* bump and read back in a single round-trip */
+		st1 = db_stmt_prepare(c, "UPDATE %smailboxes SET seq=seq+1 WHERE mailbox_idnr = ? "
+				"RETURNING seq", DBPFX);
+		db_stmt_set_u64(st1, 1, mailbox_id);
+		r = db_stmt_query(st1);
+	} else {
 		st1 = db_stmt_prepare(c, "UPDATE %s %smailboxes SET seq=seq+1 WHERE mailbox_idnr = ?",
 				db_get_sql(SQL_IGNORE), DBPFX);
 		db_stmt_set_u64(st1, 1, mailbox_id);
@@ -4255,39 +5172,74 @@ uint64_t db_mailbox_seq_update(uint64_t mailbox_id, uint64_t message_id)
 		db_stmt_set_u64(st2, 1, mailbox_id);
 		db_stmt_exec(st1);
 		r = db_stmt_query(st2);
-		if (db_result_next(r))
-			seq = db_result_get_u64(r, 0);
-		if (message_id) {
-			st3 = db_stmt_prepare(c, "UPDATE %s %smessages SET seq = ? WHERE message_idnr = ? "
-					"AND seq < ?",
-					db_get_sql(SQL_IGNORE), DBPFX);
-			db_stmt_set_u64(st3, 1, seq);
-			db_stmt_set_u64(st3, 2, message_id);
-			db_stmt_set_u64(st3, 3, seq);
-			db_stmt_exec(st3);
-		}
+	}
+	if (db_result_next(r))
+		seq = db_result_get_u64(r, 0);
+	if (message_id)
+		db_message_set_seq_c(c, message_id, seq);
+
+	TRACE(TRACE_DEBUG, "mailbox_id [%" PRIu64 "] message_id [%" PRIu64 "] -> [%" PRIu64 "]",
+			mailbox_id, message_id, seq);
+	return seq;
+}
+
+uint64_t db_mailbox_seq_update(uint64_t mailbox_id, uint64_t message_id)
+{
+	Connection_T c;
+	volatile uint64_t seq = 0;
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		seq = db_mailbox_seq_update_c(c, mailbox_id, message_id);
 		db_commit_transaction(c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		seq = 0;
 	FINALLY
 		db_con_close(c);
 	END_TRY;
-	TRACE(TRACE_DEBUG, "mailbox_id [%" PRIu64 "] message_id [%" PRIu64 "] -> [%" PRIu64 "]",
-			mailbox_id, message_id, seq);
 	return seq;
 }
 
+void db_message_set_seq_c(Connection_T c, uint64_t message_id, uint64_t seq)
+{
+	PreparedStatement_T st;
+	st = db_stmt_prepare(c, "UPDATE %s %smessages SET seq = ? WHERE message_idnr = ? "
+			"AND seq < ?", db_get_sql(SQL_IGNORE), DBPFX);
+	db_stmt_set_u64(st, 1, seq);
+	db_stmt_set_u64(st, 2, message_id);
+	db_stmt_set_u64(st, 3, seq);
+	db_stmt_exec(st);
+}
+
+#define SEQ_SLICE 500
+
+gboolean db_message_set_seq_list_c(Connection_T c, GList *ids, uint64_t seq)
+{
+	GList *slices, *s;
+	gboolean ok = TRUE;
+
+	if (! (ids = g_list_first(ids)))
+		return TRUE;
+
+	slices = g_list_slices_u64(ids, SEQ_SLICE);
+	for (s = slices; s && ok; s = g_list_next(s)) {
+		ok = db_exec(c, "UPDATE %s %smessages SET seq = %" PRIu64 " "
+				"WHERE message_idnr IN (%s) AND seq < %" PRIu64 "",
+				db_get_sql(SQL_IGNORE), DBPFX, seq, (gchar *)s->data, seq);
+	}
+	g_list_destroy(slices);
+
+	return ok;
+}
+
 void db_message_set_seq(uint64_t message_id, uint64_t seq)
 {
-	Connection_T c; PreparedStatement_T st;
+	Connection_T c;
 	c = db_con_get();
 	TRY
-		st = db_stmt_prepare(c, "UPDATE %s %smessages SET seq = ? WHERE message_idnr = ? "
-				"AND seq < ?", db_get_sql(SQL_IGNORE), DBPFX);
-		db_stmt_set_u64(st, 1, seq);
-		db_stmt_set_u64(st, 2, message_id);
-		db_stmt_set_u64(st, 3, seq);
-		db_stmt_exec(st);
+		db_message_set_seq_c(c, message_id, seq);
 	CATCH(SQLException)
 		LOG_SQLERROR;
 	FINALLY
@@ -4297,8 +5249,47 @@ void db_message_set_seq(uint64_t message_id, uint64_t seq)
 
 int db_move_message(uint64_t message_id, uint64_t mailbox_id)
 {
-	return db_update("UPDATE %smessages SET mailbox_idnr = %" PRIu64 " WHERE message_idnr = %" PRIu64 "",
-		DBPFX, mailbox_id, message_id);
+	Connection_T c; ResultSet_T r; volatile int t = FALSE;
+	uint64_t mailbox_from = 0;
+	MailboxCounters_T counters;
+	char where[DEF_FRAGSIZE];
+
+	memset(where, 0, sizeof(where));
+	snprintf(where, DEF_FRAGSIZE-1, "message_idnr = %" PRIu64 "", message_id);
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		r = db_query(c, "SELECT mailbox_idnr FROM %smessages WHERE %s", DBPFX, where);
+		if (r && db_result_next(r))
+			mailbox_from = db_result_get_u64(r, 0);
+		if (mailbox_from && db_mailbox_counters_count(c, mailbox_from, where, &counters)
+				&& db_exec(c, "UPDATE %smessages SET mailbox_idnr = %" PRIu64 " WHERE %s",
+					DBPFX, mailbox_id, where)) {
+			counters.mailbox_idnr = mailbox_id;
+			counters.uidnext = message_id + 1;
+			t = db_mailbox_counters_delta(c, &counters);
+			counters.mailbox_idnr = mailbox_from;
+			counters.exists = -counters.exists;
+			counters.unseen = -counters.unseen;
+			counters.recent = -counters.recent;
+			counters.uidnext = 0;
+			if (t)
+				t = db_mailbox_counters_delta(c, &counters);
+		}
+		if (t)
+			db_commit_transaction(c);
+		else
+			db_rollback_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = FALSE;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
 }
 
 int db_rehash_store(void)
@@ -4367,40 +5358,257 @@ int db_rehash_store(void)
 	return t;
 }
 
-int db_append_msg(const char *msgdata, uint64_t mailbox_idnr, uint64_t user_idnr,
-		char* internal_date, uint64_t * msg_idnr, gboolean recent)
+int db_verify_store(uint64_t *checked, uint64_t *mismatched)
 {
-        DbmailMessage *message;
-	int result;
+	GList *ids = NULL;
+	Connection_T c; PreparedStatement_T s; ResultSet_T r; volatile int t = DM_SUCCESS;
+	const char *buf, *stored;
+	char hash[FIELDSIZE];
+
+	*checked = *mismatched = 0;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT id FROM %smimeparts", DBPFX);
+		while (db_result_next(r)) {
+			uint64_t *id = g_new0(uint64_t,1);
+			*id = db_result_get_u64(r, 0);
+			ids = g_list_prepend(ids, id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	END_TRY;
+
+	if (t == DM_EQUERY) {
+		db_con_close(c);
+		return t;
+	}
+
+	ids = g_list_first(ids);
+	TRY
+		while (ids) {
+			uint64_t *id = ids->data;
+
+			db_con_clear(c);
+			s = db_stmt_prepare(c, "SELECT hash, data FROM %smimeparts WHERE id=?", DBPFX);
+			db_stmt_set_u64(s,1, *id);
+			r = db_stmt_query(s);
+			if (db_result_next(r)) {
+				stored = db_result_get(r, 0);
+				buf = db_result_get(r, 1);
+				memset(hash, 0, sizeof(hash));
+				dm_get_hash_for_string(buf, hash);
+				(*checked)++;
+				if (! MATCH(hash, stored)) {
+					TRACE(TRACE_WARNING, "mimepart [%" PRIu64 "] hash mismatch", *id);
+					(*mismatched)++;
+				}
+			}
+
+			if (! g_list_next(ids)) break;
+			ids = g_list_next(ids);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_list_destroy(ids);
+
+	return t;
+}
+
+int db_append_msgs(uint64_t mailbox_idnr, uint64_t user_idnr, GList *appends, gboolean recent)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T s;
+	GList *messages = NULL, *ids = NULL, *m, *a, *k;
+	uint64_t size = 0;
+	volatile uint64_t seq = 0;
+	MailboxCounters_T counters;
+	char unique_id[UID_SIZE];
+	char *frag;
+	int valid;
+	volatile int t = DM_SUCCESS;
+
+	if (! appends) return DM_SUCCESS;
+
+	memset(&counters, 0, sizeof(counters));
+	counters.mailbox_idnr = mailbox_idnr;
 
 	if (! mailbox_is_writable(mailbox_idnr)) return DM_EQUERY;
 
-        message = dbmail_message_new(NULL);
-        message = dbmail_message_init_with_string(message, msgdata);
-	dbmail_message_set_internal_date(message, (char *)internal_date);
-        
-        if (dbmail_message_store(message) < 0) {
-		dbmail_message_free(message);
+	appends = g_list_first(appends);
+	for (a = appends; a; a = g_list_next(a)) {
+		AppendMessage_T *append = (AppendMessage_T *)a->data;
+		DbmailMessage *message = dbmail_message_new(NULL);
+		if (! (message = dbmail_message_init_with_string(message, append->msgdata))) {
+			TRACE(TRACE_INFO, "invalid message in append to mailbox [%" PRIu64 "]", mailbox_idnr);
+			t = DM_EGENERAL;
+			break;
+		}
+		dbmail_message_set_internal_date(message, (char *)append->internal_date);
+		size += (uint64_t)dbmail_message_get_size(message, FALSE);
+		messages = g_list_append(messages, message);
+	}
+
+	/* one quotum check for the whole batch */
+	if (t == DM_SUCCESS && (valid = dm_quota_user_validate(user_idnr, size)) == DM_EQUERY) {
+		t = DM_EQUERY;
+	} else if (t == DM_SUCCESS && ! valid) {
+		TRACE(TRACE_DEBUG, "error copying message to user [%" PRIu64 "],"
+				"maxmail exceeded", user_idnr);
+		t = -2;
+	}
+
+	if (t != DM_SUCCESS) {
+		g_list_foreach(messages, (GFunc)dbmail_message_free, NULL);
+		g_list_free(messages);
+		return t;
+	}
+
+	/* store the physmessages and link them straight into the target
+	 * mailbox in one transaction: all messages become visible at
+	 * once with a single modseq, or nothing is left behind */
+	frag = db_returning("message_idnr");
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+
+		for (a = appends, m = messages; a && m; a = g_list_next(a), m = g_list_next(m)) {
+			AppendMessage_T *append = (AppendMessage_T *)a->data;
+			DbmailMessage *message = (DbmailMessage *)m->data;
+			int *flags = append->flags;
+			struct tm now;
+			time_t clock = time(NULL);
+			char *stored;
+
+			if (dbmail_message_store_physmessage_c(c, message) < 0) {
+				t = DM_EQUERY;
+				break;
+			}
+
+			/* the internal date exactly as insert_physmessage wrote it */
+			localtime_r(&clock, &now);
+			stored = dbmail_message_get_internal_date(message, now.tm_year + 1900);
+			append->internaldate = date_sql2time(stored);
+			g_free(stored);
+
+			memset(unique_id,0,sizeof(unique_id));
+			create_unique_id(unique_id, user_idnr);
+
+			if (db_params.db_driver == DM_DRIVER_ORACLE) {
+				db_exec(c, "INSERT INTO %smessages ("
+					"mailbox_idnr,physmessage_id,seen_flag,answered_flag,deleted_flag,flagged_flag,recent_flag,draft_flag,unique_id,status)"
+					" VALUES (%" PRIu64 ",%" PRIu64 ",%d,%d,%d,%d,%d,%d,'%s',%d)",
+					DBPFX, mailbox_idnr, dbmail_message_get_physid(message),
+					flags[IMAP_FLAG_SEEN] ? 1 : 0, flags[IMAP_FLAG_ANSWERED] ? 1 : 0,
+					flags[IMAP_FLAG_DELETED] ? 1 : 0, flags[IMAP_FLAG_FLAGGED] ? 1 : 0,
+					(recent || flags[IMAP_FLAG_RECENT]) ? 1 : 0, flags[IMAP_FLAG_DRAFT] ? 1 : 0,
+					unique_id, MESSAGE_STATUS_SEEN);
+				append->msg_idnr = db_get_pk(c, "messages");
+			} else {
+				r = db_query(c, "INSERT INTO %smessages ("
+					"mailbox_idnr,physmessage_id,seen_flag,answered_flag,deleted_flag,flagged_flag,recent_flag,draft_flag,unique_id,status)"
+					" VALUES (%" PRIu64 ",%" PRIu64 ",%d,%d,%d,%d,%d,%d,'%s',%d) %s",
+					DBPFX, mailbox_idnr, dbmail_message_get_physid(message),
+					flags[IMAP_FLAG_SEEN] ? 1 : 0, flags[IMAP_FLAG_ANSWERED] ? 1 : 0,
+					flags[IMAP_FLAG_DELETED] ? 1 : 0, flags[IMAP_FLAG_FLAGGED] ? 1 : 0,
+					(recent || flags[IMAP_FLAG_RECENT]) ? 1 : 0, flags[IMAP_FLAG_DRAFT] ? 1 : 0,
+					unique_id, MESSAGE_STATUS_SEEN, frag);
+				append->msg_idnr = db_insert_result(c, r);
+			}
+
+			if (! append->msg_idnr) {
+				t = DM_EQUERY;
+				break;
+			}
+			ids = g_list_append(ids, &append->msg_idnr);
+
+			counters.exists++;
+			if (! flags[IMAP_FLAG_SEEN])
+				counters.unseen++;
+			if (recent || flags[IMAP_FLAG_RECENT])
+				counters.recent++;
+			if (counters.uidnext <= append->msg_idnr)
+				counters.uidnext = append->msg_idnr + 1;
+
+			for (k = g_list_first(append->keywords); k; k = g_list_next(k)) {
+				/* skip keywords listed twice by the client */
+				if (g_list_find_custom(g_list_first(append->keywords), k->data,
+							(GCompareFunc)g_ascii_strcasecmp) != k)
+					continue;
+				s = db_stmt_prepare(c, "INSERT INTO %skeywords (message_idnr,keyword) VALUES (?, ?)", DBPFX);
+				db_stmt_set_u64(s, 1, append->msg_idnr);
+				db_stmt_set_str(s, 2, (char *)k->data);
+				db_stmt_exec(s);
+			}
+		}
+
+		if (t == DM_SUCCESS && ! dm_quota_user_delta(c, user_idnr, (int64_t)size))
+			t = DM_EQUERY;
+		if (t == DM_SUCCESS && ! db_mailbox_counters_delta(c, &counters))
+			t = DM_EQUERY;
+		/* the modseq last: the mailbox row stays locked the shortest */
+		if (t == DM_SUCCESS) {
+			seq = db_mailbox_seq_update_c(c, mailbox_idnr, 0);
+			if (! db_message_set_seq_list_c(c, ids, seq))
+				t = DM_EQUERY;
+		}
+		if (t == DM_SUCCESS)
+			db_commit_transaction(c);
+		else
+			db_rollback_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_free(frag);
+	g_list_free(ids);
+	g_list_foreach(messages, (GFunc)dbmail_message_free, NULL);
+	g_list_free(messages);
+
+	if (t == DM_EQUERY) {
+		TRACE(TRACE_ERR, "error appending messages for user [%" PRIu64 "]", user_idnr);
+		for (a = appends; a; a = g_list_next(a))
+			((AppendMessage_T *)a->data)->msg_idnr = 0;
 		return DM_EQUERY;
 	}
 
-	result = db_copymsg(message->msg_idnr, mailbox_idnr, user_idnr, msg_idnr, recent);
-	db_delete_message(message->msg_idnr);
-        dbmail_message_free(message);
-	
-        switch (result) {
-            case -2:
-                    TRACE(TRACE_DEBUG, "error copying message to user [%" PRIu64 "],"
-                            "maxmail exceeded", user_idnr);
-                    return -2;
-            case -1:
-                    TRACE(TRACE_ERR, "error copying message to user [%" PRIu64 "]", 
-                            user_idnr);
-                    return -1;
-        }
-                
-        TRACE(TRACE_NOTICE, "message id=%" PRIu64 " is inserted", *msg_idnr);
-        
-        return (db_set_message_status(*msg_idnr, MESSAGE_STATUS_SEEN)?FALSE:TRUE);
+	TRACE(TRACE_NOTICE, "[%u] messages inserted into mailbox [%" PRIu64 "] seq [%" PRIu64 "]",
+			g_list_length(appends), mailbox_idnr, seq);
+
+	return DM_SUCCESS;
+}
+
+int db_append_msg(const char *msgdata, uint64_t mailbox_idnr, uint64_t user_idnr,
+		char* internal_date, uint64_t * msg_idnr, gboolean recent,
+		int *flags, GList *keywords)
+{
+	AppendMessage_T append;
+	GList *appends;
+	int result;
+
+	memset(&append, 0, sizeof(append));
+	append.msgdata = msgdata;
+	append.internal_date = internal_date;
+	append.keywords = keywords;
+	if (flags)
+		memcpy(append.flags, flags, sizeof(append.flags));
+
+	appends = g_list_append(NULL, &append);
+	result = db_append_msgs(mailbox_idnr, user_idnr, appends, recent);
+	g_list_free(appends);
+
+	*msg_idnr = append.msg_idnr;
+
+	return result;
 }
 
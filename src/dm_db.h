@@ -75,6 +75,7 @@ void db_con_clear(C c);
 int db_disconnect(void);
 
 void log_query_time(char *query, struct timeval before, struct timeval after);
+unsigned db_statement_count(void);
 
 PreparedStatement_T db_stmt_prepare(Connection_T, const char *, ...);
 int db_stmt_set_str(S stmt, int index, const char *x);
@@ -246,6 +247,33 @@ int db_usermap_resolve(ClientBase_T *ci, const char *userid, char * real_usernam
  */
 int db_get_physmessage_id(uint64_t message_idnr, /*@out@*/ uint64_t * physmessage_id);
 
+/**
+ * \brief get the rfcsize of a physmessage
+ * \param physmessage_id
+ * \param rfcsize will hold the size on return
+ * \return 
+ *     - DM_EQUERY on error
+ *     - DM_SUCCESS if a non-zero size was found
+ *     - DM_EGENERAL if the size is unknown
+ */
+int db_get_physmessage_size(uint64_t physmessage_id, /*@out@*/ uint64_t * rfcsize);
+
+/**
+ * \brief read the values of a header from the header cache
+ *
+ * the cache keeps no position, and identical values of a header
+ * are stored once, so repeated headers come back in no particular
+ * order. Headers not in the cache are not found either.
+ *
+ * \param physmessage_id
+ * \param header case-insensitive header name
+ * \param values list to append the (decoded) values to
+ * \return 
+ *     - DM_EQUERY on error
+ *     - DM_SUCCESS otherwise
+ */
+int db_get_cached_header(uint64_t physmessage_id, const char *header, GList **values);
+
 
 /**
  * \brief return number of bytes used by user identified by userid
@@ -262,15 +290,68 @@ int dm_quota_user_dec(uint64_t user_idnr, uint64_t size);
 int dm_quota_user_inc(uint64_t user_idnr, uint64_t size);
 
 /**
- * \brief finds all users which need to have their curmail_size (amount
- * of space used by user) updated. Then updates this number in the
- * database
+ * \brief apply a signed change to the used quotum of a user on a
+ * connection that is inside the transaction which inserted or
+ * removed the messages, so the two can never drift apart.
+ * \param c connection with an open transaction
+ * \param user_idnr owner of the messages
+ * \param delta number of bytes added (positive) or removed (negative)
+ * \return
+ *     - FALSE on database error
+ *     - TRUE otherwise
+ */
+int dm_quota_user_delta(C c, uint64_t user_idnr, int64_t delta);
+
+/**
+ * \brief apply a signed change to the message counters of a mailbox
+ * on a connection that is inside the transaction which changed the
+ * messages. Callers sum up the change for a whole command and apply
+ * it once, so a command costs a single update of the mailbox row.
+ * \param c connection with an open transaction
+ * \param delta change to apply; uidnext is a lower bound, 0 leaves it
+ * \return
+ *     - FALSE on database error
+ *     - TRUE otherwise
+ */
+int db_mailbox_counters_delta(C c, const MailboxCounters_T *delta);
+
+/**
+ * \brief count the messages in a mailbox that match a condition and
+ * are counted by the mailbox counters (status NEW or SEEN)
+ * \param c connection
+ * \param mailbox_idnr mailbox the messages belong to
+ * \param where condition on the messages table, e.g. an id list
+ * \param counts filled with the matching counts
+ * \return
+ *     - FALSE on database error
+ *     - TRUE otherwise
+ */
+int db_mailbox_counters_count(C c, uint64_t mailbox_idnr, const char *where, MailboxCounters_T *counts);
+
+/**
+ * \brief subtract the messages in a mailbox that match a condition
+ * from its counters. Call this before the messages are expunged,
+ * moved away or deleted, within the same transaction.
+ * \param c connection with an open transaction
+ * \param mailbox_idnr mailbox the messages belong to
+ * \param where condition on the messages table, e.g. an id list
+ * \return
+ *     - FALSE on database error
+ *     - TRUE otherwise
+ */
+int db_mailbox_counters_remove(C c, uint64_t mailbox_idnr, const char *where);
+
+/**
+ * \brief verify curmail_size (amount of space used by user) against
+ * the stored messages for all users, one slice of users at a time.
+ * Quota are maintained incrementally, so this is only needed as a
+ * consistency check.
+ * \param repair also store the recalculated values
  * \return 
- *     - -2 on memory error
  *     - -1 on database error
- *     -  0 on success
+ *     - number of users with a wrong curmail_size otherwise
  */
-int dm_quota_rebuild(void);
+int dm_quota_rebuild(gboolean repair);
 
 /**
  * \brief performs a recalculation of used quotum of a user and puts
@@ -349,6 +430,26 @@ int db_empty_mailbox(uint64_t user_idnr, int only_empty);
  */
 int db_get_mailbox_size(uint64_t mailbox_idnr, int only_deleted, uint64_t * mailbox_size);
 
+/**
+ * \brief fetch a page of message summaries for a mailbox
+ * \param mailbox_idnr
+ * \param after only messages with a uid above this one
+ * \param changedsince only messages with a modseq above this one
+ * \param limit maximum number of messages in the page
+ * \param modseq will hold the mailbox modseq at the time of the query
+ * \param summaries list of MessageSummary in uid order, to be released
+ * with db_mailbox_summary_free
+ *
+ * The \Recent flag is never set in the summaries.
+ * \return
+ * 	- DM_EQUERY on database failure
+ * 	- DM_EGENERAL if the mailbox does not exist
+ * 	- DM_SUCCESS on success
+ */
+int db_mailbox_summary(uint64_t mailbox_idnr, uint64_t after, uint64_t changedsince,
+		unsigned limit, uint64_t *modseq, GList **summaries);
+void db_mailbox_summary_free(GList *summaries);
+
 /**
 * \brief check for all message blocks  that are not connected to
 *        a physmessage. This can only occur when in use with a 
@@ -368,6 +469,14 @@ int db_icheck_physmessages(gboolean cleanup);
 int db_icheck_headernames(gboolean cleanup);
 int db_icheck_headervalues(gboolean cleanup);
 
+/**
+ * \brief check the per-mailbox exists/unseen/recent/uidnext counters
+ * against the messages table.
+ * \param cleanup if TRUE, recompute drifted counters
+ * \return number of mailboxes with drifted counters, or DM_EQUERY
+ */
+int db_icheck_mailbox_counters(gboolean cleanup);
+
 /** 
  * \brief check for cached header values
  *
@@ -390,6 +499,14 @@ int db_update_rfcsize(GList *lost);
 int db_icheck_envelope(GList **lost);
 int db_set_envelope(GList *lost);
 
+/**
+ * \brief check for cached bodystructures
+ *
+ */
+
+int db_icheck_bodystructure(GList **lost);
+int db_set_bodystructure(GList *lost);
+
 /**
  * \brief set status of a message
  * \param message_idnr
@@ -575,6 +692,21 @@ int db_isselectable(uint64_t mailbox_idnr);
  *    - 1 flag set
  */
 int db_noinferiors(uint64_t mailbox_idnr);
+/**
+ * \brief append a batch of messages to a mailbox in one transaction,
+ * with a single quotum check and one modseq for all of them
+ * \param mailbox_idnr destination mailbox
+ * \param user_idnr who is appending
+ * \param appends list of AppendMessage_T, msg_idnr is set on success
+ * \param recent set the recent flag
+ * \return 
+ * 		- -2 on quotum exceeded
+ * 		- -1 on failure
+ * 		- 0 on success
+ * 		- 1 on invalid message
+ */
+int db_append_msgs(uint64_t mailbox_idnr, uint64_t user_idnr, GList *appends, gboolean recent);
+
 /** 
  * \brief append message to mailbox
  * \param msgdata raw message data
@@ -582,13 +714,19 @@ int db_noinferiors(uint64_t mailbox_idnr);
  * \param user_idnr who is appending
  * \param internal_date optional
  * \param msg_idnr result
+ * \param recent set the recent flag
+ * \param flags optional IMAP_NFLAGS array of flags to set
+ * \param keywords optional list of keywords to set
  * \return 
+ * 		- -2 on quotum exceeded
  * 		- -1 on failure
  * 		- 0 on success
+ * 		- 1 on invalid message
  */
 
 int db_append_msg(const char *msgdata, uint64_t mailbox_idnr, uint64_t user_idnr, 
-		char * internal_date, uint64_t * msg_idnr, gboolean recent);
+		char * internal_date, uint64_t * msg_idnr, gboolean recent,
+		int *flags, GList *keywords);
 
 /**
  * \brief move all messages from one mailbox to another.
@@ -611,6 +749,35 @@ int db_movemsg(uint64_t mailbox_to, uint64_t mailbox_from);
  */
 int db_copymsg(uint64_t msg_idnr, uint64_t mailbox_to,
 	       uint64_t user_idnr, uint64_t * newmsg_idnr, gboolean recent);
+/**
+ * \brief like db_copymsg, but stamp the copy with a modseq the caller
+ * already allocated instead of bumping the mailbox seq per message.
+ * \param seq modseq for the new message; 0 allocates one as db_copymsg does
+ */
+int db_copymsg_seq(uint64_t msg_idnr, uint64_t mailbox_to,
+	       uint64_t user_idnr, uint64_t * newmsg_idnr, gboolean recent, uint64_t seq);
+/**
+ * \brief copy a message inside the caller's transaction, so a command
+ * copying a set of messages commits or fails as a whole
+ * \param c connection with an open transaction
+ * \param counters summed change to the target's counters; the caller
+ * applies it with db_mailbox_counters_delta() before committing
+ * \return as db_copymsg
+ */
+int db_copymsg_c(C c, uint64_t msg_idnr, uint64_t mailbox_to,
+	       uint64_t user_idnr, uint64_t * newmsg_idnr, gboolean recent, uint64_t seq,
+	       MailboxCounters_T *counters);
+
+/**
+ * \brief link one stored physmessage into many mailboxes at once
+ * \param physmessage_id physmessage to link
+ * \param msgsize size of the message, for quotum accounting
+ * \param targets list of DeliveryTarget_T; result is set on each
+ * \return
+ * 		- -1 on database failure
+ * 		- 0 on success (see the per-target results)
+ */
+int db_copymsg_batch(uint64_t physmessage_id, uint64_t msgsize, GList *targets);
 
 /**
  * \brief check if mailbox already holds message with message-id
@@ -694,6 +861,13 @@ int db_get_msgflag(const char *flag_name, uint64_t msg_idnr);
  * 		-  1 on success
  */
 int db_set_msgflag(uint64_t msg_idnr, int *flags, GList *keywords, int action_type, uint64_t seq, MessageInfo *msginfo);
+/**
+ * \brief as db_set_msgflag, inside the caller's transaction
+ * \param c connection with an open transaction
+ * \param counters summed change to the counters of the mailbox; the
+ * caller applies it with db_mailbox_counters_delta() once per command
+ */
+int db_set_msgflag_c(C c, uint64_t msg_idnr, int *flags, GList *keywords, int action_type, uint64_t seq, MessageInfo *msginfo, MailboxCounters_T *counters);
 
 /**
  * \brief set one right in an acl for a user
@@ -756,6 +930,31 @@ int db_user_validate(ClientBase_T *ci, const char *pwfield, uint64_t *user_idnr,
 int db_user_security_trigger(uint64_t user_idnr);
 
 int db_user_exists(const char *username, uint64_t * user_idnr);
+
+/**
+ * \brief read the generation of the aliases and users tables, so
+ * processes caching recipient lookups can notice changes made elsewhere.
+ * \param generation filled with the counter
+ * \return DM_SUCCESS or DM_EQUERY
+ */
+int db_alias_generation(uint64_t *generation);
+/**
+ * \brief bump the aliases and users generation; call it in the
+ * transaction that changes either table.
+ */
+void db_alias_generation_bump(C c);
+/**
+ * \brief read the generation of the users credentials, so processes
+ * caching logins can notice password changes made elsewhere.
+ * \param generation filled with the counter
+ * \return DM_SUCCESS or DM_EQUERY
+ */
+int db_auth_generation(uint64_t *generation);
+/**
+ * \brief bump the credentials generation; call it in the transaction
+ * that changes a password, a username or the active state of a user.
+ */
+void db_auth_generation_bump(C c);
 int db_user_create_shadow(const char *username, uint64_t * user_idnr);
 int db_user_create(const char *username, const char *password, const char *enctype,
 		 uint64_t clientid, uint64_t maxmail, uint64_t * user_idnr); 
@@ -777,9 +976,28 @@ char * db_returning(const char *s);
 
 uint64_t db_mailbox_seq_update(uint64_t mailbox_id, uint64_t message_id);
 void db_message_set_seq(uint64_t message_id, uint64_t seq);
+/**
+ * \brief as above, but inside the caller's transaction on c, so the
+ * modseq only becomes visible together with the rows stamped with it.
+ * Throws SQLException on error.
+ */
+uint64_t db_mailbox_seq_update_c(C c, uint64_t mailbox_id, uint64_t message_id);
+void db_message_set_seq_c(C c, uint64_t message_id, uint64_t seq);
+/**
+ * \brief stamp a list of messages with seq, one statement per slice
+ * \param ids list of (uint64_t *) message_idnr
+ * \return TRUE on success, FALSE on database failure
+ */
+gboolean db_message_set_seq_list_c(C c, GList *ids, uint64_t seq);
 int db_move_message(uint64_t message_id, uint64_t mailbox_id);
 
 int db_rehash_store(void);
+/**
+ * \brief recompute the hash of every stored mimepart and
+ * count the parts whose stored hash does not match their data.
+ * \return DM_SUCCESS or DM_EQUERY
+ */
+int db_verify_store(uint64_t *checked, uint64_t *mismatched);
 
 #undef P
 #undef S
@@ -24,6 +24,8 @@
 #include "dbmail.h"
 #define THIS_MODULE "dsn"
 
+extern DBParam_T db_params;
+
 /* Enhanced Status Codes from RFC 1893
  * Nota Bene: should be updated to include
  * its successor, RFC 3463, too.
@@ -226,6 +228,187 @@ void set_dsn(delivery_status_t *dsn,
 	dsn->detail = qux;
 }
 
+/*
+ * Recipient resolution cache
+ *
+ * Resolving an address walks aliases, usernames, domain and userpart
+ * catch-alls, each costing one or more (recursive) lookups. The outcome
+ * for an address, including "does not exist", is kept for
+ * resolve_cache_ttl seconds from the lookup that resolved it. Alias and
+ * user changes made through this process drop the cache right away;
+ * changes made by other processes, like dbmail-users, are noticed through
+ * the aliases generation counter that every such change bumps, checked
+ * at most once a second.
+ */
+
+#define RESOLVE_CACHE_TTL 60
+#define RESOLVE_CACHE_SIZE 4096
+
+typedef struct {
+	delivery_status_t dsn;
+	GList *userids;
+	GList *forwards;
+	time_t expires;
+} ResolveCacheEntry;
+
+static GHashTable *resolve_cache = NULL;
+static int resolve_cache_ttl = RESOLVE_CACHE_TTL;
+static GOnce resolve_cache_once = G_ONCE_INIT;
+static time_t resolve_cache_checked = 0;
+static uint64_t resolve_cache_generation = 0;
+static unsigned resolve_cache_hits = 0;
+static unsigned resolve_cache_misses = 0;
+G_LOCK_DEFINE_STATIC(resolve_cache_mutex);
+
+static void resolve_cache_free(gpointer data)
+{
+	ResolveCacheEntry *e = (ResolveCacheEntry *)data;
+	g_list_destroy(e->userids);
+	g_list_destroy(e->forwards);
+	g_free(e);
+}
+
+static gpointer resolve_cache_init(gpointer UNUSED data)
+{
+	Field_T val;
+
+	memset(val, 0, sizeof(Field_T));
+	config_get_value("resolve_cache_ttl", "DELIVERY", val);
+	if (strlen(val))
+		resolve_cache_ttl = atoi(val);
+
+	TRACE(TRACE_DEBUG, "resolve cache ttl [%d]", resolve_cache_ttl);
+
+	resolve_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, resolve_cache_free);
+
+	return (gpointer)NULL;
+}
+
+static gboolean resolve_cache_expired(gpointer UNUSED key, gpointer value, gpointer data)
+{
+	return ((ResolveCacheEntry *)value)->expires <= *(time_t *)data;
+}
+
+static GList * resolve_copy_userids(GList *userids)
+{
+	GList *copy = NULL;
+	for (userids = g_list_first(userids); userids; userids = g_list_next(userids)) {
+		uint64_t *uid = g_new0(uint64_t,1);
+		*uid = *(uint64_t *)userids->data;
+		copy = g_list_append(copy, uid);
+	}
+	return copy;
+}
+
+static GList * resolve_copy_forwards(GList *forwards)
+{
+	GList *copy = NULL;
+	for (forwards = g_list_first(forwards); forwards; forwards = g_list_next(forwards))
+		copy = g_list_append(copy, g_strdup((char *)forwards->data));
+	return copy;
+}
+
+/* drop everything if the aliases or users tables changed elsewhere */
+static void resolve_cache_check(time_t now)
+{
+	uint64_t generation = 0;
+
+	if (MATCH(db_params.authdriver, "LDAP"))
+		return;
+
+	G_LOCK(resolve_cache_mutex);
+	if (resolve_cache_checked == now) {
+		G_UNLOCK(resolve_cache_mutex);
+		return;
+	}
+	resolve_cache_checked = now;
+	G_UNLOCK(resolve_cache_mutex);
+
+	if (db_alias_generation(&generation) != DM_SUCCESS)
+		return;
+
+	G_LOCK(resolve_cache_mutex);
+	if (generation != resolve_cache_generation) {
+		TRACE(TRACE_DEBUG, "aliases or users changed; flushing resolve cache");
+		resolve_cache_generation = generation;
+		g_hash_table_remove_all(resolve_cache);
+	}
+	G_UNLOCK(resolve_cache_mutex);
+}
+
+static int resolve_cache_lookup(Delivery_T *delivery)
+{
+	ResolveCacheEntry *e;
+	time_t now = time(NULL);
+	char *key;
+	int found = FALSE;
+
+	resolve_cache_check(now);
+
+	key = g_ascii_strdown(delivery->address, -1);
+
+	G_LOCK(resolve_cache_mutex);
+	if ((e = g_hash_table_lookup(resolve_cache, key))) {
+		if (e->expires > now) {
+			delivery->dsn = e->dsn;
+			delivery->userids = g_list_concat(delivery->userids, resolve_copy_userids(e->userids));
+			delivery->forwards = g_list_concat(delivery->forwards, resolve_copy_forwards(e->forwards));
+			found = TRUE;
+		} else {
+			g_hash_table_remove(resolve_cache, key);
+		}
+	}
+	if (found)
+		resolve_cache_hits++;
+	else
+		resolve_cache_misses++;
+	G_UNLOCK(resolve_cache_mutex);
+
+	g_free(key);
+
+	if (found)
+		TRACE(TRACE_DEBUG, "[%s] resolved from cache", delivery->address);
+
+	return found;
+}
+
+static void resolve_cache_insert(Delivery_T *delivery)
+{
+	time_t now = time(NULL);
+	ResolveCacheEntry *e = g_new0(ResolveCacheEntry, 1);
+
+	e->dsn = delivery->dsn;
+	e->userids = resolve_copy_userids(delivery->userids);
+	e->forwards = resolve_copy_forwards(delivery->forwards);
+	e->expires = now + resolve_cache_ttl;
+
+	G_LOCK(resolve_cache_mutex);
+	if (g_hash_table_size(resolve_cache) >= RESOLVE_CACHE_SIZE) {
+		g_hash_table_foreach_remove(resolve_cache, resolve_cache_expired, &now);
+		if (g_hash_table_size(resolve_cache) >= RESOLVE_CACHE_SIZE)
+			g_hash_table_remove_all(resolve_cache);
+	}
+	g_hash_table_replace(resolve_cache, g_ascii_strdown(delivery->address, -1), e);
+	G_UNLOCK(resolve_cache_mutex);
+}
+
+void dsnuser_cache_invalidate(void)
+{
+	g_once(&resolve_cache_once, resolve_cache_init, NULL);
+
+	G_LOCK(resolve_cache_mutex);
+	g_hash_table_remove_all(resolve_cache);
+	G_UNLOCK(resolve_cache_mutex);
+}
+
+void dsnuser_cache_stats(unsigned *hits, unsigned *misses)
+{
+	G_LOCK(resolve_cache_mutex);
+	*hits = resolve_cache_hits;
+	*misses = resolve_cache_misses;
+	G_UNLOCK(resolve_cache_mutex);
+}
+
 static int address_has_alias(Delivery_T *delivery)
 {
 	int alias_count;
@@ -511,6 +694,7 @@ int dsnuser_resolve_list(List_T deliveries)
 int dsnuser_resolve(Delivery_T *delivery)
 {
 	uint64_t *uid;
+	int cached = FALSE;
 	/* If the userid is already set, then we're doing direct-to-userid.
 	 * We just want to make sure that the userid actually exists... */
 	if (delivery->useridnr != 0) {
@@ -544,7 +728,12 @@ int dsnuser_resolve(Delivery_T *delivery)
 
 		TRACE(TRACE_INFO, "checking if [%s] is a valid username, alias, or catchall.", delivery->address);
 
-		if (address_has_alias(delivery))  {
+		g_once(&resolve_cache_once, resolve_cache_init, NULL);
+
+		if (resolve_cache_ttl > 0 && (cached = resolve_cache_lookup(delivery))) {
+			TRACE(TRACE_INFO, "delivering [%s] as cached.", delivery->address);
+
+		} else if (address_has_alias(delivery))  {
 			/* The address had aliases and they've
 			 * been resolved into the delivery struct. */
 			/* Success. Address related. Valid. */
@@ -582,6 +771,11 @@ int dsnuser_resolve(Delivery_T *delivery)
 			TRACE(TRACE_INFO, "could not find [%s] at all.", delivery->address);
 		}
 
+		/* entries expire a ttl after they were resolved, hits
+		 * don't extend them */
+		if (resolve_cache_ttl > 0 && ! cached)
+			resolve_cache_insert(delivery);
+
 	/* Neither useridnr nor address.
 	 * Something is wrong upstream. */
 	} else {
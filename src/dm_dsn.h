@@ -110,6 +110,18 @@ int dsnuser_resolve_list(List_T deliveries);
  */
 int dsnuser_resolve(Delivery_T *dsnuser);
 
+/**
+ * \brief Drop all cached address resolutions. Called whenever
+ * users or aliases are changed through this process.
+ */
+void dsnuser_cache_invalidate(void);
+
+/**
+ * \brief Report how many address resolutions were served
+ * from the cache, and how many had to be looked up.
+ */
+void dsnuser_cache_stats(unsigned *hits, unsigned *misses);
+
 /**
  * \brief Loop through the list of delivery addresses
  * and find out what the single worst case scenario was
@@ -203,6 +203,63 @@ void Http_getUsers(T R)
 }
 
 //--------------------------------------------------------------------------------------//
+/*
+ * paged message summaries: pages are keyed on uid, so concurrent appends
+ * and expunges don't shift them. Every page reports the mailbox modseq;
+ * when it moved while paging, a client re-walks with changedsince set to
+ * the modseq of its first page to pick up what changed behind it.
+ */
+#define HTTP_SUMMARY_PAGE 100
+#define HTTP_SUMMARY_MAXPAGE 1000
+
+extern const char *imap_flag_desc_escaped[];
+
+static void Http_addJsonString(struct evbuffer *buf, const char *s)
+{
+	evbuffer_add(buf, "\"", 1);
+	for (; *s; s++) {
+		switch (*s) {
+			case '"':  evbuffer_add(buf, "\\\"", 2); break;
+			case '\\': evbuffer_add(buf, "\\\\", 2); break;
+			case '\n': evbuffer_add(buf, "\\n", 2); break;
+			case '\r': evbuffer_add(buf, "\\r", 2); break;
+			case '\t': evbuffer_add(buf, "\\t", 2); break;
+			default:
+				if ((unsigned char)*s < 0x20)
+					evbuffer_add_printf(buf, "\\u%04x", (unsigned char)*s);
+				else
+					evbuffer_add(buf, s, 1);
+		}
+	}
+	evbuffer_add(buf, "\"", 1);
+}
+
+static void Http_addSummary(struct evbuffer *buf, MessageSummary *m)
+{
+	GList *k;
+	int j, n = 0;
+
+	evbuffer_add_printf(buf, "    \"%" PRIu64 "\":{\"size\":%" PRIu64 ",\"modseq\":%" PRIu64
+			",\"internaldate\":%ld,\"flags\":[",
+			m->info.uid, m->info.rfcsize, m->info.seq, (long)m->info.internaldate);
+	for (j = 0; j < IMAP_NFLAGS; j++) {
+		if (! MSGINFO_FLAG(&m->info, j))
+			continue;
+		if (n++) evbuffer_add(buf, ",", 1);
+		Http_addJsonString(buf, imap_flag_desc_escaped[j]);
+	}
+	for (k = m->info.keywords; k; k = g_list_next(k)) {
+		if (n++) evbuffer_add(buf, ",", 1);
+		Http_addJsonString(buf, (const char *)k->data);
+	}
+	evbuffer_add_printf(buf, "]");
+	if (m->envelope) {
+		evbuffer_add_printf(buf, ",\"envelope\":");
+		Http_addJsonString(buf, m->envelope);
+	}
+	evbuffer_add_printf(buf, "}");
+}
+
 void Http_getMailboxes(T R)
 {
 	const char *mailbox = Request_getId(R);
@@ -244,7 +301,7 @@ void Http_getMailboxes(T R)
 		unsigned exists = MailboxState_getExists(b);
 
 		if ((msg = evhttp_find_header(Request_getPOST(R),"message"))) {
-			if (! db_append_msg(msg, MailboxState_getId(b), MailboxState_getOwner(b), NULL, &msg_id, TRUE))
+			if (! db_append_msg(msg, MailboxState_getId(b), MailboxState_getOwner(b), NULL, &msg_id, TRUE, NULL, NULL))
 				exists++;		
 		}
 		evbuffer_add_printf(buf, "{\"mailboxes\": {\n");
@@ -278,6 +335,53 @@ void Http_getMailboxes(T R)
 	
 		if (ids) g_list_free(g_list_first(ids));
 		MailboxState_free(&b);
+
+	} else if (MATCH(Request_getMethod(R),"summary")) {
+
+		/*
+		 * list a page of message summaries
+		 * C < GET /mailboxes/876/summary?after=1200&limit=100&changedsince=4711
+		 */
+
+		uint64_t after = 0, changedsince = 0, modseq = 0, next = 0;
+		unsigned limit = HTTP_SUMMARY_PAGE;
+		const char *arg;
+		GList *summaries = NULL, *l;
+		int result;
+
+		if ((arg = evhttp_find_header(Request_getGET(R), "after")))
+			after = strtoull(arg, NULL, 10);
+		if ((arg = evhttp_find_header(Request_getGET(R), "changedsince")))
+			changedsince = strtoull(arg, NULL, 10);
+		if ((arg = evhttp_find_header(Request_getGET(R), "limit")))
+			limit = (unsigned)strtoul(arg, NULL, 10);
+		if ((! limit) || (limit > HTTP_SUMMARY_MAXPAGE))
+			limit = HTTP_SUMMARY_MAXPAGE;
+
+		result = db_mailbox_summary(id, after, changedsince, limit, &modseq, &summaries);
+		if (result == DM_EGENERAL) {
+			Request_error(R, HTTP_NOTFOUND, "Not found");
+			evbuffer_free(buf);
+			return;
+		}
+
+		if (result == DM_SUCCESS) {
+			if (g_list_length(summaries) == limit)
+				next = ((MessageSummary *)g_list_last(summaries)->data)->info.uid;
+
+			evbuffer_add_printf(buf, "{\"mailboxes\": {\n");
+			evbuffer_add_printf(buf, "    \"%" PRIu64 "\":{\"modseq\":%" PRIu64 ",\"next\":%" PRIu64 "}",
+					id, modseq, next);
+			evbuffer_add_printf(buf, "\n},\n\"messages\": {\n");
+			for (l = summaries; l; l = g_list_next(l)) {
+				MessageSummary *m = (MessageSummary *)l->data;
+				Http_addSummary(buf, m);
+				if (g_list_next(l))
+					evbuffer_add_printf(buf, ",\n");
+			}
+			evbuffer_add_printf(buf, "\n}}\n");
+		}
+		db_mailbox_summary_free(summaries);
 	}
 
 	if (EVBUFFER_LENGTH(buf))
@@ -292,9 +396,75 @@ void Http_getMailboxes(T R)
 
 
 
+/*
+ * message bodies are streamed straight from the mimeparts in chunks of
+ * about HTTP_CHUNK_SIZE; headers and sizes come from the caches, so the
+ * message is only parsed when it predates those (messageblks storage,
+ * no header cache or no rfcsize).
+ */
+#define HTTP_CHUNK_SIZE 65536
+
+static int Http_pullMessage(struct evbuffer *buf, void *data)
+{
+	DbmailMessageStream *S = (DbmailMessageStream *)data;
+	GString *chunk = g_string_sized_new(HTTP_CHUNK_SIZE);
+	int r = dbmail_message_stream_read(S, chunk, HTTP_CHUNK_SIZE);
+	if (chunk->len)
+		evbuffer_add(buf, chunk->str, chunk->len);
+	g_string_free(chunk, TRUE);
+	return r;
+}
+
+static void Http_freeMessage(void *data)
+{
+	dbmail_message_stream_free((DbmailMessageStream *)data);
+}
+
+static DbmailMessage * Http_retrieveMessage(DbmailMessage *m, uint64_t pid)
+{
+	if (! m) {
+		m = dbmail_message_new(NULL);
+		m = dbmail_message_retrieve(m, pid);
+	}
+	return m;
+}
+
+/*
+ * parse only the header block, which is the first mimepart
+ * of a message stored in mimeparts
+ */
+static DbmailMessage * Http_retrieveHeaders(DbmailMessage *m, uint64_t pid)
+{
+	DbmailMessageStream *S;
+
+	if (m)
+		return m;
+
+	if ((S = dbmail_message_stream_new(pid))) {
+		GString *s = g_string_new("");
+		if (dbmail_message_stream_read(S, s, 1) >= 0) {
+			m = dbmail_message_new(NULL);
+			m = dbmail_message_init_with_string(m, s->str);
+		}
+		g_string_free(s, TRUE);
+		dbmail_message_stream_free(S);
+	}
+
+	return Http_retrieveMessage(m, pid);
+}
+
+static void Http_addHeaders(struct evbuffer *buf, const char *hname, GList *headers)
+{
+	while (headers) {
+		evbuffer_add_printf(buf, "%s: %s\n", hname, (char *)headers->data);
+		headers = g_list_next(headers);
+	}
+}
+
 void Http_getMessages(T R)
 {
-	DbmailMessage *m;
+	DbmailMessage *m = NULL;
+	DbmailMessageStream *S = NULL;
 	struct evbuffer *buf;
 	uint64_t pid;
 	uint64_t id = 0;
@@ -312,8 +482,6 @@ void Http_getMessages(T R)
 		return;
 	}
 	buf = evbuffer_new();
-	m = dbmail_message_new(NULL);
-	m = dbmail_message_retrieve(m, pid);
 	if (Request_getMethod(R) == NULL) {
 
 		/*
@@ -321,11 +489,17 @@ void Http_getMessages(T R)
 		 * C < GET /messages/1245911
 		 */
 
-		uint64_t size = dbmail_message_get_size(m, TRUE);
-		Request_setContentType(R,"application/json; charset=utf-8");
-		evbuffer_add_printf(buf, "{\"messages\": {\n");
-		evbuffer_add_printf(buf, "   \"%" PRIu64 "\":{\"size\":%" PRIu64 "}", id, size);
-		evbuffer_add_printf(buf, "\n}}\n");
+		uint64_t size = 0;
+		if (db_get_physmessage_size(pid, &size) != DM_SUCCESS) {
+			if ((m = Http_retrieveMessage(m, pid)))
+				size = dbmail_message_get_size(m, TRUE);
+		}
+		if (size) {
+			Request_setContentType(R,"application/json; charset=utf-8");
+			evbuffer_add_printf(buf, "{\"messages\": {\n");
+			evbuffer_add_printf(buf, "   \"%" PRIu64 "\":{\"size\":%" PRIu64 "}", id, size);
+			evbuffer_add_printf(buf, "\n}}\n");
+		}
 
 	} else if (MATCH(Request_getMethod(R), "view")) {
 
@@ -334,10 +508,17 @@ void Http_getMessages(T R)
 		 * C < GET /messages/1245911/view
 		 */
 
-		char *s = dbmail_message_to_string(m);
 		Request_setContentType(R, "message/rfc822; charset=utf-8");
-		evbuffer_add_printf(buf, "%s", s);
-		g_free(s);
+		if ((S = dbmail_message_stream_new(pid))) {
+			evbuffer_free(buf);
+			Request_send_chunked(R, HTTP_OK, "OK", Http_pullMessage, Http_freeMessage, S);
+			return;
+		}
+		if ((m = Http_retrieveMessage(m, pid))) {
+			char *s = dbmail_message_to_string(m);
+			evbuffer_add_printf(buf, "%s", s);
+			g_free(s);
+		}
 
 	} else if (MATCH(Request_getMethod(R),"headers")) {
 
@@ -353,19 +534,26 @@ void Http_getMessages(T R)
 			char **headerlist = g_strsplit(Request_getArg(R),",",0);
 			while (headerlist[i]) {
 				char *hname = headerlist[i];
+				GList *headers = NULL;
 				hname[0] = g_ascii_toupper(hname[0]);
 				TRACE(TRACE_DEBUG,"header: [%s]", headerlist[i]);
-				GList * headers = dbmail_message_get_header_repeated(m, headerlist[i]);
 
-				while(headers) {
-					evbuffer_add_printf(buf, "%s: %s\n", hname, (char *)headers->data);
-					if (! g_list_next(headers))
-						break;
-					headers = g_list_next(headers);
+				/* a single cached value is the answer. Repeated
+				 * headers lose their order in the cache, and a
+				 * miss may be a header the cache skipped, so
+				 * those are read from the header block */
+				if ((db_get_cached_header(pid, hname, &headers) != DM_SUCCESS)
+						|| (g_list_length(headers) != 1)) {
+					g_list_destroy(headers);
+					headers = NULL;
+					if ((m = Http_retrieveHeaders(m, pid)))
+						headers = dbmail_message_get_header_decoded(m, hname);
 				}
+				Http_addHeaders(buf, hname, headers);
+				g_list_destroy(headers);
 				i++;
-				g_list_free(g_list_first(headers));
 			}
+			g_strfreev(headerlist);
 		} else {
 
 			/*
@@ -373,10 +561,18 @@ void Http_getMessages(T R)
 			 * C < GET /messages/1245911/headers
 			 */
 
-			char *s = dbmail_message_hdrs_to_string(m);
-			Request_setContentType(R, "text/plain; charset=utf-8");
-			evbuffer_add_printf(buf, "%s", s);
-			g_free(s);
+			if ((S = dbmail_message_stream_new(pid))) {
+				/* the first mimepart holds the message headers */
+				GString *s = g_string_new("");
+				if (dbmail_message_stream_read(S, s, 1) >= 0)
+					evbuffer_add(buf, s->str, s->len);
+				g_string_free(s, TRUE);
+				dbmail_message_stream_free(S);
+			} else if ((m = Http_retrieveMessage(m, pid))) {
+				char *s = dbmail_message_hdrs_to_string(m);
+				evbuffer_add_printf(buf, "%s", s);
+				g_free(s);
+			}
 		}
 	}
 
@@ -386,6 +582,7 @@ void Http_getMessages(T R)
 		Request_error(R, HTTP_SERVUNAVAIL, "Server error");
 
 	evbuffer_free(buf);
-	dbmail_message_free(m);
+	if (m)
+		dbmail_message_free(m);
 }
 
@@ -28,14 +28,74 @@ static GOnce iconv_once = G_ONCE_INIT;
 
 struct DbmailIconv *ic;
 
-G_LOCK_DEFINE_STATIC(mutex);
+/*
+ * converters are cached per thread, keyed on the "to\0from" charset
+ * pair, so conversions never contend on a lock and iconv_open is
+ * paid only once per charset pair per thread. At most ICONV_CACHE_SIZE
+ * converters are kept; when full, the least recently used is closed.
+ */
+#define ICONV_CACHE_SIZE 32
+
+typedef struct {
+	GBytes *key;
+	iconv_t cd;
+} IconvCacheEntry;
+
+typedef struct {
+	GHashTable *index;	/* key -> link in lru */
+	GQueue lru;		/* most recently used first */
+	GByteArray *scratch;	/* lookup key */
+	unsigned opened;
+	unsigned reused;
+} IconvCache;
+
+static void iconv_cache_entry_free(IconvCacheEntry *e)
+{
+	iconv_close(e->cd);
+	g_bytes_unref(e->key);
+	g_free(e);
+}
+
+static void iconv_cache_free(gpointer data)
+{
+	IconvCache *cache = (IconvCache *)data;
+	IconvCacheEntry *e;
+	TRACE(TRACE_DEBUG, "closing [%u] converters", g_queue_get_length(&cache->lru));
+	g_hash_table_destroy(cache->index);
+	while ((e = g_queue_pop_head(&cache->lru)))
+		iconv_cache_entry_free(e);
+	g_byte_array_free(cache->scratch, TRUE);
+	g_free(cache);
+}
+
+static GPrivate iconv_cache_key = G_PRIVATE_INIT(iconv_cache_free);
+
+static IconvCache * iconv_cache_get(void)
+{
+	IconvCache *cache;
+
+	if (! (cache = g_private_get(&iconv_cache_key))) {
+		cache = g_new0(IconvCache, 1);
+		cache->index = g_hash_table_new(g_bytes_hash, g_bytes_equal);
+		g_queue_init(&cache->lru);
+		cache->scratch = g_byte_array_new();
+		g_private_set(&iconv_cache_key, cache);
+	}
+	return cache;
+}
+
+/* converters opened and reused by the calling thread; for the tests */
+void dbmail_iconv_stats(unsigned *opened, unsigned *reused)
+{
+	IconvCache *cache = iconv_cache_get();
+	*opened = cache->opened;
+	*reused = cache->reused;
+}
 
 static void dbmail_iconv_close(void)
 {
 	TRACE(TRACE_DEBUG,"closing");
-	ic->to_db = NULL;
-	ic->from_db = NULL;
-	ic->from_msg = NULL;
+	g_private_replace(&iconv_cache_key, NULL);
 	g_free(ic);
 	ic = NULL;
 }
@@ -47,9 +107,6 @@ static gpointer dbmail_iconv_once(gpointer UNUSED data)
 	memset(ic->db_charset,'\0', FIELDSIZE);
 	memset(ic->msg_charset,'\0', FIELDSIZE);
 
-	ic->to_db = (iconv_t)-1;
-	ic->from_msg = (iconv_t)-1;
-
 	GETCONFIGVALUE("ENCODING", "DBMAIL", ic->db_charset);
 	GETCONFIGVALUE("DEFAULT_MSG_ENCODING", "DBMAIL", ic->msg_charset);
 
@@ -59,20 +116,8 @@ static gpointer dbmail_iconv_once(gpointer UNUSED data)
 	if (! ic->msg_charset[0])
 		g_strlcpy(ic->msg_charset, g_mime_locale_charset(), FIELDSIZE-1);
 
-	TRACE(TRACE_DEBUG,"Initialize DB encoding surface [UTF-8..%s]", ic->db_charset);
-	ic->to_db = g_mime_iconv_open(ic->db_charset,"UTF-8");
-	if (ic->to_db == (iconv_t)-1)
-		TRACE(TRACE_EMERG, "iconv failure");
-
-	TRACE(TRACE_DEBUG,"Initialize DB decoding surface [%s..UTF-8]", ic->db_charset);
-	ic->from_db = g_mime_iconv_open("UTF-8", ic->db_charset);
-	if (ic->to_db == (iconv_t)-1)
-		TRACE(TRACE_EMERG, "iconv failure");
-
-	TRACE(TRACE_DEBUG,"Initialize default MSG decoding surface [%s..UTF-8]", ic->msg_charset);
-	ic->from_msg=g_mime_iconv_open("UTF-8",ic->msg_charset);
-	if (ic->from_msg == (iconv_t)-1)
-		TRACE(TRACE_EMERG, "iconv failure");
+	TRACE(TRACE_DEBUG,"DB encoding surface [UTF-8..%s]", ic->db_charset);
+	TRACE(TRACE_DEBUG,"default MSG decoding surface [%s..UTF-8]", ic->msg_charset);
 
 	atexit(dbmail_iconv_close);
 
@@ -84,11 +129,72 @@ void dbmail_iconv_init(void)
 	g_once(&iconv_once, dbmail_iconv_once, NULL);
 }
 
+/*
+ * get the converter for charset pair from..to for the calling thread,
+ * reset to its initial shift state. Returns (iconv_t)-1 if there is no
+ * converter; failures are not cached, so a missing charset costs an
+ * iconv_open per lookup. The converter is owned by the cache and must
+ * not be closed.
+ */
+static iconv_t dbmail_iconv_get(const char *to, const char *from)
+{
+	IconvCache *cache = iconv_cache_get();
+	IconvCacheEntry *e;
+	GList *link;
+	GBytes *key;
+	iconv_t cd;
+
+	g_byte_array_set_size(cache->scratch, 0);
+	g_byte_array_append(cache->scratch, (const guint8 *)to, strlen(to) + 1);
+	g_byte_array_append(cache->scratch, (const guint8 *)from, strlen(from));
+	key = g_bytes_new_static(cache->scratch->data, cache->scratch->len);
+	link = g_hash_table_lookup(cache->index, key);
+	g_bytes_unref(key);
+
+	if (link) {
+		g_queue_unlink(&cache->lru, link);
+		g_queue_push_head_link(&cache->lru, link);
+		cache->reused++;
+		e = (IconvCacheEntry *)link->data;
+		/* a previous conversion may have stopped mid-sequence */
+		iconv(e->cd, NULL, NULL, NULL, NULL);
+		return e->cd;
+	}
+
+	cd = iconv_open(g_mime_charset_iconv_name(to), g_mime_charset_iconv_name(from));
+	if (cd == (iconv_t)-1) {
+		TRACE(TRACE_INFO, "no converter for [%s..%s]", from, to);
+		return (iconv_t)-1;
+	}
+	cache->opened++;
+
+	if (g_queue_get_length(&cache->lru) >= ICONV_CACHE_SIZE) {
+		e = g_queue_pop_tail(&cache->lru);
+		g_hash_table_remove(cache->index, e->key);
+		iconv_cache_entry_free(e);
+	}
+
+	e = g_new0(IconvCacheEntry, 1);
+	e->key = g_bytes_new(cache->scratch->data, cache->scratch->len);
+	e->cd = cd;
+	g_queue_push_head(&cache->lru, e);
+	g_hash_table_insert(cache->index, e->key, cache->lru.head);
+
+	return cd;
+}
+
+static char * dbmail_iconv_strdup(const char *to, const char *from, const char *str_in)
+{
+	iconv_t cd = dbmail_iconv_get(to, from);
+	if (cd == (iconv_t)-1)
+		return NULL;
+	return g_mime_iconv_strdup(cd, str_in);
+}
+
 /* convert not encoded field to utf8 */
 char * dbmail_iconv_str_to_utf8(const char* str_in, const char *charset)
 {
 	char * subj=NULL, *t;
-	iconv_t conv_iconv = (iconv_t)-1;
 
 	dbmail_iconv_init();
 
@@ -100,18 +206,11 @@ char * dbmail_iconv_str_to_utf8(const char* str_in, const char *charset)
 	if (g_utf8_validate((const gchar *)str_in, -1, NULL) || !g_mime_utils_text_is_8bit((unsigned char *)str_in, strlen(str_in)))
 		return g_strdup(t);
 
-	if (charset) {
-		if ((conv_iconv=g_mime_iconv_open("UTF-8",charset)) != (iconv_t)-1) {
-			subj = g_mime_iconv_strdup(conv_iconv,str_in);
-			g_mime_iconv_close(conv_iconv);
-		}
-	}
+	if (charset)
+		subj = dbmail_iconv_strdup("UTF-8", charset, str_in);
 
-	if (subj==NULL) {
-		G_LOCK(mutex);
-		subj=g_mime_iconv_strdup(ic->from_msg,str_in);
-		G_UNLOCK(mutex);
-	}
+	if (subj==NULL)
+		subj = dbmail_iconv_strdup("UTF-8", ic->msg_charset, str_in);
 
 	if (subj==NULL) {
 		subj=g_strdup(str_in);
@@ -127,7 +226,6 @@ char * dbmail_iconv_str_to_utf8(const char* str_in, const char *charset)
 char * dbmail_iconv_str_to_db(const char* str_in, const char *charset)
 {
 	char * subj=NULL;
-	iconv_t conv_iconv;
 
 	dbmail_iconv_init();
 
@@ -137,32 +235,21 @@ char * dbmail_iconv_str_to_db(const char* str_in, const char *charset)
 	if (! g_mime_utils_text_is_8bit((unsigned char *)str_in, strlen(str_in)) )
 		return g_strdup(str_in);
 
-	G_LOCK(mutex);
-	subj = g_mime_iconv_strdup(ic->to_db,str_in);
-	G_UNLOCK(mutex);
+	subj = dbmail_iconv_strdup(ic->db_charset, "UTF-8", str_in);
 
 	if (subj != NULL)
 		return subj;
 
-	if (charset) {
-		conv_iconv = g_mime_iconv_open(ic->db_charset,charset);
-		if (conv_iconv != (iconv_t)-1) {
-			subj=g_mime_iconv_strdup(conv_iconv,str_in);
-			g_mime_iconv_close(conv_iconv);
-		}
-	}
+	if (charset)
+		subj = dbmail_iconv_strdup(ic->db_charset, charset, str_in);
 
 	if (subj==NULL) {
 		char *subj2;
 
-		G_LOCK(mutex);
-		subj2 = g_mime_iconv_strdup(ic->from_msg,str_in);
-		G_UNLOCK(mutex);
+		subj2 = dbmail_iconv_strdup("UTF-8", ic->msg_charset, str_in);
 
 		if (subj2 != NULL) {
-			G_LOCK(mutex);
-			subj = g_mime_iconv_strdup(ic->to_db, subj2);
-			G_UNLOCK(mutex);
+			subj = dbmail_iconv_strdup(ic->db_charset, "UTF-8", subj2);
 			g_free(subj2);
 		}
 	}
@@ -190,9 +277,7 @@ char * dbmail_iconv_db_to_utf7(const char* str_in)
 		return g_strdup(str_in);
 
 	if (! g_utf8_validate((const char *)str_in,-1,NULL)) {
-		G_LOCK(mutex);
-		subj = g_mime_iconv_strdup(ic->from_db, str_in);
-		G_UNLOCK(mutex);
+		subj = dbmail_iconv_strdup("UTF-8", ic->db_charset, str_in);
 		if (subj != NULL){
 			gchar *subj2;
 			subj2 = g_mime_utils_header_encode_text((const char *)subj);
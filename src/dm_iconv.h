@@ -25,10 +25,6 @@
 struct DbmailIconv {
 	Field_T db_charset;
 	Field_T msg_charset;
-
-	iconv_t to_db;
-	iconv_t from_db;
-	iconv_t from_msg;
 };
 
 
@@ -48,7 +48,6 @@ extern const char *imap_flag_desc[];
 extern const char *imap_flag_desc_escaped[];
 extern volatile sig_atomic_t alarm_occured;
 
-extern GAsyncQueue *queue;
 extern ServerConfig_T *server_conf;
 
 /*
@@ -127,6 +126,7 @@ ImapSession * dbmail_imap_session_new(Mempool_T pool)
 	Capa_remove(self->preauth_capa, "CONDSTORE");
 	Capa_remove(self->preauth_capa, "ENABLE");
 	Capa_remove(self->preauth_capa, "QRESYNC");
+	Capa_remove(self->preauth_capa, "COMPRESS=DEFLATE");
 
 	if (! (server_conf && server_conf->ssl))
 		Capa_remove(self->preauth_capa, "STARTTLS");
@@ -256,12 +256,17 @@ void dbmail_imap_session_delete(ImapSession ** s)
 	self = NULL;
 }
 
+static void _fetch_cache_free(FetchCache_T *cache)
+{
+	if (cache->items)
+		g_tree_destroy(cache->items);
+	memset(cache, 0, sizeof(FetchCache_T));
+}
+
 void dbmail_imap_session_fetch_free(ImapSession *self, gboolean all) 
 {
-	if (self->envelopes) {
-		g_tree_destroy(self->envelopes);
-		self->envelopes = NULL;
-	}
+	_fetch_cache_free(&self->envelopes);
+	_fetch_cache_free(&self->bodystructures);
 	if (self->ids) {
 		g_tree_destroy(self->ids);
 		self->ids = NULL;
@@ -566,7 +571,6 @@ int dbmail_imap_session_fetch_parse_args(ImapSession * self)
 		
 		if (! nexttoken || ! MATCH(nexttoken,"[")) {
 			if (ispeek) return -2;	/* error DONE */
-			self->fi->msgparse_needed = 1;
 			self->fi->getMIME_IMB_noextension = 1;	/* just BODY specified */
 		} else {
 			int res = 0;
@@ -616,14 +620,12 @@ int dbmail_imap_session_fetch_parse_args(ImapSession * self)
 		self->fi->getFlags = 1;
 		self->fi->getSize = 1;
 	} else if (MATCH(token,"full")) {
-		self->fi->msgparse_needed=1;
 		self->fi->getInternalDate = 1;
 		self->fi->getEnvelope = 1;
 		self->fi->getMIME_IMB_noextension = 1;
 		self->fi->getFlags = 1;
 		self->fi->getSize = 1;
 	} else if (MATCH(token,"bodystructure")) {
-		self->fi->msgparse_needed=1;
 		self->fi->getMIME_IMB = 1;
 	} else if (MATCH(token,"envelope")) {
 		self->fi->getEnvelope = 1;
@@ -953,74 +955,107 @@ static int _imap_show_body_section(body_fetch *bodyfetch, gpointer data)
 	return 0;
 }
 
-/* get envelopes */
-static void _fetch_envelopes(ImapSession *self)
+/*
+ * load the next batch of cached strings for the messages from the
+ * current one onwards. 'table' holds 'columns' per physmessage_id,
+ * like the envelope and bodystructure caches; one query serves
+ * QUERY_BATCHSIZE messages.
+ */
+static void _fetch_cache_load(ImapSession *self, FetchCache_T *cache,
+		const char *table, const char *columns, int ncolumns)
 {
-	Connection_T c; ResultSet_T r; volatile int t = FALSE;
+	Connection_T c; ResultSet_T r;
 	INIT_QUERY;
-	gchar *s;
-	uint64_t *mid;
-	uint64_t id;
+	uint64_t *mid, id, hi;
 	char range[DEF_FRAGSIZE];
 	GList *last;
+	int i;
 	memset(range,0,sizeof(range));
 
-	if (! self->envelopes) {
-		self->envelopes = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free,(GDestroyNotify)g_free);
-		self->lo = 0;
-		self->hi = 0;
+	if (! cache->items) {
+		cache->items = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free,(GDestroyNotify)g_strfreev);
+		cache->lo = 0;
+		cache->ceiling = 0;
 	}
 
-	if ((s = g_tree_lookup(self->envelopes, &(self->msg_idnr))) != NULL) {
-		dbmail_imap_session_buff_printf(self, "ENVELOPE %s", s);
+	if (self->msg_idnr <= cache->ceiling)
 		return;
-	}
 
-	TRACE(TRACE_DEBUG,"[%p] lo: %" PRIu64 "", self, self->lo);
+	TRACE(TRACE_DEBUG,"[%p] %s lo: %" PRIu64 "", self, table, cache->lo);
 
-	if (! (last = g_list_nth(self->ids_list, self->lo+(uint64_t)QUERY_BATCHSIZE)))
+	if (! (last = g_list_nth(self->ids_list, cache->lo+(uint64_t)QUERY_BATCHSIZE)))
 		last = g_list_last(self->ids_list);
-	self->hi = *(uint64_t *)last->data;
+	hi = max(*(uint64_t *)last->data, self->msg_idnr);
 
-	if (self->msg_idnr == self->hi)
+	if (self->msg_idnr == hi)
 		snprintf(range,DEF_FRAGSIZE-1,"= %" PRIu64 "", self->msg_idnr);
 	else
-		snprintf(range,DEF_FRAGSIZE-1,"BETWEEN %" PRIu64 " AND %" PRIu64 "", self->msg_idnr, self->hi);
+		snprintf(range,DEF_FRAGSIZE-1,"BETWEEN %" PRIu64 " AND %" PRIu64 "", self->msg_idnr, hi);
 
-	snprintf(query, DEF_QUERYSIZE-1, "SELECT message_idnr,envelope "
-			"FROM %senvelope e "
+	snprintf(query, DEF_QUERYSIZE-1, "SELECT message_idnr,%s "
+			"FROM %s%s x "
 			"LEFT JOIN %smessages m USING (physmessage_id) "
 			"WHERE m.mailbox_idnr = %" PRIu64 " "
 			"AND message_idnr %s",
-			DBPFX, DBPFX,  
+			columns, DBPFX, table, DBPFX,
 			self->mailbox->id, range);
 	c = db_con_get();
 	TRY
 		r = db_query(c, query);
 		while (db_result_next(r)) {
+			gchar **values;
 			id = db_result_get_u64(r, 0);
-			
+
 			if (! g_tree_lookup(self->ids,&id))
 				continue;
-			
+
 			mid = mempool_pop(small_pool, sizeof(uint64_t));
 			*mid = id;
-			
-			g_tree_insert(self->envelopes,mid,g_strdup(ResultSet_getString(r, 2)));
+
+			values = g_new0(gchar *, ncolumns + 1);
+			for (i = 0; i < ncolumns; i++)
+				values[i] = g_strdup(db_result_get(r, i + 1));
+			g_tree_insert(cache->items, mid, values);
 		}
+		cache->lo += QUERY_BATCHSIZE;
+		cache->ceiling = hi;
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		t = DM_EQUERY;
 	FINALLY
 		db_con_close(c);
 	END_TRY;
+}
 
-	if (t == DM_EQUERY) return;
+/* get envelopes */
+static void _fetch_envelopes(ImapSession *self)
+{
+	gchar **envelope;
 
-	self->lo += QUERY_BATCHSIZE;
+	_fetch_cache_load(self, &self->envelopes, "envelope", "envelope", 1);
+
+	envelope = g_tree_lookup(self->envelopes.items, &(self->msg_idnr));
+	dbmail_imap_session_buff_printf(self, "ENVELOPE %s", envelope ? envelope[0] : "");
+}
+
+/* get bodystructures
+ *
+ * served from the bodystructure cache; messages stored before the
+ * cache existed are parsed instead.
+ */
+static gchar * _fetch_bodystructure(ImapSession *self, gboolean extension)
+{
+	gchar **structure;
+
+	_fetch_cache_load(self, &self->bodystructures, "bodystructure", "bodystructure,body", 2);
+
+	if ((structure = g_tree_lookup(self->bodystructures.items, &(self->msg_idnr))) != NULL)
+		return g_strdup(structure[extension ? 0 : 1]);
 
-	s = g_tree_lookup(self->envelopes, &(self->msg_idnr));
-	dbmail_imap_session_buff_printf(self, "ENVELOPE %s", s?s:"");
+	TRACE(TRACE_DEBUG, "[%p] no cached bodystructure for [%" PRIu64 "]", self, self->msg_idnr);
+	if (! dbmail_imap_session_message_load(self))
+		return NULL;
+
+	return imap_get_structure(GMIME_MESSAGE((self->message)->content), extension);
 }
 
 static void _imap_show_body_sections(ImapSession *self) 
@@ -1038,6 +1073,88 @@ static void _imap_show_body_sections(ImapSession *self)
 	}
 }
 
+/*
+ * the implicit \Seen updates of a FETCH command share one transaction.
+ * The modseq is allocated once, as the last statement before the
+ * commit, so it never becomes visible before the changes it covers
+ * and the mailbox row is not locked while the messages are sent.
+ */
+typedef struct {
+	Connection_T c;
+	MailboxCounters_T counters;
+	GList *ids;
+	int status;
+} FetchSeen_T;
+
+static int _fetch_set_seen(ImapSession *self, uint64_t *uid, int *flags, MessageInfo *msginfo)
+{
+	FetchSeen_T *seen = (FetchSeen_T *)self->fi->seen;
+
+	if (! seen) {
+		seen = g_new0(FetchSeen_T, 1);
+		seen->counters.mailbox_idnr = MailboxState_getId(self->mailbox->mbstate);
+		seen->c = db_con_get();
+		self->fi->seen = seen;
+		TRY
+			db_begin_transaction(seen->c);
+		CATCH(SQLException)
+			LOG_SQLERROR;
+			seen->status = DM_EQUERY;
+		END_TRY;
+	}
+
+	if (seen->status == DM_SUCCESS) {
+		TRY
+			if (db_set_msgflag_c(seen->c, *uid, flags, NULL, IMAPFA_ADD, 0, msginfo, &seen->counters) < 0)
+				seen->status = DM_EQUERY;
+			else
+				seen->ids = g_list_prepend(seen->ids, uid);
+		CATCH(SQLException)
+			LOG_SQLERROR;
+			seen->status = DM_EQUERY;
+		END_TRY;
+	}
+
+	return seen->status;
+}
+
+static int _fetch_seen_commit(ImapSession *self, gboolean rollback)
+{
+	FetchSeen_T *seen = (FetchSeen_T *)self->fi->seen;
+	volatile int result;
+
+	if (! seen)
+		return DM_SUCCESS;
+
+	result = rollback ? DM_EGENERAL : seen->status;
+
+	TRY
+		if (result == DM_SUCCESS && ! db_mailbox_counters_delta(seen->c, &seen->counters))
+			result = DM_EQUERY;
+		if (result == DM_SUCCESS && seen->ids) {
+			uint64_t seq = db_mailbox_seq_update_c(seen->c, seen->counters.mailbox_idnr, 0);
+			if (! db_message_set_seq_list_c(seen->c, seen->ids, seq))
+				result = DM_EQUERY;
+		}
+		if (result == DM_SUCCESS)
+			db_commit_transaction(seen->c);
+		else
+			db_rollback_transaction(seen->c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(seen->c);
+		result = DM_EQUERY;
+	FINALLY
+		db_con_close(seen->c);
+	END_TRY;
+
+	g_list_free(seen->ids);
+	g_free(seen);
+	self->fi->seen = NULL;
+
+	return result;
+}
+
 static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 {
 	int result;
@@ -1081,7 +1198,7 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 	}
 	if (self->fi->getInternalDate) {
 		SEND_SPACE;
-		char *s =date_sql2imap(msginfo->internaldate);
+		char *s =date_time2imap(msginfo->internaldate);
 		dbmail_imap_session_buff_printf(self, "INTERNALDATE \"%s\"", s);
 		g_free(s);
 	}
@@ -1105,7 +1222,7 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 	}
 	if (self->fi->getMIME_IMB) {
 		SEND_SPACE;
-		if ((s = imap_get_structure(GMIME_MESSAGE((self->message)->content), 1))==NULL) {
+		if ((s = _fetch_bodystructure(self, TRUE))==NULL) {
 			dbmail_imap_session_buff_clear(self);
 			dbmail_imap_session_buff_printf(self, "\r\n* BYE error fetching body structure\r\n");
 			return -1;
@@ -1116,7 +1233,7 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 
 	if (self->fi->getMIME_IMB_noextension) {
 		SEND_SPACE;
-		if ((s = imap_get_structure(GMIME_MESSAGE((self->message)->content), 0))==NULL) {
+		if ((s = _fetch_bodystructure(self, FALSE))==NULL) {
 			dbmail_imap_session_buff_clear(self);
 			dbmail_imap_session_buff_printf(self, "\r\n* BYE error fetching body\r\n");
 			return -1;
@@ -1195,13 +1312,14 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 		
 		if (result == 1) {
 			reportflags = TRUE;
-			result = db_set_msgflag(self->msg_idnr, setSeenSet, NULL, IMAPFA_ADD, 0, msginfo);
-			if (result == -1) {
+			/* the flag is set in place */
+			MailboxState_unshare(self->mailbox->mbstate);
+			msginfo = g_tree_lookup(MailboxState_getMsginfo(self->mailbox->mbstate), uid);
+			if (_fetch_set_seen(self, uid, setSeenSet, msginfo) == DM_EQUERY) {
 				dbmail_imap_session_buff_clear(self);
 				dbmail_imap_session_buff_printf(self, "\r\n* BYE internal dbase error\r\n");
 				return -1;
 			}
-			db_mailbox_seq_update(MailboxState_getId(self->mailbox->mbstate), self->msg_idnr);
 		}
 
 		self->fi->getFlags = 1;
@@ -1248,6 +1366,10 @@ int dbmail_imap_session_fetch_get_items(ImapSession *self)
 	else {
 		self->error = FALSE;
 		g_tree_foreach(self->ids, (GTraverseFunc) _do_fetch, self);
+		if (_fetch_seen_commit(self, self->error) == DM_EQUERY && ! self->error) {
+			dbmail_imap_session_buff_printf(self, "\r\n* BYE internal dbase error\r\n");
+			self->error = TRUE;
+		}
 		dbmail_imap_session_buff_flush(self);
 		if (self->error) return -1;
 	}
@@ -1448,9 +1570,11 @@ static void notify_fetch(ImapSession *self, MailboxState_T N, uint64_t *uid)
 
 static gboolean notify_expunge(ImapSession *self, uint64_t *uid)
 {
-	uint64_t *msn = NULL, m = 0;
+	uint64_t m = 0;
 
-	if (! (msn = g_tree_lookup(MailboxState_getIds(self->mailbox->mbstate), uid))) {
+	/* don't use the ids tree here: a series of expunges would
+	 * renumber it for every message */
+	if (! (m = MailboxState_getMsnByUid(self->mailbox->mbstate, *uid))) {
 		TRACE(TRACE_DEBUG,"[%p] can't find uid [%" PRIu64 "]", self, *uid);
 		return TRUE;
 	}
@@ -1461,7 +1585,6 @@ static gboolean notify_expunge(ImapSession *self, uint64_t *uid)
 		case IMAP_COMM_SEARCH:
 			break;
 		default:
-			m = *msn;
 			if (MailboxState_removeUid(self->mailbox->mbstate, *uid) == DM_SUCCESS)
 				dbmail_imap_session_buff_printf(self, "* %" PRIu64 " EXPUNGE\r\n", m);
 			else
@@ -1719,32 +1842,99 @@ int dbmail_imap_session_set_state(ImapSession *self, ClientState_T state)
 	return 0;
 }
 
-static gboolean _do_expunge(uint64_t *id, ImapSession *self)
+/* number of messages marked per UPDATE during expunge */
+#define EXPUNGE_SLICE 500
+
+/*
+ * mark a set of messages as expunged using one
+ * statement per slice, and return the number of
+ * bytes freed in 'size'. Quotum and mailbox counters
+ * are adjusted once for the whole set.
+ */
+static int _expunge_set(uint64_t mailbox_id, uint64_t owner_id, GList *ids, uint64_t *size, uint64_t *modseq)
 {
-	MessageInfo *msginfo = g_tree_lookup(MailboxState_getMsginfo(self->mailbox->mbstate), id);
-	assert(msginfo);
+	Connection_T c;
+	ResultSet_T r;
+	GList *slices, *slice;
+	MailboxCounters_T counters;
+	volatile int t = DM_SUCCESS;
 
-	if (! msginfo->flags[IMAP_FLAG_DELETED]) return FALSE;
+	*size = 0;
+	memset(&counters, 0, sizeof(counters));
+	counters.mailbox_idnr = mailbox_id;
+	slices = g_list_slices_u64(ids, EXPUNGE_SLICE);
 
-	if (db_exec(self->c, "UPDATE %smessages SET status=%d WHERE message_idnr=%" PRIu64 " ", DBPFX, MESSAGE_STATUS_DELETE, *id) == DM_EQUERY)
-		return TRUE;
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		slice = g_list_first(slices);
+		while (slice) {
+			r = db_query(c, "SELECT COALESCE(SUM(pm.messagesize),0), COUNT(*), "
+					"SUM(CASE WHEN m.seen_flag = 0 THEN 1 ELSE 0 END), "
+					"SUM(CASE WHEN m.recent_flag = 1 THEN 1 ELSE 0 END) "
+					"FROM %smessages m "
+					"JOIN %sphysmessage pm ON m.physmessage_id = pm.id "
+					"WHERE m.mailbox_idnr = %" PRIu64 " AND m.status < %d "
+					"AND m.message_idnr IN (%s)",
+					DBPFX, DBPFX, mailbox_id, MESSAGE_STATUS_DELETE,
+					(char *)slice->data);
+			if (! r) {
+				t = DM_EQUERY;
+				break;
+			}
+			if (db_result_next(r)) {
+				*size += db_result_get_u64(r, 0);
+				counters.exists -= (int64_t)db_result_get_u64(r, 1);
+				counters.unseen -= (int64_t)db_result_get_u64(r, 2);
+				counters.recent -= (int64_t)db_result_get_u64(r, 3);
+			}
+
+			if (! db_exec(c, "UPDATE %smessages SET status=%d "
+					"WHERE mailbox_idnr = %" PRIu64 " AND status < %d "
+					"AND message_idnr IN (%s)",
+					DBPFX, MESSAGE_STATUS_DELETE, mailbox_id,
+					MESSAGE_STATUS_DELETE, (char *)slice->data)) {
+				t = DM_EQUERY;
+				break;
+			}
+			slice = g_list_next(slice);
+		}
+		if (t == DM_SUCCESS && *size && ! dm_quota_user_delta(c, owner_id, -(int64_t)*size))
+			t = DM_EQUERY;
+		/* one update of the mailbox row for the whole expunge */
+		if (t == DM_SUCCESS && ! db_mailbox_counters_delta(c, &counters))
+			t = DM_EQUERY;
+		if (t == DM_SUCCESS) {
+			*modseq = db_mailbox_seq_update_c(c, mailbox_id, 0);
+			db_commit_transaction(c);
+		} else {
+			db_rollback_transaction(c);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_list_destroy(slices);
 
-	return notify_expunge(self, id);
+	return t;
 }
 
 int dbmail_imap_session_mailbox_expunge(ImapSession *self, const char *set, uint64_t *modseq)
 {
-	uint64_t mailbox_size;
-	int i;
-	GList *ids;
-	GTree *uids = NULL;
+	uint64_t mailbox_size = 0;
+	GList *ids, *deleted = NULL;
+	GTree *uids = NULL, *msginfo;
 	MailboxState_T M = self->mailbox->mbstate;
+	int result = DM_SUCCESS;
 
-	if (! (i = g_tree_nnodes(MailboxState_getIds(M))))
-		return DM_SUCCESS;
+	*modseq = 0;
 
-	if (db_get_mailbox_size(self->mailbox->id, 1, &mailbox_size) == DM_EQUERY)
-		return DM_EQUERY;
+	if (! g_tree_nnodes(MailboxState_getIds(M)))
+		return DM_SUCCESS;
 
 	if (set) {
 		uids = dbmail_mailbox_get_set(self->mailbox, set, self->use_uid);
@@ -1753,29 +1943,38 @@ int dbmail_imap_session_mailbox_expunge(ImapSession *self, const char *set, uint
 		ids = g_tree_keys(MailboxState_getIds(M));
 	}
 
-	ids = g_list_reverse(ids);
+	/* collect the \Deleted messages in the session's view */
+	msginfo = MailboxState_getMsginfo(M);
+	ids = g_list_first(ids);
+	while (ids) {
+		MessageInfo *info = g_tree_lookup(msginfo, ids->data);
+		assert(info);
+		if (MSGINFO_FLAG(info, IMAP_FLAG_DELETED))
+			deleted = g_list_prepend(deleted, ids->data);
+		if (! g_list_next(ids))
+			break;
+		ids = g_list_next(ids);
+	}
+	g_list_free(g_list_first(ids));
 
-	if (ids) {
-		self->c = db_con_get();
-		db_begin_transaction(self->c);
-		g_list_foreach(ids, (GFunc) _do_expunge, self);
-		db_commit_transaction(self->c);
-		db_con_close(self->c);
-		self->c = NULL;
-		g_list_free(g_list_first(ids));
+	if (deleted) {
+		/* slices are built in ascending order, EXPUNGE
+		 * responses are sent highest uid first */
+		deleted = g_list_reverse(deleted);
+		result = _expunge_set(self->mailbox->id, MailboxState_getOwner(M), deleted, &mailbox_size, modseq);
+		if (result == DM_SUCCESS) {
+			deleted = g_list_reverse(deleted);
+			g_list_foreach(deleted, (GFunc) notify_expunge, self);
+		}
+		g_list_free(deleted);
 	}
 
 	if (uids)
 		g_tree_destroy(uids);
 
-	*modseq = 0;
-	if (i > g_tree_nnodes(MailboxState_getIds(M))) {
-		*modseq = db_mailbox_seq_update(self->mailbox->id, 0);
-		if (! dm_quota_user_dec(self->userid, mailbox_size))
-			return DM_EQUERY;
-	}
+	MailboxState_compact(M);
 
-	return 0;
+	return result;
 }
 
 /*****************************************************************************
@@ -2060,6 +2259,12 @@ int imap4_tokenizer_main(ImapSession *self, const char *buffer)
 		i--;		/* walked one too far */
 	}
 
+	/* too many arguments, e.g. an oversized MULTIAPPEND batch */
+	if (i < max && s[i] && self->args_idx >= MAX_ARGS - 1) {
+		TRACE(TRACE_INFO, "[%p] too many arguments", self);
+		return -1;
+	}
+
 	if (paridx != 0) return -1; /* error in parenthesis structure */
 		
 finalize:
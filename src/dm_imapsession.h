@@ -12,6 +12,13 @@
 // command state during idle command
 #define IDLE -1 
 
+/* cached per-message strings, loaded in batches during FETCH */
+typedef struct {
+	GTree *items;          // message_idnr -> NULL terminated string vector
+	uint64_t lo;           // offset in ids_list of the next batch
+	uint64_t ceiling;      // highest message_idnr loaded so far
+} FetchCache_T;
+
 /* ImapSession definition */
 typedef struct {
 	Mempool_T pool;
@@ -51,7 +58,8 @@ typedef struct {
 	GTree *ids;
 	GList *new_ids; // store new uids after a COPY command
 	GTree *physids;		// cache physmessage_ids for uids 
-	GTree *envelopes;
+	FetchCache_T envelopes;	// cached ENVELOPE strings
+	FetchCache_T bodystructures;	// cached BODYSTRUCTURE and BODY strings
 	GTree *mbxinfo; 	// cache MailboxState_T 
 	GList *ids_list;
 
@@ -74,6 +82,7 @@ typedef struct {
 	void (* cb_enter)(gpointer);	/* callback on thread entry		*/
 	void (* cb_leave)(gpointer);	/* callback on thread exit		*/
 	ImapSession *session;
+	ClientBase_T *ci;               /* owner of a session-less job */
 	gpointer data;                  /* payload */
 	volatile int status;		/* command result 			*/
 } dm_thread_data;
@@ -501,6 +501,111 @@ char * dbmail_mailbox_sorted_as_string(DbmailMailbox *self)
 }
 
 
+/*
+ * append a sequence-set for the ids in list (in list order) to t,
+ * collapsing runs of ascending consecutive ids into ranges
+ */
+static void _append_range(GString *t, uint64_t first, uint64_t last)
+{
+	if (first == last)
+		g_string_append_printf(t, "%" PRIu64 ",", first);
+	else
+		g_string_append_printf(t, "%" PRIu64 ":%" PRIu64 ",", first, last);
+}
+
+static void _append_sequence_set(GString *t, GList *l)
+{
+	uint64_t first, last;
+
+	if (! (l = g_list_first(l)))
+		return;
+
+	first = last = *(uint64_t *)l->data;
+	while ((l = g_list_next(l))) {
+		uint64_t id = *(uint64_t *)l->data;
+		if (id == last + 1) {
+			last = id;
+			continue;
+		}
+		_append_range(t, first, last);
+		first = last = id;
+	}
+	_append_range(t, first, last);
+	g_string_truncate(t, t->len - 1);
+}
+
+/*
+ * return the ESEARCH (RFC 4731) or ESORT (RFC 5267) result data for
+ * the last search as a string, e.g. "MIN 2 MAX 9 COUNT 3 ALL 2,8:9".
+ *
+ * options is a mask of ESEARCH_* result options. If sorted is set the
+ * ids are taken in sort order, and MIN/MAX refer to the first and last
+ * message in that order.
+ */
+char * dbmail_mailbox_esearch(DbmailMailbox *self, int options, gboolean sorted)
+{
+	GList *ids = NULL, *l;
+	GString *t;
+	gchar *s;
+	gboolean uid = dbmail_mailbox_get_uid(self);
+	uint64_t maxseq = 0;
+	unsigned count;
+
+	if (self->found && g_tree_nnodes(self->found) > 0) {
+		if (sorted) {
+			l = g_list_first(self->sorted);
+			while (l) {
+				uint64_t *msn = g_tree_lookup(self->found, l->data);
+				if (msn)
+					ids = g_list_prepend(ids, uid ? l->data : (gpointer)msn);
+				l = g_list_next(l);
+			}
+			ids = g_list_reverse(ids);
+		} else if (uid) {
+			ids = g_tree_keys(self->found);
+		} else {
+			ids = g_tree_values(self->found);
+		}
+	}
+
+	count = g_list_length(ids);
+	t = g_string_new("");
+
+	if (count) {
+		if (options & ESEARCH_MIN)
+			g_string_append_printf(t, "MIN %" PRIu64 " ", *(uint64_t *)g_list_first(ids)->data);
+		if (options & ESEARCH_MAX)
+			g_string_append_printf(t, "MAX %" PRIu64 " ", *(uint64_t *)g_list_last(ids)->data);
+	}
+	if (options & ESEARCH_COUNT)
+		g_string_append_printf(t, "COUNT %u ", count);
+	if (count && (options & ESEARCH_ALL)) {
+		g_string_append(t, "ALL ");
+		_append_sequence_set(t, ids);
+		g_string_append_c(t, ' ');
+	}
+
+	if (count && self->modseq) {
+		GTree *msginfo = MailboxState_getMsginfo(self->mbstate);
+		GTree *msn = MailboxState_getMsn(self->mbstate);
+		for (l = g_list_first(ids); l; l = g_list_next(l)) {
+			uint64_t *id = uid ? (uint64_t *)l->data : g_tree_lookup(msn, l->data);
+			MessageInfo *info = id ? g_tree_lookup(msginfo, id) : NULL;
+			if (info)
+				maxseq = max(maxseq, info->seq);
+		}
+		g_string_append_printf(t, "MODSEQ %" PRIu64, maxseq);
+	}
+
+	g_list_free(ids);
+
+	s = t->str;
+	g_string_free(t, FALSE);
+
+	return g_strchomp(s);
+}
+
+
 /* imap sorted search */
 static int append_search(DbmailMailbox *self, search_key *value, gboolean descend)
 {
@@ -76,6 +76,14 @@ char * dbmail_mailbox_ids_as_string(DbmailMailbox *self, gboolean uid, const cha
 char * dbmail_mailbox_sorted_as_string(DbmailMailbox *self);
 char * dbmail_mailbox_orderedsubject(DbmailMailbox *self);
 
+/* ESEARCH/ESORT result options */
+#define ESEARCH_MIN	0x01
+#define ESEARCH_MAX	0x02
+#define ESEARCH_COUNT	0x04
+#define ESEARCH_ALL	0x08
+
+char * dbmail_mailbox_esearch(DbmailMailbox *self, int options, gboolean sorted);
+
 int dbmail_mailbox_build_imap_search(DbmailMailbox *self, String_T *search_keys, uint64_t *idx, search_order order);
 
 GTree * dbmail_mailbox_get_set(DbmailMailbox *self, const char *set, gboolean uid);
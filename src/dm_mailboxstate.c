@@ -32,6 +32,21 @@ extern const char *imap_flag_desc_escaped[];
 
 #define T MailboxState_T
 
+/*
+ * message table shared between states of the same mailbox
+ * at the same seq
+ */
+typedef struct {
+	uint64_t id;
+	uint64_t seq;
+	volatile gint refcount;
+	uint64_t lastuid;
+	GTree *msginfo;
+	GTree *ids;
+	GTree *msn;
+	GList *chunks;
+} Snapshot_T;
+
 struct T {
 	Mempool_T pool;
 	gboolean freepool;
@@ -59,27 +74,397 @@ struct T {
 	GTree *ids;
 	GTree *msn;
 	GTree *recent_queue;
+	// msn index
+	uint64_t lastuid;	// highest uid in ids
+	uint64_t positions;	// msn positions handed out since the last renumbering
+	uint64_t removed;	// messages removed since the last renumbering
+	uint64_t fenwick_size;
+	uint32_t *fenwick;	// removals per msn position
+	// message info storage
+	GList *chunks;
+	MessageInfo *chunk;
+	unsigned chunksize;
+	unsigned chunkused;
+	unsigned garbage;	// records in chunks no longer in msginfo
+	// copy-on-write
+	Snapshot_T *snapshot;
+	gboolean shared;	// msginfo, ids and msn belong to snapshot
+	// rights preloaded by MailboxState_countList
+	uint64_t rights_userid;
+	unsigned rights;
 };
    
 static void db_getmailbox_seq(T M, Connection_T c);
 static void db_getmailbox_permission(T M, Connection_T c);
 static void state_load_metadata(T M, Connection_T c);
 static void MailboxState_setMsginfo(T M, GTree *msginfo);
+static gboolean mailbox_build_recent(uint64_t *uid, MessageInfo *msginfo, T M);
 /* */
 
+/*
+ * msn index
+ *
+ * removing a message from ids and msn is O(log n), but leaves
+ * the msn values of all messages after it off by one. Instead of
+ * renumbering on every removal, the removed positions are counted
+ * in a fenwick tree, so the current msn of a message is its stale
+ * msn minus the number of removals before it. The trees are
+ * renumbered in a single pass once somebody asks for them.
+ */
+static uint64_t msn_index_count(T M, uint64_t pos)
+{
+	uint64_t count = 0;
+	for (; pos > 0; pos -= (pos & (~pos + 1)))
+		count += M->fenwick[pos];
+	return count;
+}
+
+static void msn_index_mark(T M, uint64_t pos)
+{
+	for (; pos <= M->positions; pos += (pos & (~pos + 1)))
+		M->fenwick[pos]++;
+}
+
+static void msn_index_reset(T M, uint64_t positions)
+{
+	if (positions >= M->fenwick_size) {
+		g_free(M->fenwick);
+		M->fenwick_size = positions + 1024;
+		M->fenwick = g_new0(uint32_t, M->fenwick_size);
+	} else if (M->fenwick) {
+		memset(M->fenwick, 0, sizeof(uint32_t) * M->fenwick_size);
+	}
+	M->positions = positions;
+	M->removed = 0;
+}
+
+static uint64_t msn_index_append(T M)
+{
+	uint64_t pos = M->positions + 1;
+
+	if (pos >= M->fenwick_size) {
+		uint64_t size = M->fenwick_size * 2 + 1024;
+		M->fenwick = g_renew(uint32_t, M->fenwick, size);
+		memset(M->fenwick + M->fenwick_size, 0, sizeof(uint32_t) * (size - M->fenwick_size));
+		M->fenwick_size = size;
+	}
+
+	/* a new node covers the removals in (pos - lowbit(pos), pos] */
+	M->fenwick[pos] = msn_index_count(M, pos - 1) - msn_index_count(M, pos - (pos & (~pos + 1)));
+	M->positions = pos;
+
+	return pos;
+}
+
+static gboolean _renumber(uint64_t UNUSED *uid, uint64_t *msn, gpointer data)
+{
+	T M = (T)data;
+	*msn = ++M->positions;
+	return FALSE;
+}
+
+/*
+ * bring the msn values in ids and msn up to date after one or
+ * more removals. The msn values are shared between both trees,
+ * and renumbering keeps their relative order, so no rebalancing
+ * is needed.
+ */
+static void MailboxState_renumber(T M)
+{
+	if (! M->removed)
+		return;
+
+	TRACE(TRACE_DEBUG, "[%" PRIu64 "] renumber after [%" PRIu64 "] removals",
+			M->id, M->removed);
+
+	M->positions = 0;
+	g_tree_foreach(M->ids, (GTraverseFunc)_renumber, M);
+	msn_index_reset(M, M->positions);
+}
+
 static void MailboxState_uid_msn_new(T M)
 {
 	if (M->msn) g_tree_destroy(M->msn);
 	M->msn = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,NULL);
 
 	if (M->ids) g_tree_destroy(M->ids);
-	M->ids = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,(GDestroyNotify)g_free);
+	M->ids = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,NULL);
+}
+
+/*
+ * message info storage
+ *
+ * records are handed out from chunks that grow geometrically,
+ * so a mailbox costs one allocation per chunk instead of one per
+ * message, and records loaded in uid order sit next to each other.
+ * The msginfo tree is keyed by &msginfo->uid and the ids and msn
+ * trees share &msginfo->msn, so no boxed keys are needed either.
+ */
+#define MSGINFO_CHUNK_MIN 16
+#define MSGINFO_CHUNK_MAX 16384
+
+static MessageInfo * MessageInfo_new(T M)
+{
+	if ((! M->chunk) || (M->chunkused == M->chunksize)) {
+		M->chunksize = M->chunksize ? min(M->chunksize * 2, MSGINFO_CHUNK_MAX) : MSGINFO_CHUNK_MIN;
+		M->chunk = g_new0(MessageInfo, M->chunksize);
+		M->chunkused = 0;
+		M->chunks = g_list_prepend(M->chunks, M->chunk);
+	}
+	return &M->chunk[M->chunkused++];
+}
+
+/*
+ * keywords
+ *
+ * the same few keywords are set on many messages, so records
+ * share one copy of each, counted by the number of records that
+ * reference it. Unlike interned strings these go away once no
+ * message in any state carries them.
+ */
+static GHashTable *keyword_refs = NULL;
+G_LOCK_DEFINE_STATIC(keyword_refs_lock);
+
+static gpointer keyword_ref(const char *keyword)
+{
+	gpointer key, count;
+
+	G_LOCK(keyword_refs_lock);
+	if (! keyword_refs)
+		keyword_refs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	if (g_hash_table_lookup_extended(keyword_refs, keyword, &key, &count)) {
+		g_hash_table_insert(keyword_refs, key, GUINT_TO_POINTER(GPOINTER_TO_UINT(count) + 1));
+	} else {
+		key = g_strdup(keyword);
+		g_hash_table_insert(keyword_refs, key, GUINT_TO_POINTER(1));
+	}
+	G_UNLOCK(keyword_refs_lock);
+
+	return key;
+}
+
+static void keyword_unref(gpointer keyword)
+{
+	gpointer key, count;
+
+	G_LOCK(keyword_refs_lock);
+	if (keyword_refs && g_hash_table_lookup_extended(keyword_refs, keyword, &key, &count)) {
+		if (GPOINTER_TO_UINT(count) > 1)
+			g_hash_table_insert(keyword_refs, key, GUINT_TO_POINTER(GPOINTER_TO_UINT(count) - 1));
+		else
+			g_hash_table_remove(keyword_refs, key);
+	}
+	G_UNLOCK(keyword_refs_lock);
+}
+
+/*
+ * number of distinct keywords held by message records
+ * in this process
+ */
+unsigned MailboxState_keyword_refs(void)
+{
+	unsigned n = 0;
+	G_LOCK(keyword_refs_lock);
+	if (keyword_refs)
+		n = g_hash_table_size(keyword_refs);
+	G_UNLOCK(keyword_refs_lock);
+	return n;
+}
+
+static gboolean _free_keywords(gpointer UNUSED key, MessageInfo *msginfo, gpointer UNUSED data)
+{
+	g_list_foreach(msginfo->keywords, (GFunc)keyword_unref, NULL);
+	g_list_free(msginfo->keywords);
+	msginfo->keywords = NULL;
+	return FALSE;
 }
 
-static void MessageInfo_free(MessageInfo *m)
+static GTree * MessageInfo_tree_new(void)
 {
-	g_list_destroy(m->keywords);
-	g_free(m);
+	return g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, NULL);
+}
+
+void MessageInfo_mergeKeywords(MessageInfo *msginfo, GList *keywords, int action)
+{
+	GList *k, *el;
+
+	if (action == IMAPFA_REPLACE) {
+		_free_keywords(NULL, msginfo, NULL);
+		action = IMAPFA_ADD;
+	}
+
+	for (k = g_list_first(keywords); k; k = g_list_next(k)) {
+		el = g_list_find_custom(msginfo->keywords, k->data, (GCompareFunc)g_ascii_strcasecmp);
+		if ((action == IMAPFA_ADD) && (! el)) {
+			msginfo->keywords = g_list_append(msginfo->keywords,
+					keyword_ref((const char *)k->data));
+		} else if ((action == IMAPFA_REMOVE) && el) {
+			keyword_unref(el->data);
+			msginfo->keywords = g_list_delete_link(msginfo->keywords, el);
+		}
+	}
+}
+
+/*
+ * shared snapshots
+ *
+ * sessions that open the same mailbox at the same seq share the
+ * message table loaded by the first of them, instead of each
+ * running its own query and keeping its own copy. A state takes
+ * a private copy of the table before its first change (see
+ * MailboxState_unshare), so shared tables are never written to.
+ * Only the latest snapshot of each mailbox can be attached to; a
+ * snapshot is freed when the last state using it goes away.
+ */
+static GHashTable *snapshots = NULL;
+G_LOCK_DEFINE_STATIC(snapshots_lock);
+static volatile gint state_loads = 0;
+
+static void snapshot_free(Snapshot_T *s)
+{
+	g_tree_foreach(s->msginfo, (GTraverseFunc)_free_keywords, NULL);
+	g_tree_destroy(s->msn);
+	g_tree_destroy(s->ids);
+	g_tree_destroy(s->msginfo);
+	g_list_foreach(s->chunks, (GFunc)g_free, NULL);
+	g_list_free(s->chunks);
+	g_free(s);
+}
+
+static void snapshot_release(Snapshot_T *s)
+{
+	gboolean last;
+
+	G_LOCK(snapshots_lock);
+	if ((last = g_atomic_int_dec_and_test(&s->refcount))) {
+		if (snapshots && (g_hash_table_lookup(snapshots, &s->id) == s))
+			g_hash_table_remove(snapshots, &s->id);
+	}
+	G_UNLOCK(snapshots_lock);
+
+	if (last)
+		snapshot_free(s);
+}
+
+static void MailboxState_attach(T M, Snapshot_T *s)
+{
+	M->snapshot = s;
+	M->shared = TRUE;
+	M->msginfo = s->msginfo;
+	M->ids = s->ids;
+	M->msn = s->msn;
+	M->lastuid = s->lastuid;
+	M->positions = g_tree_nnodes(s->ids);
+	M->removed = 0;
+}
+
+/*
+ * attach to the snapshot of M's mailbox at M's seq, if there is one
+ */
+static gboolean snapshot_attach(T M)
+{
+	Snapshot_T *s = NULL;
+
+	if (! M->seq)
+		return FALSE;
+
+	G_LOCK(snapshots_lock);
+	if (snapshots && (s = g_hash_table_lookup(snapshots, &M->id))) {
+		if (s->seq == M->seq)
+			g_atomic_int_inc(&s->refcount);
+		else
+			s = NULL;
+	}
+	G_UNLOCK(snapshots_lock);
+
+	if (! s)
+		return FALSE;
+
+	TRACE(TRACE_DEBUG, "[%" PRIu64 "] seq [%" PRIu64 "] shared", M->id, M->seq);
+	MailboxState_attach(M, s);
+
+	return TRUE;
+}
+
+/*
+ * hand the message table M just loaded over to a new snapshot
+ */
+static void snapshot_publish(T M)
+{
+	Snapshot_T *s;
+
+	if (M->snapshot || (! M->seq) || (! M->msginfo))
+		return;
+
+	s = g_new0(Snapshot_T, 1);
+	s->id = M->id;
+	s->seq = M->seq;
+	s->refcount = 1;
+	s->lastuid = M->lastuid;
+	s->msginfo = M->msginfo;
+	s->ids = M->ids;
+	s->msn = M->msn;
+	s->chunks = M->chunks;
+
+	M->chunks = NULL;
+	M->chunk = NULL;
+	M->chunksize = M->chunkused = 0;
+	MailboxState_attach(M, s);
+
+	G_LOCK(snapshots_lock);
+	if (! snapshots)
+		snapshots = g_hash_table_new(g_int64_hash, g_int64_equal);
+	g_hash_table_replace(snapshots, &s->id, s);
+	G_UNLOCK(snapshots_lock);
+}
+
+static gboolean _copy_msginfo(gpointer UNUSED key, MessageInfo *msginfo, gpointer data)
+{
+	gpointer *args = (gpointer *)data;
+	T M = (T)args[0];
+	MessageInfo *copy = MessageInfo_new(M);
+
+	*copy = *msginfo;
+	copy->keywords = g_list_copy(msginfo->keywords);
+	g_list_foreach(copy->keywords, (GFunc)keyword_ref, NULL);
+	g_tree_insert((GTree *)args[1], &copy->uid, copy);
+
+	return FALSE;
+}
+
+/*
+ * take a private copy of a shared message table. Pointers into
+ * the shared table stay valid for the lifetime of M.
+ */
+void MailboxState_unshare(T M)
+{
+	gpointer args[2];
+	GTree *msginfo;
+
+	if (! M->shared)
+		return;
+
+	TRACE(TRACE_DEBUG, "[%" PRIu64 "] seq [%" PRIu64 "] copy", M->id, M->seq);
+
+	msginfo = MessageInfo_tree_new();
+	args[0] = M;
+	args[1] = msginfo;
+	g_tree_foreach(M->snapshot->msginfo, (GTraverseFunc)_copy_msginfo, args);
+
+	M->shared = FALSE;
+	M->msginfo = NULL;
+	M->ids = NULL;
+	M->msn = NULL;
+	MailboxState_setMsginfo(M, msginfo);
+}
+
+/*
+ * number of message tables loaded from the database
+ * by this process
+ */
+unsigned MailboxState_loads(void)
+{
+	return (unsigned)g_atomic_int_get(&state_loads);
 }
 
 static T state_load_messages(T M, Connection_T c)
@@ -88,7 +473,7 @@ static T state_load_messages(T M, Connection_T c)
 	const char *query_result, *keyword;
 	MessageInfo *result;
 	GTree *msginfo;
-	uint64_t *uid, id = 0;
+	uint64_t id = 0;
 	ResultSet_T r;
 	PreparedStatement_T stmt;
 	Field_T frag;
@@ -102,7 +487,8 @@ static T state_load_messages(T M, Connection_T c)
 			"WHERE m.mailbox_idnr = ? AND m.status IN (%d,%d,%d) ORDER BY message_idnr ASC",
 			frag, DBPFX, DBPFX, MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN, MESSAGE_STATUS_DELETE);
 
-	msginfo = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL,(GDestroyNotify)g_free,(GDestroyNotify)MessageInfo_free);
+	msginfo = MessageInfo_tree_new();
+	g_atomic_int_inc(&state_loads);
 
 	stmt = db_stmt_prepare(c, query);
 	db_stmt_set_u64(stmt, 1, M->id);
@@ -114,26 +500,18 @@ static T state_load_messages(T M, Connection_T c)
 
 		id = db_result_get_u64(r, IMAP_NFLAGS + 3);
 
-		uid = g_new0(uint64_t,1); *uid = id;
-
-		result = g_new0(MessageInfo,1);
+		result = MessageInfo_new(M);
 
 		/* id */
 		result->uid = id;
 
-		/* mailbox_id */
-		result->mailbox_id = M->id;
-
 		/* flags */
 		for (j = 0; j < IMAP_NFLAGS; j++)
-			result->flags[j] = db_result_get_bool(r,j);
+			MSGINFO_SET_FLAG(result, j, db_result_get_bool(r,j));
 
 		/* internal date */
 		query_result = db_result_get(r,IMAP_NFLAGS);
-		strncpy(result->internaldate,
-				(query_result) ? query_result :
-				"01-Jan-1970 00:00:01 +0100",
-				IMAP_INTERNALDATE_LEN-1);
+		result->internaldate = query_result ? date_sql2time(query_result) : 0;
 
 		/* rfcsize */
 		result->rfcsize = db_result_get_u64(r,IMAP_NFLAGS + 1);
@@ -142,7 +520,7 @@ static T state_load_messages(T M, Connection_T c)
 		/* status */
 		result->status = db_result_get_int(r, IMAP_NFLAGS + 4);
 
-		g_tree_insert(msginfo, uid, result); 
+		g_tree_insert(msginfo, &result->uid, result); 
 
 	}
 
@@ -172,7 +550,7 @@ static T state_load_messages(T M, Connection_T c)
 		id = db_result_get_u64(r,0);
 		keyword = db_result_get(r,1);
 		if ((result = g_tree_lookup(msginfo, &id)) != NULL)
-			result->keywords = g_list_append(result->keywords, g_strdup(keyword));
+			result->keywords = g_list_append(result->keywords, keyword_ref(keyword));
 	}
 	if (! nrows) TRACE(TRACE_DEBUG, "no keywords");
 
@@ -211,7 +589,8 @@ T MailboxState_new(Mempool_T pool, uint64_t id)
 	TRY
 		db_begin_transaction(c); // we need read-committed isolation
 		state_load_metadata(M, c);
-		state_load_messages(M, c);
+		if (! snapshot_attach(M))
+			state_load_messages(M, c);
 		db_commit_transaction(c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
@@ -224,6 +603,8 @@ T MailboxState_new(Mempool_T pool, uint64_t id)
 	if (t == DM_EQUERY) {
 		TRACE(TRACE_ERR, "Error opening mailbox");
 		MailboxState_free(&M);
+	} else {
+		snapshot_publish(M);
 	}
 
 	return M;
@@ -232,10 +613,11 @@ T MailboxState_new(Mempool_T pool, uint64_t id)
 void MailboxState_remap(T M)
 {
 	GList *ids = NULL;
-	uint64_t *uid, *msn = NULL, rows = 1;
+	uint64_t *uid, rows = 1;
 	MessageInfo *msginfo;
 
 	MailboxState_uid_msn_new(M);
+	M->lastuid = 0;
 
 	ids = g_tree_keys(M->msginfo);
 	ids = g_list_first(ids);
@@ -244,11 +626,11 @@ void MailboxState_remap(T M)
 
 		msginfo = g_tree_lookup(M->msginfo, uid);
 		if (msginfo->status < MESSAGE_STATUS_DELETE) {
-			msn = g_new0(uint64_t,1);
-			*msn = msginfo->msn = rows++;
+			msginfo->msn = rows++;
 
-			g_tree_insert(M->ids, uid, msn);
-			g_tree_insert(M->msn, msn, uid);
+			g_tree_insert(M->ids, uid, &msginfo->msn);
+			g_tree_insert(M->msn, &msginfo->msn, uid);
+			M->lastuid = *uid;
 		}
 
 		if (! g_list_next(ids)) break;
@@ -256,6 +638,8 @@ void MailboxState_remap(T M)
 	}
 
 	g_list_free(g_list_first(ids));
+
+	msn_index_reset(M, rows - 1);
 }
 	
 GTree * MailboxState_getMsginfo(T M)
@@ -268,44 +652,175 @@ static void MailboxState_setMsginfo(T M, GTree *msginfo)
 	GTree *oldmsginfo = M->msginfo;
 	M->msginfo = msginfo;
 	MailboxState_remap(M);
-	if (oldmsginfo) g_tree_destroy(oldmsginfo);
+	if (oldmsginfo) {
+		g_tree_foreach(oldmsginfo, (GTraverseFunc)_free_keywords, NULL);
+		g_tree_destroy(oldmsginfo);
+	}
 }
 
-void MailboxState_addMsginfo(T M, uint64_t uid, MessageInfo *msginfo)
+/*
+ * add a message to the state. The record is copied into the
+ * state's own storage, and info itself is freed.
+ */
+void MailboxState_addMsginfo(T M, uint64_t uid, MessageInfo *info)
 {
-	uint64_t *id = g_new0(uint64_t,1);
-	*id = uid;
-	g_tree_insert(M->msginfo, id, msginfo); 
-	if (msginfo->flags[IMAP_FLAG_RECENT] == 1) {
+	MessageInfo *msginfo, *old;
+	gboolean append;
+
+	MailboxState_unshare(M);
+
+	if (! M->msginfo)
+		MailboxState_setMsginfo(M, MessageInfo_tree_new());
+	if (! M->recent_queue)
+		M->recent_queue = g_tree_new((GCompareFunc)ucmp);
+
+	msginfo = MessageInfo_new(M);
+	*msginfo = *info;
+	msginfo->uid = uid;
+	g_free(info);
+
+	if ((old = g_tree_lookup(M->msginfo, &uid))) {
+		_free_keywords(NULL, old, NULL);
+		M->garbage++;
+	}
+
+	append = (uid > M->lastuid) && (! old);
+
+	g_tree_replace(M->msginfo, &msginfo->uid, msginfo); 
+	if (MSGINFO_FLAG(msginfo, IMAP_FLAG_RECENT)) {
 		M->seq--; // force resync
 		M->recent++;
+		if (MailboxState_getPermission(M) == IMAPPERM_READWRITE)
+			mailbox_build_recent(&msginfo->uid, msginfo, M);
+	}
+
+	if (append && msginfo->status < MESSAGE_STATUS_DELETE) {
+		msginfo->msn = msn_index_append(M);
+		g_tree_insert(M->ids, &msginfo->uid, &msginfo->msn);
+		g_tree_insert(M->msn, &msginfo->msn, &msginfo->uid);
+		M->lastuid = uid;
+	} else if (! append) {
+		MailboxState_remap(M);
 	}
-	MailboxState_build_recent(M);
-	MailboxState_remap(M);
 }
 
 int MailboxState_removeUid(T M, uint64_t uid)
 {
-	MessageInfo *msginfo = g_tree_lookup(M->msginfo, &uid);
+	gpointer key, value;
+	MessageInfo *msginfo;
+
+	MailboxState_unshare(M);
+
+	msginfo = g_tree_lookup(M->msginfo, &uid);
 	if (! msginfo) {
 		TRACE(TRACE_WARNING,"trying to remove unknown UID [%" PRIu64 "]", uid);
 		return DM_EGENERAL;
 	}
 	msginfo->status = MESSAGE_STATUS_DELETE;
+
+	if (! g_tree_lookup_extended(M->ids, &uid, &key, &value))
+		return DM_SUCCESS;
+
+	msn_index_mark(M, *(uint64_t *)value);
+	M->removed++;
 	M->exists--;
 
-	MailboxState_remap(M);
+	g_tree_remove(M->msn, value);
+	g_tree_remove(M->ids, key);
+
+	/* the record stays in its chunk until MailboxState_compact */
+	_free_keywords(NULL, msginfo, NULL);
+	g_tree_remove(M->msginfo, &uid);
+	M->garbage++;
 
 	return DM_SUCCESS;
 }
 
+static gboolean _move_msginfo(gpointer UNUSED key, MessageInfo *msginfo, gpointer data)
+{
+	gpointer *args = (gpointer *)data;
+	MessageInfo *chunk = (MessageInfo *)args[0];
+	unsigned *used = (unsigned *)args[1];
+	MessageInfo *moved = &chunk[(*used)++];
+
+	*moved = *msginfo;
+	msginfo->keywords = NULL;
+	g_tree_insert((GTree *)args[2], &moved->uid, moved);
+
+	return FALSE;
+}
+
+/*
+ * records expunged by removeUid or replaced by addMsginfo stay
+ * behind in their chunks. Once they outnumber half the live
+ * records, move the live ones into a single chunk of the right
+ * size and free the old ones.
+ *
+ * the ids and msn trees are keyed on the records, so callers must
+ * not hold keys from getIds or getMsn across this call.
+ */
+void MailboxState_compact(T M)
+{
+	gpointer args[3];
+	GList *chunks;
+	GTree *msginfo;
+	unsigned nnodes, used = 0;
+
+	if (M->shared || (! M->msginfo))
+		return;
+
+	nnodes = g_tree_nnodes(M->msginfo);
+	if ((M->garbage < MSGINFO_CHUNK_MIN) || (M->garbage < (nnodes / 2)))
+		return;
+
+	TRACE(TRACE_DEBUG, "[%" PRIu64 "] reclaim [%u] records, keep [%u]", M->id, M->garbage, nnodes);
+
+	chunks = M->chunks;
+	M->chunk = g_new0(MessageInfo, max(nnodes, 1));
+	M->chunksize = max(nnodes, 1);
+	M->chunks = g_list_prepend(NULL, M->chunk);
+
+	msginfo = MessageInfo_tree_new();
+	args[0] = M->chunk;
+	args[1] = &used;
+	args[2] = msginfo;
+	g_tree_foreach(M->msginfo, (GTraverseFunc)_move_msginfo, args);
+	M->chunkused = used;
+
+	MailboxState_setMsginfo(M, msginfo);
+	M->garbage = 0;
+
+	g_list_foreach(chunks, (GFunc)g_free, NULL);
+	g_list_free(chunks);
+}
+
+unsigned MailboxState_getGarbage(T M)
+{
+	return M->garbage;
+}
+
+uint64_t MailboxState_getMsnByUid(T M, uint64_t uid)
+{
+	uint64_t *msn;
+
+	if (! (M->ids && (msn = g_tree_lookup(M->ids, &uid))))
+		return 0;
+
+	if (! M->removed)
+		return *msn;
+
+	return *msn - msn_index_count(M, *msn);
+}
+
 GTree * MailboxState_getIds(T M)
 {
+	MailboxState_renumber(M);
 	return M->ids;
 }
 
 GTree * MailboxState_getMsn(T M)
 {
+	MailboxState_renumber(M);
 	return M->msn;
 }
 
@@ -657,15 +1172,35 @@ void MailboxState_free(T *M)
 	g_tree_destroy(s->keywords);
 	s->keywords = NULL;
 
+	if (s->shared) {
+		s->msn = NULL;
+		s->ids = NULL;
+		s->msginfo = NULL;
+	}
+
 	if (s->msn) g_tree_destroy(s->msn);
 	s->msn = NULL;
 
 	if (s->ids) g_tree_destroy(s->ids);		
 	s->ids = NULL;
 
-	if (s->msginfo) g_tree_destroy(s->msginfo);
+	g_free(s->fenwick);
+	s->fenwick = NULL;
+
+	if (s->msginfo) {
+		g_tree_foreach(s->msginfo, (GTraverseFunc)_free_keywords, NULL);
+		g_tree_destroy(s->msginfo);
+	}
 	s->msginfo = NULL;
 
+	g_list_foreach(s->chunks, (GFunc)g_free, NULL);
+	g_list_free(s->chunks);
+	s->chunks = NULL;
+
+	if (s->snapshot)
+		snapshot_release(s->snapshot);
+	s->snapshot = NULL;
+
 	if (s->recent_queue) {
 		g_tree_foreach(s->recent_queue, (GTraverseFunc)_free_recent_queue, s);
 		g_tree_destroy(s->recent_queue);
@@ -789,58 +1324,37 @@ static void db_getmailbox_count(T M, Connection_T c)
 {
 	ResultSet_T r; 
 	PreparedStatement_T stmt;
-	unsigned result[3];
-
-	result[0] = result[1] = result[2] = 0;
 
 	g_return_if_fail(M->id);
 
-	/* count messages */
+	/* every command that changes messages moves the counters in the
+	 * same transaction as the change itself, so there is no need to
+	 * aggregate over the messages here.
+	 * NOTE:
+	 * - expunged messages are counted for uidnext as well in order to be
+	 *   able to restore them
+	 * - the next uid MUST NOT change unless messages are added to THIS mailbox
+	 * */
 	stmt = db_stmt_prepare(c,
-			"SELECT "
-			"SUM( CASE WHEN seen_flag = 0 THEN 1 ELSE 0 END) AS unseen, "
-			"SUM( CASE WHEN seen_flag = 1 THEN 1 ELSE 0 END) AS seen, "
-			"SUM( CASE WHEN recent_flag = 1 THEN 1 ELSE 0 END) AS recent "
-			"FROM %smessages WHERE mailbox_idnr=? AND status IN (%d,%d)",
-			DBPFX, MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
+			"SELECT exists_count, unseen_count, recent_count, uidnext "
+			"FROM %smailboxes WHERE mailbox_idnr=?", DBPFX);
 
 	db_stmt_set_u64(stmt, 1, M->id);
 
 	r = db_stmt_query(stmt);
 
-	if (db_result_next(r)) {
-		result[0] = (unsigned)db_result_get_int(r,0); // unseen
-		result[1] = (unsigned)db_result_get_int(r,1); // seen
-		result[2] = (unsigned)db_result_get_int(r,2); // recent
-	}
+	M->exists = M->unseen = M->recent = 0;
+	M->uidnext = 1;
 
-	M->exists = result[0] + result[1];
-	M->unseen = result[0];
-	M->recent = result[2];
- 
-	TRACE(TRACE_DEBUG, "exists [%d] unseen [%d] recent [%d]", M->exists, M->unseen, M->recent);
-	/* now determine the next message UID 
-	 * NOTE:
-	 * - expunged messages are selected as well in order to be able to restore them 
-	 * - the next uit MUST NOT change unless messages are added to THIS mailbox
-	 * */
-
-	if (M->exists == 0) {
-		M->uidnext = 1;
-		return;
+	if (db_result_next(r)) {
+		M->exists = (unsigned)db_result_get_int(r,0);
+		M->unseen = (unsigned)db_result_get_int(r,1);
+		M->recent = (unsigned)db_result_get_int(r,2);
+		M->uidnext = db_result_get_u64(r,3);
 	}
 
-	db_con_clear(c);
-	stmt = db_stmt_prepare(c,
-			"SELECT MAX(message_idnr)+1 FROM %smessages WHERE mailbox_idnr=?",
-			DBPFX);
-	db_stmt_set_u64(stmt, 1, M->id);
-	r = db_stmt_query(stmt);
-
-	if (db_result_next(r))
-		M->uidnext = db_result_get_u64(r,0);
-	else
-		M->uidnext = 1;
+	TRACE(TRACE_DEBUG, "exists [%d] unseen [%d] recent [%d] uidnext [%" PRIu64 "]",
+			M->exists, M->unseen, M->recent, M->uidnext);
 }
 
 static void db_getmailbox_keywords(T M, Connection_T c)
@@ -942,6 +1456,103 @@ int MailboxState_count(T M)
 	return t;
 }
 
+#define COUNT_SLICE 200
+
+int MailboxState_countList(GList *states, uint64_t userid)
+{
+	Connection_T c; ResultSet_T r;
+	volatile int t = DM_SUCCESS;
+	GTree *index, *user_acl;
+	GList *ids = NULL, *slices, *s;
+	uint64_t anyone = 0;
+
+	if (! (states = g_list_first(states)))
+		return t;
+
+	if (userid && ! auth_user_exists(DBMAIL_ACL_ANYONE_USER, &anyone))
+		anyone = 0;
+
+	index = g_tree_new((GCompareFunc)ucmp);
+	user_acl = g_tree_new((GCompareFunc)ucmp);
+	for (s = states; s; s = g_list_next(s)) {
+		T M = (T)s->data;
+		if (! M->id) continue;
+		g_tree_insert(index, &M->id, M);
+		ids = g_list_prepend(ids, &M->id);
+		M->rights = 0;
+	}
+	slices = g_list_slices_u64(ids, COUNT_SLICE);
+	g_list_free(ids);
+
+	c = db_con_get();
+	TRY
+		s = slices;
+		while (s) {
+			r = db_query(c, "SELECT mailbox_idnr, exists_count, unseen_count, "
+					"recent_count, uidnext, seq, owner_idnr FROM %smailboxes "
+					"WHERE mailbox_idnr IN (%s)", DBPFX, (gchar *)s->data);
+			while (db_result_next(r)) {
+				uint64_t id = db_result_get_u64(r, 0);
+				T M = g_tree_lookup(index, &id);
+				if (! M) continue;
+				M->exists = (unsigned)db_result_get_int(r, 1);
+				M->unseen = (unsigned)db_result_get_int(r, 2);
+				M->recent = (unsigned)db_result_get_int(r, 3);
+				M->uidnext = db_result_get_u64(r, 4);
+				M->seq = db_result_get_u64(r, 5);
+				M->owner_id = db_result_get_u64(r, 6);
+			}
+
+			/* the acl rows of the user and 'anyone' on the same slice */
+			if (userid) {
+				r = db_query(c, "SELECT mailbox_id,user_id,lookup_flag,read_flag,seen_flag,"
+						"write_flag,insert_flag,post_flag,"
+						"create_flag,delete_flag,deleted_flag,expunge_flag,administer_flag "
+						"FROM %sacl WHERE mailbox_id IN (%s) "
+						"AND user_id IN (%" PRIu64 ",%" PRIu64 ")", DBPFX,
+						(gchar *)s->data, userid, anyone ? anyone : userid);
+				while (db_result_next(r)) {
+					int i;
+					unsigned mask = 0;
+					uint64_t id = db_result_get_u64(r, 0);
+					uint64_t user = db_result_get_u64(r, 1);
+					T M = g_tree_lookup(index, &id);
+					if (! M) continue;
+					for (i = ACL_RIGHT_LOOKUP; i < ACL_RIGHT_NONE; i++) {
+						if (db_result_get_bool(r, i + 2))
+							mask |= (1 << i);
+					}
+					if (user == userid)
+						g_tree_insert(user_acl, &M->id, M);
+					M->rights |= mask;
+				}
+			}
+			s = g_list_next(s);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (userid && t == DM_SUCCESS) {
+		for (s = states; s; s = g_list_next(s)) {
+			T M = (T)s->data;
+			if (! M->id) continue;
+			if ((M->owner_id == userid) && (! g_tree_lookup(user_acl, &M->id)))
+				M->rights = ACL_RIGHTS_ALL;
+			M->rights_userid = userid;
+		}
+	}
+
+	g_list_destroy(slices);
+	g_tree_destroy(user_acl);
+	g_tree_destroy(index);
+
+	return t;
+}
+
 char * MailboxState_flags(T M)
 {
 	char *s = NULL;
@@ -961,83 +1572,86 @@ char * MailboxState_flags(T M)
 	return g_strchomp(s);
 }
 
-int MailboxState_hasPermission(T M, uint64_t userid, const char *right_flag)
+int MailboxState_getRights(T M, uint64_t userid, uint64_t anyone, unsigned *rights)
 {
-	PreparedStatement_T stmt;
-	Connection_T c;
-       	ResultSet_T r;
-	volatile int result = FALSE;
-	volatile bool owner_acl = false;
+	Connection_T c; ResultSet_T r; PreparedStatement_T s;
+	volatile int t = DM_SUCCESS;
+	volatile gboolean user_acl = FALSE;
+	volatile unsigned user_rights = 0, anyone_rights = 0;
 	uint64_t owner_id, mboxid;
 
+	assert(rights);
+	*rights = 0;
+
 	mboxid = MailboxState_getId(M);
+	g_return_val_if_fail(mboxid, DM_EGENERAL);
 
-	TRACE(TRACE_DEBUG, "checking ACL [%s] for user [%" PRIu64 "] on mailbox [%" PRIu64 "]",
-			right_flag, userid, mboxid);
+	if (M->rights_userid && M->rights_userid == userid) {
+		*rights = M->rights;
+		return DM_SUCCESS;
+	}
 
 	/* If we don't know who owns the mailbox, look it up. */
 	owner_id = MailboxState_getOwner(M);
 	if (! owner_id) {
-		result = db_get_mailbox_owner(mboxid, &owner_id);
+		t = db_get_mailbox_owner(mboxid, &owner_id);
+		if (t == DM_EQUERY)
+			return t;
+		if (! owner_id) // no such mailbox
+			return DM_SUCCESS;
 		MailboxState_setOwner(M, owner_id);
-		if (! (result > 0))
-			return result;
-	}
-
-	if (owner_id == userid) {
-		c = db_con_get();
-		TRY
-			stmt = db_stmt_prepare(c,
-					"SELECT * FROM %sacl WHERE "
-					"user_id = ? AND mailbox_id = ?", 
-					DBPFX);
-			db_stmt_set_u64(stmt, 1, userid);
-			db_stmt_set_u64(stmt, 2, mboxid);
-			r = db_stmt_query(stmt);
-
-			if (db_result_next(r))
-				owner_acl = true;
-		CATCH(SQLException)
-			LOG_SQLERROR;
-			result = DM_EQUERY;
-		FINALLY	
-			db_con_close(c);
-		END_TRY;
-
-		if (! owner_acl) {
-			TRACE(TRACE_DEBUG, "mailbox [%" PRIu64 "] is owned by user [%" PRIu64 "]"
-					"and no ACL in place. Giving all rights",
-					mboxid, userid);
-			return 1;
-		} else {
-			TRACE(TRACE_DEBUG, "mailbox [%" PRIu64 "] is owned by user [%" PRIu64 "]"
-					"but ACL in place. Restricted access for owner.",
-					mboxid, userid);
-		}
-
+		t = DM_SUCCESS;
 	}
 
-	result = FALSE;
 	c = db_con_get();
 	TRY
-		stmt = db_stmt_prepare(c,
-			       	"SELECT * FROM %sacl WHERE "
-				"user_id = ? AND mailbox_id = ? AND %s = 1", 
-				DBPFX, right_flag);
-		db_stmt_set_u64(stmt, 1, userid);
-		db_stmt_set_u64(stmt, 2, mboxid);
-		r = db_stmt_query(stmt);
-
-		if (db_result_next(r))
-			result = TRUE;
+		s = db_stmt_prepare(c, "SELECT user_id,lookup_flag,read_flag,seen_flag,"
+			"write_flag,insert_flag,post_flag,"
+			"create_flag,delete_flag,deleted_flag,expunge_flag,administer_flag "
+			"FROM %sacl "
+			"WHERE mailbox_id = ? AND user_id IN (?,?)", DBPFX);
+		db_stmt_set_u64(s, 1, mboxid);
+		db_stmt_set_u64(s, 2, userid);
+		db_stmt_set_u64(s, 3, anyone ? anyone : userid);
+		r = db_stmt_query(s);
+		while (db_result_next(r)) {
+			int i;
+			unsigned mask = 0;
+			uint64_t id = db_result_get_u64(r, 0);
+			for (i = ACL_RIGHT_LOOKUP; i < ACL_RIGHT_NONE; i++) {
+				if (db_result_get_bool(r, i + 1))
+					mask |= (1 << i);
+			}
+			if (id == userid) {
+				user_acl = TRUE;
+				user_rights = mask;
+			}
+			if (anyone && (id == anyone))
+				anyone_rights = mask;
+		}
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		result = DM_EQUERY;
-	FINALLY	
+		t = DM_EQUERY;
+	FINALLY
 		db_con_close(c);
 	END_TRY;
 
-	return result;
+	if (t == DM_EQUERY)
+		return t;
+
+	if ((owner_id == userid) && (! user_acl)) {
+		TRACE(TRACE_DEBUG, "mailbox [%" PRIu64 "] is owned by user [%" PRIu64 "]"
+				"and no ACL in place. Giving all rights",
+				mboxid, userid);
+		user_rights = ACL_RIGHTS_ALL;
+	}
+
+	*rights = user_rights | anyone_rights;
+
+	TRACE(TRACE_DEBUG, "user [%" PRIu64 "] mailbox [%" PRIu64 "] rights [%#x]",
+			userid, mboxid, *rights);
+
+	return t;
 }
 
 int MailboxState_getAcl(T M, uint64_t userid, struct ACLMap *map)
@@ -1100,7 +1714,7 @@ int MailboxState_getAcl(T M, uint64_t userid, struct ACLMap *map)
 
 static gboolean mailbox_build_recent(uint64_t *uid, MessageInfo *msginfo, T M)
 {
-	if (msginfo->flags[IMAP_FLAG_RECENT]) {
+	if (MSGINFO_FLAG(msginfo, IMAP_FLAG_RECENT)) {
 		uint64_t *copy = mempool_pop(M->pool, sizeof(uint64_t));
 		*copy = *uid;
 		g_tree_insert(M->recent_queue, copy, copy);
@@ -1119,19 +1733,28 @@ int MailboxState_build_recent(T M)
 	return 0;
 }
 
-static long long int _update_recent(volatile GList *slices, uint64_t seq)
+static long long int _update_recent(uint64_t mailbox_id, volatile GList *slices, uint64_t seq)
 {
-	INIT_QUERY;
 	Connection_T c;
+	MailboxCounters_T counters, cleared;
+	char *where;
 	volatile long long int count = 0;
 
 	if (! (slices = g_list_first(slices)))
 		return count;
 
+	memset(&counters, 0, sizeof(counters));
+	counters.mailbox_idnr = mailbox_id;
+
 	c = db_con_get();
 	TRY
 		db_begin_transaction(c);
 		while (slices) {
+			where = g_strdup_printf("recent_flag = 1 AND seq < %" PRIu64 " AND message_idnr IN (%s)",
+					seq, (gchar *)slices->data);
+			if (db_mailbox_counters_count(c, mailbox_id, where, &cleared))
+				counters.recent -= cleared.recent;
+			g_free(where);
 			Connection_execute(c, "UPDATE %smessages SET recent_flag = 0, seq = %" PRIu64 
 					" WHERE recent_flag = 1 AND seq < %" PRIu64 
 					" AND message_idnr IN (%s)", 
@@ -1140,6 +1763,7 @@ static long long int _update_recent(volatile GList *slices, uint64_t seq)
 			if (! g_list_next(slices)) break;
 			slices = g_list_next(slices);
 		}
+		db_mailbox_counters_delta(c, &counters);
 		db_commit_transaction(c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
@@ -1170,7 +1794,7 @@ int MailboxState_flush_recent(T M)
 	if (recent) {
 		long long int changed = 0;
 		uint64_t seq = MailboxState_getSeq(M);
-		changed = _update_recent(g_list_slices_u64(recent,100), seq+1);
+		changed = _update_recent(MailboxState_getId(M), g_list_slices_u64(recent,100), seq+1);
 		if (changed)
 			db_mailbox_seq_update(MailboxState_getId(M), 0);
 	}
@@ -1186,7 +1810,7 @@ int MailboxState_flush_recent(T M)
 
 static gboolean mailbox_clear_recent(uint64_t *uid, MessageInfo *msginfo, T M)
 {
-	msginfo->flags[IMAP_FLAG_RECENT] = 0;
+	MSGINFO_SET_FLAG(msginfo, IMAP_FLAG_RECENT, 0);
 	gpointer value;
 	gpointer orig_key;
 	if (g_tree_lookup_extended(M->recent_queue, uid, &orig_key, &value)) {
@@ -1199,6 +1823,7 @@ static gboolean mailbox_clear_recent(uint64_t *uid, MessageInfo *msginfo, T M)
 int MailboxState_clear_recent(T M)
 {
         if (MailboxState_getPermission(M) == IMAPPERM_READWRITE && MailboxState_getMsginfo(M)) {
+		MailboxState_unshare(M);
 		GTree *info = MailboxState_getMsginfo(M);
 		g_tree_foreach(info, (GTraverseFunc)mailbox_clear_recent, M);
 	}
@@ -1213,10 +1838,10 @@ GList * MailboxState_message_flags(T M, MessageInfo *msginfo)
 	uint64_t uid = msginfo->uid;
 
 	for (j = 0; j < IMAP_NFLAGS; j++) {
-		if (msginfo->flags[j])
+		if (MSGINFO_FLAG(msginfo, j))
 			sublist = g_list_append(sublist,g_strdup((gchar *)imap_flag_desc_escaped[j]));
 	}
-	if ((msginfo->flags[IMAP_FLAG_RECENT] == 0) && g_tree_lookup(M->recent_queue, &uid)) {
+	if ((! MSGINFO_FLAG(msginfo, IMAP_FLAG_RECENT)) && g_tree_lookup(M->recent_queue, &uid)) {
 		TRACE(TRACE_DEBUG,"set \\recent flag");
 		sublist = g_list_append(sublist, g_strdup((gchar *)imap_flag_desc_escaped[IMAP_FLAG_RECENT]));
 	}
@@ -31,6 +31,15 @@ extern T            MailboxState_new(Mempool_T pool, uint64_t id);
 
 extern int          MailboxState_info(T);
 extern int          MailboxState_count(T);
+/**
+ * \brief load the message counters and seq for a list of
+ * mailboxes with a single query per slice of mailbox ids
+ *
+ * If userid is set, the rights of that user on every mailbox are
+ * loaded with one more query per slice, and MailboxState_getRights
+ * answers from them.
+ */
+extern int          MailboxState_countList(GList *, uint64_t userid);
 extern void         MailboxState_remap(T);
 extern int          MailboxState_build_recent(T);
 extern int          MailboxState_flush_recent(T);
@@ -42,6 +51,13 @@ extern void         MailboxState_addMsginfo(T, uint64_t, MessageInfo *);
 extern GTree *      MailboxState_getMsginfo(T);
 extern GTree *      MailboxState_getIds(T);
 extern GTree *      MailboxState_getMsn(T);
+extern uint64_t     MailboxState_getMsnByUid(T, uint64_t);
+extern void         MessageInfo_mergeKeywords(MessageInfo *, GList *, int);
+extern void         MailboxState_unshare(T);
+extern void         MailboxState_compact(T);
+extern unsigned     MailboxState_getGarbage(T);
+extern unsigned     MailboxState_loads(void);
+extern unsigned     MailboxState_keyword_refs(void);
 
 
 extern void         MailboxState_setId(T, uint64_t);
@@ -80,9 +96,16 @@ extern GTree *      MailboxState_get_set(T, const char *, gboolean);
 extern void         MailboxState_free(T *);
 
 /**
- * \brief check if a user has a certain right to a mailbox
+ * \brief get the rights bitmask on a mailbox for a user
+ *
+ * The mask holds one bit (1 << ACLRight) for every right the user
+ * has either directly, as the owner of the mailbox, or through the
+ * 'anyone' user. All rows are loaded with a single query.
+ *
+ * \param anyone user_idnr of the 'anyone' user, or 0 if none
+ * \return DM_SUCCESS, or DM_EQUERY on database failure
  */
-extern int MailboxState_hasPermission(T, uint64_t user_idnr, const char *right_flag);
+extern int MailboxState_getRights(T, uint64_t userid, uint64_t anyone, unsigned *rights);
 /**
  * \brief get all permissions on a mailbox for a user
  * 
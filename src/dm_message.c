@@ -46,15 +46,16 @@ extern DBParam_T db_params;
 
 static void _header_cache(const char *, const char *, gpointer);
 
-static gboolean _header_insert(uint64_t physmessage_id, uint64_t headername_id, uint64_t headervalue_id);
+static gboolean _header_insert(const DbmailMessage *self, uint64_t headername_id, uint64_t headervalue_id);
 static int _header_name_get_id(const DbmailMessage *self, const char *header, uint64_t *id);
-static int _header_value_get_id(const char *value, const char *sortfield, const char *datefield, uint64_t *id);
+static int _header_value_get_id(const DbmailMessage *self, const char *value, const char *sortfield, const char *datefield, uint64_t *id);
 
 static DbmailMessage * _retrieve(DbmailMessage *self, const char *query_template);
 static int _message_insert(DbmailMessage *self, 
 		uint64_t user_idnr, 
 		const char *mailbox, 
 		const char *unique_id); 
+static void insert_physmessage(DbmailMessage *self, Connection_T c);
 
 
 /* general mime utils (missing from gmime?) */
@@ -109,7 +110,336 @@ gchar * g_mime_object_get_body(const GMimeObject *object)
 	return s;
 }
 
-static uint64_t blob_exists(const char *buf, const char *hash)
+/*
+ * mimepart deduplication
+ *
+ * blob_dedup = compare (default) matches existing parts on hash and
+ * size and lets the database compare the stored data byte-for-byte.
+ * blob_dedup = hash trusts a strong hash plus size, so the part is
+ * only sent to the database once when it is new.
+ *
+ * blob_filter = yes keeps a bloom filter of all known hashes in this
+ * process; parts not in the filter are inserted without looking for
+ * an existing copy first. The first part stored starts a thread that
+ * reads the known hashes in slices of BLOB_FILTER_SLICE ids; until it
+ * is done every part is looked up as without the filter. The filter
+ * takes blob_filter_size megabytes; each megabyte holds about half a
+ * million parts before more than 1% of the new ones are looked up.
+ *
+ * The filter only learns about parts stored by this process. Parts
+ * stored by other processes after their slice was read may end up
+ * stored twice; that wastes space but is otherwise harmless.
+ */
+
+#define BLOB_FILTER_SIZE 2	// megabytes
+#define BLOB_FILTER_HASHES 4
+#define BLOB_FILTER_SLICE 10000
+
+enum {
+	BLOB_FILTER_NONE,
+	BLOB_FILTER_LOADING,
+	BLOB_FILTER_READY,
+	BLOB_FILTER_FAILED
+};
+
+static struct {
+	gboolean hash_only;
+	gboolean use_filter;
+	int filter_state;
+	uint64_t filter_bits;
+	guchar *filter;
+	GThread *loader;
+	volatile gint lookups;	// existence checks sent to the database
+	volatile gint skipped;	// existence checks the filter ruled out
+} blob_config;
+
+static GOnce blob_once = G_ONCE_INIT;
+G_LOCK_DEFINE_STATIC(blob_filter_mutex);
+
+static gpointer blob_config_init(gpointer UNUSED data)
+{
+	Field_T val, algorithm;
+	int size = BLOB_FILTER_SIZE;
+
+	memset(&blob_config, 0, sizeof(blob_config));
+
+	memset(val, 0, sizeof(Field_T));
+	memset(algorithm, 0, sizeof(Field_T));
+	GETCONFIGVALUE("blob_dedup", "DBMAIL", val);
+	GETCONFIGVALUE("hash_algorithm", "DBMAIL", algorithm);
+
+	if (SMATCH(val, "hash")) {
+		if (SMATCH(algorithm, "sha256") || SMATCH(algorithm, "sha512") 
+				|| SMATCH(algorithm, "whirlpool")) {
+			blob_config.hash_only = TRUE;
+		} else {
+			TRACE(TRACE_WARNING, "blob_dedup = hash requires hash_algorithm "
+					"sha256, sha512 or whirlpool; using compare");
+		}
+	}
+
+	memset(val, 0, sizeof(Field_T));
+	GETCONFIGVALUE("blob_filter", "DBMAIL", val);
+	if (SMATCH(val, "yes"))
+		blob_config.use_filter = TRUE;
+
+	memset(val, 0, sizeof(Field_T));
+	GETCONFIGVALUE("blob_filter_size", "DBMAIL", val);
+	if (strlen(val))
+		size = atoi(val);
+	if (size <= 0) {
+		TRACE(TRACE_WARNING, "invalid blob_filter_size [%s]; using [%d]", val, BLOB_FILTER_SIZE);
+		size = BLOB_FILTER_SIZE;
+	}
+	blob_config.filter_bits = (uint64_t)size << 23;
+
+	TRACE(TRACE_DEBUG, "blob dedup [%s] filter [%s] size [%dMB]", 
+			blob_config.hash_only ? "hash" : "compare",
+			blob_config.use_filter ? "yes" : "no", size);
+
+	return (gpointer)NULL;
+}
+
+static void blob_filter_index(const char *hash, uint64_t *h1, uint64_t *h2)
+{
+	char part[17];
+
+	memset(part, 0, sizeof(part));
+	strncpy(part, hash, 16);
+	*h1 = g_ascii_strtoull(part, NULL, 16);
+
+	memset(part, 0, sizeof(part));
+	if (strlen(hash) > 16)
+		strncpy(part, hash + 16, 16);
+	*h2 = g_ascii_strtoull(part, NULL, 16) | 1;
+}
+
+static void blob_filter_add_unlocked(const char *hash)
+{
+	uint64_t h1, h2, bit;
+	int i;
+
+	blob_filter_index(hash, &h1, &h2);
+	for (i = 0; i < BLOB_FILTER_HASHES; i++) {
+		bit = (h1 + i * h2) % blob_config.filter_bits;
+		blob_config.filter[bit >> 3] |= (1 << (bit & 7));
+	}
+}
+
+static void blob_filter_add(const char *hash)
+{
+	if (! blob_config.use_filter)
+		return;
+
+	/* parts stored while loading are added too */
+	G_LOCK(blob_filter_mutex);
+	if (blob_config.filter)
+		blob_filter_add_unlocked(hash);
+	G_UNLOCK(blob_filter_mutex);
+}
+
+/*
+ * read the known hashes one slice of ids at a time, so the
+ * filter lock is only held while a slice is added
+ */
+static gpointer blob_filter_load(gpointer UNUSED data)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T s;
+	volatile gboolean t = TRUE;
+	volatile uint64_t maxid = 0;
+	uint64_t slice, count = 0;
+	GList *hashes, *h;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT MAX(id) FROM %smimeparts", DBPFX);
+		if (db_result_next(r))
+			maxid = db_result_get_u64(r, 0);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = FALSE;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	for (slice = 0; t && slice < maxid; slice += BLOB_FILTER_SLICE) {
+		hashes = NULL;
+		c = db_con_get();
+		TRY
+			s = db_stmt_prepare(c, "SELECT hash FROM %smimeparts WHERE id > ? AND id <= ?", DBPFX);
+			db_stmt_set_u64(s, 1, slice);
+			db_stmt_set_u64(s, 2, slice + BLOB_FILTER_SLICE);
+			r = db_stmt_query(s);
+			while (db_result_next(r))
+				hashes = g_list_prepend(hashes, g_strdup(db_result_get(r, 0)));
+		CATCH(SQLException)
+			LOG_SQLERROR;
+			t = FALSE;
+		FINALLY
+			db_con_close(c);
+		END_TRY;
+
+		G_LOCK(blob_filter_mutex);
+		for (h = hashes; h; h = g_list_next(h)) {
+			blob_filter_add_unlocked((const char *)h->data);
+			count++;
+		}
+		G_UNLOCK(blob_filter_mutex);
+		g_list_destroy(hashes);
+	}
+
+	G_LOCK(blob_filter_mutex);
+	if (t) {
+		blob_config.filter_state = BLOB_FILTER_READY;
+	} else {
+		g_free(blob_config.filter);
+		blob_config.filter = NULL;
+		blob_config.filter_state = BLOB_FILTER_FAILED;
+	}
+	G_UNLOCK(blob_filter_mutex);
+
+	if (t)
+		TRACE(TRACE_INFO, "blob filter loaded with [%" PRIu64 "] hashes", count);
+	else
+		TRACE(TRACE_WARNING, "loading blob filter failed; filter disabled");
+
+	return NULL;
+}
+
+/*
+ * return FALSE if the hash is certainly unknown, TRUE if it
+ * may already be stored.
+ */
+static gboolean blob_filter_test(const char *hash)
+{
+	uint64_t h1, h2, bit;
+	gboolean found = TRUE;
+	int i;
+
+	if (! blob_config.use_filter)
+		return TRUE;
+
+	G_LOCK(blob_filter_mutex);
+	switch (blob_config.filter_state) {
+		case BLOB_FILTER_NONE:
+			blob_config.filter = g_new0(guchar, blob_config.filter_bits >> 3);
+			blob_config.filter_state = BLOB_FILTER_LOADING;
+			blob_config.loader = g_thread_new("blob_filter", blob_filter_load, NULL);
+			break;
+		case BLOB_FILTER_READY:
+			blob_filter_index(hash, &h1, &h2);
+			for (i = 0; i < BLOB_FILTER_HASHES; i++) {
+				bit = (h1 + i * h2) % blob_config.filter_bits;
+				if (! (blob_config.filter[bit >> 3] & (1 << (bit & 7)))) {
+					found = FALSE;
+					break;
+				}
+			}
+			/* fall through */
+		case BLOB_FILTER_FAILED:
+			if (blob_config.loader) {
+				g_thread_join(blob_config.loader);
+				blob_config.loader = NULL;
+			}
+			break;
+	}
+	G_UNLOCK(blob_filter_mutex);
+
+	if (found)
+		g_atomic_int_inc(&blob_config.lookups);
+	else
+		g_atomic_int_inc(&blob_config.skipped);
+
+	return found;
+}
+
+/*
+ * test hooks, not part of the public API
+ *
+ * wait for a filter load in progress, then re-read the
+ * blob_dedup and blob_filter settings and start over
+ */
+void dbmail_message_blob_reset(void)
+{
+	g_once(&blob_once, blob_config_init, NULL);
+
+	dbmail_message_blob_wait();
+
+	G_LOCK(blob_filter_mutex);
+	g_free(blob_config.filter);
+	blob_config_init(NULL);
+	G_UNLOCK(blob_filter_mutex);
+}
+
+/*
+ * wait for the filter to finish loading; returns TRUE
+ * if it is in use
+ */
+gboolean dbmail_message_blob_wait(void)
+{
+	int state;
+
+	while (TRUE) {
+		G_LOCK(blob_filter_mutex);
+		state = blob_config.filter_state;
+		if (state != BLOB_FILTER_LOADING && blob_config.loader) {
+			g_thread_join(blob_config.loader);
+			blob_config.loader = NULL;
+		}
+		G_UNLOCK(blob_filter_mutex);
+		if (state != BLOB_FILTER_LOADING)
+			break;
+		g_usleep(10000);
+	}
+
+	return (state == BLOB_FILTER_READY);
+}
+
+void dbmail_message_blob_stats(unsigned *lookups, unsigned *skipped)
+{
+	*lookups = (unsigned)g_atomic_int_get(&blob_config.lookups);
+	*skipped = (unsigned)g_atomic_int_get(&blob_config.skipped);
+}
+
+/*
+ * a message stored with dbmail_message_store_physmessage_c() writes
+ * all its rows in the caller's transaction; otherwise every row is
+ * written in a short transaction of its own. A failed statement in
+ * the caller's transaction is recorded in store_failed, the caller
+ * rolls back.
+ */
+static Connection_T store_con_get(const DbmailMessage *m)
+{
+	return m->store_c ? m->store_c : db_con_get();
+}
+
+static void store_begin(const DbmailMessage *m, Connection_T c)
+{
+	if (c != m->store_c)
+		db_begin_transaction(c);
+}
+
+static void store_commit(const DbmailMessage *m, Connection_T c)
+{
+	if (c != m->store_c)
+		db_commit_transaction(c);
+}
+
+static void store_rollback(const DbmailMessage *m, Connection_T c)
+{
+	if (c == m->store_c)
+		((DbmailMessage *)m)->store_failed = TRUE;
+	else
+		db_rollback_transaction(c);
+}
+
+static void store_con_close(const DbmailMessage *m, Connection_T c)
+{
+	if (c != m->store_c)
+		db_con_close(c);
+}
+
+static uint64_t blob_exists(const DbmailMessage *m, const char *buf, const char *hash)
 {
 	volatile uint64_t id = 0;
 	volatile uint64_t id_old = 0;
@@ -120,7 +450,12 @@ static uint64_t blob_exists(const char *buf, const char *hash)
 	memset(blob_cmp, 0, sizeof(blob_cmp));
 
 	l = strlen(buf);
-	c = db_con_get();
+
+	/* the oracle check below needs a transaction of its own */
+	if (m->store_c && db_params.db_driver == DM_DRIVER_ORACLE && l > DM_ORA_MAX_BYTES_LOB_CMP)
+		return 0;
+
+	c = store_con_get(m);
 	TRY
 		if (db_params.db_driver == DM_DRIVER_ORACLE  && l > DM_ORA_MAX_BYTES_LOB_CMP) {
 			db_begin_transaction(c);
@@ -150,6 +485,14 @@ static uint64_t blob_exists(const char *buf, const char *hash)
 			} else {
 				db_commit_transaction(c);
 			}
+		} else if (blob_config.hash_only) {
+			s = db_stmt_prepare(c,"SELECT id FROM %smimeparts WHERE hash=? AND %ssize%s=?", 
+					DBPFX,db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN));
+			db_stmt_set_str(s,1,hash);
+			db_stmt_set_u64(s,2,l);
+			r = db_stmt_query(s);
+			if (db_result_next(r))
+				id = db_result_get_u64(r,0);
 		} else {
 			snprintf(blob_cmp, DEF_FRAGSIZE-1, db_get_sql(SQL_COMPARE_BLOB), "data");
 			s = db_stmt_prepare(c,"SELECT id FROM %smimeparts WHERE hash=? AND %ssize%s=? AND %s", 
@@ -164,16 +507,18 @@ static uint64_t blob_exists(const char *buf, const char *hash)
 		}
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		if (db_params.db_driver == DM_DRIVER_ORACLE) 
+		if (c == m->store_c)
+			store_rollback(m, c);
+		else if (db_params.db_driver == DM_DRIVER_ORACLE) 
 			db_rollback_transaction(c);
 	FINALLY
-		db_con_close(c);
+		store_con_close(m, c);
 	END_TRY;
 
 	return id;
 }
 
-static uint64_t blob_insert(const char *buf, const char *hash)
+static uint64_t blob_insert(const DbmailMessage *m, const char *buf, const char *hash)
 {
 	Connection_T c; PreparedStatement_T s; ResultSet_T r;
 	size_t l;
@@ -183,9 +528,9 @@ static uint64_t blob_insert(const char *buf, const char *hash)
 	assert(buf);
 	l = strlen(buf);
 
-	c = db_con_get();
+	c = store_con_get(m);
 	TRY
-		db_begin_transaction(c);
+		store_begin(m, c);
 		s = db_stmt_prepare(c, "INSERT INTO %smimeparts (hash, data, %ssize%s) VALUES (?, ?, ?) %s", 
 				DBPFX, db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN), frag);
 		db_stmt_set_str(s, 1, hash);
@@ -198,12 +543,12 @@ static uint64_t blob_insert(const char *buf, const char *hash)
 			r = db_stmt_query(s);
 			id = db_insert_result(c,r);
 		}
-		db_commit_transaction(c);
+		store_commit(m, c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		db_rollback_transaction(c);
+		store_rollback(m, c);
 	FINALLY
-		db_con_close(c);
+		store_con_close(m, c);
 	END_TRY;
 
 	TRACE(TRACE_DEBUG,"inserted id [%" PRIu64 "]", id);
@@ -215,7 +560,7 @@ static uint64_t blob_insert(const char *buf, const char *hash)
 static int register_blob(DbmailMessage *m, uint64_t id, gboolean is_header)
 {
 	Connection_T c; volatile gboolean t = FALSE;
-	c = db_con_get();
+	c = store_con_get(m);
 
 	if (m->part_depth > MAX_MIME_DEPTH) {
 		TRACE(TRACE_WARNING, "MIME part depth exceeds allowed limit. You should recompile "
@@ -224,38 +569,41 @@ static int register_blob(DbmailMessage *m, uint64_t id, gboolean is_header)
 	}
 
 	TRY
-		db_begin_transaction(c);
+		store_begin(m, c);
 		t = db_exec(c, "INSERT INTO %spartlists (physmessage_id, is_header, part_key, part_depth, part_order, part_id) "
 				"VALUES (%" PRIu64 ",%d,%d,%d,%d,%" PRIu64 ")", DBPFX,
 				dbmail_message_get_physid(m), is_header, m->part_key, m->part_depth, m->part_order, id);	
-		db_commit_transaction(c);
+		store_commit(m, c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		db_rollback_transaction(c);
+		store_rollback(m, c);
 	FINALLY
-		db_con_close(c);
+		store_con_close(m, c);
 	END_TRY;
 
 	return t;
 }
 
-static uint64_t blob_store(const char *buf)
+static uint64_t blob_store(const DbmailMessage *m, const char *buf)
 {
 	uint64_t id;
 	char hash[FIELDSIZE];
 
 	if (! buf) return 0;
 
+	g_once(&blob_once, blob_config_init, NULL);
+
 	memset(hash, 0, sizeof(hash));
 	if (dm_get_hash_for_string(buf, hash))
 		return 0;
 
 	// store this message fragment
-	if ((id = blob_exists(buf, (const char *)hash)) != 0) {
+	if (blob_filter_test(hash) && (id = blob_exists(m, buf, (const char *)hash)) != 0) {
 		return id;
 	}
 
-	if ((id = blob_insert(buf, (const char *)hash)) != 0) {
+	if ((id = blob_insert(m, buf, (const char *)hash)) != 0) {
+		blob_filter_add(hash);
 		return id;
 	}
 	
@@ -276,7 +624,7 @@ static int store_blob(DbmailMessage *m, const char *buf, gboolean is_header)
 	dprint("<blob is_header=\"%d\" part_depth=\"%d\" part_key=\"%d\" part_order=\"%d\">\n%s\n</blob>\n", 
 			is_header, m->part_depth, m->part_key, m->part_order, buf);
 
-	if (! (id = blob_store(buf)))
+	if (! (id = blob_store(m, buf)))
 		return DM_EQUERY;
 
 	// register this message fragment
@@ -354,18 +702,142 @@ static bool find_boundary(const char *s, char *boundary)
 	return true;
 }
 
+/*
+ * reassembly of a message from its mimeparts. The boundary state is kept
+ * in a MimeWalk so parts can be fed one at a time, either from a single
+ * query (_mime_retrieve) or incrementally (dbmail_message_stream_read).
+ */
+typedef void (*MimeSink)(const char *, size_t, gpointer);
+
+typedef struct {
+	int depth;
+	int row;
+	gboolean got_boundary;
+	gboolean prev_boundary;
+	gboolean is_header;
+	gboolean is_message;
+	gboolean prev_is_message;
+	gboolean finalized;
+	char boundary[MAX_MIME_BLEN];
+	char blist[MAX_MIME_DEPTH+1][MAX_MIME_BLEN];
+} MimeWalk;
+
+static void mime_walk_init(MimeWalk *w)
+{
+	memset(w, 0, sizeof(MimeWalk));
+	w->is_header = TRUE;
+}
+
+static void mime_walk_emit(MimeSink sink, gpointer data, const char *pre, const char *boundary, const char *post)
+{
+	sink(pre, strlen(pre), data);
+	sink(boundary, strlen(boundary), data);
+	sink(post, strlen(post), data);
+}
+
+/* emit the boundaries that precede a part; str is only inspected
+ * for headers. Returns FALSE if the part must be skipped */
+static gboolean mime_walk_open(MimeWalk *w, int depth, gboolean is_header, const char *str, MimeSink sink, gpointer data)
+{
+	GMimeContentType *mimetype = NULL;
+	int prevdepth = w->depth;
+	gboolean prev_header = w->is_header;
+
+	w->depth = depth;
+	if (depth > MAX_MIME_DEPTH) {
+		TRACE(TRACE_WARNING, "MIME part depth exceeds allowed maximum [%d]",
+				MAX_MIME_DEPTH);
+		return FALSE;
+	}
+	w->is_header = is_header;
+
+	if (is_header) {
+		w->prev_boundary = w->got_boundary;
+		w->prev_is_message = w->is_message;
+		if ((mimetype = find_type(str))) {
+			w->is_message = g_mime_content_type_is_type(mimetype, "message", "rfc822");
+			g_object_unref(mimetype);
+		}
+	}
+
+	w->got_boundary = FALSE;
+
+	if (is_header && find_boundary(str, &w->boundary[0])) {
+		w->got_boundary = TRUE;
+		dprint("<boundary depth=\"%d\">%s</boundary>\n", depth, w->boundary);
+		strncpy(w->blist[depth], w->boundary, MAX_MIME_BLEN-1);
+	}
+
+	while ((prevdepth > 0) && (prevdepth-1 >= depth) && w->blist[prevdepth-1][0]) {
+		dprint("\n--%s at %d -> %d--\n", w->blist[prevdepth-1], prevdepth, prevdepth-1);
+		mime_walk_emit(sink, data, "\n--", w->blist[prevdepth-1], "--\n");
+		memset(w->blist[prevdepth-1], 0, MAX_MIME_BLEN);
+		prevdepth--;
+		w->finalized=TRUE;
+	}
+
+	if ((depth > 0) && (w->blist[depth-1][0]))
+		strncpy(w->boundary, w->blist[depth-1], MAX_MIME_BLEN-1);
+
+	if (is_header)
+	  if (prev_header && depth>0 && !w->prev_is_message) {
+		dprint("--%s\n", w->boundary);
+		mime_walk_emit(sink, data, "--", w->boundary, "\n");
+	  } else if (!prev_header || w->prev_boundary) {
+		dprint("\n--%s\n", w->boundary);
+		mime_walk_emit(sink, data, "\n--", w->boundary, "\n");
+	  }
+
+	return TRUE;
+}
+
+static void mime_walk_close(MimeWalk *w, MimeSink sink, gpointer data)
+{
+	if (w->is_header)
+		sink("\n", 1, data);
+
+	w->row++;
+}
+
+static void mime_walk_part(MimeWalk *w, int depth, gboolean is_header, const char *str, MimeSink sink, gpointer data)
+{
+	if (! mime_walk_open(w, depth, is_header, str, sink, data))
+		return;
+
+	sink(str, strlen(str), data);
+	dprint("<part is_header=\"%d\" depth=\"%d\">\n%s\n</part>\n", is_header, depth, str);
+
+	mime_walk_close(w, sink, data);
+}
+
+static void mime_walk_finish(MimeWalk *w, MimeSink sink, gpointer data)
+{
+	if (w->row > 2 && w->boundary[0] && !w->finalized) {
+		dprint("\n--%s-- final\n", w->boundary);
+		mime_walk_emit(sink, data, "\n--", w->boundary, "--\n");
+		w->finalized=TRUE;
+	}
+}
+
+static void _mime_sink_string(const char *s, size_t l, gpointer data)
+{
+	p_string_append_len((String_T)data, s, l);
+}
+
+static void _mime_sink_gstring(const char *s, size_t l, gpointer data)
+{
+	g_string_append_len((GString *)data, s, l);
+}
+
 static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 {
 	PreparedStatement_T stmt;
 	Connection_T c;
        	ResultSet_T r;
 	char internal_date[SQL_INTERNALDATE_LEN];
-	GMimeContentType *mimetype = NULL;
-	volatile int prevdepth, depth = 0, row = 0;
 	volatile int t = FALSE;
-	volatile gboolean got_boundary = FALSE, prev_boundary = FALSE, is_header = TRUE, prev_header, finalized=FALSE;
-	volatile gboolean prev_is_message = FALSE, is_message = FALSE;
 	volatile String_T m = NULL, n = NULL;
+	MimeWalk *w;
 	const void *blob;
 	Field_T frag;
 
@@ -374,14 +846,11 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 	n = p_string_new(self->pool, "");
 	p_string_printf(n,db_get_sql(SQL_ENCODE_ESCAPE), "data");
 
+	w = g_new0(MimeWalk, 1);
+	mime_walk_init(w);
+
 	c = db_con_get();
 	TRY
-		char boundary[MAX_MIME_BLEN];
-		char blist[MAX_MIME_DEPTH+1][MAX_MIME_BLEN];
-
-		memset(&boundary, 0, sizeof(boundary));
-		memset(&blist, 0, sizeof(blist));
-
 		stmt = db_stmt_prepare(c,
 			       	"SELECT l.part_key,l.part_depth,l.part_order,l.is_header,%s,%s "
 				"FROM %smimeparts p "
@@ -394,31 +863,10 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 		
 		m = p_string_new(self->pool, "");
 
-		row = 0;
 		while (db_result_next(r)) {
 			int l;
-#if DPRINT
-			int order;
-			int key;
-#endif
 
-			prevdepth	= depth;
-			prev_header	= is_header;
-#if DPRINT
-			key		= db_result_get_int(r,0);
-#endif
-			depth		= db_result_get_int(r,1);
-			if (depth > MAX_MIME_DEPTH) {
-				TRACE(TRACE_WARNING, "MIME part depth exceeds allowed maximum [%d]",
-						MAX_MIME_DEPTH);
-				continue;
-			}
-
-#if DPRINT
-			order		= db_result_get_int(r,2);
-#endif
-			is_header	= db_result_get_bool(r,3);
-			if (row == 0) {
+			if (w->row == 0) {
 				memset(internal_date, 0, sizeof(internal_date));
 				g_strlcpy(internal_date, db_result_get(r,4), SQL_INTERNALDATE_LEN-1);
 			}
@@ -426,60 +874,13 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 			char *str = g_new0(char, l + 1);
 			str = strncpy(str, blob, l);
 
-			if (is_header) {
-				prev_boundary = got_boundary;
-				prev_is_message = is_message;
-				if ((mimetype = find_type(str))) {
-					is_message = g_mime_content_type_is_type(mimetype, "message", "rfc822");
-					g_object_unref(mimetype);
-				}
-			}
-
-			got_boundary = FALSE;
-
-			if (is_header && find_boundary(str, &boundary[0])) {
-				got_boundary = TRUE;
-				dprint("<boundary depth=\"%d\">%s</boundary>\n", depth, boundary);
-				strncpy(blist[depth], boundary, MAX_MIME_BLEN-1);
-			}
-
-			while ((prevdepth > 0) && (prevdepth-1 >= depth) && blist[prevdepth-1][0]) {
-				dprint("\n--%s at %d -> %d--\n", blist[prevdepth-1], prevdepth, prevdepth-1);
-				p_string_append_printf(m, "\n--%s--\n", blist[prevdepth-1]);
-				memset(blist[prevdepth-1], 0, MAX_MIME_BLEN);
-				prevdepth--;
-				finalized=TRUE;
-			}
-
-			if ((depth > 0) && (blist[depth-1][0]))
-				strncpy(boundary, blist[depth-1], MAX_MIME_BLEN-1);
-
-			if (is_header)
-			  if (prev_header && depth>0 && !prev_is_message) {
-				dprint("--%s\n", boundary);
-				p_string_append_printf(m, "--%s\n", boundary);
-			  } else if (!prev_header || prev_boundary) {
-				dprint("\n--%s\n", boundary);
-				p_string_append_printf(m, "\n--%s\n", boundary);
-			  }
+			mime_walk_part(w, db_result_get_int(r,1), db_result_get_bool(r,3),
+					str, _mime_sink_string, (gpointer)m);
 
-			p_string_append_printf(m, "%s", str);
-			dprint("<part is_header=\"%d\" depth=\"%d\" key=\"%d\" order=\"%d\">\n%s\n</part>\n", 
-				is_header, depth, key, order, str);
-
-			if (is_header)
-				p_string_append_printf(m,"\n");
-			
 			g_free(str);
-			row++;
-		}
-
-		if (row > 2 && boundary[0] && !finalized) {
-			dprint("\n--%s-- final\n", boundary);
-			p_string_append_printf(m, "\n--%s--\n", boundary);
-			finalized=1;
 		}
 
+		mime_walk_finish(w, _mime_sink_string, (gpointer)m);
 
 	CATCH(SQLException)
 		LOG_SQLERROR;
@@ -488,11 +889,13 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 		db_con_close(c);
 	END_TRY;
 
-	if ((row == 0) || (t == DM_EQUERY)) {
+	if ((w->row == 0) || (t == DM_EQUERY)) {
+		g_free(w);
 		if (m) p_string_free(m, TRUE);
 		p_string_free(n, TRUE);
 		return NULL;
 	}
+	g_free(w);
 
 	self = dbmail_message_init_with_string(self,p_string_str(m));
 	dbmail_message_set_internal_date(self, internal_date);
@@ -501,6 +904,179 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 	return self;
 }
 
+/*
+ * incremental retrieval: only the partlist index is loaded up front,
+ * mimepart blobs are fetched one by one as the consumer asks for more.
+ * Bodies larger than MIMEPART_SLICE are fetched a slice at a time, so
+ * a single large attachment is never held in memory as a whole.
+ */
+#define MIMEPART_SLICE (1<<20)
+
+typedef struct {
+	uint64_t part_id;
+	uint64_t size;
+	int depth;
+	gboolean is_header;
+} MimeStreamPart;
+
+struct DbmailMessageStream {
+	uint64_t physid;
+	GArray *parts;
+	guint next;
+	uint64_t offset;	/* into the body of parts[next] being sliced */
+	gboolean done;
+	MimeWalk walk;
+};
+
+DbmailMessageStream * dbmail_message_stream_new(uint64_t physid)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T s;
+	volatile gboolean t = FALSE;
+	DbmailMessageStream *S;
+
+	assert(physid);
+
+	S = g_new0(DbmailMessageStream, 1);
+	S->physid = physid;
+	S->parts = g_array_new(FALSE, FALSE, sizeof(MimeStreamPart));
+	mime_walk_init(&S->walk);
+
+	c = db_con_get();
+	TRY
+		s = db_stmt_prepare(c, "SELECT l.part_id, l.part_depth, l.is_header, p.%ssize%s "
+				"FROM %spartlists l JOIN %smimeparts p ON p.id = l.part_id "
+				"WHERE l.physmessage_id = ? ORDER BY l.part_key, l.part_order ASC, l.part_depth DESC",
+				db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN), DBPFX, DBPFX);
+		db_stmt_set_u64(s, 1, physid);
+		r = db_stmt_query(s);
+		while (db_result_next(r)) {
+			MimeStreamPart p;
+			p.part_id = db_result_get_u64(r, 0);
+			p.depth = db_result_get_int(r, 1);
+			p.is_header = db_result_get_bool(r, 2);
+			p.size = db_result_get_u64(r, 3);
+			g_array_append_val(S->parts, p);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if ((t == DM_EQUERY) || (S->parts->len == 0)) {
+		dbmail_message_stream_free(S);
+		return NULL;
+	}
+
+	return S;
+}
+
+/* \brief append the next chunk of the reassembled message to out
+ * \param stream as returned by dbmail_message_stream_new
+ * \param out buffer to append to
+ * \param max stop fetching mimeparts once out holds at least max bytes
+ * \return 
+ *     - 1 if more data remains
+ *     - 0 when the message is complete
+ *     - DM_EQUERY on error
+ */
+int dbmail_message_stream_read(DbmailMessageStream *S, GString *out, size_t max)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T s, slice = NULL;
+	volatile int t = 1;
+	Field_T frag, sub;
+	const char *substring;
+
+	if (S->done)
+		return 0;
+
+	snprintf(frag, sizeof(Field_T)-1, db_get_sql(SQL_ENCODE_ESCAPE), "data");
+
+	c = db_con_get();
+	TRY
+		s = db_stmt_prepare(c, "SELECT %s FROM %smimeparts WHERE id = ?", frag, DBPFX);
+		while ((S->next < S->parts->len) && (out->len < max)) {
+			MimeStreamPart *p = &g_array_index(S->parts, MimeStreamPart, S->next);
+			int l;
+			const void *blob;
+			char *str;
+
+			if ((! p->is_header) && (p->size > MIMEPART_SLICE)
+					&& (substring = db_get_sql(SQL_SUBSTRING))) {
+				if (! slice) {
+					snprintf(sub, sizeof(Field_T)-1, substring, "data");
+					snprintf(frag, sizeof(Field_T)-1, db_get_sql(SQL_ENCODE_ESCAPE), sub);
+					slice = db_stmt_prepare(c, "SELECT %s FROM %smimeparts WHERE id = ?",
+							frag, DBPFX);
+				}
+				if ((S->offset == 0) && ! mime_walk_open(&S->walk, p->depth, FALSE, NULL,
+							_mime_sink_gstring, (gpointer)out)) {
+					S->next++;
+					continue;
+				}
+				db_stmt_set_u64(slice, 1, p->part_id);
+				db_stmt_set_u64(slice, 2, S->offset + 1);
+				db_stmt_set_int(slice, 3, MIMEPART_SLICE);
+				r = db_stmt_query(slice);
+				if (! db_result_next(r)) {
+					TRACE(TRACE_ERR, "[%" PRIu64 "] mimepart [%" PRIu64 "] missing",
+							S->physid, p->part_id);
+					t = DM_EQUERY;
+					break;
+				}
+				blob = db_result_get_blob(r, 0, &l);
+				g_string_append_len(out, blob, l);
+				S->offset += MIMEPART_SLICE;
+				if ((l == 0) || (S->offset >= p->size)) {
+					mime_walk_close(&S->walk, _mime_sink_gstring, (gpointer)out);
+					S->offset = 0;
+					S->next++;
+				}
+				continue;
+			}
+
+			db_stmt_set_u64(s, 1, p->part_id);
+			r = db_stmt_query(s);
+			if (! db_result_next(r)) {
+				TRACE(TRACE_ERR, "[%" PRIu64 "] mimepart [%" PRIu64 "] missing",
+						S->physid, p->part_id);
+				t = DM_EQUERY;
+				break;
+			}
+			blob = db_result_get_blob(r, 0, &l);
+			str = g_new0(char, l + 1);
+			str = strncpy(str, blob, l);
+			mime_walk_part(&S->walk, p->depth, p->is_header, str, _mime_sink_gstring, (gpointer)out);
+			g_free(str);
+			S->next++;
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t == DM_EQUERY)
+		return t;
+
+	if (S->next == S->parts->len) {
+		mime_walk_finish(&S->walk, _mime_sink_gstring, (gpointer)out);
+		S->done = TRUE;
+		return 0;
+	}
+
+	return 1;
+}
+
+void dbmail_message_stream_free(DbmailMessageStream *S)
+{
+	if (! S) return;
+	g_array_free(S->parts, TRUE);
+	g_free(S);
+}
+
 static gboolean store_mime_object(GMimeObject *parent, GMimeObject *object, DbmailMessage *m);
 
 static int store_head(GMimeObject *object, DbmailMessage *m)
@@ -765,42 +1341,50 @@ int dbmail_message_get_class(const DbmailMessage *self)
 	return self->klass;
 }
 
-/* \brief initialize a previously created DbmailMessage using a GString
+/* \brief initialize a previously created DbmailMessage from a stream
  * \param the empty DbmailMessage
- * \param char *content contains the raw message
+ * \param stream containing the raw message; the message takes over
+ *        the caller's reference
  * \return the filled DbmailMessage
  */
-DbmailMessage * dbmail_message_init_with_string(DbmailMessage *self, const char *str)
+#define FROMLINE 80
+DbmailMessage * dbmail_message_init_with_stream(DbmailMessage *self, GMimeStream *stream)
 {
 	char *buf, *crlf;
 	GMimeObject *content;
 	GMimeParser *parser;
-#define FROMLINE 80
 	char from[FROMLINE];
-	size_t buflen = strlen(str);
+	char peek[FROMLINE];
+	ssize_t l;
 
 	assert(self->content == NULL);
 
 	memset(from, 0, sizeof(from));
+	memset(peek, 0, sizeof(peek));
+
+	g_mime_stream_reset(stream);
+	l = g_mime_stream_read(stream, peek, FROMLINE - 1);
+	g_mime_stream_reset(stream);
 
-	if ((strncmp(str, "From ", 5) == 0) || (strncmp(str, " ", 1) == 0)) {
+	if ((l > 0) && ((strncmp(peek, "From ", 5) == 0) || (strncmp(peek, " ", 1) == 0))) {
 		/* don't use gmime's from scanner since body lines may begin with 'From ' */
 		char *end;
-		if ((end = g_strstr_len(str, FROMLINE, "\n"))) {
-			g_strlcpy(from, str, FROMLINE);
+		if ((end = g_strstr_len(peek, l, "\n"))) {
+			g_strlcpy(from, peek, FROMLINE);
 			TRACE(TRACE_DEBUG, "From_ [%s]", from);
 
 			// skip broken first line if it starts with a ' '
 			// we will still try to decode the contents to a date
-			if (strncmp(str, " ", 1) == 0) {
-				str = end+1;
+			if (strncmp(peek, " ", 1) == 0) {
+				GMimeStream *sub = g_mime_stream_substream(stream,
+						g_mime_stream_tell(stream) + (end - peek) + 1, -1);
+				g_object_unref(stream);
+				stream = sub;
 			}
 		}
 	}
 
-	self->stream = g_mime_stream_mem_new();
-	g_mime_stream_write(self->stream, str, buflen);
-	g_mime_stream_reset(self->stream);
+	self->stream = stream;
 
 	parser = g_mime_parser_new_with_stream(self->stream);
 
@@ -830,6 +1414,18 @@ DbmailMessage * dbmail_message_init_with_string(DbmailMessage *self, const char
 	return self;
 }
 
+/* \brief initialize a previously created DbmailMessage using a GString
+ * \param the empty DbmailMessage
+ * \param char *content contains the raw message
+ * \return the filled DbmailMessage
+ */
+DbmailMessage * dbmail_message_init_with_string(DbmailMessage *self, const char *str)
+{
+	GMimeStream *stream = g_mime_stream_mem_new();
+	g_mime_stream_write(stream, str, strlen(str));
+	return dbmail_message_init_with_stream(self, stream);
+}
+
 void dbmail_message_set_physid(DbmailMessage *self, uint64_t id)
 {
 	self->id = id;
@@ -1111,23 +1707,44 @@ DbmailMessage * dbmail_message_retrieve(DbmailMessage *self, uint64_t physid)
  */
 static int _update_message(DbmailMessage *self)
 {
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
 	uint64_t size    = (uint64_t)dbmail_message_get_size(self,FALSE);
-	uint64_t rfcsize = (uint64_t)dbmail_message_get_size(self,TRUE);
+	uint64_t user_idnr = db_get_useridnr(self->msg_idnr);
+	uint64_t mailbox_idnr = 0;
+	MailboxCounters_T counters;
+	char where[DEF_FRAGSIZE];
 
 	assert(size);
-	assert(rfcsize);
-	if (! db_update("UPDATE %sphysmessage SET messagesize = %" PRIu64 ", rfcsize = %" PRIu64 " WHERE id = %" PRIu64 "", 
-			DBPFX, size, rfcsize, self->id))
-		return DM_EQUERY;
 
-	if (! db_update("UPDATE %smessages SET status = %d WHERE message_idnr = %" PRIu64 "", 
-			DBPFX, MESSAGE_STATUS_NEW, self->msg_idnr))
-		return DM_EQUERY;
+	memset(where, 0, sizeof(where));
+	snprintf(where, DEF_FRAGSIZE-1, "message_idnr = %" PRIu64 "", self->msg_idnr);
 
-	if (! dm_quota_user_inc(db_get_useridnr(self->msg_idnr), size))
-		return DM_EQUERY;
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		r = db_query(c, "SELECT mailbox_idnr FROM %smessages WHERE %s", DBPFX, where);
+		if (r && db_result_next(r))
+			mailbox_idnr = db_result_get_u64(r, 0);
+		/* the message becomes visible: count it in its mailbox */
+		if (mailbox_idnr && db_exec(c, "UPDATE %smessages SET status = %d WHERE %s",
+				DBPFX, MESSAGE_STATUS_NEW, where)
+				&& db_mailbox_counters_count(c, mailbox_idnr, where, &counters)
+				&& db_mailbox_counters_delta(c, &counters)
+				&& dm_quota_user_delta(c, user_idnr, (int64_t)size)) {
+			db_commit_transaction(c);
+		} else {
+			db_rollback_transaction(c);
+			t = DM_EQUERY;
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
 
-	return DM_SUCCESS;
+	return t;
 }
 
 
@@ -1181,6 +1798,7 @@ int dbmail_message_store(DbmailMessage *self)
 			}
 
 			dbmail_message_cache_envelope(self);
+			dbmail_message_cache_bodystructure(self);
 
 			step++;
 		}
@@ -1192,6 +1810,48 @@ int dbmail_message_store(DbmailMessage *self)
 	return res;
 }
 
+/* \brief store the physmessage, mime-parts and header caches of a
+ * message without creating a messages row, in the caller's
+ * transaction on c. The caller links the physmessage to a mailbox
+ * in the same transaction, or rolls back.
+ * \param 	c connection with an open transaction
+ * \param 	filled DbmailMessage
+ * \return 
+ *     - -1 on error
+ *     -  0 on success
+ */
+int dbmail_message_store_physmessage_c(Connection_T c, DbmailMessage *self)
+{
+	int t = DM_SUCCESS;
+
+	insert_physmessage(self, c);
+	if (! dbmail_message_get_physid(self))
+		return DM_EQUERY;
+
+	self->store_c = c;
+	self->store_failed = FALSE;
+	self->store_headers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	if (dm_message_store(self)) {
+		TRACE(TRACE_WARNING,"Failed to store mimeparts");
+		t = DM_EQUERY;
+	} else if (dbmail_message_cache_headers(self) < 0) {
+		t = DM_EQUERY;
+	} else {
+		dbmail_message_cache_envelope(self);
+		dbmail_message_cache_bodystructure(self);
+	}
+
+	if (self->store_failed)
+		t = DM_EQUERY;
+
+	g_hash_table_destroy(self->store_headers);
+	self->store_headers = NULL;
+	self->store_c = NULL;
+
+	return t;
+}
+
 static void insert_physmessage(DbmailMessage *self, Connection_T c)
 {
 	ResultSet_T r = NULL;
@@ -1200,6 +1860,8 @@ static void insert_physmessage(DbmailMessage *self, Connection_T c)
 	volatile uint64_t id = 0;
 	struct timeval tv;
 	struct tm gmt;
+	uint64_t size    = (uint64_t)dbmail_message_get_size(self, FALSE);
+	uint64_t rfcsize = (uint64_t)dbmail_message_get_size(self, TRUE);
 
 	/* get the messages date, but override it if it's from the future */
 	gettimeofday(&tv, NULL);
@@ -1214,18 +1876,22 @@ static void insert_physmessage(DbmailMessage *self, Connection_T c)
 		char2date_str(internal_date, &to_date_str);
 		g_free(internal_date);
 		if (db_params.db_driver == DM_DRIVER_ORACLE) 
-			db_exec(c, "INSERT INTO %sphysmessage (internal_date) VALUES (%s) %s",
-					DBPFX, &to_date_str, frag);
+			db_exec(c, "INSERT INTO %sphysmessage (internal_date, messagesize, rfcsize) "
+					"VALUES (%s, %" PRIu64 ", %" PRIu64 ") %s",
+					DBPFX, &to_date_str, size, rfcsize, frag);
 		else 
-			r = db_query(c, "INSERT INTO %sphysmessage (internal_date) VALUES (%s) %s",
-					DBPFX, &to_date_str, frag);
+			r = db_query(c, "INSERT INTO %sphysmessage (internal_date, messagesize, rfcsize) "
+					"VALUES (%s, %" PRIu64 ", %" PRIu64 ") %s",
+					DBPFX, &to_date_str, size, rfcsize, frag);
 	} else {
 		if (db_params.db_driver == DM_DRIVER_ORACLE) 
-			db_exec(c, "INSERT INTO %sphysmessage (internal_date) VALUES (%s) %s",
-					DBPFX, db_get_sql(SQL_CURRENT_TIMESTAMP), frag);
+			db_exec(c, "INSERT INTO %sphysmessage (internal_date, messagesize, rfcsize) "
+					"VALUES (%s, %" PRIu64 ", %" PRIu64 ") %s",
+					DBPFX, db_get_sql(SQL_CURRENT_TIMESTAMP), size, rfcsize, frag);
 		else
-			r = db_query(c, "INSERT INTO %sphysmessage (internal_date) VALUES (%s) %s",
-					DBPFX, db_get_sql(SQL_CURRENT_TIMESTAMP), frag);
+			r = db_query(c, "INSERT INTO %sphysmessage (internal_date, messagesize, rfcsize) "
+					"VALUES (%s, %" PRIu64 ", %" PRIu64 ") %s",
+					DBPFX, db_get_sql(SQL_CURRENT_TIMESTAMP), size, rfcsize, frag);
 	}
 
 	g_free(frag);	
@@ -1251,6 +1917,7 @@ int _message_insert(DbmailMessage *self,
 	uint64_t mailboxid;
 	char *frag = NULL;
 	Connection_T c; ResultSet_T r;
+	MailboxCounters_T counters;
 	volatile int t = 0;
 
 	assert(unique_id);
@@ -1293,6 +1960,12 @@ int _message_insert(DbmailMessage *self,
 		}
 		TRACE(TRACE_DEBUG,"new message_idnr [%" PRIu64 "]", self->msg_idnr);
 
+		/* not visible until _update_message, but the uid is taken */
+		memset(&counters, 0, sizeof(counters));
+		counters.mailbox_idnr = mailboxid;
+		counters.uidnext = self->msg_idnr + 1;
+		db_mailbox_counters_delta(c, &counters);
+
 		t = DM_SUCCESS;
 		db_commit_transaction(c);
 	CATCH(SQLException)
@@ -1332,12 +2005,12 @@ void _message_cache_envelope_date(const DbmailMessage *self)
 
 	_header_name_get_id(self, "Date", &headername_id);
 	if (headername_id)
-		_header_value_get_id(value, sortfield, datefield, &headervalue_id);
+		_header_value_get_id(self, value, sortfield, datefield, &headervalue_id);
 
 	g_free(value);
 
 	if (headervalue_id && headername_id)
-		_header_insert(self->id, headername_id, headervalue_id);
+		_header_insert(self, headername_id, headervalue_id);
 }
 
 int dbmail_message_cache_headers(const DbmailMessage *self)
@@ -1427,10 +2100,10 @@ static int _header_name_get_id(const DbmailMessage *self, const char *header, ui
 	case_header = g_strdup_printf(db_get_sql(SQL_STRCASE),"headername");
 	tmp = g_new0(uint64_t,1);
 
-	c = db_con_get();
+	c = store_con_get(self);
 
 	TRY
-		db_begin_transaction(c);
+		store_begin(self, c);
 		*tmp = 0;
 		s = db_stmt_prepare(c, "SELECT id FROM %sheadername WHERE %s=?", DBPFX, case_header);
 		db_stmt_set_str(s,1,safe_header);
@@ -1460,14 +2133,14 @@ static int _header_name_get_id(const DbmailMessage *self, const char *header, ui
 			}
 		}
 		t = TRUE;
-		db_commit_transaction(c);
+		store_commit(self, c);
 
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		db_rollback_transaction(c);
+		store_rollback(self, c);
 		t = DM_EQUERY;
 	FINALLY
-		db_con_close(c);
+		store_con_close(self, c);
 	END_TRY;
 
 	g_free(case_header);
@@ -1546,7 +2219,7 @@ static uint64_t _header_value_insert(Connection_T c, const char *value, const ch
 	return id;
 }
 
-static int _header_value_get_id(const char *value, const char *sortfield, const char *datefield, uint64_t *id)
+static int _header_value_get_id(const DbmailMessage *self, const char *value, const char *sortfield, const char *datefield, uint64_t *id)
 {
 	uint64_t tmp = 0;
 	char hash[FIELDSIZE];
@@ -1556,45 +2229,56 @@ static int _header_value_get_id(const char *value, const char *sortfield, const
 	if (dm_get_hash_for_string(value, hash))
 		return FALSE;
 
-	c = db_con_get();
+	c = store_con_get(self);
 	TRY
-		db_begin_transaction(c);
+		store_begin(self, c);
 		if ((tmp = _header_value_exists(c, value, (const char *)hash)) != 0)
 			*id = tmp;
 		else if ((tmp = _header_value_insert(c, value, sortfield, datefield, (const char *)hash)) != 0)
 			*id = tmp;
-		db_commit_transaction(c);
+		store_commit(self, c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		db_rollback_transaction(c);
+		store_rollback(self, c);
 		*id = 0;
 	FINALLY
-		db_con_close(c);
+		store_con_close(self, c);
 	END_TRY;
 
 	return TRUE;
 }
 
-static gboolean _header_insert(uint64_t physmessage_id, uint64_t headername_id, uint64_t headervalue_id)
+static gboolean _header_insert(const DbmailMessage *self, uint64_t headername_id, uint64_t headervalue_id)
 {
 
 	Connection_T c; PreparedStatement_T s; volatile gboolean t = TRUE;
 
-	c = db_con_get();
+	/* a header repeated with the same value is linked once; in the
+	 * caller's transaction the duplicate key would abort it */
+	if (self->store_c) {
+		gchar *row = g_strdup_printf("%" PRIu64 ":%" PRIu64, headername_id, headervalue_id);
+		if (g_hash_table_lookup(self->store_headers, row)) {
+			g_free(row);
+			return TRUE;
+		}
+		g_hash_table_insert(self->store_headers, row, row);
+	}
+
+	c = store_con_get(self);
 	db_con_clear(c);
 	TRY
-		db_begin_transaction(c);
+		store_begin(self, c);
 		s = db_stmt_prepare(c, "INSERT INTO %sheader (physmessage_id, headername_id, headervalue_id) VALUES (?,?,?)", DBPFX);
-		db_stmt_set_u64(s, 1, physmessage_id);
+		db_stmt_set_u64(s, 1, self->id);
 		db_stmt_set_u64(s, 2, headername_id);
 		db_stmt_set_u64(s, 3, headervalue_id);
 		db_stmt_exec(s);
-		db_commit_transaction(c);
+		store_commit(self, c);
 	CATCH(SQLException)
-		db_rollback_transaction(c);
+		store_rollback(self, c);
 		t = FALSE;
 	FINALLY
-		db_con_close(c);
+		store_con_close(self, c);
 	END_TRY;
 	
 	return t;
@@ -1654,6 +2338,50 @@ static GString * _header_addresses(InternetAddressList *ialist)
 	return store;
 }
 
+static gboolean _header_is_address(const char *header)
+{
+	const char *fields[] = { "From", "To", "Reply-to", "Cc", "Bcc", "Return-path", NULL };
+	int i;
+	for (i = 0; fields[i]; i++) {
+		if (g_ascii_strcasecmp(header, fields[i]) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * the values of a header, in message order, decoded the same
+ * way _header_cache stores them in the headervalue table
+ */
+GList * dbmail_message_get_header_decoded(const DbmailMessage *self, const char *header)
+{
+	GList *raw, *l, *values = NULL;
+	const char *charset = dbmail_message_get_charset(self);
+	gboolean isaddr = _header_is_address(header);
+
+	raw = dbmail_message_get_header_repeated(self, header);
+	for (l = raw; l; l = g_list_next(l)) {
+		char *value = dbmail_iconv_decode_field((const char *)l->data, charset, isaddr);
+		if ((! value) || (strlen(value) == 0)) {
+			g_free(value);
+			continue;
+		}
+		if (isaddr) {
+			InternetAddressList *emaillist;
+			if ((emaillist = internet_address_list_parse_string(value))) {
+				GString *store = _header_addresses(emaillist);
+				g_object_unref(emaillist);
+				g_free(value);
+				value = g_string_free(store, FALSE);
+			}
+		}
+		values = g_list_append(values, value);
+	}
+	g_list_free(raw);
+
+	return values;
+}
+
 static void _header_cache(const char *header, const char *raw, gpointer user_data)
 {
 	uint64_t headername_id = 0;
@@ -1681,17 +2409,7 @@ static void _header_cache(const char *header, const char *raw, gpointer user_dat
 	if (! headername_id)
 		return;
 
-	if (g_ascii_strcasecmp(header,"From")==0)
-		isaddr=1;
-	else if (g_ascii_strcasecmp(header,"To")==0)
-		isaddr=1;
-	else if (g_ascii_strcasecmp(header,"Reply-to")==0)
-		isaddr=1;
-	else if (g_ascii_strcasecmp(header,"Cc")==0)
-		isaddr=1;
-	else if (g_ascii_strcasecmp(header,"Bcc")==0)
-		isaddr=1;
-	else if (g_ascii_strcasecmp(header,"Return-path")==0)
+	if (_header_is_address(header))
 		isaddr=1;
 	else if (g_ascii_strcasecmp(header,"Subject")==0)
 		issubject=1;
@@ -1766,13 +2484,13 @@ static void _header_cache(const char *header, const char *raw, gpointer user_dat
 		g_utf8_strncpy(sortfield, value, CACHE_WIDTH-1);
 
 	/* Fetch header value id if exists, else insert, and return new id */
-	_header_value_get_id(value, sortfield, datefield, &headervalue_id);
+	_header_value_get_id(self, value, sortfield, datefield, &headervalue_id);
 
 	g_free(value);
 
 	/* Insert relation between physmessage, header name and header value */
 	if (headervalue_id)
-		_header_insert(self->id, headername_id, headervalue_id);
+		_header_insert(self, headername_id, headervalue_id);
 	else
 		TRACE(TRACE_INFO, "error inserting headervalue. skipping.");
 
@@ -1782,7 +2500,7 @@ static void _header_cache(const char *header, const char *raw, gpointer user_dat
 	date=0;
 }
 
-static void insert_field_cache(uint64_t physid, const char *field, const char *value)
+static void insert_field_cache(const DbmailMessage *self, const char *field, const char *value)
 {
 	gchar *clean_value;
 	Connection_T c; PreparedStatement_T s;
@@ -1792,20 +2510,20 @@ static void insert_field_cache(uint64_t physid, const char *field, const char *v
 	/* field values are truncated to 255 bytes */
 	clean_value = g_strndup(value,CACHE_WIDTH);
 
-	c = db_con_get();
+	c = store_con_get(self);
 	TRY
-		db_begin_transaction(c);
+		store_begin(self, c);
 		s = db_stmt_prepare(c,"INSERT INTO %s%sfield (physmessage_id, %sfield) VALUES (?,?)", DBPFX, field, field);
-		db_stmt_set_u64(s, 1, physid);
+		db_stmt_set_u64(s, 1, self->id);
 		db_stmt_set_str(s, 2, clean_value);
 		db_stmt_exec(s);
-		db_commit_transaction(c);
+		store_commit(self, c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		db_rollback_transaction(c);
+		store_rollback(self, c);
 		TRACE(TRACE_ERR, "insert %sfield failed [%s]", field, value);
 	FINALLY
-		db_con_close(c);
+		store_con_close(self, c);
 	END_TRY;
 	g_free(clean_value);
 }
@@ -1840,7 +2558,7 @@ void dbmail_message_cache_referencesfield(const DbmailMessage *self)
 	
 	while (refs->msgid) {
 		if (! g_tree_lookup(tree,refs->msgid)) {
-			insert_field_cache(self->id, "references", refs->msgid);
+			insert_field_cache(self, "references", refs->msgid);
 			g_tree_insert(tree,refs->msgid,refs->msgid);
 		}
 		if (refs->next == NULL)
@@ -1859,26 +2577,62 @@ void dbmail_message_cache_envelope(const DbmailMessage *self)
 
 	envelope = imap_get_envelope(GMIME_MESSAGE(self->content));
 
-	c = db_con_get();
+	c = store_con_get(self);
 	TRY
-		db_begin_transaction(c);
+		store_begin(self, c);
 		s = db_stmt_prepare(c, "INSERT INTO %senvelope (physmessage_id, envelope) VALUES (?,?)", DBPFX);
 		db_stmt_set_u64(s, 1, self->id);
 		db_stmt_set_str(s, 2, envelope);
 		db_stmt_exec(s);
-		db_commit_transaction(c);
+		store_commit(self, c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		db_rollback_transaction(c);
+		store_rollback(self, c);
 		TRACE(TRACE_ERR, "insert envelope failed [%s]", envelope);
 	FINALLY
-		db_con_close(c);
+		store_con_close(self, c);
 	END_TRY;
 
 	g_free(envelope);
 	envelope = NULL;
 }
 
+void dbmail_message_cache_bodystructure(const DbmailMessage *self)
+{
+	char *structure = NULL, *body = NULL;
+	Connection_T c; PreparedStatement_T s;
+
+	structure = imap_get_structure(GMIME_MESSAGE(self->content), 1);
+	body = imap_get_structure(GMIME_MESSAGE(self->content), 0);
+
+	if (! (structure && body)) {
+		TRACE(TRACE_WARNING, "unable to determine body structure for [%" PRIu64 "]", self->id);
+		g_free(structure);
+		g_free(body);
+		return;
+	}
+
+	c = store_con_get(self);
+	TRY
+		store_begin(self, c);
+		s = db_stmt_prepare(c, "INSERT INTO %sbodystructure (physmessage_id, bodystructure, body) VALUES (?,?,?)", DBPFX);
+		db_stmt_set_u64(s, 1, self->id);
+		db_stmt_set_str(s, 2, structure);
+		db_stmt_set_str(s, 3, body);
+		db_stmt_exec(s);
+		store_commit(self, c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		store_rollback(self, c);
+		TRACE(TRACE_ERR, "insert bodystructure failed [%s]", structure);
+	FINALLY
+		store_con_close(self, c);
+	END_TRY;
+
+	g_free(structure);
+	g_free(body);
+}
+
 // 
 // construct a new message where only sender, recipient, subject and 
 // a body are known. The body can be any kind of charset. Make sure
@@ -2030,57 +2784,93 @@ static int get_mailbox_from_filters(DbmailMessage *message, uint64_t useridnr, c
 	return t;
 }
 
-/* Figure out where to deliver the message, then deliver it.
- * */
-dsn_class_t sort_and_deliver(DbmailMessage *message,
+/* Work out the mailbox a message for useridnr should go to when
+ * no Sieve script is involved: filters, INBOX, or the subaddress.
+ * Returns a newly allocated subaddress in *subaddress if one was used.
+ */
+static const char * sort_target_mailbox(DbmailMessage *message,
 		const char *destination, uint64_t useridnr,
-		const char *mailbox, mailbox_source source)
+		const char *mailbox, mailbox_source *source,
+		char *into, size_t intolen, char **subaddress)
 {
-	int cancelkeep = 0;
-	int reject = 0;
-	dsn_class_t ret;
 	Field_T val;
-	char *subaddress = NULL;
-	char into[1024];
 
-	/* Catch the brute force delivery right away.
-	 * We skip the Sieve scripts, and down the call
-	 * chain we don't check permissions on the mailbox. */
-	if (source == BOX_BRUTEFORCE) {
-		TRACE(TRACE_NOTICE, "Beginning brute force delivery for user [%" PRIu64 "] to mailbox [%s].",
-				useridnr, mailbox);
-		return sort_deliver_to_mailbox(message, useridnr, mailbox, source, NULL, NULL);
-	}
+	*subaddress = NULL;
 
 	/* This is the only condition when called from pipe.c, actually. */
 	if (! mailbox) {
-		memset(into,0,sizeof(into));
+		memset(into,0,intolen);
 
-		if (! (get_mailbox_from_filters(message, useridnr, mailbox, into, sizeof(into)-1))) {				
+		if (! (get_mailbox_from_filters(message, useridnr, mailbox, into, intolen-1))) {
 			mailbox = "INBOX";
-			source = BOX_DEFAULT;
+			*source = BOX_DEFAULT;
 		} else {
 			mailbox = into;
 		}
 	}
 
 	TRACE(TRACE_INFO, "Destination [%s] useridnr [%" PRIu64 "], mailbox [%s], source [%d]",
-			destination, useridnr, mailbox, source);
+			destination, useridnr, mailbox, *source);
 	
 	/* Subaddress. */
 	config_get_value("SUBADDRESS", "DELIVERY", val);
 	if (strcasecmp(val, "yes") == 0) {
 		int res;
 		size_t sublen, subpos;
-		res = find_bounded((char *)destination, '+', '@', &subaddress, &sublen, &subpos);
+		res = find_bounded((char *)destination, '+', '@', subaddress, &sublen, &subpos);
 		if (res > 0 && sublen > 0) {
-			/* We'll free this towards the end of the function. */
-			mailbox = subaddress;
-			source = BOX_ADDRESSPART;
+			mailbox = *subaddress;
+			*source = BOX_ADDRESSPART;
 			TRACE(TRACE_INFO, "Setting BOX_ADDRESSPART mailbox to [%s]", mailbox);
 		}
 	}
 
+	return mailbox;
+}
+
+/* Does delivery for useridnr need the per-recipient path
+ * (brute force or an active Sieve script)?
+ */
+static gboolean sort_needs_filtering(uint64_t useridnr, mailbox_source source)
+{
+	Field_T val;
+
+	if (source == BOX_BRUTEFORCE)
+		return TRUE;
+
+	config_get_value("SIEVE", "DELIVERY", val);
+	if (strcasecmp(val, "yes") == 0 && dm_sievescript_isactive(useridnr))
+		return TRUE;
+
+	return FALSE;
+}
+
+/* Figure out where to deliver the message, then deliver it.
+ * */
+dsn_class_t sort_and_deliver(DbmailMessage *message,
+		const char *destination, uint64_t useridnr,
+		const char *mailbox, mailbox_source source)
+{
+	int cancelkeep = 0;
+	int reject = 0;
+	dsn_class_t ret;
+	Field_T val;
+	char *subaddress = NULL;
+	char into[1024];
+
+	/* Catch the brute force delivery right away.
+	 * We skip the Sieve scripts, and down the call
+	 * chain we don't check permissions on the mailbox. */
+	if (source == BOX_BRUTEFORCE) {
+		TRACE(TRACE_NOTICE, "Beginning brute force delivery for user [%" PRIu64 "] to mailbox [%s].",
+				useridnr, mailbox);
+		return sort_deliver_to_mailbox(message, useridnr, mailbox, source, NULL, NULL);
+	}
+
+	/* subaddress is freed towards the end of the function. */
+	mailbox = sort_target_mailbox(message, destination, useridnr, mailbox,
+			&source, into, sizeof(into), &subaddress);
+
 	/* Give Sieve access to the envelope recipient. */
 	dbmail_message_set_envelope_recipient(message, destination);
 
@@ -2131,15 +2921,19 @@ dsn_class_t sort_and_deliver(DbmailMessage *message,
 	return ret;
 }
 
-dsn_class_t sort_deliver_to_mailbox(DbmailMessage *message,
+/* Find or create the target mailbox and check that we may post to it,
+ * falling back to INBOX. *mboxidnr is left at 0 when the message
+ * is a suppressed duplicate.
+ */
+static dsn_class_t sort_check_mailbox(DbmailMessage *message,
 		uint64_t useridnr, const char *mailbox, mailbox_source source,
-		int *msgflags, GList *keywords)
+		uint64_t *mboxidnr)
 {
-	uint64_t mboxidnr = 0, newmsgidnr = 0;
 	Field_T val;
-	size_t msgsize = (uint64_t)dbmail_message_get_size(message, FALSE);
 
-	if (db_find_create_mailbox(mailbox, source, useridnr, &mboxidnr) != 0) {
+	*mboxidnr = 0;
+
+	if (db_find_create_mailbox(mailbox, source, useridnr, mboxidnr) != 0) {
 		TRACE(TRACE_ERR, "mailbox [%s] not found", mailbox);
 		return DSN_CLASS_FAIL;
 	}
@@ -2156,7 +2950,7 @@ dsn_class_t sort_deliver_to_mailbox(DbmailMessage *message,
         
 		// don't load the full mailbox state
 		MailboxState_T S = MailboxState_new(NULL, 0);
-		MailboxState_setId(S, mboxidnr);
+		MailboxState_setId(S, *mboxidnr);
 		permission = acl_has_right(S, useridnr, ACL_RIGHT_POST);
 		MailboxState_free(&S);
 		
@@ -2175,7 +2969,7 @@ dsn_class_t sort_deliver_to_mailbox(DbmailMessage *message,
 				TRACE(TRACE_NOTICE, "already tried to deliver to INBOX");
 				return DSN_CLASS_FAIL;
 			}
-			return sort_deliver_to_mailbox(message, useridnr, "INBOX", BOX_DEFAULT, msgflags, keywords);
+			return sort_check_mailbox(message, useridnr, "INBOX", BOX_DEFAULT, mboxidnr);
 		case 1:
 			// Has right.
 			TRACE(TRACE_INFO, "user [%" PRIu64 "] has right to deliver mail to [%s]",
@@ -2191,14 +2985,61 @@ dsn_class_t sort_deliver_to_mailbox(DbmailMessage *message,
 	GETCONFIGVALUE("suppress_duplicates", "DELIVERY", val);
 	if (strcasecmp(val,"yes")==0) {
 		const char *messageid = dbmail_message_get_header(message, "message-id");
-		if ( messageid && ((db_mailbox_has_message_id(mboxidnr, messageid)) > 0) ) {
+		if ( messageid && ((db_mailbox_has_message_id(*mboxidnr, messageid)) > 0) ) {
 			TRACE(TRACE_INFO, "suppress_duplicate: [%s]", messageid);
-			return DSN_CLASS_OK;
+			*mboxidnr = 0;
 		}
 	}
 
+	return DSN_CLASS_OK;
+}
+
+dsn_class_t sort_deliver_to_mailbox(DbmailMessage *message,
+		uint64_t useridnr, const char *mailbox, mailbox_source source,
+		int *msgflags, GList *keywords)
+{
+	Connection_T c;
+	MailboxCounters_T counters;
+	uint64_t mboxidnr = 0, newmsgidnr = 0, seq;
+	volatile int result = DM_EQUERY;
+	dsn_class_t ret;
+	size_t msgsize = (uint64_t)dbmail_message_get_size(message, FALSE);
+
+	if ((ret = sort_check_mailbox(message, useridnr, mailbox, source, &mboxidnr)) != DSN_CLASS_OK)
+		return ret;
+	if (! mboxidnr)
+		return DSN_CLASS_OK;
+
 	// Ok, we have the ACL right, time to deliver the message.
-	switch (db_copymsg(message->msg_idnr, mboxidnr, useridnr, &newmsgidnr, TRUE)) {
+	// The copy, its initial flags and their modseq are committed together.
+	memset(&counters, 0, sizeof(counters));
+	counters.mailbox_idnr = mboxidnr;
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		seq = db_mailbox_seq_update_c(c, mboxidnr, 0);
+		result = db_copymsg_c(c, message->msg_idnr, mboxidnr, useridnr, &newmsgidnr, TRUE, seq, &counters);
+		if (result == DM_EGENERAL && (msgflags || keywords)) {
+			TRACE(TRACE_NOTICE, "message id=%" PRIu64 ", setting imap flags", 
+				newmsgidnr);
+			if (db_set_msgflag_c(c, newmsgidnr, msgflags, keywords, IMAPFA_ADD, 0, NULL, &counters) < 0)
+				result = DM_EQUERY;
+		}
+		if (result == DM_EGENERAL && ! db_mailbox_counters_delta(c, &counters))
+			result = DM_EQUERY;
+		if (result == DM_EGENERAL)
+			db_commit_transaction(c);
+		else
+			db_rollback_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		result = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	switch (result) {
 	case -2:
 		TRACE(TRACE_ERR, "error copying message to user [%" PRIu64 "],"
 				"maxmail exceeded", useridnr);
@@ -2210,13 +3051,6 @@ dsn_class_t sort_deliver_to_mailbox(DbmailMessage *message,
 	default:
 		TRACE(TRACE_NOTICE, "useridnr [%" PRIu64 "] mailbox [%" PRIu64 "] message [%" PRIu64 "] size [%zd] is inserted", 
 				useridnr, mboxidnr, newmsgidnr, msgsize);
-		if (msgflags || keywords) {
-			TRACE(TRACE_NOTICE, "message id=%" PRIu64 ", setting imap flags", 
-				newmsgidnr);
-
-			if (db_set_msgflag(newmsgidnr, msgflags, keywords, IMAPFA_ADD, 0, NULL))
-				db_mailbox_seq_update(mboxidnr, newmsgidnr);
-		}
 		message->msg_idnr = newmsgidnr;
 		return DSN_CLASS_OK;
 	}
@@ -2685,12 +3519,42 @@ int send_forward_list(DbmailMessage *message, GList *targets, const char *from)
  *   - -1 on full failure
  */
 
+typedef struct {
+	int ok, temp, fail, fail_quota;
+} DeliveryCount_T;
+
+static void deliver_count(DeliveryCount_T *count, dsn_class_t class, uint64_t useridnr)
+{
+	switch (class) {
+	case DSN_CLASS_OK:
+		TRACE(TRACE_INFO, "successful delivery for useridnr [%" PRIu64 "]", useridnr);
+		count->ok = 1;
+		break;
+	case DSN_CLASS_FAIL:
+		TRACE(TRACE_ERR, "permanent failure delivering for useridnr [%" PRIu64 "]", useridnr);
+		count->fail = 1;
+		break;
+	case DSN_CLASS_QUOTA:
+		TRACE(TRACE_NOTICE, "mailbox over quota, message rejected for useridnr [%" PRIu64 "]", useridnr);
+		count->fail_quota = 1;
+		break;
+	case DSN_CLASS_TEMP:
+	default:
+		TRACE(TRACE_ERR, "unknown temporary failure delivering for useridnr [%" PRIu64 "]", useridnr);
+		count->temp = 1;
+		break;
+	}
+}
+
 int insert_messages(DbmailMessage *message, List_T dsnusers)
 {
 	uint64_t tmpid;
+	List_T d;
+	GList *targets = NULL, *counts = NULL;
+	GTree *batched;
 	int result=0;
 	Field_T val;
-	gboolean quota_softfail = FALSE;
+	gboolean quota_softfail = FALSE, suppress = FALSE;
 
  	delivery_status_t final_dsn;
 
@@ -2710,59 +3574,123 @@ int insert_messages(DbmailMessage *message, List_T dsnusers)
 		TRACE(TRACE_INFO, "Using default hard bounce for quota failure");
 
 
+	/* sort_check_mailbox only sees committed messages; copies
+	 * batched for the same mailbox must be suppressed here */
+	config_get_value("suppress_duplicates", "DELIVERY", val);
+	if (SMATCH(val, "yes") && dbmail_message_get_header(message, "message-id"))
+		suppress = TRUE;
+	batched = g_tree_new((GCompareFunc)ucmp);
+
 	tmpid = message->msg_idnr; // for later removal
 
 	// TODO: Run a Sieve script associated with the internal delivery user.
 	// Code would go here, after we've stored the message 
 	// before we've started delivering it
 
-	/* Loop through the users list. */
-	dsnusers = p_list_first(dsnusers);
-	while (dsnusers) {
-		
+	/* First pass: recipients without Sieve or brute force delivery only
+	 * need a mailbox resolved; collect those and link the message into
+	 * all of them in a single transaction. The others are sorted and
+	 * delivered one by one, as before. */
+	for (d = p_list_first(dsnusers); d; d = p_list_next(d)) {
 		GList *userids;
+		Delivery_T *delivery = (Delivery_T *)p_list_data(d);
+		DeliveryCount_T *count = g_new0(DeliveryCount_T, 1);
+
+		counts = g_list_append(counts, count);
 
-		int ok = 0, temp = 0, fail = 0, fail_quota = 0;
-		
-		Delivery_T *delivery = (Delivery_T *)p_list_data(dsnusers);
-		
 		/* Each user may have a list of user_idnr's for local
 		 * delivery. */
-		userids = g_list_first(delivery->userids);
-		while (userids) {
+		for (userids = g_list_first(delivery->userids); userids; userids = g_list_next(userids)) {
 			uint64_t *useridnr = (uint64_t *) userids->data;
+			mailbox_source source = delivery->source;
+			const char *mailbox;
+			char *subaddress = NULL;
+			char into[1024];
+			uint64_t mboxidnr = 0;
+			dsn_class_t class;
+
+			if (sort_needs_filtering(*useridnr, source)) {
+				TRACE(TRACE_DEBUG, "calling sort_and_deliver for useridnr [%" PRIu64 "]", *useridnr);
+				class = sort_and_deliver(message, delivery->address, *useridnr, delivery->mailbox, source);
+				deliver_count(count, class, *useridnr);
+				if (execute_auto_ran(message, *useridnr) < 0)
+					TRACE(TRACE_ERR, "error in execute_auto_ran(), but continuing delivery normally.");
+				continue;
+			}
 
-			TRACE(TRACE_DEBUG, "calling sort_and_deliver for useridnr [%" PRIu64 "]", *useridnr);
-			switch (sort_and_deliver(message, delivery->address, *useridnr, delivery->mailbox, delivery->source)) {
-			case DSN_CLASS_OK:
-				TRACE(TRACE_INFO, "successful sort_and_deliver for useridnr [%" PRIu64 "]", *useridnr);
-				ok = 1;
-				break;
-			case DSN_CLASS_FAIL:
-				TRACE(TRACE_ERR, "permanent failure sort_and_deliver for useridnr [%" PRIu64 "]", *useridnr);
-				fail = 1;
+			mailbox = sort_target_mailbox(message, delivery->address, *useridnr,
+					delivery->mailbox, &source, into, sizeof(into), &subaddress);
+			dbmail_message_set_envelope_recipient(message, delivery->address);
+			class = sort_check_mailbox(message, *useridnr, mailbox, source, &mboxidnr);
+			g_free(subaddress);
+
+			if (class == DSN_CLASS_OK && mboxidnr && suppress && g_tree_lookup(batched, &mboxidnr)) {
+				TRACE(TRACE_INFO, "suppress_duplicate: mailbox [%" PRIu64 "] already in this delivery", mboxidnr);
+				mboxidnr = 0;
+			}
+
+			if (class == DSN_CLASS_OK && mboxidnr) {
+				DeliveryTarget_T *target = g_new0(DeliveryTarget_T, 1);
+				target->useridnr = *useridnr;
+				target->mailbox_idnr = mboxidnr;
+				target->data = count;
+				targets = g_list_append(targets, target);
+				g_tree_insert(batched, &target->mailbox_idnr, target);
+				continue;
+			}
+
+			deliver_count(count, class, *useridnr);
+			if (execute_auto_ran(message, *useridnr) < 0)
+				TRACE(TRACE_ERR, "error in execute_auto_ran(), but continuing delivery normally.");
+		}
+	}
+
+	g_tree_destroy(batched);
+
+	/* Second pass: one set-based insert for the collected mailboxes,
+	 * then fold the per-recipient results back into their delivery. */
+	if (targets) {
+		GList *t;
+		uint64_t msgsize = (uint64_t)dbmail_message_get_size(message, FALSE);
+
+		db_copymsg_batch(dbmail_message_get_physid(message), msgsize, targets);
+
+		for (t = g_list_first(targets); t; t = g_list_next(t)) {
+			DeliveryTarget_T *target = (DeliveryTarget_T *)t->data;
+			dsn_class_t class;
+			switch (target->result) {
+			case DM_SUCCESS:
+				TRACE(TRACE_NOTICE, "useridnr [%" PRIu64 "] mailbox [%" PRIu64 "] size [%" PRIu64 "] is inserted",
+						target->useridnr, target->mailbox_idnr, msgsize);
+				class = DSN_CLASS_OK;
 				break;
-			case DSN_CLASS_QUOTA:
-				TRACE(TRACE_NOTICE, "mailbox over quota, message rejected for useridnr [%" PRIu64 "]", *useridnr);
-				fail_quota = 1;
+			case -2:
+				TRACE(TRACE_ERR, "error copying message to user [%" PRIu64 "],"
+						"maxmail exceeded", target->useridnr);
+				class = DSN_CLASS_QUOTA;
 				break;
-			case DSN_CLASS_TEMP:
 			default:
-				TRACE(TRACE_ERR, "unknown temporary failure in sort_and_deliver for useridnr [%" PRIu64 "]", *useridnr);
-				temp = 1;
+				TRACE(TRACE_ERR, "error copying message to user [%" PRIu64 "]", target->useridnr);
+				class = DSN_CLASS_TEMP;
 				break;
 			}
+			deliver_count((DeliveryCount_T *)target->data, class, target->useridnr);
 
 			/* Automatic reply and notification */
-			if (execute_auto_ran(message, *useridnr) < 0) {
+			if (execute_auto_ran(message, target->useridnr) < 0)
 				TRACE(TRACE_ERR, "error in execute_auto_ran(), but continuing delivery normally.");
-			}   
-
-			if (! g_list_next(userids))
-				break;
-			userids = g_list_next(userids);
-
 		}
+		g_list_destroy(targets);
+	}
+
+	/* Loop through the users list. */
+	dsnusers = p_list_first(dsnusers);
+	counts = g_list_first(counts);
+	while (dsnusers) {
+		
+		Delivery_T *delivery = (Delivery_T *)p_list_data(dsnusers);
+		DeliveryCount_T *count = (DeliveryCount_T *)counts->data;
+		int ok = count->ok, temp = count->temp, fail = count->fail, fail_quota = count->fail_quota;
 
 		final_dsn.class = dsnuser_worstcase_int(ok, temp, fail, fail_quota);
 		switch (final_dsn.class) {
@@ -2817,8 +3745,10 @@ int insert_messages(DbmailMessage *message, List_T dsnusers)
 		if (! p_list_next(dsnusers))
 			break;
 		dsnusers = p_list_next(dsnusers);
+		counts = g_list_next(counts);
 
 	}
+	g_list_destroy(g_list_first(counts));
 
 	/* Always delete the temporary message, even if the delivery failed.
 	 * It is the MTA's job to requeue or bounce the message,
@@ -45,6 +45,7 @@
 
 DbmailMessage * dbmail_message_new(Mempool_T);
 DbmailMessage * dbmail_message_init_with_string(DbmailMessage *self, const char *content);
+DbmailMessage * dbmail_message_init_with_stream(DbmailMessage *self, GMimeStream *stream);
 DbmailMessage * dbmail_message_construct(DbmailMessage *self, 
 		const gchar *sender, const gchar *recipient, 
 		const gchar *subject, const gchar *body);
@@ -54,11 +55,21 @@ DbmailMessage * dbmail_message_construct(DbmailMessage *self,
  */
 
 int dbmail_message_store(DbmailMessage *message);
+int dbmail_message_store_physmessage_c(Connection_T c, DbmailMessage *message);
 int dbmail_message_cache_headers(const DbmailMessage *message);
 gboolean dm_message_store(DbmailMessage *m);
 
 DbmailMessage * dbmail_message_retrieve(DbmailMessage *self, uint64_t physid);
 
+/*
+ * stream a stored message in chunks, without parsing it
+ */
+typedef struct DbmailMessageStream DbmailMessageStream;
+
+DbmailMessageStream * dbmail_message_stream_new(uint64_t physid);
+int dbmail_message_stream_read(DbmailMessageStream *stream, GString *out, size_t max);
+void dbmail_message_stream_free(DbmailMessageStream *stream);
+
 /*
  * attribute accessors
  */
@@ -94,9 +105,11 @@ const gchar * dbmail_message_get_header(const DbmailMessage *self, const char *h
 
 /* Get all instances of a header. */
 GList * dbmail_message_get_header_repeated(const DbmailMessage *self, const char *header);
+GList * dbmail_message_get_header_decoded(const DbmailMessage *self, const char *header);
 
 void dbmail_message_cache_referencesfield(const DbmailMessage *self);
 void dbmail_message_cache_envelope(const DbmailMessage *self);
+void dbmail_message_cache_bodystructure(const DbmailMessage *self);
 
 /*
  * destructor
@@ -837,6 +837,37 @@ int check_date(const char *date)
 	return 1;
 }
 
+/*
+ * check_date_time()
+ *
+ * checks a date-time for IMAP validity:
+ * dd-MMM-yyyy hh:mm:ss +zzzz
+ * 01234567890123456789012345
+ */
+int check_date_time(const char *date_time)
+{
+	char date[STRLEN_MINDATA + 1];
+	int i;
+
+	if (strlen(date_time) != 26) return 0;
+
+	memset(date, 0, sizeof(date));
+	strncpy(date, date_time[0] == ' ' ? date_time + 1 : date_time,
+			date_time[0] == ' ' ? STRLEN_MINDATA - 1 : STRLEN_MINDATA);
+	if (! check_date(date)) return 0;
+
+	if (date_time[11] != ' ' || date_time[14] != ':' || date_time[17] != ':' || date_time[20] != ' ')
+		return 0;
+	if (date_time[21] != '+' && date_time[21] != '-')
+		return 0;
+	for (i = 12; i < 26; i++) {
+		if (i == 14 || i == 17 || i == 20 || i == 21) continue;
+		if (! isdigit(date_time[i])) return 0;
+	}
+
+	return 1;
+}
+
 /*
  * check_msg_set()
  *
@@ -904,6 +935,47 @@ char *date_sql2imap(const char *sqldate)
 }
 
 
+/*
+ * convert a mySQL date (yyyy-mm-dd hh:mm:ss) to seconds since the epoch.
+ * Like date_sql2imap() the date is taken to be UTC.
+ * NOTE: if date is not valid, 0 is returned
+ */
+time_t date_sql2time(const char *sqldate)
+{
+	struct tm tm_sql_date;
+	char *last;
+
+	memset(&tm_sql_date, 0, sizeof(struct tm));
+
+	last = strptime(sqldate,"%Y-%m-%d %H:%M:%S", &tm_sql_date);
+	if ( (last == NULL) || (*last != '\0') )
+		return 0;
+
+	return timegm(&tm_sql_date);
+}
+
+/*
+ * convert seconds since the epoch to a valid IMAP internal date
+ * NOTE: if date is not valid, IMAP_STANDARD_DATE is returned
+ */
+char *date_time2imap(time_t date)
+{
+	struct tm tm_date;
+	char _imapdate[IMAP_INTERNALDATE_LEN] = IMAP_STANDARD_DATE;
+	char q[IMAP_INTERNALDATE_LEN];
+
+	memset(&tm_date, 0, sizeof(struct tm));
+
+	if ((date <= 0) || (! gmtime_r(&date, &tm_date)))
+		return g_strdup(_imapdate);
+
+	strftime(q, sizeof(q), "%d-%b-%Y %H:%M:%S", &tm_date);
+	snprintf(_imapdate,IMAP_INTERNALDATE_LEN, "%s +0000", q);
+
+	return g_strdup(_imapdate);
+}
+
+
 /*
  * convert TO a mySQL date (yyyy-mm-dd) FROM a valid IMAP internal date:
  *                          0123456789
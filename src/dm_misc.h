@@ -135,11 +135,14 @@ int dm_valid_format(const char *str);
 
 
 char *date_sql2imap(const char *sqldate);
+time_t date_sql2time(const char *sqldate);
+char *date_time2imap(time_t date);
 int date_imap2sql(const char *imapdate, char *);
 
 int checkmailboxname(const char *s);
 int check_msg_set(const char *s);
 int check_date(const char *date);
+int check_date_time(const char *date_time);
 
 /**
  * \brief discards all input coming from instream
@@ -46,6 +46,10 @@ struct T {
 	ClientBase_T *ci;
 	void (*cb)(T);
 	char **parts;
+	char *token;            /* user:password awaiting validation */
+	gboolean authorized;
+	gboolean deferred;      /* finished by Request_auth_leave */
+	gboolean closed;        /* client went away meanwhile */
 };
 
 //--------------------------------------------------------------------------------------//
@@ -91,14 +95,73 @@ static gboolean Request_user_auth(T R, char *token)
 	return r;
 }
 
-static gboolean Request_basic_auth(T R)
+static void Request_realm(Field_T realm)
 {
-	const char *auth;
-	Field_T realm;
 	memset(realm,0,sizeof(Field_T));
 	config_get_value("realm", "HTTP", realm);
 	if (! strlen(realm))
 		strcpy(realm,"DBMail HTTP Access");
+}
+
+static void Request_dispatch(T R)
+{
+	Request_setContentType(R,"text/html; charset=utf-8");
+	R->cb(R);
+}
+
+static void Request_auth_closed(struct evhttp_connection *evcon UNUSED, void *arg)
+{
+	T R = (T)arg;
+	TRACE(TRACE_DEBUG, "[%p] connection closed during authentication", R->req);
+	R->closed = TRUE;
+}
+
+/* worker thread: password hashing must not stall the event loop */
+static void Request_auth_enter(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	T R = (T)D->data;
+
+	R->authorized = Request_user_auth(R, R->token);
+	dm_queue_notify(D);
+}
+
+/* event loop: answer the request */
+static void Request_auth_leave(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	T R = (T)D->data;
+	struct evhttp_connection *evcon;
+
+	if (R->closed) {
+		Request_free(&R);
+		return;
+	}
+
+	if ((evcon = evhttp_request_get_connection(R->req)))
+		evhttp_connection_set_closecb(evcon, NULL, NULL);
+
+	if (R->authorized) {
+		Request_dispatch(R);
+	} else {
+		Field_T realm;
+		Request_realm(realm);
+		TRACE(TRACE_DEBUG,"Authorization failed");
+		basic_unauth(R, realm);
+	}
+	Request_free(&R);
+}
+
+/*
+ * returns TRUE if the request may proceed right away. Anything
+ * but the admin account is verified on a worker thread; the
+ * request is then marked deferred and answered from there.
+ */
+static gboolean Request_basic_auth(T R)
+{
+	const char *auth;
+	Field_T realm;
+	Request_realm(realm);
 
 	// authenticate
 	if (! (auth = evhttp_find_header(R->req->input_headers, "Authorization"))) {
@@ -120,12 +183,13 @@ static gboolean Request_basic_auth(T R)
 		g_free(s);
 		TRACE(TRACE_DEBUG,"Authorization [%" PRIu64 "][%s] <-> [%s]", (uint64_t)len, safe, userpw);
 		if ((strlen(userpw) != strlen(safe)) || (strncmp(safe,(char *)userpw,strlen(userpw))!=0)) {
-			if (! Request_user_auth(R, safe)) {
-				TRACE(TRACE_DEBUG,"Authorization failed");
-				basic_unauth(R, realm);
-				g_free(safe);
-				return FALSE;
-			}
+			struct evhttp_connection *evcon;
+			R->token = safe;
+			R->deferred = TRUE;
+			if ((evcon = evhttp_request_get_connection(R->req)))
+				evhttp_connection_set_closecb(evcon, Request_auth_closed, R);
+			dm_thread_job_push(NULL, Request_auth_enter, Request_auth_leave, R);
+			return FALSE;
 		}
 		g_free(safe);
 	} else {
@@ -258,6 +322,98 @@ void Request_send(T R, int code, const char *message, struct evbuffer *buf)
 	evhttp_send_reply(R->req, code, message, buf);
 }
 
+/*
+ * chunked replies: pull is asked for the next chunk whenever the previous
+ * one has been written to the client, so only one chunk is held in memory
+ * per request. pull returns > 0 while more data follows, 0 at the end and
+ * < 0 on error, which drops the connection without ending the reply.
+ * done is called exactly once to release data.
+ */
+typedef struct {
+	struct evhttp_request *req;
+	Request_pull_t pull;
+	void (*done)(void *);
+	void *data;
+} RequestChunks_T;
+
+static void Request_chunks_free(RequestChunks_T *C)
+{
+	struct evhttp_connection *evcon = evhttp_request_get_connection(C->req);
+	if (evcon)
+		evhttp_connection_set_closecb(evcon, NULL, NULL);
+	C->done(C->data);
+	g_free(C);
+}
+
+static void Request_chunks_closed(struct evhttp_connection *evcon UNUSED, void *arg)
+{
+	RequestChunks_T *C = (RequestChunks_T *)arg;
+	TRACE(TRACE_DEBUG, "[%p] connection closed during chunked reply", C->req);
+	C->done(C->data);
+	g_free(C);
+}
+
+/* a reply that failed halfway must not look complete: drop the
+ * connection without the terminating chunk */
+static void Request_chunks_abort(RequestChunks_T *C)
+{
+	struct evhttp_connection *evcon = evhttp_request_get_connection(C->req);
+
+	TRACE(TRACE_ERR, "[%p] chunked reply aborted", C->req);
+	Request_chunks_free(C);
+	if (evcon)
+		evhttp_connection_free(evcon);
+}
+
+static void Request_chunks_next(struct evhttp_connection *evcon UNUSED, void *arg)
+{
+	RequestChunks_T *C = (RequestChunks_T *)arg;
+	struct evhttp_request *req;
+	struct evbuffer *buf = evbuffer_new();
+	int more = C->pull(buf, C->data);
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+	if (more > 0) {
+		evhttp_send_reply_chunk_with_cb(C->req, buf, Request_chunks_next, C);
+		evbuffer_free(buf);
+		return;
+	}
+#else
+	while (more > 0) {
+		evhttp_send_reply_chunk(C->req, buf);
+		more = C->pull(buf, C->data);
+	}
+#endif
+	if (more < 0) {
+		evbuffer_free(buf);
+		Request_chunks_abort(C);
+		return;
+	}
+
+	req = C->req;
+	if (evbuffer_get_length(buf))
+		evhttp_send_reply_chunk(req, buf);
+	evbuffer_free(buf);
+	Request_chunks_free(C);
+	evhttp_send_reply_end(req);
+}
+
+void Request_send_chunked(T R, int code, const char *message, Request_pull_t pull, void (*done)(void *), void *data)
+{
+	struct evhttp_connection *evcon;
+	RequestChunks_T *C = g_new0(RequestChunks_T, 1);
+	C->req = R->req;
+	C->pull = pull;
+	C->done = done;
+	C->data = data;
+
+	if ((evcon = evhttp_request_get_connection(R->req)))
+		evhttp_connection_set_closecb(evcon, Request_chunks_closed, C);
+
+	evhttp_send_reply_start(R->req, code, message);
+	Request_chunks_next(evcon, C);
+}
+
 void Request_error(T R, int code, const char *message)
 {
         char *fmt = "<HTML><HEAD>\n"
@@ -292,7 +448,9 @@ void Request_free(T *R)
 	g_strfreev(r->parts);
 	evhttp_clear_headers(r->GET);
 	evhttp_clear_headers(r->POST);
-	r = NULL;
+	g_free(r->token);
+	g_free(r);
+	*R = NULL;
 }
 
 /* routing setup */
@@ -308,9 +466,8 @@ void Request_handle(T R)
 	}
 
 	if (R->cb) {
-		if (! Request_basic_auth(R)) return;
-		Request_setContentType(R,"text/html; charset=utf-8");
-		R->cb(R);
+		if (Request_basic_auth(R))
+			Request_dispatch(R);
 	} else {
 		const char *host = evhttp_find_header(R->req->input_headers, "Host");
 		char *url = g_strdup_printf("http://%s%s", host?host:"","/users/");
@@ -326,7 +483,8 @@ void Request_cb(struct evhttp_request *req, void * data)
 {
 	Request_T R = Request_new(req, data);
 	Request_handle(R);
-	Request_free(&R);
+	if (! R->deferred)
+		Request_free(&R);
 }
 
 
@@ -26,9 +26,12 @@
 #define T Request_T
 typedef struct T *T;
 
+typedef int (*Request_pull_t)(struct evbuffer *, void *);
+
 extern T        Request_new(struct evhttp_request *, void *);
 extern void     Request_cb(struct evhttp_request *, void *);
 extern void     Request_send(T, int, const char *, struct evbuffer *);
+extern void     Request_send_chunked(T, int, const char *, Request_pull_t, void (*)(void *), void *);
 extern void     Request_error(T, int, const char *);
 extern void     Request_header(T, const char *, const char *);
 extern void     Request_setContentType(T, const char *);
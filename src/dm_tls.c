@@ -27,6 +27,12 @@
 
 #include "dbmail.h"
 #include <openssl/err.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
 
 #define THIS_MODULE "tls"
 
@@ -42,6 +48,12 @@ SSL_CTX *tls_init(void) {
 	/* configurable. */
 	
 	ctx = SSL_CTX_new(SSLv23_server_method());
+
+	/* ci_write retries from its write buffer, which may have
+	 * been reallocated in the mean time */
+	if (ctx)
+		SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
 	return ctx;
 }
 
@@ -99,6 +111,173 @@ void tls_load_ciphers(ServerConfig_T *conf) {
 	}
 }
 
+/*
+ * TLS session resumption
+ *
+ * Sessions are kept in OpenSSL's server-side session cache, which
+ * lives in the memory of each process: it is shared by the reactors
+ * of a process, but a client that reconnects to another process or
+ * host gets a full handshake when it resumes by session id.
+ *
+ * Stateless session tickets cover that case. Ticket keys are derived
+ * from a secret and the current rotation period, so every process
+ * that reads the same tls_ticket_keyfile encrypts and accepts the
+ * same tickets without any coordination. Tickets from the previous
+ * period are still accepted, and are renewed.
+ */
+
+#define TLS_TICKET_KEYLEN 32
+#define TLS_TICKET_ROTATION 43200
+
+static unsigned char tls_ticket_secret[SHA256_DIGEST_LENGTH];
+static int tls_ticket_rotation = TLS_TICKET_ROTATION;
+
+static void tls_ticket_derive(const char *label, uint64_t period, unsigned char *out)
+{
+	char info[64];
+	unsigned int len = 0;
+
+	snprintf(info, sizeof(info), "dbmail-%s-%" PRIu64, label, period);
+	HMAC(EVP_sha256(), tls_ticket_secret, sizeof(tls_ticket_secret),
+			(unsigned char *)info, strlen(info), out, &len);
+}
+
+/*
+ * the keys for a ticket at time now. When encrypting, key_name is
+ * filled in. Returns 1 for a current key, 2 for a key from the
+ * previous period that should be renewed, 0 for an unknown key.
+ */
+int tls_ticket_keys(unsigned char *key_name, int enc, time_t now,
+		unsigned char *aes, unsigned char *mac)
+{
+	unsigned char name[EVP_MAX_MD_SIZE];
+	uint64_t period = (uint64_t)now / tls_ticket_rotation;
+	int i;
+
+	if (enc) {
+		tls_ticket_derive("name", period, name);
+		tls_ticket_derive("aes", period, aes);
+		tls_ticket_derive("hmac", period, mac);
+		memcpy(key_name, name, 16);
+		return 1;
+	}
+
+	for (i = 0; i < 2; i++) {
+		tls_ticket_derive("name", period - i, name);
+		if (memcmp(key_name, name, 16))
+			continue;
+		tls_ticket_derive("aes", period - i, aes);
+		tls_ticket_derive("hmac", period - i, mac);
+		return i ? 2 : 1;
+	}
+
+	return 0;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int tls_ticket_cb(SSL UNUSED *ssl, unsigned char *key_name, unsigned char *iv,
+		EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc)
+{
+	unsigned char aes[EVP_MAX_MD_SIZE], mac[EVP_MAX_MD_SIZE];
+	OSSL_PARAM params[3];
+	int r;
+
+	if (enc && RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+		return -1;
+	if (! (r = tls_ticket_keys(key_name, enc, time(NULL), aes, mac)))
+		return 0; // unknown key; full handshake
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, mac, TLS_TICKET_KEYLEN);
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	if (! EVP_MAC_CTX_set_params(hctx, params))
+		return -1;
+
+	if (enc)
+		EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, aes, iv);
+	else
+		EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, aes, iv);
+
+	return r;
+}
+#else
+static int tls_ticket_cb(SSL UNUSED *ssl, unsigned char *key_name, unsigned char *iv,
+		EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+	unsigned char aes[EVP_MAX_MD_SIZE], mac[EVP_MAX_MD_SIZE];
+	int r;
+
+	if (enc && RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+		return -1;
+	if (! (r = tls_ticket_keys(key_name, enc, time(NULL), aes, mac)))
+		return 0; // unknown key; full handshake
+
+	HMAC_Init_ex(hctx, mac, TLS_TICKET_KEYLEN, EVP_sha256(), NULL);
+	if (enc)
+		EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, aes, iv);
+	else
+		EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, aes, iv);
+
+	return r; // 2 renews tickets from the previous period
+}
+#endif
+
+void tls_load_sessions(ServerConfig_T *conf)
+{
+	gchar *secret = NULL;
+	gsize len = 0;
+	GError *err = NULL;
+
+	SSL_CTX_set_session_id_context(tls_context, 
+			(const unsigned char *)conf->service_name,
+			min(strlen(conf->service_name), SSL_MAX_SID_CTX_LENGTH));
+	SSL_CTX_set_session_cache_mode(tls_context, SSL_SESS_CACHE_SERVER);
+
+	if (conf->tls_ticket_rotation > 0)
+		tls_ticket_rotation = conf->tls_ticket_rotation;
+	SSL_CTX_set_timeout(tls_context, tls_ticket_rotation);
+
+	if (strlen(conf->tls_ticket_keyfile)) {
+		if (g_file_get_contents(conf->tls_ticket_keyfile, &secret, &len, &err) && len >= 16) {
+			SHA256((unsigned char *)secret, len, tls_ticket_secret);
+			TRACE(TRACE_DEBUG, "ticket keys derived from [%s]", conf->tls_ticket_keyfile);
+		} else {
+			TRACE(TRACE_WARNING, "unable to use ticket key file [%s]: %s",
+					conf->tls_ticket_keyfile, 
+					err ? err->message : "need at least 16 bytes");
+			len = 0;
+		}
+		if (err) g_error_free(err);
+		if (secret) {
+			memset(secret, 0, len);
+			g_free(secret);
+		}
+	}
+
+	if (! len) {
+		if (RAND_bytes(tls_ticket_secret, sizeof(tls_ticket_secret)) <= 0) {
+			TRACE(TRACE_WARNING, "no entropy for ticket keys; session tickets disabled");
+			SSL_CTX_set_options(tls_context, SSL_OP_NO_TICKET);
+			return;
+		}
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(tls_context, tls_ticket_cb);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(tls_context, tls_ticket_cb);
+#endif
+
+	if (conf->tls_ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+		SSL_CTX_set_options(tls_context, SSL_OP_ENABLE_KTLS);
+		TRACE(TRACE_INFO, "kernel TLS offload enabled");
+#else
+		TRACE(TRACE_WARNING, "kernel TLS offload not supported by this OpenSSL");
+#endif
+	}
+}
+
 /* Grab the top error off of the error stack and then return a string
  * corresponding to that error */
 char *tls_get_error(void) 
@@ -26,6 +26,8 @@ SSL_CTX *tls_init(void);
 SSL *tls_setup(int);
 void tls_load_certs(ServerConfig_T *);
 void tls_load_ciphers(ServerConfig_T *);
+void tls_load_sessions(ServerConfig_T *);
+int tls_ticket_keys(unsigned char *, int, time_t, unsigned char *, unsigned char *);
 char *tls_get_error(void);
 
 #endif
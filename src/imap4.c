@@ -32,8 +32,6 @@
 #define MAX_FAULTY_RESPONSES 5
 
 extern ServerConfig_T *server_conf;
-extern GAsyncQueue *queue;
-extern struct event_base *evbase;
 
 const char AcceptedTagChars[] =
     "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
@@ -80,6 +78,7 @@ const char *IMAP_COMMANDS[] = {
 	"idle",
 	"starttls",
        	"id",
+	"compress",
 	"***NOMORE***"
 };
 
@@ -124,6 +123,7 @@ const IMAP_COMMAND_HANDLER imap_handler_functions[] = {
        	_ic_idle,
        	_ic_starttls,
 	_ic_id,
+	_ic_compress,
 	NULL
 };
 
@@ -614,9 +614,9 @@ int imap_handle_connection(client_sock *c)
 
 	session = dbmail_imap_session_new(c->pool);
 
-	assert(evbase);
-	ci->rev = event_new(evbase, ci->rx, EV_READ|EV_PERSIST, socket_read_cb, (void *)session);
-	ci->wev = event_new(evbase, ci->tx, EV_WRITE, socket_write_cb, (void *)session);
+	assert(ci->reactor);
+	ci->rev = event_new(ci->reactor->base, ci->rx, EV_READ|EV_PERSIST, socket_read_cb, (void *)session);
+	ci->wev = event_new(ci->reactor->base, ci->tx, EV_WRITE, socket_write_cb, (void *)session);
 	ci_cork(ci);
 
 	session->ci = ci;
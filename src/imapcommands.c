@@ -36,9 +36,6 @@ extern DBParam_T db_params;
 #define DBPFX db_params.pfx
 
 extern ServerConfig_T *server_conf;
-extern int selfpipe[2];
-extern pthread_mutex_t selfpipe_lock;
-extern GAsyncQueue *queue;
 extern const char *imap_flag_desc[];
 extern const char *imap_flag_desc_escaped[];
 extern const char AcceptedMailboxnameChars[];
@@ -53,11 +50,16 @@ struct cmd_t {
 	uint64_t mailbox_id;
 	uint64_t seq;
 	uint64_t unchangedsince;
+	Connection_T c;			// transaction spanning the whole command
+	MailboxCounters_T counters;	// summed change to the mailbox counters
+	GList *changed;			// message ids to stamp with seq before commit
+	GList *report;			// messages to report once seq is known
+	int status;
 };
 
 /* 
- * push a message onto the queue and notify the
- * event-loop by sending a char into the selfpipe
+ * push a message onto the queue of the owning reactor
+ * and notify its event-loop through the selfpipe
  */
 
 #define SESSION_GET \
@@ -65,12 +67,7 @@ struct cmd_t {
 
 #define SESSION_RETURN \
 	D->session->command_state = TRUE; \
-	g_async_queue_push(queue, (gpointer)D); \
-	PLOCK(selfpipe_lock); \
-	if (selfpipe[1] > -1) { \
-		if (write(selfpipe[1], "D", 1)) { /* ignore */; } \
-	} \
-	PUNLOCK(selfpipe_lock); \
+	dm_queue_notify(D); \
 	return;
 
 /* Macro for OK answers with optional response code */
@@ -189,6 +186,32 @@ int _ic_starttls(ImapSession *self)
 	return i;
 }
 
+/*
+ * _ic_compress()
+ *
+ * RFC 4978: the tagged OK is the last uncompressed response,
+ * everything after it is deflated in both directions.
+ */
+int _ic_compress(ImapSession *self)
+{
+	if (!check_state_and_args(self, 1, 1, CLIENTSTATE_AUTHENTICATED)) return 1;
+	if (! MATCH(p_string_str(self->args[self->args_idx]), "DEFLATE")) {
+		ci_write(self->ci, "%s BAD unsupported compression mechanism\r\n", self->tag);
+		return 1;
+	}
+	if (self->ci->zout) {
+		ci_write(self->ci, "%s NO [COMPRESSIONACTIVE] DEFLATE active\r\n", self->tag);
+		return 1;
+	}
+	ci_write(self->ci, "%s OK DEFLATE active\r\n", self->tag);
+	if (ci_compress(self->ci) != DM_SUCCESS)
+		return -1;
+
+	Capa_remove(self->capa, "COMPRESS=DEFLATE");
+
+	return 3; /* done */
+}
+
 /*
  * _ic_noop()
  *
@@ -329,7 +352,7 @@ int _ic_authenticate(ImapSession *self)
 static gboolean mailbox_first_unseen(gpointer key, gpointer value, gpointer data)
 {
 	MessageInfo *msginfo = (MessageInfo *)value;
-	if (msginfo->flags[IMAP_FLAG_SEEN])
+	if (MSGINFO_FLAG(msginfo, IMAP_FLAG_SEEN))
 	       	return FALSE;
 	*(uint64_t *)data = *(uint64_t *)key;
 	return TRUE;
@@ -941,9 +964,16 @@ void _ic_delete_enter(dm_thread_data *D)
 			c = db_con_get();
 			TRY
 				db_begin_transaction(c);
+				db_mailbox_counters_remove(c, mailbox_idnr, "1=1");
 				db_exec(c, "UPDATE %smessages SET status=%d WHERE mailbox_idnr = %" PRIu64 "", DBPFX, MESSAGE_STATUS_PURGE, mailbox_idnr);
 				db_exec(c, "UPDATE %smailboxes SET no_select = 1 WHERE mailbox_idnr = %" PRIu64 "", DBPFX, mailbox_idnr);
-				db_commit_transaction(c);
+				db_mailbox_seq_update_c(c, mailbox_idnr, 0);
+				if (dm_quota_user_delta(c, self->userid, -(int64_t)mailbox_size)) {
+					db_commit_transaction(c);
+				} else {
+					db_rollback_transaction(c);
+					t = DM_EQUERY;
+				}
 			CATCH(SQLException)
 				LOG_SQLERROR;
 				db_rollback_transaction(c);
@@ -958,11 +988,6 @@ void _ic_delete_enter(dm_thread_data *D)
 			}
 
 			MailboxState_setNoSelect(S, TRUE);
-			db_mailbox_seq_update(mailbox_idnr, 0);
-			if (! dm_quota_user_dec(self->userid, mailbox_size)) {
-				D->status=DM_EQUERY;
-				SESSION_RETURN;
-			}
 		}
 
 		/* check if this was the currently selected mailbox */
@@ -1002,6 +1027,8 @@ int _ic_delete(ImapSession *self)
 static int mailbox_rename(MailboxState_T M, const char *newname)
 {
 	if ( (db_setmailboxname(MailboxState_getId(M), newname)) == DM_EQUERY) return DM_EQUERY;
+	/* a rename can move the mailbox into another namespace */
+	acl_cache_invalidate(MailboxState_getId(M));
 	MailboxState_setName(M, newname);
 	return DM_SUCCESS;
 }
@@ -1217,13 +1244,70 @@ int _ic_unsubscribe(ImapSession *self)
 	return _ic_subscribe(self);
 }
 
+/*
+ * STATUS data items, shared by STATUS and LIST-STATUS
+ */
+static gboolean _status_attr_known(ImapSession *self, const char *attr)
+{
+	if (MATCH(attr, "messages") || MATCH(attr, "recent") || MATCH(attr, "unseen")
+			|| MATCH(attr, "uidnext") || MATCH(attr, "uidvalidity"))
+		return TRUE;
+	if (Capa_match(self->capa, "CONDSTORE") && MATCH(attr, "highestmodseq"))
+		return TRUE;
+	return FALSE;
+}
+
+static GList * _status_attr_append(ImapSession *self, MailboxState_T M, const char *attr, GList *plst)
+{
+	if (MATCH(attr, "messages"))
+		plst = g_list_append_printf(plst,"MESSAGES %u", MailboxState_getExists(M));
+	else if (MATCH(attr, "recent"))
+		plst = g_list_append_printf(plst,"RECENT %u", MailboxState_getRecent(M));
+	else if (MATCH(attr, "unseen"))
+		plst = g_list_append_printf(plst,"UNSEEN %u", MailboxState_getUnseen(M));
+	else if (MATCH(attr, "uidnext"))
+		plst = g_list_append_printf(plst,"UIDNEXT %" PRIu64 "", MailboxState_getUidnext(M));
+	else if (MATCH(attr, "uidvalidity"))
+		plst = g_list_append_printf(plst,"UIDVALIDITY %" PRIu64 "", MailboxState_getId(M));
+	else if (MATCH(attr, "highestmodseq")) {
+		plst = g_list_append_printf(plst,"HIGHESTMODSEQ %" PRIu64, MailboxState_getSeq(M));
+		self->enabled.condstore = true;
+	}
+	return plst;
+}
+
+static void _status_write_out(ImapSession *self, MailboxState_T M, const char *name, GList *attrs)
+{
+	GList *plst = NULL;
+	gchar *pstring, *astring;
+
+	attrs = g_list_first(attrs);
+	while (attrs) {
+		plst = _status_attr_append(self, M, (const char *)attrs->data, plst);
+		attrs = g_list_next(attrs);
+	}
+
+	astring = dbmail_imap_astring_as_string(name);
+	pstring = dbmail_imap_plist_as_string(plst);
+	g_list_destroy(plst);
+
+	dbmail_imap_session_buff_printf(self, "* STATUS %s %s\r\n", astring, pstring);
+	g_free(astring); g_free(pstring);
+}
+
+typedef struct {
+	ImapSession *self;
+	GList *status;		// LIST-STATUS data items, NULL if not requested
+} ListOut_T;
+
 /**
  * Write out one element of found folders (contains found hierarchy too)
  *
  * This is called for each found folder in a loop.
  */
-static gboolean _ic_list_write_out_found_folder(gpointer UNUSED key, MailboxState_T M, ImapSession *self)
+static gboolean _ic_list_write_out_found_folder(gpointer UNUSED key, MailboxState_T M, ListOut_T *out)
 {
+	ImapSession *self = out->self;
 	GList *plist = NULL;
 	char *pstring = NULL;
 	if (MailboxState_noSelect(M))
@@ -1243,9 +1327,66 @@ static gboolean _ic_list_write_out_found_folder(gpointer UNUSED key, MailboxStat
 	g_list_free(g_list_first(plist));
 	g_free(pstring);
 
+	/* RFC 5819: no STATUS for non-selectable or unreadable mailboxes */
+	if (out->status && (! MailboxState_noSelect(M))
+			&& acl_has_right(M, self->userid, ACL_RIGHT_READ) == TRUE)
+		_status_write_out(self, M, MailboxState_getName(M), out->status);
+
 	return FALSE;
 }
 
+static gboolean _ic_list_collect_selectable(gpointer UNUSED key, MailboxState_T M, GList **states)
+{
+	if (! MailboxState_noSelect(M))
+		*states = g_list_prepend(*states, M);
+	return FALSE;
+}
+
+/*
+ * parse LIST-EXTENDED return options: RETURN ( [CHILDREN] [STATUS ( item ... )] )
+ *
+ * return 0 on success, -1 on syntax errors
+ */
+static int _ic_list_return_options(ImapSession *self, GList **status)
+{
+	int i = 2;
+
+	if (! self->args[i])
+		return 0;
+
+	if (self->command_type != IMAP_COMM_LIST || ! MATCH(p_string_str(self->args[i]), "RETURN"))
+		return -1;
+	if (! (self->args[++i] && MATCH(p_string_str(self->args[i]), "(")))
+		return -1;
+
+	for (i++; self->args[i]; i++) {
+		const char *opt = p_string_str(self->args[i]);
+		if (MATCH(opt, ")"))
+			break;
+		if (MATCH(opt, "CHILDREN"))	// always returned
+			continue;
+		if (! MATCH(opt, "STATUS"))
+			return -1;
+		if (! (self->args[++i] && MATCH(p_string_str(self->args[i]), "(")))
+			return -1;
+		for (i++; self->args[i]; i++) {
+			const char *attr = p_string_str(self->args[i]);
+			if (MATCH(attr, ")"))
+				break;
+			if (! _status_attr_known(self, attr))
+				return -1;
+			*status = g_list_append(*status, (gpointer)attr);
+		}
+		if (! self->args[i] || ! *status)
+			return -1;
+	}
+
+	if (! self->args[i] || self->args[i + 1])
+		return -1;
+
+	return 0;
+}
+
 void free_mailboxstate(void *data)
 {
 	MailboxState_T M = (MailboxState_T)data;
@@ -1273,11 +1414,22 @@ void _ic_list_enter(dm_thread_data *D)
 	char pattern[255];
 	char mailbox[IMAP_MAX_MAILBOX_NAMELEN];
 	const char *refname;
+	ListOut_T out;
+
+	memset(&out, 0, sizeof(ListOut_T));
+	out.self = self;
+
+	if (_ic_list_return_options(self, &out.status)) {
+		dbmail_imap_session_buff_printf(self, "%s BAD invalid return options\r\n", self->tag);
+		D->status = 1;
+		SESSION_RETURN;
+	}
 
 	/* check if self->args are both empty strings, i.e. A001 LIST "" "" 
 	   this has special meaning; show root & delimiter */
 	if (p_string_len(self->args[0]) == 0 && p_string_len(self->args[1]) == 0) {
 		dbmail_imap_session_buff_printf(self, "* %s (\\NoSelect) \"/\" \"\"\r\n", self->command);
+		g_list_free(out.status);
 		SESSION_OK;
 		SESSION_RETURN;
 	}
@@ -1288,6 +1440,7 @@ void _ic_list_enter(dm_thread_data *D)
 		if (index(AcceptedMailboxnameChars, refname[i]) == NULL) {
 			dbmail_imap_session_buff_printf(self, "%s BAD reference name contains invalid characters\r\n", self->tag);
 			D->status = 1;
+			g_list_free(out.status);
 			SESSION_RETURN;
 		}
 	}
@@ -1302,9 +1455,11 @@ void _ic_list_enter(dm_thread_data *D)
 	D->status = db_findmailbox_by_regex(self->userid, pattern, &children, list_is_lsub);
 	if (D->status == -1) {
 		dbmail_imap_session_buff_printf(self, "* BYE internal dbase error\r\n");
+		g_list_free(out.status);
 		SESSION_RETURN;
 	} else if (D->status == 1) {
 		dbmail_imap_session_buff_printf(self, "%s BAD invalid pattern specified\r\n", self->tag);
+		g_list_free(out.status);
 		SESSION_RETURN;
 	}
 
@@ -1397,12 +1552,25 @@ void _ic_list_enter(dm_thread_data *D)
 	TRACE(TRACE_DEBUG,"copying found hierarchy to found_folders");
 	g_tree_merge(found_folders, found_hierarchy, IST_SUBSEARCH_OR);
 
+	if (out.status) {
+		/* LIST-STATUS: fetch the counters and rights of all matched mailboxes at once */
+		GList *states = NULL;
+		g_tree_foreach(found_folders, (GTraverseFunc)_ic_list_collect_selectable, &states);
+		if (MailboxState_countList(states, self->userid) == DM_EQUERY)
+			D->status = DM_EQUERY;
+		g_list_free(states);
+	}
+
 	TRACE(TRACE_DEBUG,"writing out found_folders");
-	g_tree_foreach(found_folders, (GTraverseFunc)_ic_list_write_out_found_folder, self);
+	if (D->status == DM_EQUERY)
+		dbmail_imap_session_buff_printf(self, "* BYE internal dbase error\r\n");
+	else
+		g_tree_foreach(found_folders, (GTraverseFunc)_ic_list_write_out_found_folder, &out);
 
 	if (found_hierarchy) g_tree_destroy(found_hierarchy);
 	if (found_folders) g_tree_destroy(found_folders);
 	if (children) g_list_destroy(children);
+	g_list_free(out.status);
 
 	if (! D->status) dbmail_imap_session_buff_printf(self, "%s OK %s completed\r\n", self->tag, self->command);
 
@@ -1411,8 +1579,9 @@ void _ic_list_enter(dm_thread_data *D)
 
 int _ic_list(ImapSession *self)
 {
+	int maxargs = (self->command_type == IMAP_COMM_LIST) ? 0 : 2;
 
-	if (!check_state_and_args(self, 2, 2, CLIENTSTATE_AUTHENTICATED)) return 1;
+	if (!check_state_and_args(self, 2, maxargs, CLIENTSTATE_AUTHENTICATED)) return 1;
 	dm_thread_data_push((gpointer)self, _ic_list_enter, _ic_cb_leave, NULL);
 	return 0;
 }
@@ -1439,9 +1608,8 @@ static void _ic_status_enter(dm_thread_data *D)
 	MailboxState_T M;
 	uint64_t id;
 	int i, endfound, result;
-	GList *plst = NULL;
-	gchar *pstring, *astring;
-	
+	GList *attrs = NULL;
+
 	if (p_string_str(self->args[1])[0] != '(') {
 		dbmail_imap_session_buff_printf(self, "%s BAD argument list should be parenthesed\r\n", self->tag);
 		D->status = 1;
@@ -1506,36 +1674,20 @@ static void _ic_status_enter(dm_thread_data *D)
 
 	for (i = 2; self->args[i]; i++) {
 		const char *attr = p_string_str(self->args[i]);
-		if (MATCH(attr, "messages"))
-			plst = g_list_append_printf(plst,"MESSAGES %u", MailboxState_getExists(M));
-		else if (MATCH(attr, "recent"))
-			plst = g_list_append_printf(plst,"RECENT %u", MailboxState_getRecent(M));
-		else if (MATCH(attr, "unseen"))
-			plst = g_list_append_printf(plst,"UNSEEN %u", MailboxState_getUnseen(M));
-		else if (MATCH(attr, "uidnext"))
-			plst = g_list_append_printf(plst,"UIDNEXT %" PRIu64 "", MailboxState_getUidnext(M));
-		else if (MATCH(attr, "uidvalidity"))
-			plst = g_list_append_printf(plst,"UIDVALIDITY %" PRIu64 "", MailboxState_getId(M));
-		else if (Capa_match(self->capa, "CONDSTORE") && MATCH(attr, "highestmodseq")) {
-			plst = g_list_append_printf(plst,"HIGHESTMODSEQ %" PRIu64, MailboxState_getSeq(M));
-			self->enabled.condstore = true;
-		}
-		else if (MATCH(attr, ")"))
+		if (MATCH(attr, ")"))
 			break;
-		else {
+		if (! _status_attr_known(self, attr)) {
 			dbmail_imap_session_buff_printf(self, "\r\n%s BAD option '%s' specified\r\n",
 				self->tag, attr);
 			D->status = 1;
+			g_list_free(attrs);
 			MailboxState_free(&M);
 			SESSION_RETURN;
 		}
+		attrs = g_list_append(attrs, (gpointer)attr);
 	}
-	astring = dbmail_imap_astring_as_string(p_string_str(self->args[0]));
-	pstring = dbmail_imap_plist_as_string(plst); 
-	g_list_destroy(plst);
-
-	dbmail_imap_session_buff_printf(self, "* STATUS %s %s\r\n", astring, pstring);	
-	g_free(astring); g_free(pstring);
+	_status_write_out(self, M, p_string_str(self->args[0]), attrs);
+	g_list_free(attrs);
 	MailboxState_free(&M);
 
 	SESSION_OK;
@@ -1582,20 +1734,103 @@ int _ic_idle(ImapSession *self)
 
 /* _ic_append()
  *
- * append a message to a mailbox
+ * append one or more (MULTIAPPEND) messages to a mailbox
  */
 
+static void _append_free(GList *appends)
+{
+	GList *a = g_list_first(appends);
+	while (a) {
+		AppendMessage_T *append = (AppendMessage_T *)a->data;
+		g_list_destroy(append->keywords);
+		g_free(append);
+		if (! g_list_next(a))
+			break;
+		a = g_list_next(a);
+	}
+	g_list_free(g_list_first(appends));
+}
+
+/*
+ * parse the [flags] [date-time] literal triplets following the
+ * mailbox name; the union of all flags is returned in 'flaglist'
+ */
+static GList * _append_parse(ImapSession *self, int *flaglist, gboolean *keywords)
+{
+	GList *appends = NULL;
+	AppendMessage_T *append;
+	int i = 1, j;
+
+	while (self->args[i]) {
+		append = g_new0(AppendMessage_T, 1);
+		appends = g_list_append(appends, append);
+
+		/* check if a flag list has been specified */
+		if (p_string_str(self->args[i])[0] == '(') {
+			/* ok fetch the flags specified */
+			TRACE(TRACE_DEBUG, "[%p] flag list found:", self);
+
+			i++;
+			while (self->args[i] && p_string_str(self->args[i])[0] != ')') {
+				const char *arg = p_string_str(self->args[i]);
+				TRACE(TRACE_DEBUG, "[%p] [%s]", self, arg);
+				for (j = 0; j < IMAP_NFLAGS; j++) {
+					if (MATCH(arg, imap_flag_desc_escaped[j])) {
+						append->flags[j] = 1;
+						flaglist[j] = 1;
+						break;
+					}
+				}
+				if (j == IMAP_NFLAGS) {
+					TRACE(TRACE_DEBUG,"[%p] found keyword [%s]", self, arg);
+					append->keywords = g_list_append(append->keywords, g_strdup(arg));
+					*keywords = TRUE;
+				}
+
+				i++;
+			}
+
+			if (! self->args[i])
+				break;
+			i++;
+			TRACE(TRACE_DEBUG, "[%p] )", self);
+		}
+
+		if (! self->args[i])
+			break;
+
+		/* there could be a date-time here: it is always followed
+		 * by the message literal */
+		if (self->args[i + 1] && check_date_time(p_string_str(self->args[i]))) {
+			append->internal_date = p_string_str(self->args[i]);
+			i++;
+			TRACE(TRACE_DEBUG, "[%p] internal date [%s] found", self, append->internal_date);
+		}
+
+		append->msgdata = p_string_str(self->args[i]);
+		i++;
+	}
+
+	if (! appends || ! ((AppendMessage_T *)g_list_last(appends)->data)->msgdata) {
+		TRACE(TRACE_INFO, "[%p] unexpected end of arguments", self);
+		_append_free(appends);
+		return NULL;
+	}
+
+	return appends;
+}
+
 void _ic_append_enter(dm_thread_data *D)
 {
-	uint64_t mboxid, message_id = 0;
-	int i, j, result;
-	const char *internal_date = NULL;
-	int flaglist[IMAP_NFLAGS], flagcount = 0;
-	GList *keywords = NULL;
+	uint64_t mboxid;
+	int j, result;
+	int flaglist[IMAP_NFLAGS];
+	gboolean keywords = FALSE;
 	MailboxState_T M;
 	SESSION_GET;
-	const char *message;
 	gboolean recent = TRUE;
+	GList *appends, *a, *ids = NULL;
+	GString *uids;
 	MessageInfo *info;
 
 	memset(flaglist,0,sizeof(flaglist));
@@ -1623,39 +1858,7 @@ void _ic_append_enter(dm_thread_data *D)
 		SESSION_RETURN;
 	}
 
-	i = 1;
-
-	/* check if a flag list has been specified */
-	if (p_string_str(self->args[i])[0] == '(') {
-		/* ok fetch the flags specified */
-		TRACE(TRACE_DEBUG, "[%p] flag list found:", self);
-
-		i++;
-		while (self->args[i] && p_string_str(self->args[i])[0] != ')') {
-			const char *arg = p_string_str(self->args[i]);
-			TRACE(TRACE_DEBUG, "[%p] [%s]", self, arg);
-			for (j = 0; j < IMAP_NFLAGS; j++) {
-				if (MATCH(arg, imap_flag_desc_escaped[j])) {
-					flaglist[j] = 1;
-					flagcount++;
-					break;
-				}
-			}
-			if (j == IMAP_NFLAGS) {
-				TRACE(TRACE_DEBUG,"[%p] found keyword [%s]", self, arg);
-				keywords = g_list_append(keywords,g_strdup(arg));
-				flagcount++;
-			}
-
-			i++;
-		}
-
-		i++;
-		TRACE(TRACE_DEBUG, "[%p] )", self);
-	}
-
-	if (!self->args[i]) {
-		TRACE(TRACE_INFO, "[%p] unexpected end of arguments", self);
+	if (! (appends = _append_parse(self, flaglist, &keywords))) {
 		dbmail_imap_session_buff_printf(self, "%s BAD invalid arguments specified to APPEND\r\n", self->tag);
 		D->status = 1;
 		SESSION_RETURN;
@@ -1664,12 +1867,14 @@ void _ic_append_enter(dm_thread_data *D)
 	/** check ACL's for STORE */
 	if (flaglist[IMAP_FLAG_SEEN] == 1) {
 		if ((result = mailbox_check_acl(self, M, ACL_RIGHT_SEEN))) {
+			_append_free(appends);
 			D->status = result;
 			SESSION_RETURN;
 		}
 	}
 	if (flaglist[IMAP_FLAG_DELETED] == 1) {
 		if ((result = mailbox_check_acl(self, M, ACL_RIGHT_DELETED))) {
+			_append_free(appends);
 			D->status = result;
 			SESSION_RETURN;
 		}
@@ -1678,36 +1883,26 @@ void _ic_append_enter(dm_thread_data *D)
 	    flaglist[IMAP_FLAG_FLAGGED] == 1 ||
 	    flaglist[IMAP_FLAG_RECENT] == 1 ||
 	    flaglist[IMAP_FLAG_DRAFT] == 1 ||
-	    g_list_length(keywords) > 0) {
+	    keywords) {
 		if ((result = mailbox_check_acl(self, M, ACL_RIGHT_WRITE))) {
+			_append_free(appends);
 			D->status = result;
 			SESSION_RETURN;
 		}
 	}
 
-
-	/* there could be a literal date here, check if the next argument exists
-	 * if so, assume this is the literal date.
-	 */
-	if (self->args[i + 1]) {
-		internal_date = p_string_str(self->args[i]);
-		i++;
-		TRACE(TRACE_DEBUG, "[%p] internal date [%s] found, next arg [%s]",
-				self, internal_date, p_string_str(self->args[i]));
-	}
-
 	if (self->state == CLIENTSTATE_SELECTED && self->mailbox->id == mboxid) {
 		recent = FALSE;
 	}
 	
-	message = p_string_str(self->args[i]);
-
-	D->status = db_append_msg(message, mboxid, self->userid, (char *)internal_date, &message_id, recent);
+	/* all messages are stored, or none */
+	D->status = db_append_msgs(mboxid, self->userid, appends, recent);
 
 	switch (D->status) {
 	case -1:
 		TRACE(TRACE_ERR, "[%p] error appending msg", self);
 		dbmail_imap_session_buff_printf(self, "* BYE internal dbase error storing message\r\n");
+		_append_free(appends);
 		D->status=1;
 		SESSION_RETURN;
 		break;
@@ -1715,6 +1910,7 @@ void _ic_append_enter(dm_thread_data *D)
 	case -2:
 		TRACE(TRACE_INFO, "[%p] quotum would exceed", self);
 		dbmail_imap_session_buff_printf(self, "%s NO not enough quotum left\r\n", self->tag);
+		_append_free(appends);
 		D->status=1;
 		SESSION_RETURN;
 		break;
@@ -1722,42 +1918,43 @@ void _ic_append_enter(dm_thread_data *D)
 	case TRUE:
 		TRACE(TRACE_ERR, "[%p] faulty msg", self);
 		dbmail_imap_session_buff_printf(self, "%s NO invalid message specified\r\n", self->tag);
+		_append_free(appends);
 		SESSION_RETURN;
 		break;
-	case FALSE:
-		if (flagcount) {
-			if (db_set_msgflag(message_id, flaglist, keywords, IMAPFA_ADD, 0, NULL) < 0)
-				TRACE(TRACE_ERR, "[%p] error setting flags for message [%" PRIu64 "]", self, message_id);
-			else
-				db_mailbox_seq_update(mboxid, message_id);
-		}
-		break;
 	}
 
-	if (message_id && self->state == CLIENTSTATE_SELECTED && self->mailbox->id == mboxid) {
+	if (self->state == CLIENTSTATE_SELECTED && self->mailbox->id == mboxid) {
 		dbmail_imap_session_mailbox_status(self, TRUE);
 	}
 
 	// MessageInfo
-	info = g_new0(MessageInfo,1);
-	info->uid = message_id;
-	info->mailbox_id = mboxid;
-	for (flagcount = 0; flagcount < IMAP_NFLAGS; flagcount++)
-		info->flags[flagcount] = flaglist[flagcount];
-	info->flags[IMAP_FLAG_RECENT] = 1;
-	strncpy(info->internaldate, 
-			internal_date?internal_date:"01-Jan-1970 00:00:01 +0100",
-		       	IMAP_INTERNALDATE_LEN-1);
-	info->rfcsize = strlen(message);
-	info->keywords = keywords;
-
 	M = dbmail_imap_session_mbxinfo_lookup(self, mboxid);
-	MailboxState_addMsginfo(M, message_id, info);
+	for (a = g_list_first(appends); a; a = g_list_next(a)) {
+		AppendMessage_T *append = (AppendMessage_T *)a->data;
+
+		info = g_new0(MessageInfo,1);
+		info->uid = append->msg_idnr;
+		for (j = 0; j < IMAP_NFLAGS; j++)
+			MSGINFO_SET_FLAG(info, j, append->flags[j]);
+		MSGINFO_SET_FLAG(info, IMAP_FLAG_RECENT, 1);
+		info->internaldate = append->internaldate;
+		info->rfcsize = strlen(append->msgdata);
+		MessageInfo_mergeKeywords(info, append->keywords, IMAPFA_ADD);
+
+		MailboxState_addMsginfo(M, append->msg_idnr, info);
+		ids = g_list_append(ids, &append->msg_idnr);
+	}
+	MailboxState_compact(M);
+
+	uids = g_list_join_u64(ids, ",");
+	g_list_free(ids);
+
+	char *response = g_strdup_printf("APPENDUID %" PRIu64 " %s", mboxid, uids->str);
+	g_string_free(uids, TRUE);
+	_append_free(appends);
 
-	char buffer[1024];
-	memset(buffer, 0, sizeof(buffer));
-	g_snprintf(buffer, 1023, "APPENDUID %" PRIu64 " %" PRIu64, mboxid, message_id);
-	SESSION_OK_WITH_RESP_CODE(buffer);
+	SESSION_OK_WITH_RESP_CODE(response);
+	g_free(response);
 	SESSION_RETURN;
 }
 
@@ -1917,11 +2114,51 @@ int _ic_expunge(ImapSession *self)
  * search the selected mailbox for messages
  *
  */
+
+/*
+ * parse the ESEARCH/ESORT result options: RETURN ( [MIN] [MAX] [COUNT] [ALL] )
+ *
+ * return the option mask (0 for a plain SEARCH or SORT), or -1 on syntax errors
+ */
+static int search_return_options(ImapSession *self)
+{
+	int options = 0;
+	uint64_t i = self->args_idx;
+
+	if (! MATCH(p_string_str(self->args[i]), "RETURN"))
+		return 0;
+	if (! (self->args[++i] && MATCH(p_string_str(self->args[i]), "(")))
+		return -1;
+
+	for (i++; self->args[i]; i++) {
+		const char *opt = p_string_str(self->args[i]);
+		if (MATCH(opt, ")"))
+			break;
+		if (MATCH(opt, "MIN"))
+			options |= ESEARCH_MIN;
+		else if (MATCH(opt, "MAX"))
+			options |= ESEARCH_MAX;
+		else if (MATCH(opt, "COUNT"))
+			options |= ESEARCH_COUNT;
+		else if (MATCH(opt, "ALL"))
+			options |= ESEARCH_ALL;
+		else
+			return -1;
+	}
+	if (! self->args[i])
+		return -1;
+
+	self->args_idx = i + 1;
+
+	/* RETURN () is equivalent to RETURN (ALL) */
+	return options ? options : ESEARCH_ALL;
+}
+
 static void sorted_search_enter(dm_thread_data *D)
 {
 	SESSION_GET;
 	DbmailMailbox *mb;
-	int result = 0;
+	int result = 0, options = 0;
 	gchar *s = NULL;
 	const gchar *cmd;
 
@@ -1932,6 +2169,15 @@ static void sorted_search_enter(dm_thread_data *D)
 		SESSION_RETURN;
 	}
 
+	if (order == SEARCH_UNORDERED || order == SEARCH_SORTED) {
+		if ((options = search_return_options(self)) < 0) {
+			dbmail_imap_session_buff_printf(self, "%s BAD invalid result options\r\n",
+				self->tag);
+			D->status = 1;
+			SESSION_RETURN;
+		}
+	}
+
 	if (self->state == CLIENTSTATE_SELECTED)
 		dbmail_imap_session_mailbox_status(self, TRUE);
 
@@ -1963,7 +2209,11 @@ static void sorted_search_enter(dm_thread_data *D)
 		}
 		dbmail_mailbox_search(mb);
 		/* ok, display results */
-		switch(order) {
+		if (options) {
+			if (order == SEARCH_SORTED)
+				dbmail_mailbox_sort(mb);
+			s = dbmail_mailbox_esearch(mb, options, order == SEARCH_SORTED);
+		} else switch(order) {
 			case SEARCH_SORTED:
 				dbmail_mailbox_sort(mb);
 				s = dbmail_mailbox_sorted_as_string(mb);
@@ -1982,7 +2232,14 @@ static void sorted_search_enter(dm_thread_data *D)
 		TRACE(TRACE_DEBUG, "empty mailbox?");
 	}
 
-	if (s) {
+	if (options) {
+		/* ESEARCH: a result is sent even if nothing matched */
+		if ((! s) && (options & ESEARCH_COUNT))
+			s = g_strdup("COUNT 0");
+		dbmail_imap_session_buff_printf(self, "* ESEARCH (TAG \"%s\")%s%s%s\r\n",
+			self->tag, self->use_uid ? " UID" : "", (s && *s) ? " " : "", s ? s : "");
+		g_free(s);
+	} else if (s) {
 		dbmail_imap_session_buff_printf(self, "* %s %s\r\n", cmd, s);
 		g_free(s);
 	} else {
@@ -2179,14 +2436,14 @@ static gboolean _do_store(uint64_t *id, gpointer UNUSED value, dm_thread_data *D
 
 
 	if (MailboxState_getPermission(self->mailbox->mbstate) == IMAPPERM_READWRITE) {
-		changed = db_set_msgflag(*id, cmd->flaglist, cmd->keywords, cmd->action, cmd->unchangedsince, msginfo);
+		changed = db_set_msgflag_c(cmd->c, *id, cmd->flaglist, cmd->keywords, cmd->action,
+				cmd->unchangedsince, msginfo, &cmd->counters);
 		if (changed < 0) {
 			dbmail_imap_session_buff_printf(self, "\r\n* BYE internal dbase error\r\n");
 			D->status = TRUE;
 			return TRUE;
 		} else if (changed) {
-			db_message_set_seq(*id, cmd->seq);
-			msginfo->seq = cmd->seq;
+			cmd->changed = g_list_prepend(cmd->changed, id);
 		} else {
 			self->ids_list = g_list_prepend(self->ids_list, id);
 		}
@@ -2201,34 +2458,46 @@ static gboolean _do_store(uint64_t *id, gpointer UNUSED value, dm_thread_data *D
 		switch (cmd->action) {
 			case IMAPFA_ADD:
 				if (cmd->flaglist[i])
-					msginfo->flags[i] = 1;
+					MSGINFO_SET_FLAG(msginfo, i, 1);
 			break;
 			case IMAPFA_REMOVE:
 				if (cmd->flaglist[i]) 
-					msginfo->flags[i] = 0;
+					MSGINFO_SET_FLAG(msginfo, i, 0);
 			break;
 			case IMAPFA_REPLACE:
-				if (cmd->flaglist[i]) 
-					msginfo->flags[i] = 1;
-				else
-					msginfo->flags[i] = 0;
+				MSGINFO_SET_FLAG(msginfo, i, cmd->flaglist[i]);
 			break;
 		}
 	}
 
 	// Set the user keywords as labels
-	g_list_merge(&(msginfo->keywords), cmd->keywords, cmd->action, (GCompareFunc)g_ascii_strcasecmp);
+	MessageInfo_mergeKeywords(msginfo, cmd->keywords, cmd->action);
 
-	// reporting callback
-	if ((! cmd->silent) || changed > 0) {
-		bool showmodseq = (changed && (cmd->unchangedsince || self->mailbox->condstore));
-		bool showflags = (! cmd->silent);
-		_fetch_update(self, msginfo, showmodseq, showflags);
-	}
+	// reported after the commit, when the modseq is known
+	if ((! cmd->silent) || changed > 0)
+		cmd->report = g_list_prepend(cmd->report, msginfo);
 
 	return FALSE;
 }
 
+static void _store_report(ImapSession *self, struct cmd_t *cmd)
+{
+	GList *l;
+	GTree *msginfo = MailboxState_getMsginfo(self->mailbox->mbstate);
+
+	for (l = g_list_first(cmd->changed); l; l = g_list_next(l)) {
+		MessageInfo *m = g_tree_lookup(msginfo, l->data);
+		if (m) m->seq = cmd->seq;
+	}
+
+	for (l = g_list_last(cmd->report); l; l = g_list_previous(l)) {
+		MessageInfo *m = (MessageInfo *)l->data;
+		bool changed = (cmd->seq && m->seq == cmd->seq);
+		bool showmodseq = (changed && (cmd->unchangedsince || self->mailbox->condstore));
+		_fetch_update(self, m, showmodseq, ! cmd->silent);
+	}
+}
+
 static void _ic_store_enter(dm_thread_data *D)
 {
 	SESSION_GET;
@@ -2387,14 +2656,51 @@ static void _ic_store_enter(dm_thread_data *D)
 		g_free(flags);
 	}
 
+	/* flags are changed in place; stop sharing the message table
+	 * before any references into it are taken */
+	MailboxState_unshare(self->mailbox->mbstate);
+
 	if ((result = _dm_imapsession_get_ids(self, p_string_str(self->args[self->args_idx]))) == DM_SUCCESS) {
 		if (self->ids) {
-			uint64_t seq = db_mailbox_seq_update(MailboxState_getId(self->mailbox->mbstate), 0);
-			cmd.seq = seq;
-			g_tree_foreach(self->ids, (GTraverseFunc) _do_store, D);
+			cmd.counters.mailbox_idnr = MailboxState_getId(self->mailbox->mbstate);
+			/* all flag changes of the command share one transaction,
+			 * one modseq and a single update of the mailbox counters.
+			 * The mailbox row is only locked by the last statements. */
+			cmd.c = db_con_get();
+			TRY
+				db_begin_transaction(cmd.c);
+				g_tree_foreach(self->ids, (GTraverseFunc) _do_store, D);
+				if (! D->status && ! db_mailbox_counters_delta(cmd.c, &cmd.counters)) {
+					dbmail_imap_session_buff_printf(self, "\r\n* BYE internal dbase error\r\n");
+					D->status = TRUE;
+				}
+				if (! D->status && cmd.changed) {
+					cmd.seq = db_mailbox_seq_update_c(cmd.c, cmd.counters.mailbox_idnr, 0);
+					if (! db_message_set_seq_list_c(cmd.c, cmd.changed, cmd.seq)) {
+						dbmail_imap_session_buff_printf(self, "\r\n* BYE internal dbase error\r\n");
+						D->status = TRUE;
+					}
+				}
+				if (D->status)
+					db_rollback_transaction(cmd.c);
+				else
+					db_commit_transaction(cmd.c);
+			CATCH(SQLException)
+				LOG_SQLERROR;
+				db_rollback_transaction(cmd.c);
+				dbmail_imap_session_buff_printf(self, "\r\n* BYE internal dbase error\r\n");
+				D->status = TRUE;
+			FINALLY
+				db_con_close(cmd.c);
+			END_TRY;
+
+			if (! D->status)
+				_store_report(self, &cmd);
 		}
 	}
 
+	g_list_free(cmd.changed);
+	g_list_free(cmd.report);
 	g_list_destroy(cmd.keywords);
 
 	if (result || D->status) {
@@ -2438,8 +2744,8 @@ static gboolean _do_copy(uint64_t *id, gpointer UNUSED value, ImapSession *self)
 	int result;
 	uint64_t *new_ids_element = NULL;
 
-	result = db_copymsg(*id, cmd->mailbox_id, self->userid, &newid, TRUE);
-	db_message_set_seq(*id, cmd->seq);
+	result = db_copymsg_c(cmd->c, *id, cmd->mailbox_id, self->userid, &newid, TRUE, 0, &cmd->counters);
+	cmd->status = result;
 	if (result == -1) {
 		dbmail_imap_session_buff_printf(self, "* BYE internal dbase error\r\n");
 		return TRUE;
@@ -2455,6 +2761,7 @@ static gboolean _do_copy(uint64_t *id, gpointer UNUSED value, ImapSession *self)
 	TRACE(TRACE_DEBUG, "copied uid %" PRIu64 " -> %" PRIu64, *id, *new_ids_element);
 	// prepending is faster then appending
 	self->new_ids = g_list_prepend(self->new_ids, new_ids_element);
+	cmd->changed = g_list_prepend(cmd->changed, id);
 	return FALSE;
 }
 
@@ -2498,13 +2805,44 @@ static void _ic_copy_enter(dm_thread_data *D)
 
 	memset(&cmd, 0, sizeof(cmd));
 	cmd.mailbox_id = destmboxid;
+	cmd.counters.mailbox_idnr = destmboxid;
 	self->cmd = &cmd;
 	if ((result = _dm_imapsession_get_ids(self, src)) == DM_SUCCESS) {
 		if (self->ids) {
-			cmd.seq = db_mailbox_seq_update(destmboxid, 0);
-			g_tree_foreach(self->ids, (GTraverseFunc) _do_copy, self);
+			/* the copies are committed together with their modseq
+			 * and a single update of the destination's counters.
+			 * The mailbox row is only locked by the last statements. */
+			cmd.c = db_con_get();
+			TRY
+				db_begin_transaction(cmd.c);
+				g_tree_foreach(self->ids, (GTraverseFunc) _do_copy, self);
+				if (cmd.status >= 0 && ! db_mailbox_counters_delta(cmd.c, &cmd.counters)) {
+					dbmail_imap_session_buff_printf(self, "* BYE internal dbase error\r\n");
+					cmd.status = DM_EQUERY;
+				}
+				if (cmd.status >= 0 && self->new_ids) {
+					cmd.seq = db_mailbox_seq_update_c(cmd.c, destmboxid, 0);
+					if (! (db_message_set_seq_list_c(cmd.c, self->new_ids, cmd.seq)
+							&& db_message_set_seq_list_c(cmd.c, cmd.changed, cmd.seq))) {
+						dbmail_imap_session_buff_printf(self, "* BYE internal dbase error\r\n");
+						cmd.status = DM_EQUERY;
+					}
+				}
+				if (cmd.status < 0)
+					db_rollback_transaction(cmd.c);
+				else
+					db_commit_transaction(cmd.c);
+			CATCH(SQLException)
+				LOG_SQLERROR;
+				db_rollback_transaction(cmd.c);
+				dbmail_imap_session_buff_printf(self, "* BYE internal dbase error\r\n");
+				cmd.status = DM_EQUERY;
+			FINALLY
+				db_con_close(cmd.c);
+			END_TRY;
 		}
 	}
+	g_list_free(cmd.changed);
 	self->cmd = NULL;
 
 	if (result) {
@@ -2512,6 +2850,14 @@ static void _ic_copy_enter(dm_thread_data *D)
 		SESSION_RETURN;
 	}
 
+	/* the tagged or untagged failure has been sent already */
+	if (cmd.status < 0) {
+		g_list_destroy(self->new_ids);
+		self->new_ids = NULL;
+		D->status = (cmd.status == -2) ? 1 : -1;
+		SESSION_RETURN;
+	}
+
 	if (MailboxState_getId(self->mailbox->mbstate) == destmboxid)
 		dbmail_imap_session_mailbox_status(self, TRUE);
 
@@ -25,6 +25,9 @@
 
 #define MAX_ERRORS 3
 
+/* message data past this size is spooled to a temporary file */
+#define LMTP_SPOOL_MEMSIZE (1024 * 1024)
+
 extern ServerConfig_T *server_conf;
 
 /* allowed lmtp commands */
@@ -39,6 +42,7 @@ static const char *const commands[] = {
 	"HELP", 
 	"NOOP", 
 	"RCPT",
+	"BDAT",
 	NULL
 };
 
@@ -53,12 +57,12 @@ typedef enum {
 	LMTP_HELP,
 	LMTP_NOOP,
 	LMTP_RCPT,
+	LMTP_BDAT,
 	LMTP_END
 } command_t;
 
 int lmtp(ClientSession_T *session);
 
-static int lmtp_tokenizer(ClientSession_T *session, char *buffer);
 
 void send_greeting(ClientSession_T *session)
 {
@@ -76,6 +80,47 @@ void send_greeting(ClientSession_T *session)
 		ci_write(session->ci, "220 %s LMTP\r\n", session->hostname);
 }
 
+/*
+ * make room for more octets in the spool. Small messages stay in
+ * memory; once a message outgrows LMTP_SPOOL_MEMSIZE it moves to an
+ * unlinked temporary file, which goes away with the stream. If that
+ * fails the message stays in memory.
+ */
+static void lmtp_spool_reserve(ClientSession_T *session, uint64_t more)
+{
+	GMimeStream *fs;
+	gchar *name = NULL;
+	GError *err = NULL;
+	int64_t len;
+	int fd;
+
+	if (! GMIME_IS_STREAM_MEM(session->spool))
+		return;
+
+	len = g_mime_stream_length(session->spool);
+	if (len > LMTP_SPOOL_MEMSIZE || len + more <= LMTP_SPOOL_MEMSIZE)
+		return;
+
+	if ((fd = g_file_open_tmp("dbmail-lmtp-XXXXXX", &name, &err)) < 0) {
+		TRACE(TRACE_WARNING, "[%p] unable to spool to file: %s", session, err->message);
+		g_error_free(err);
+		return;
+	}
+	unlink(name);
+	g_free(name);
+
+	fs = g_mime_stream_fs_new(fd);
+	g_mime_stream_reset(session->spool);
+	if (g_mime_stream_write_to_stream(session->spool, fs) != len) {
+		TRACE(TRACE_WARNING, "[%p] unable to spool to file", session);
+		g_object_unref(fs);
+		return;
+	}
+	TRACE(TRACE_DEBUG, "[%p] spooling to file after [%" PRId64 "] octets", session, len);
+	g_object_unref(session->spool);
+	session->spool = fs;
+}
+
 static void lmtp_cb_time(void *arg)
 {
 	ClientSession_T *session = (ClientSession_T *)arg;
@@ -89,13 +134,26 @@ static void lmtp_handle_input(void *arg)
 	char buffer[MAX_LINESIZE];	/* connection buffer */
 	ClientSession_T *session = (ClientSession_T *)arg;
 	while (TRUE) {
-		memset(buffer, 0, sizeof(buffer));
+		if (session->command_type == LMTP_BDAT && session->chunk_size) {
+			/* BDAT octets go straight into the spool */
+			if ((l = ci_read_stream(session->ci, session->spool, session->chunk_size)) <= 0)
+				break;
+			session->chunk_size -= l;
+			if (session->chunk_size)
+				break;
+			session->parser_state = TRUE;
+			l = 1;
+		} else {
+			memset(buffer, 0, sizeof(buffer));
+
+			l = ci_readln(session->ci, buffer);
 
-		l = ci_readln(session->ci, buffer);
+			if (l==0) break;
 
-		if (l==0) break;
+			l = lmtp_tokenizer(session, buffer);
+		}
 
-		if ((l = lmtp_tokenizer(session, buffer))) {
+		if (l) {
 			if (l == -3) {
 				client_session_bailout(&session);
 				return;
@@ -256,22 +314,51 @@ int lmtp_tokenizer(ClientSession_T *session, char *buffer)
 			if (state != CLIENTSTATE_AUTHENTICATED) {
 				return lmtp_error(session, "550 Command out of sequence\r\n");
 			}
+			if (session->spool) {
+				return lmtp_error(session, "503 BDAT in progress\r\n");
+			}
+			if (session->binarymime) {
+				return lmtp_error(session, "503 BODY=BINARYMIME requires BDAT\r\n");
+			}
 			if (p_list_length(session->rcpt) < 1) {
 				return lmtp_error(session, "503 No valid recipients\r\n");
 			}
 			if (p_list_length(session->from) < 1) {
 				return lmtp_error(session, "554 No valid sender.\r\n");
 			}
+			session->spool = g_mime_stream_mem_new();
 			ci_write(session->ci, "354 Start mail input; end with <CRLF>.<CRLF>\r\n");
 			return FALSE;
 		}
 
-		if (strncmp(buffer,".\n",2)==0 || strncmp(buffer,".\r\n",3)==0)
+		if (strncmp(buffer,".\n",2)==0 || strncmp(buffer,".\r\n",3)==0) {
+			session->parser_state = TRUE;
+		} else {
+			const char *line = (buffer[0] == '.') ? &buffer[1] : buffer;
+			lmtp_spool_reserve(session, strlen(line));
+			g_mime_stream_write_string(session->spool, line);
+		}
+	} else if (session->command_type == LMTP_BDAT) {
+		/* BDAT <chunk-size> [LAST] (RFC 3030): the chunk
+		 * itself is read by lmtp_handle_input */
+		char *end = NULL;
+		String_T s = p_list_data(p_list_first(session->args));
+		const char *arg = p_string_str(s);
+
+		session->chunk_size = strtoull(arg, &end, 10);
+		if (end == arg)
+			return lmtp_error(session, "501 Syntax: BDAT <chunk-size> [LAST]\r\n");
+		while (*end == ' ') end++;
+		if (*end && strcasecmp(end, "LAST") != 0)
+			return lmtp_error(session, "501 Syntax: BDAT <chunk-size> [LAST]\r\n");
+		session->chunk_last = (*end) ? TRUE : FALSE;
+
+		if (! session->spool)
+			session->spool = g_mime_stream_mem_new();
+		lmtp_spool_reserve(session, session->chunk_size);
+
+		if (! session->chunk_size)
 			session->parser_state = TRUE;
-		else if (strncmp(buffer,".",1)==0)
-			p_string_append(session->rbuff, &buffer[1]);
-		else
-			p_string_append(session->rbuff, buffer);
 	} else
 		session->parser_state = TRUE;
 
@@ -281,12 +368,63 @@ int lmtp_tokenizer(ClientSession_T *session, char *buffer)
 }
 
 
-int lmtp(ClientSession_T * session)
+/* parse the spooled message and deliver it to all recipients */
+static int lmtp_deliver(ClientSession_T *session)
 {
 	DbmailMessage *msg;
 	ClientBase_T *ci = session->ci;
-	int helpcmd;
 	const char *class, *subject, *detail;
+
+	msg = dbmail_message_new(NULL);
+	msg = dbmail_message_init_with_stream(msg, session->spool);
+	session->spool = NULL;
+	if (p_list_data(session->from))
+		dbmail_message_set_header(msg, "Return-Path", 
+				(char *)p_string_str(p_list_data(session->from)));
+
+	if (insert_messages(msg, session->rcpt) == -1) {
+		ci_write(ci, "430 Message not received\r\n");
+		dbmail_message_free(msg);
+		return 1;
+	}
+	/* The DATA command itself it not given a reply except
+	 * that of the status of each of the remaining recipients. */
+
+	/* The replies MUST be in the order received */
+	session->rcpt = p_list_first(session->rcpt);
+	while (session->rcpt) {
+		Delivery_T * dsnuser = (Delivery_T *)p_list_data(session->rcpt);
+		dsn_tostring(dsnuser->dsn, &class, &subject, &detail);
+
+		/* Give a simple OK, otherwise a detailed message. */
+		switch (dsnuser->dsn.class) {
+			case DSN_CLASS_OK:
+				ci_write(ci, "%d%d%d Recipient <%s> OK\r\n",
+						dsnuser->dsn.class, dsnuser->dsn.subject, dsnuser->dsn.detail,
+						dsnuser->address);
+				break;
+			default:
+				ci_write(ci, "%d%d%d Recipient <%s> %s %s %s\r\n",
+						dsnuser->dsn.class, dsnuser->dsn.subject, dsnuser->dsn.detail,
+						dsnuser->address, class, subject, detail);
+		}
+
+		if (! p_list_next(session->rcpt))
+			break;
+		session->rcpt = p_list_next(session->rcpt);
+	}
+	dbmail_message_free(msg);
+	/* Reset the session after a successful delivery;
+	 * MTA's like Exim prefer to immediately begin the
+	 * next delivery without an RSET or a reconnect. */
+	lmtp_rset(session,TRUE);
+	return 1;
+}
+
+int lmtp(ClientSession_T * session)
+{
+	ClientBase_T *ci = session->ci;
+	int helpcmd;
 	size_t tmplen = 0, tmppos = 0;
 	char *tmpaddr = NULL, *tmpbody = NULL, *arg;
 	int state = 0;
@@ -313,14 +451,9 @@ int lmtp(ClientSession_T * session)
 		 * with a MUST statement, so just hardcode them.
 		 * */
 		ci_write(ci, "250-%s\r\n250-PIPELINING\r\n"
-			"250-ENHANCEDSTATUSCODES\r\n250 SIZE\r\n", 
+			"250-ENHANCEDSTATUSCODES\r\n250-8BITMIME\r\n"
+			"250-CHUNKING\r\n250-BINARYMIME\r\n250 SIZE\r\n", 
 			session->hostname);
-				/* This is a SHOULD implement:
-				 * "250-8BITMIME\r\n"
-				 * Might as well do these, too:
-				 * "250-CHUNKING\r\n"
-				 * "250-BINARYMIME\r\n"
-				 * */
 		client_session_reset(session);
 		session->state = CLIENTSTATE_AUTHENTICATED;
 		client_session_set_timeout(session, server_conf->timeout);
@@ -348,7 +481,8 @@ int lmtp(ClientSession_T * session)
 
 		if ((helpcmd == LMTP_LHLO) || (helpcmd == LMTP_DATA) || 
 			(helpcmd == LMTP_RSET) || (helpcmd == LMTP_QUIT) || 
-			(helpcmd == LMTP_NOOP) || (helpcmd == LMTP_HELP)) {
+			(helpcmd == LMTP_NOOP) || (helpcmd == LMTP_HELP) ||
+			(helpcmd == LMTP_BDAT)) {
 			ci_write(ci, "%s", LMTP_HELP_TEXT[helpcmd]);
 		} else
 			ci_write(ci, "%s", LMTP_HELP_TEXT[LMTP_END]);
@@ -404,10 +538,9 @@ int lmtp(ClientSession_T * session)
 			return 1;
 		}
 
-		/* Second look for a BODY keyword.
-		 * See if it has an argument, and if we
-		 * support that feature. Don't give an OK
-		 * if we can't handle it yet, like 8BIT!
+		/* Second look for a BODY keyword. 7BIT, 8BITMIME
+		 * (RFC1652) and BINARYMIME (RFC3030) are all
+		 * stored as received.
 		 * */
 
 		/* Find the '=' following the address
@@ -418,16 +551,10 @@ int lmtp(ClientSession_T * session)
 			if (strlen(tmpbody))
 				tmpbody++;
 
-		/* This is all a bit nested now... */
 		if (tmpbody) {
-			if (MATCH(tmpbody, "8BITMIME")) {   // RFC1652
-				ci_write(ci, "500 Please use 7BIT MIME only.\r\n");
-				return 1;
-			}
-			if (MATCH(tmpbody, "BINARYMIME")) { // RFC3030
-				ci_write(ci, "500 Please use 7BIT MIME only.\r\n");
-				return 1;
-			}
+			TRACE(TRACE_DEBUG, "BODY=[%s]", tmpbody);
+			/* RFC 3030: such a message can only be sent with BDAT */
+			session->binarymime = (strncasecmp(tmpbody, "BINARYMIME", 10) == 0);
 		}
 
 		String_T s = p_string_new(session->pool, tmpaddr);
@@ -495,50 +622,32 @@ int lmtp(ClientSession_T * session)
 
 	/* Here's where it gets really exciting! */
 	case LMTP_DATA:
-		msg = dbmail_message_new(NULL);
-		dbmail_message_init_with_string(msg, p_string_str(session->rbuff));
-		if (p_list_data(session->from))
-			dbmail_message_set_header(msg, "Return-Path", 
-					(char *)p_string_str(p_list_data(session->from)));
-		p_string_truncate(session->rbuff,0);
-
-		if (insert_messages(msg, session->rcpt) == -1) {
-			ci_write(ci, "430 Message not received\r\n");
-			dbmail_message_free(msg);
+		return lmtp_deliver(session);
+
+	case LMTP_BDAT:
+		state = session->state;
+
+		if (state != CLIENTSTATE_AUTHENTICATED) {
+			lmtp_rset(session, FALSE);
+			ci_write(ci, "503 Command out of sequence.\r\n");
 			return 1;
 		}
-		/* The DATA command itself it not given a reply except
-		 * that of the status of each of the remaining recipients. */
-
-		/* The replies MUST be in the order received */
-		session->rcpt = p_list_first(session->rcpt);
-		while (session->rcpt) {
-			Delivery_T * dsnuser = (Delivery_T *)p_list_data(session->rcpt);
-			dsn_tostring(dsnuser->dsn, &class, &subject, &detail);
-
-			/* Give a simple OK, otherwise a detailed message. */
-			switch (dsnuser->dsn.class) {
-				case DSN_CLASS_OK:
-					ci_write(ci, "%d%d%d Recipient <%s> OK\r\n",
-							dsnuser->dsn.class, dsnuser->dsn.subject, dsnuser->dsn.detail,
-							dsnuser->address);
-					break;
-				default:
-					ci_write(ci, "%d%d%d Recipient <%s> %s %s %s\r\n",
-							dsnuser->dsn.class, dsnuser->dsn.subject, dsnuser->dsn.detail,
-							dsnuser->address, class, subject, detail);
-			}
-
-			if (! p_list_next(session->rcpt))
-				break;
-			session->rcpt = p_list_next(session->rcpt);
+		if (p_list_length(session->rcpt) < 1) {
+			lmtp_rset(session, TRUE);
+			ci_write(ci, "503 No valid recipients\r\n");
+			return 1;
 		}
-		dbmail_message_free(msg);
-		/* Reset the session after a successful delivery;
-		 * MTA's like Exim prefer to immediately begin the
-		 * next delivery without an RSET or a reconnect. */
-		lmtp_rset(session,TRUE);
-		return 1;
+		if (p_list_length(session->from) < 1) {
+			lmtp_rset(session, TRUE);
+			ci_write(ci, "554 No valid sender.\r\n");
+			return 1;
+		}
+		if (! session->chunk_last) {
+			ci_write(ci, "250 %" PRId64 " octets received\r\n",
+					g_mime_stream_length(session->spool));
+			return 1;
+		}
+		return lmtp_deliver(session);
 
 	default:
 		return lmtp_error(session, "500 What are you trying to say here?\r\n");
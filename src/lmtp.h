@@ -79,11 +79,16 @@ static const char *const LMTP_HELP_TEXT[] = {
 	    "214-dialogue. The commands MAIL, RCPT and DATA\r\n"
 	    "214-may only be issued after a successful LHLO.\r\n"
 	    "214 Syntax: LHLO [your hostname]\r\n"
-/* LMTP_END 10 */ ,
+/* LMTP_BDAT 10 */ ,
+	"214-The BDAT command transfers a message in\r\n"
+	    "214-one or more chunks of exactly <chunk-size>\r\n"
+	    "214-octets, the final chunk is marked LAST.\r\n"
+	    "214 Syntax: BDAT <chunk-size> [LAST]\r\n"
+/* LMTP_END 11 */ ,
 	"214-This is DBMail-LMTP.\r\n"
 	    "214-The following commands are supported:\r\n"
 	    "214-LHLO, RSET, NOOP, QUIT, HELP.\r\n"
-	    "214-VRFY, EXPN, MAIL, RCPT, DATA.\r\n"
+	    "214-VRFY, EXPN, MAIL, RCPT, DATA, BDAT.\r\n"
 	    "214-For more information about a command:\r\n"
 	    "214 Use HELP <command>.\r\n"
 /* For good measure... */ ,
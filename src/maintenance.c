@@ -58,6 +58,7 @@ static int do_check_iplog(const char *timespec);
 static int do_check_replycache(const char *timespec);
 static int do_vacuum_db(void);
 static int do_rehash(void);
+static int do_verify_hashes(void);
 static int do_migrate(int migrate_limit);
 
 int do_showhelp(void) {
@@ -71,7 +72,7 @@ int do_showhelp(void) {
 	"     -a        perform all checks (in this release: -ctubpds)\n"
 	"     -c        clean up database (optimize/vacuum)\n"
 	"     -t        test for message integrity\n"
-	"     -b        body/header/envelope cache check\n"
+	"     -b        body/header/envelope/bodystructure cache check\n"
 	"     -p        purge messages have the DELETE status set\n"
 	"     -d        set DELETE status for deleted messages\n"
 	"     -s        remove dangling/invalid aliases and forwards\n"
@@ -85,6 +86,8 @@ int do_showhelp(void) {
 	"     --inbox name  Inbox folder to move from, used in conjunction with --move\n"
 	"     --trash name  Trash folder to move to, used in conjunction with --move\n"
 	"     -m limit  limit migration to [limit] number of physmessages. Default 10000 per run\n"
+	"     --rehash  rebuild the hash values for all message parts\n"
+	"     --verify-hashes  check the stored hash of all message parts\n"
 	"\nCommon options for all DBMail utilities:\n"
 	"     -f file   specify an alternative config file\n"
 	"     -q        quietly skip interactive prompts\n"
@@ -105,12 +108,14 @@ int main(int argc, char *argv[])
 	int check_iplog = 0, check_replycache = 0;
 	char *timespec_iplog = NULL, *timespec_replycache = NULL;
 	int vacuum_db = 0, purge_deleted = 0, set_deleted = 0, dangling_aliases = 0, rehash = 0, move_old = 0, erase_old = 0;
+	int verify_hashes = 0;
 	int show_help = 0;
 	int do_nothing = 1;
 	int is_header = 0;
 	int migrate = 0, migrate_limit = 10000;
 	static struct option long_options[] = {
 		{ "rehash", 0, 0, 0 },
+		{ "verify-hashes", 0, 0, 0 },
 		{ "move", 1, 0, 0 },
 		{ "erase", 1, 0, 0 },
 		{ "trash", 1, 0, 0 },
@@ -140,6 +145,8 @@ int main(int argc, char *argv[])
 			do_nothing = 0;
 			if (strcmp(long_options[opt_index].name,"rehash")==0)
 				rehash = 1;
+			if (strcmp(long_options[opt_index].name,"verify-hashes")==0)
+				verify_hashes = 1;
 
 			if (strcmp(long_options[opt_index].name,"move")==0) {
 				move_old = 1;
@@ -319,6 +326,7 @@ int main(int argc, char *argv[])
 	if (check_replycache) do_check_replycache(timespec_replycache);
 	if (vacuum_db) do_vacuum_db();
 	if (rehash) do_rehash();
+	if (verify_hashes) do_verify_hashes();
 	if (migrate) do_migrate(migrate_limit);
 
 	if (!has_errors && !serious_errors) {
@@ -515,13 +523,6 @@ int do_set_deleted(void)
 			return -1;
 		}
 		qprintf("Ok. Messages set for deletion.\n");
-		qprintf("Re-calculating used quota for all users...\n");
-		if (dm_quota_rebuild() < 0) {
-			qerrorf ("Failed. An error occured. Please check log.\n");
-			serious_errors = 1;
-			return -1;
-		}
-		qprintf("Ok. Used quota updated for all users.\n");
 	}
 	return 0;
 }
@@ -638,6 +639,8 @@ int do_check_integrity(void)
 	 5. Check for loose mimeparts
 	 6. Check for loose headernames
 	 7. Check for loose headervalues
+	 8. Check per-mailbox message counters
+	 9. Check used quota
 	 */
 
 	/* part 3 */
@@ -755,6 +758,50 @@ int do_check_integrity(void)
 		action, difftime(stop, start));
 	/* end part 7 */
 
+	/* part 8 */
+	start = stop;
+	qprintf("\n%s DBMAIL mailbox counters integrity...\n", action);
+	if ((count = db_icheck_mailbox_counters(cleanup)) < 0) {
+		qerrorf("Failed. An error occurred. Please check log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+	if (count > 0) {
+		qerrorf("Ok. Found [%ld] mailboxes with inconsistent counters.\n", count);
+		if (cleanup) {
+			qerrorf("Ok. Mailbox counters recalculated.\n");
+		}
+	} else {
+		qprintf("Ok. Found [%ld] mailboxes with inconsistent counters.\n", count);
+	}
+
+	time(&stop);
+	qverbosef("--- %s mailbox counters took %g seconds\n",
+		action, difftime(stop, start));
+	/* end part 8 */
+
+	/* part 9 */
+	start = stop;
+	qprintf("\n%s DBMAIL used quota integrity...\n", action);
+	if ((count = dm_quota_rebuild(cleanup)) < 0) {
+		qerrorf("Failed. An error occurred. Please check log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+	if (count > 0) {
+		qerrorf("Ok. Found [%ld] users with inconsistent used quota.\n", count);
+		if (cleanup) {
+			qerrorf("Ok. Used quota recalculated.\n");
+		}
+	} else {
+		qprintf("Ok. Found [%ld] users with inconsistent used quota.\n", count);
+	}
+
+	time(&stop);
+	qverbosef("--- %s used quota took %g seconds\n",
+		action, difftime(stop, start));
+	/* end part 9 */
+
 	g_list_destroy(lost);
 	lost = NULL;
 
@@ -851,6 +898,50 @@ static int do_envelope(void)
 }
 
 
+static int do_bodystructure(void)
+{
+	time_t start, stop;
+	GList *lost = NULL;
+
+	if (no_to_all) {
+		qprintf("\nChecking DBMAIL for cached bodystructures...\n");
+	}
+	if (yes_to_all) {
+		qprintf("\nRepairing DBMAIL for cached bodystructures...\n");
+	}
+	time(&start);
+
+	if (db_icheck_bodystructure(&lost) < 0) {
+		qerrorf("Failed. An error occured. Please check log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+
+	if (g_list_length(lost) > 0) {
+		qerrorf("Ok. Found [%d] missing bodystructure values.\n", g_list_length(lost));
+		has_errors = 1;
+	} else {
+		qprintf("Ok. Found [%d] missing bodystructure values.\n", g_list_length(lost));
+	}
+
+	if (yes_to_all) {
+		if (db_set_bodystructure(lost) < 0) {
+			qerrorf("Error setting the bodystructure cache");
+			has_errors = 1;
+		}
+	}
+
+	g_list_destroy(lost);
+
+	time(&stop);
+	qverbosef("--- checking bodystructure cache took %g seconds\n",
+	       difftime(stop, start));
+	
+	return 0;
+
+}
+
+
 int do_header_cache(void)
 {
 	time_t start, stop;
@@ -864,6 +955,10 @@ int do_header_cache(void)
 		serious_errors = 1;
 		return -1;
 	}
+	if (do_bodystructure()) {
+		serious_errors = 1;
+		return -1;
+	}
 	
 	if (no_to_all) 
 		qprintf("\nChecking DBMAIL for cached header values...\n");
@@ -992,6 +1087,28 @@ int do_vacuum_db(void)
 	return 0;
 }
 
+int do_verify_hashes(void)
+{
+	uint64_t checked = 0, mismatched = 0;
+
+	qprintf ("Verifying hash keys for stored message chunks...\n");
+	if (db_verify_store(&checked, &mismatched) == DM_EQUERY) {
+		qerrorf("Failed. Please check the log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+
+	if (mismatched) {
+		qerrorf("Ok. Found [%" PRIu64 "] of [%" PRIu64 "] message chunks with a bad hash.\n"
+				"Run dbmail-util --rehash to repair them.\n", mismatched, checked);
+		has_errors = 1;
+	} else {
+		qprintf ("Ok. Checked [%" PRIu64 "] message chunks.\n", checked);
+	}
+
+	return 0;
+}
+
 int do_rehash(void)
 {
 	if (yes_to_all) {
@@ -1313,6 +1313,9 @@ int auth_validate(ClientBase_T *ci, const char *username, const char *password,
 	
 	db_find_create_mailbox("INBOX", BOX_DEFAULT, *user_idnr, &mailbox_idnr);
 
+	if (! db_use_usermap())
+		auth_cache_insert(ci, username, password, *user_idnr);
+
 	return 1;
 }
 
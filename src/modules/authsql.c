@@ -272,14 +272,18 @@ int auth_change_password(uint64_t user_idnr, const char *new_pass, const char *e
 
 	c = db_con_get();
 	TRY
+		db_begin_transaction(c);
 		s = db_stmt_prepare(c, "UPDATE %susers SET passwd = ?, encryption_type = ? WHERE user_idnr=?", DBPFX);
 		db_stmt_set_str(s, 1, new_pass);
 		db_stmt_set_str(s, 2, encoding);
 		db_stmt_set_u64(s, 3, user_idnr);
 		db_stmt_exec(s);
+		db_auth_generation_bump(c);
+		db_commit_transaction(c);
 		t = TRUE;
 	CATCH(SQLException)
 		LOG_SQLERROR;
+		db_rollback_transaction(c);
 		t = DM_EQUERY;
 	FINALLY
 		db_con_close(c);
@@ -344,6 +348,9 @@ int auth_validate(ClientBase_T *ci, const char *username, const char *password,
 	if (! (valid = db_user_validate(ci, "passwd", user_idnr, password))) {
 		if ((valid = db_user_validate(ci, "spasswd", user_idnr, password))) 
 			db_user_security_trigger(*user_idnr);
+	} else if (valid == 1 && ! db_use_usermap()) {
+		/* never cache a security password: it must trigger every time */
+		auth_cache_insert(ci, username, password, *user_idnr);
 	}
 	if (! valid)
 		*user_idnr = 0;
@@ -483,15 +490,19 @@ int auth_addalias(uint64_t user_idnr, const char *alias, uint64_t clientid)
 	db_con_clear(c);
 
 	TRY
+		db_begin_transaction(c);
 		s = db_stmt_prepare(c, "INSERT INTO %saliases (alias,deliver_to,client_idnr) VALUES (?,?,?)",DBPFX);
 		db_stmt_set_str(s, 1, alias);
 		db_stmt_set_u64(s, 2, user_idnr);
 		db_stmt_set_u64(s, 3, clientid);
 
 		db_stmt_exec(s);
+		db_alias_generation_bump(c);
+		db_commit_transaction(c);
 		t = TRUE;
 	CATCH(SQLException)
 		LOG_SQLERROR;
+		db_rollback_transaction(c);
 		t = DM_EQUERY;
 	FINALLY
 		db_con_close(c);
@@ -551,15 +562,19 @@ int auth_addalias_ext(const char *alias,
 	db_con_clear(c);
 
 	TRY
+		db_begin_transaction(c);
 		s = db_stmt_prepare(c, "INSERT INTO %saliases (alias,deliver_to,client_idnr) VALUES (?,?,?)",DBPFX);
 		db_stmt_set_str(s, 1, alias);
 		db_stmt_set_str(s, 2, deliver_to);
 		db_stmt_set_u64(s, 3, clientid);
 
 		db_stmt_exec(s);
+		db_alias_generation_bump(c);
+		db_commit_transaction(c);
 		t = TRUE;
 	CATCH(SQLException)
 		LOG_SQLERROR;
+		db_rollback_transaction(c);
 		t = DM_EQUERY;
 	FINALLY
 		db_con_close(c);
@@ -574,13 +589,17 @@ int auth_removealias(uint64_t user_idnr, const char *alias)
 	
 	c = db_con_get();
 	TRY
+		db_begin_transaction(c);
 		s = db_stmt_prepare(c, "DELETE FROM %saliases WHERE deliver_to=? AND lower(alias) = lower(?)",DBPFX);
 		db_stmt_set_u64(s, 1, user_idnr);
 		db_stmt_set_str(s, 2, alias);
 		db_stmt_exec(s);
+		db_alias_generation_bump(c);
+		db_commit_transaction(c);
 		t = TRUE;
 	CATCH(SQLException)
 		LOG_SQLERROR;
+		db_rollback_transaction(c);
 	FINALLY
 		db_con_close(c);
 	END_TRY;
@@ -594,13 +613,17 @@ int auth_removealias_ext(const char *alias, const char *deliver_to)
 
 	c = db_con_get();
 	TRY
+		db_begin_transaction(c);
 		s = db_stmt_prepare(c, "DELETE FROM %saliases WHERE lower(deliver_to) = lower(?) AND lower(alias) = lower(?)", DBPFX);
 		db_stmt_set_str(s, 1, deliver_to);
 		db_stmt_set_str(s, 2, alias);
 		db_stmt_exec(s);
+		db_alias_generation_bump(c);
+		db_commit_transaction(c);
 		t = TRUE;
 	CATCH(SQLException)
 		LOG_SQLERROR;
+		db_rollback_transaction(c);
 	FINALLY
 		db_con_close(c);
 	END_TRY;
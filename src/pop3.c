@@ -75,6 +75,9 @@ extern int pop_before_smtp;
 
 static int pop3(ClientSession_T *session, const char *buffer);
 
+/* pop3() return value for a command that finishes on a worker thread */
+#define POP3_DEFERRED 2
+
 static void send_greeting(ClientSession_T *session)
 {
 	Field_T banner;
@@ -231,6 +234,7 @@ static void pop3_handle_input(void *arg)
 {
 	char buffer[MAX_LINESIZE];	/* connection buffer */
 	ClientSession_T *session = (ClientSession_T *)arg;
+	int result;
 
 	if (p_string_len(session->ci->write_buffer)) {
 		ci_write(session->ci, NULL);
@@ -242,10 +246,12 @@ static void pop3_handle_input(void *arg)
 		return;
 
 	ci_cork(session->ci);
-	if (pop3(session, buffer) <= 0) {
+	if ((result = pop3(session, buffer)) <= 0) {
 		client_session_bailout(&session);
 		return;
 	}
+	if (result == POP3_DEFERRED) // uncorked when the job returns
+		return;
 	ci_uncork(session->ci);
 }
 
@@ -355,17 +361,79 @@ static int _pop3_session_authenticated(ClientSession_T *session, int user_idnr)
 	return result;
 }
 
+static int _pop3_pass_result(ClientSession_T *session, int validate_result, uint64_t user_idnr)
+{
+	ClientBase_T *ci = session->ci;
+
+	switch (validate_result) {
+	case -1:
+		session->SessionResult = 3;
+		return -1;
+	case 0:
+		ci_authlog_init(ci, THIS_MODULE, (const char *)session->username, AUTHLOG_ERR);
+		TRACE(TRACE_ERR, "user [%s] coming from [%s] tried to login with wrong password", 
+			session->username, ci->src_ip);
+
+		g_free(session->username);
+		session->username = NULL;
+
+		g_free(session->password);
+		session->password = NULL;
+
+		return pop3_error(session, "-ERR username/password incorrect\r\n");
+	default:
+		return _pop3_session_authenticated(session, user_idnr);
+	}
+}
+
+typedef struct {
+	ClientSession_T *session;
+	uint64_t user_idnr;
+	int result;
+} Pop3Login_T;
+
+/* worker thread: password hashing must not stall the event loop */
+static void _pop3_pass_enter(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	Pop3Login_T *login = (Pop3Login_T *)D->data;
+	ClientSession_T *session = login->session;
+
+	/* pop3() already missed the login cache */
+	login->result = auth_validate_uncached(session->ci, (const char *)session->username,
+			(const char *)session->password, &login->user_idnr);
+	dm_queue_notify(D);
+}
+
+/* event loop: finish the PASS command */
+static void _pop3_pass_leave(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	Pop3Login_T *login = (Pop3Login_T *)D->data;
+	ClientSession_T *session = login->session;
+	int result;
+
+	result = _pop3_pass_result(session, login->result, login->user_idnr);
+	g_free(login);
+
+	if (result <= 0) {
+		client_session_bailout(&session);
+		return;
+	}
+	ci_uncork(session->ci);
+}
+
 int pop3(ClientSession_T *session, const char *buffer)
 {
 	/* returns a 0  on a quit
 	 *           -1  on a failure
 	 *            1  on a success 
+	 *            POP3_DEFERRED if a worker thread finishes the command
 	 */
 	char *command, *value, *searchptr, *enctype, *s;
 	Pop3Cmd cmdtype;
 	int found = 0;
 	//int indx = 0;
-	int validate_result;
     bool login_disabled = FALSE;
 	uint64_t result, top_lines, top_messageid, user_idnr;
 	unsigned char *md5_apop_he;
@@ -505,30 +573,17 @@ int pop3(ClientSession_T *session, const char *buffer)
 			strncpy(session->password, value, strlen(value) + 1);
 		}
 
-		/* check in authorization layer if these credentials are correct */
-		validate_result = auth_validate(ci, (const char *)session->username, (const char *)session->password, &result);
-
-		switch (validate_result) {
-		case -1:
-			session->SessionResult = 3;
-			return -1;
-		case 0:
-			ci_authlog_init(ci, THIS_MODULE, (const char *)session->username, AUTHLOG_ERR);
-			TRACE(TRACE_ERR, "user [%s] coming from [%s] tried to login with wrong password", 
-				session->username, ci->src_ip);
-
-			g_free(session->username);
-			session->username = NULL;
-
-			g_free(session->password);
-			session->password = NULL;
+		/* a recent identical login is answered right away, anything
+		 * else is verified on a worker thread */
+		if (auth_cache_lookup(ci, (const char *)session->username, (const char *)session->password, &result))
+			return _pop3_pass_result(session, 1, result);
 
-			return pop3_error(session, "-ERR username/password incorrect\r\n");
-		default:
-			return _pop3_session_authenticated(session, result);
+		{
+			Pop3Login_T *login = g_new0(Pop3Login_T, 1);
+			login->session = session;
+			dm_thread_job_push(ci, _pop3_pass_enter, _pop3_pass_leave, login);
 		}
-
-		return 1;
+		return POP3_DEFERRED;
 
 	case POP3_LIST:
 		if (state != CLIENTSTATE_AUTHENTICATED)
@@ -37,7 +37,6 @@ volatile sig_atomic_t mainReload = 0;
 // thread data
 Mempool_T    queue_pool;
 Mempool_T    small_pool;
-GAsyncQueue *queue;
 GThreadPool *tpool = NULL;
 
 extern char configFile[PATH_MAX];
@@ -55,7 +54,6 @@ struct event *sig_hup = NULL;
 struct event *sig_term = NULL;
 struct event *sig_pipe = NULL;
 struct event *sig_usr = NULL;
-struct event *heartbeat = NULL;
 
 SSL_CTX *tls_context;
 
@@ -63,10 +61,61 @@ FILE *fstdout = NULL;
 extern FILE *fstderr;
 FILE *fnull = NULL;
 
-/* self-pipe
+/* 
+ * reactors
+ *
+ * every reactor runs its own event_base. Reactor 0 runs on the
+ * main thread and owns the signal handlers; any additional
+ * reactors run on their own thread and accept connections from
+ * their own SO_REUSEPORT listeners. A client stays on the reactor
+ * that accepted it for its whole lifetime.
+ *
+ * SIGHUP is handled on reactor 0, which then runs reactor_reload_cb
+ * on every reactor. On exit all event loops are ended and their
+ * threads joined before the reactors are released.
  */
-int selfpipe[2];
-pthread_mutex_t selfpipe_lock;
+static Reactor_T *reactors = NULL;
+static int reactorcount = 0;
+static GPrivate reactor_key = G_PRIVATE_INIT(NULL);
+
+#define ACCEPT_BATCH 32
+
+void server_reactors_init(int count)
+{
+	int i;
+
+	if (count < 1) count = 1;
+
+	reactorcount = count;
+	reactors = g_new0(Reactor_T, reactorcount);
+
+	for (i = 0; i < reactorcount; i++) {
+		Reactor_T *r = &reactors[i];
+		r->id = i;
+		r->base = i ? event_base_new() : evbase;
+		r->queue = g_async_queue_new();
+		r->selfpipe[0] = r->selfpipe[1] = -1;
+		pthread_mutex_init(&r->lock, NULL);
+	}
+
+	g_private_set(&reactor_key, &reactors[0]);
+}
+
+/*
+ * the reactor driving the calling thread
+ */
+Reactor_T * server_reactor(void)
+{
+	Reactor_T *r = g_private_get(&reactor_key);
+	return r ? r : reactors;
+}
+
+Reactor_T * server_reactor_get(int id)
+{
+	if (id < 0 || id >= reactorcount)
+		return NULL;
+	return &reactors[id];
+}
 
 /* 
  *
@@ -77,43 +126,79 @@ pthread_mutex_t selfpipe_lock;
  *
  */
 
-static void cb_queue_drain(int fd, short what UNUSED, void *arg UNUSED)
+static void reactor_drain(Reactor_T *r)
+{
+	gpointer data;
+	do {
+		data = g_async_queue_try_pop(r->queue);
+		if (data) {
+			dm_thread_data *D = (gpointer)data;
+			if (D->cb_leave) D->cb_leave(data);
+			dm_thread_data_free(data);
+		}
+	} while (data);
+}
+
+static void cb_queue_drain(int fd, short what UNUSED, void *arg)
 {
 	char buf[1024];
-	event_del(heartbeat);
-	dm_queue_drain();
-	PLOCK(selfpipe_lock);
+	Reactor_T *r = (Reactor_T *)arg;
+	event_del(r->heartbeat);
+	reactor_drain(r);
+	PLOCK(r->lock);
 	if (read(fd, buf, sizeof(buf))) { /* ignore */ }
-	PUNLOCK(selfpipe_lock);
-	event_add(heartbeat, NULL);
+	PUNLOCK(r->lock);
+	event_add(r->heartbeat, NULL);
 }
 
+/* services that hand work to the thread pool */
+static gboolean server_has_queue(ServerConfig_T *conf)
+{
+	return (MATCH(conf->service_name, "IMAP") || MATCH(conf->service_name, "POP")
+			|| MATCH(conf->service_name, "SIEVE") || MATCH(conf->service_name, "HTTP"));
+}
 
 void dm_queue_heartbeat(void)
 {
-	if (pipe(selfpipe))
-		TRACE(TRACE_EMERG, "self-pipe setup failed");
+	Reactor_T *r = server_reactor();
 
-	UNBLOCK(selfpipe[0]);
-	UNBLOCK(selfpipe[1]);
+	if (pipe(r->selfpipe))
+		TRACE(TRACE_EMERG, "self-pipe setup failed");
 
-	pthread_mutex_init(&selfpipe_lock, NULL);
+	UNBLOCK(r->selfpipe[0]);
+	UNBLOCK(r->selfpipe[1]);
 
-	heartbeat = event_new(evbase, selfpipe[0], EV_READ, cb_queue_drain, NULL);
-	event_add(heartbeat, NULL);
+	r->heartbeat = event_new(r->base, r->selfpipe[0], EV_READ, cb_queue_drain, r);
+	event_add(r->heartbeat, NULL);
 }
 
 void dm_queue_drain(void)
 {
-	gpointer data;
-	do {
-		data = g_async_queue_try_pop(queue);
-		if (data) {
-			dm_thread_data *D = (gpointer)data;
-			if (D->cb_leave) D->cb_leave(data);
-			dm_thread_data_free(data);
-		}
-	} while (data);
+	reactor_drain(server_reactor());
+}
+
+/*
+ * hand a job back to the reactor owning its session
+ * and wake up that event-loop through its self-pipe
+ */
+void dm_queue_notify(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	Reactor_T *r = NULL;
+
+	if (D->ci)
+		r = D->ci->reactor;
+	else if (D->session && D->session->ci)
+		r = D->session->ci->reactor;
+	if (! r)
+		r = reactors;
+
+	g_async_queue_push(r->queue, data);
+	PLOCK(r->lock);
+	if (r->selfpipe[1] > -1) {
+		if (write(r->selfpipe[1], "Q", 1)) { /* ignore */ }
+	}
+	PUNLOCK(r->lock);
 }
 
 /*
@@ -131,14 +216,10 @@ void dm_queue_push(void *cb, void *session, void *data)
 	D->cb_enter = NULL;
 	D->cb_leave = cb;
 	D->session  = session;
+	D->ci       = NULL;
 	D->data     = data;
 
-        g_async_queue_push(queue, (gpointer)D);
-	PLOCK(selfpipe_lock);
-	if (selfpipe[1] > -1) {
-		if (write(selfpipe[1], "Q", 1)) { /* ignore */ }
-	}
-	PUNLOCK(selfpipe_lock);
+	dm_queue_notify(D);
 }
 
 /* 
@@ -169,6 +250,7 @@ void dm_thread_data_push(gpointer session, gpointer cb_enter, gpointer cb_leave,
 	D->cb_enter = cb_enter;
 	D->cb_leave = cb_leave;
 	D->session  = session;
+	D->ci       = NULL;
 	D->data     = data;
 
 	// we're not done until we're done
@@ -187,6 +269,35 @@ void dm_thread_data_push(gpointer session, gpointer cb_enter, gpointer cb_leave,
 	if (err) TRACE(TRACE_EMERG,"g_thread_pool_push failed [%s]", err->message);
 }
 
+/*
+ * push a blocking job for a client that has no ImapSession,
+ * like a POP3 login. The client stays corked until cb_leave
+ * runs on the event-loop that owns ci. Without a ci (HTTP)
+ * cb_leave runs on the main event-loop.
+ */
+void dm_thread_job_push(ClientBase_T *ci, gpointer cb_enter, gpointer cb_leave, gpointer data)
+{
+	GError *err = NULL;
+	dm_thread_data *D;
+
+	if (ci)
+		ci_cork(ci);
+
+	D = mempool_pop(queue_pool, sizeof(*D));
+	D->magic    = DM_THREAD_DATA_MAGIC;
+	D->status   = 0;
+	D->pool     = queue_pool;
+	D->cb_enter = cb_enter;
+	D->cb_leave = cb_leave;
+	D->session  = NULL;
+	D->ci       = ci;
+	D->data     = data;
+
+	g_thread_pool_push(tpool, D, &err);
+
+	if (err) TRACE(TRACE_EMERG,"g_thread_pool_push failed [%s]", err->message);
+}
+
 void dm_thread_data_free(gpointer data)
 {
 	dm_thread_data *D = (dm_thread_data *)data;
@@ -195,7 +306,7 @@ void dm_thread_data_free(gpointer data)
 
 /* 
  * worker threads can send messages to the client
- * through the main thread async queue. This data
+ * through the async queue of their reactor. This data
  * is written directly to the output event
  */
 void dm_thread_data_sendmessage(gpointer data)
@@ -220,7 +331,7 @@ static void dm_thread_dispatch(gpointer data, gpointer user_data)
 	TRACE(TRACE_DEBUG,"data[%p], user_data[%p]", data, user_data);
 	dm_thread_data *D = (dm_thread_data *)data;
 	ImapSession *session = (ImapSession *)D->session;
-	if (session->state == CLIENTSTATE_QUIT_QUEUED)
+	if (session && session->state == CLIENTSTATE_QUIT_QUEUED)
 		return;
 
 	D->cb_enter(D);
@@ -241,16 +352,15 @@ static int server_setup(ServerConfig_T *conf)
 
 	small_pool = mempool_open();
 
-	if (! MATCH(conf->service_name,"IMAP")) 
-		return 0;
-
-	// Asynchronous message queue for receiving messages
-	// from worker threads in the main thread. 
+	// Every reactor has its own asynchronous message queue
+	// for receiving messages from worker threads.
 	//
-	// Only the main thread is allowed to do network IO.
-	// see the libevent docs for the ratio and a work-around.
-	// Dbmail only needs and uses a single eventbase for now.
-	queue = g_async_queue_new();
+	// Only the thread running a reactor is allowed to do
+	// network IO for the clients it accepted.
+	server_reactors_init(conf->reactors);
+
+	if (! server_has_queue(conf))
+		return 0;
 
 	queue_pool = mempool_open();
 
@@ -302,10 +412,11 @@ static int server_start_cli(ServerConfig_T *conf)
 #endif
 
 		evbase = event_base_new();
+		conf->reactors = 1;
 		if (server_setup(conf)) return -1;
 		conf->ClientHandler(c);
 
-		if (MATCH(conf->service_name, "IMAP"))
+		if (server_has_queue(conf))
 			dm_queue_heartbeat();
 
 		event_base_dispatch(evbase);
@@ -388,7 +499,7 @@ pid_t server_daemonize(ServerConfig_T *conf)
 	return getsid(0);
 }
 
-static int dm_bind_and_listen(int sock, struct sockaddr *saddr, socklen_t len, int backlog, gboolean ssl)
+static int dm_bind_and_listen(int sock, struct sockaddr *saddr, socklen_t len, int backlog, gboolean ssl, gboolean reuseport)
 {
 	int err, so_reuseaddress = 1;
 	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
@@ -406,6 +517,15 @@ static int dm_bind_and_listen(int sock, struct sockaddr *saddr, socklen_t len, i
 		err = errno;
 		TRACE(TRACE_EMERG, "setsockopt::error [%s]", strerror(err));
 	}
+#ifdef SO_REUSEPORT
+	/* let the kernel balance connections over the reactors */
+	if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &so_reuseaddress, sizeof(so_reuseaddress)) == -1) {
+		err = errno;
+		TRACE(TRACE_EMERG, "setsockopt::error [%s]", strerror(err));
+	}
+#else
+	(void)reuseport;
+#endif
 	/* bind the address */
 	if ((bind(sock, saddr, len)) == -1) {
 		err = errno;
@@ -442,7 +562,7 @@ static int create_unix_socket(ServerConfig_T * conf)
 	TRACE(TRACE_DEBUG, "create socket [%s] backlog [%d]", conf->socket, conf->backlog);
 
 	// any error in dm_bind_and_listen is fatal
-	dm_bind_and_listen(sock, (struct sockaddr *)&un, sizeof(un), conf->backlog, FALSE);
+	dm_bind_and_listen(sock, (struct sockaddr *)&un, sizeof(un), conf->backlog, FALSE, FALSE);
 	
 	if (chmod(conf->socket, 02777)) {
 		int serr = errno;
@@ -453,7 +573,7 @@ static int create_unix_socket(ServerConfig_T * conf)
 	return sock;
 }
 
-static void create_inet_socket(ServerConfig_T *conf, int i, gboolean ssl)
+static void create_inet_socket(ServerConfig_T *conf, int i, gboolean ssl, int *sockets, int *count)
 {
 	struct addrinfo hints, *res, *res0;
 	int s, error = 0;
@@ -476,31 +596,52 @@ static void create_inet_socket(ServerConfig_T *conf, int i, gboolean ssl)
 		/*NOTREACHED*/
         }
 	
-	for (res = res0; res && conf->ssl_socketcount < MAXSOCKETS && conf->socketcount < MAXSOCKETS; res = res->ai_next) {
+	for (res = res0; res && *count < MAXSOCKETS; res = res->ai_next) {
 		if ((s = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) < 0) {
 			TRACE(TRACE_ERR, "could not create a socket of family [%d], socktype[%d], protocol [%d]", res->ai_family, res->ai_socktype, res->ai_protocol);
 			continue;
 		}
 		UNBLOCK(s);
 
-		dm_bind_and_listen(s, res->ai_addr, res->ai_addrlen, conf->backlog, ssl);
-		if (ssl)
-			conf->ssl_listenSockets[conf->ssl_socketcount++] = s;
-		else
-			conf->listenSockets[conf->socketcount++] = s;
+		dm_bind_and_listen(s, res->ai_addr, res->ai_addrlen, conf->backlog, ssl, reactorcount > 1);
+		sockets[(*count)++] = s;
  	}
 	freeaddrinfo(res0);
 }
 
-static void server_close_sockets(ServerConfig_T *conf)
+static gboolean server_socket_shared(ServerConfig_T *conf, int sock)
 {
 	int i;
+	for (i = 0; i < conf->socketcount; i++)
+		if (conf->listenSockets[i] == sock)
+			return TRUE;
+	for (i = 0; i < conf->ssl_socketcount; i++)
+		if (conf->ssl_listenSockets[i] == sock)
+			return TRUE;
+	return FALSE;
+}
+
+static void server_close_sockets(ServerConfig_T *conf)
+{
+	int i, r;
 	if (conf->evhs) {
 		for (i = 0; i < server_conf->ipcount; i++) {
 			evhttp_free(conf->evhs[i]);
 		}
 		g_free(conf->evhs);
 	} else {
+		for (r = 1; r < reactorcount; r++) {
+			Reactor_T *R = &reactors[r];
+			for (i = 0; i < R->socketcount; i++)
+				if (! server_socket_shared(conf, R->listenSockets[i]))
+					close(R->listenSockets[i]);
+			R->socketcount = 0;
+			for (i = 0; i < R->ssl_socketcount; i++)
+				if (! server_socket_shared(conf, R->ssl_listenSockets[i]))
+					close(R->ssl_listenSockets[i]);
+			R->ssl_socketcount = 0;
+		}
+
 		for (i = 0; i < conf->socketcount; i++)
 			if (conf->listenSockets[i] > 0)
 				close(conf->listenSockets[i]);
@@ -518,11 +659,14 @@ static void server_close_sockets(ServerConfig_T *conf)
 
 static void server_exit(void)
 {
+	/* the worker threads are gone after disconnect_all,
+	 * so nothing touches the reactor queues after that */
+	server_reactors_stop();
 	disconnect_all();
 	server_close_sockets(server_conf);
+	server_reactors_free();
 	//event_base_free(evbase);
 
-	pthread_mutex_destroy(&selfpipe_lock);
 	if (fstdout) fclose(fstdout);
 	if (fstderr) fclose(fstderr);
 	if (fnull) fclose(fnull);
@@ -532,7 +676,7 @@ static void server_exit(void)
 	
 static void server_create_sockets(ServerConfig_T * conf)
 {
-	int i;
+	int i, r;
 
 	conf->listenSockets = mempool_pop(small_pool, sizeof(int) * MAXSOCKETS);
 	conf->ssl_listenSockets = mempool_pop(small_pool, sizeof(int) * MAXSOCKETS);
@@ -542,66 +686,67 @@ static void server_create_sockets(ServerConfig_T * conf)
 
 	tls_load_certs(conf);
 
-	if (conf->ssl)
+	if (conf->ssl) {
 		tls_load_ciphers(conf);
+		tls_load_sessions(conf);
+	}
 
 	if (strlen(conf->port)) {
 		for (i = 0; i < conf->ipcount; i++) {
-			create_inet_socket(conf, i, FALSE);
+			create_inet_socket(conf, i, FALSE, conf->listenSockets, &conf->socketcount);
 		}
 	}
 
 	if (conf->ssl && strlen(conf->ssl_port)) {
 		for (i = 0; i < conf->ipcount; i++) {
-			create_inet_socket(conf, i, TRUE);
+			create_inet_socket(conf, i, TRUE, conf->ssl_listenSockets, &conf->ssl_socketcount);
 		}
 	}
-}
 
-#ifdef DEBUG
-static void _sock_cb(int sock, short event, void *arg, gboolean ssl)
+	reactors[0].listenSockets = conf->listenSockets;
+	reactors[0].socketcount = conf->socketcount;
+	reactors[0].ssl_listenSockets = conf->ssl_listenSockets;
+	reactors[0].ssl_socketcount = conf->ssl_socketcount;
+
+	for (r = 1; r < reactorcount; r++) {
+		Reactor_T *R = &reactors[r];
+		R->listenSockets = mempool_pop(small_pool, sizeof(int) * MAXSOCKETS);
+		R->ssl_listenSockets = mempool_pop(small_pool, sizeof(int) * MAXSOCKETS);
+#ifdef SO_REUSEPORT
+		/* the unix socket is polled by all reactors; each reactor
+		 * binds its own inet listeners */
+		if (strlen(conf->socket))
+			R->listenSockets[R->socketcount++] = conf->listenSockets[0];
+
+		if (strlen(conf->port)) {
+			for (i = 0; i < conf->ipcount; i++)
+				create_inet_socket(conf, i, FALSE, R->listenSockets, &R->socketcount);
+		}
+
+		if (conf->ssl && strlen(conf->ssl_port)) {
+			for (i = 0; i < conf->ipcount; i++)
+				create_inet_socket(conf, i, TRUE, R->ssl_listenSockets, &R->ssl_socketcount);
+		}
 #else
-static void _sock_cb(int sock, short UNUSED event, void *arg, gboolean ssl)
+		/* no SO_REUSEPORT: all reactors poll the same listeners
+		 * and race for the accept */
+		for (i = 0; i < conf->socketcount; i++)
+			R->listenSockets[R->socketcount++] = conf->listenSockets[i];
+		for (i = 0; i < conf->ssl_socketcount; i++)
+			R->ssl_listenSockets[R->ssl_socketcount++] = conf->ssl_listenSockets[i];
 #endif
+	}
+}
+
+/*
+ * hand an accepted connection to the service
+ */
+static void _sock_accepted(int csock, gboolean ssl)
 {
 	Mempool_T pool;
 	client_sock *c;
-	int csock;
 	socklen_t len;
-	struct event *ev = (struct event *)arg;
-
-#ifdef DEBUG
-	TRACE(TRACE_DEBUG,"%d %s%s%s%s, %p, ssl:%s", sock, 
-			(event&EV_TIMEOUT) ? " timeout" : "", 
-			(event&EV_READ)    ? " read"    : "", 
-			(event&EV_WRITE)   ? " write"   : "", 
-			(event&EV_SIGNAL)  ? " signal"  : "", 
-			arg, ssl?"Y":"N");
-#endif
-	/* accept the active fd */
-
-	if (mainReload) {
-		config_read(configFile);
-		reopen_logs(server_conf);
-	}
 
-	if ((csock = accept(sock, NULL, NULL)) < 0) {
-                int serr=errno;
-                switch(serr) {
-                        case ECONNABORTED:
-                        case EPROTO:
-                        case EINTR:
-                        case EAGAIN:
-                                TRACE(TRACE_DEBUG, "%d:%s", serr, strerror(serr));
-                                break;
-                        default:
-                                TRACE(TRACE_ERR, "%d:%s", serr, strerror(serr));
-                                break;
-                }
-                event_add(ev, NULL);
-                return;
-        }
-	
 	pool = mempool_open();
 	c = mempool_pop(pool, sizeof(client_sock));
 	c->pool = pool;
@@ -613,7 +758,6 @@ static void _sock_cb(int sock, short UNUSED event, void *arg, gboolean ssl)
 		mempool_push(pool, c, sizeof(client_sock));
 		mempool_close(&pool);
 		close(csock);
-		event_add(ev, NULL);
 		return;
 	}
 
@@ -623,19 +767,65 @@ static void _sock_cb(int sock, short UNUSED event, void *arg, gboolean ssl)
 		mempool_push(pool, c, sizeof(client_sock));
 		mempool_close(&pool);
 		close(csock);
-		event_add(ev, NULL);
 		return; // fatal 
 	}
 
 	c->caddr_len = len;
 	c->saddr_len = len;
 	
+	gettimeofday(&c->accepted, NULL);
+
 	if (ssl) c->ssl_state = -1; // defer tls setup
 
 	TRACE(TRACE_INFO, "connection accepted");
 
 	/* streams are ready, perform handling */
 	server_conf->ClientHandler((client_sock *)c);
+}
+
+#ifdef DEBUG
+static void _sock_cb(int sock, short event, void *arg, gboolean ssl)
+#else
+static void _sock_cb(int sock, short UNUSED event, void *arg, gboolean ssl)
+#endif
+{
+	int csock, n;
+	struct event *ev = (struct event *)arg;
+
+#ifdef DEBUG
+	TRACE(TRACE_DEBUG,"%d %s%s%s%s, %p, ssl:%s", sock, 
+			(event&EV_TIMEOUT) ? " timeout" : "", 
+			(event&EV_READ)    ? " read"    : "", 
+			(event&EV_WRITE)   ? " write"   : "", 
+			(event&EV_SIGNAL)  ? " signal"  : "", 
+			arg, ssl?"Y":"N");
+#endif
+
+	/* accept the pending connections in batches, so a burst
+	 * costs a single wakeup */
+	for (n = 0; n < ACCEPT_BATCH; n++) {
+#ifdef SOCK_NONBLOCK
+		csock = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+		csock = accept(sock, NULL, NULL);
+#endif
+		if (csock < 0) {
+			int serr=errno;
+			switch(serr) {
+				case ECONNABORTED:
+				case EPROTO:
+				case EINTR:
+				case EAGAIN:
+					TRACE(TRACE_DEBUG, "%d:%s", serr, strerror(serr));
+					break;
+				default:
+					TRACE(TRACE_ERR, "%d:%s", serr, strerror(serr));
+					break;
+			}
+			break;
+		}
+		_sock_accepted(csock, ssl);
+	}
 
 	/* reschedule */
 	event_add(ev, NULL);
@@ -652,6 +842,47 @@ static void server_sock_ssl_cb(int sock, short event, void *arg)
 }
 
 
+/*
+ * runs on every reactor after a reload, on the reactor's own thread
+ */
+static void reactor_reload_cb(int UNUSED fd, short UNUSED what, void *arg)
+{
+	Reactor_T *r = (Reactor_T *)arg;
+
+	if (r->dnsbase) {
+		evdns_base_clear_nameservers_and_suspend(r->dnsbase);
+		evdns_base_resolv_conf_parse(r->dnsbase, DNS_OPTIONS_ALL, "/etc/resolv.conf");
+		evdns_base_resume(r->dnsbase);
+	}
+	r->reloads++;
+
+	TRACE(TRACE_DEBUG, "reactor [%d] reloaded", r->id);
+}
+
+void server_reactors_reload(void)
+{
+	int i;
+	for (i = 0; i < reactorcount; i++) {
+		if (event_base_once(reactors[i].base, -1, EV_TIMEOUT, reactor_reload_cb, &reactors[i], NULL))
+			TRACE(TRACE_WARNING, "unable to reload reactor [%d]", i);
+	}
+}
+
+/*
+ * SIGHUP: the configuration is shared by all reactors, so it is
+ * re-read right here on reactor 0 instead of on the next connection
+ * it happens to accept
+ */
+static void server_reload(void)
+{
+	if (! server_conf)
+		return;
+
+	config_read(configFile);
+	reopen_logs(server_conf);
+	server_reactors_reload();
+}
+
 void server_sig_cb(int UNUSED fd, short UNUSED event, void *arg)
 {
 	struct event *ev = arg;
@@ -659,6 +890,9 @@ void server_sig_cb(int UNUSED fd, short UNUSED event, void *arg)
 	switch (EVENT_SIGNAL(ev)) {
 		case SIGHUP:
 			mainReload = 1;
+			if (reactors && reactors[0].running)
+				server_reload();
+		break;
 		case SIGPIPE: // ignore
 		break;
 		default:
@@ -757,10 +991,137 @@ static void server_pidfile(ServerConfig_T *conf)
 	configured = TRUE;
 }
 
+static void reactor_listen(Reactor_T *r)
+{
+	int i, k, total;
+
+	total = r->socketcount + r->ssl_socketcount;
+	r->evsock = g_new0(struct event *, total + 1);
+	for (i = 0; i < r->socketcount; i++) {
+		TRACE(TRACE_DEBUG, "Adding event for plain socket [%d] [%d/%d] reactor [%d]", r->listenSockets[i], i+1, total, r->id);
+		r->evsock[i] = event_new(r->base, r->listenSockets[i], EV_READ, server_sock_cb, NULL);
+		event_assign(r->evsock[i], r->base, r->listenSockets[i], EV_READ, server_sock_cb, r->evsock[i]);
+		event_add(r->evsock[i], NULL);
+	}
+	for (k = i, i = 0; i < r->ssl_socketcount; i++, k++) {
+		TRACE(TRACE_DEBUG, "Adding event for ssl socket [%d] [%d/%d] reactor [%d]", r->ssl_listenSockets[i], k+1, total, r->id);
+		r->evsock[k] = event_new(r->base, r->ssl_listenSockets[i], EV_READ, server_sock_ssl_cb, NULL);
+		event_assign(r->evsock[k], r->base, r->ssl_listenSockets[i], EV_READ, server_sock_ssl_cb, r->evsock[k]);
+		event_add(r->evsock[k], NULL);
+	}
+}
+
+static void * reactor_thread(void *arg)
+{
+	Reactor_T *r = (Reactor_T *)arg;
+
+	g_private_set(&reactor_key, r);
+
+	if (server_conf && server_has_queue(server_conf))
+		dm_queue_heartbeat();
+
+	TRACE(TRACE_DEBUG,"dispatching event loop for reactor [%d]...", r->id);
+#ifdef EVLOOP_NO_EXIT_ON_EMPTY
+	/* run until server_reactors_stop */
+	event_base_loop(r->base, EVLOOP_NO_EXIT_ON_EMPTY);
+#else
+	event_base_dispatch(r->base);
+#endif
+	TRACE(TRACE_DEBUG,"reactor [%d] done", r->id);
+
+	return NULL;
+}
+
+/*
+ * start a thread for every reactor but the first, which is
+ * run by the caller
+ */
+void server_reactors_start(void)
+{
+	int i;
+
+	reactors[0].thread = pthread_self();
+	reactors[0].running = TRUE;
+
+	for (i = 1; i < reactorcount; i++) {
+		if (pthread_create(&reactors[i].thread, NULL, reactor_thread, &reactors[i]))
+			TRACE(TRACE_EMERG, "unable to start reactor [%d]", i);
+		else
+			reactors[i].running = TRUE;
+	}
+	if (reactorcount > 1)
+		TRACE(TRACE_NOTICE, "running [%d] reactors", reactorcount);
+}
+
+/*
+ * end the event loops of all reactors and wait for their threads.
+ * Called from exit(), possibly on one of the reactor threads, which
+ * is left running.
+ */
+void server_reactors_stop(void)
+{
+	int i;
+
+	for (i = 0; i < reactorcount; i++) {
+		if (reactors[i].base)
+			event_base_loopexit(reactors[i].base, NULL);
+	}
+
+	for (i = 1; i < reactorcount; i++) {
+		Reactor_T *r = &reactors[i];
+		if ((! r->running) || pthread_equal(r->thread, pthread_self()))
+			continue;
+		if (pthread_join(r->thread, NULL))
+			TRACE(TRACE_WARNING, "unable to join reactor [%d]", i);
+		else
+			r->running = FALSE;
+	}
+	if (reactorcount)
+		reactors[0].running = FALSE;
+}
+
+/*
+ * release the reactors stopped by server_reactors_stop. The first
+ * reactor's event_base is evbase, which is left alone.
+ */
+void server_reactors_free(void)
+{
+	int i, j;
+
+	for (i = 0; i < reactorcount; i++) {
+		if (reactors[i].running)
+			return;
+	}
+
+	for (i = 0; i < reactorcount; i++) {
+		Reactor_T *r = &reactors[i];
+		if (r->heartbeat)
+			event_free(r->heartbeat);
+		if (r->selfpipe[0] > -1)
+			close(r->selfpipe[0]);
+		if (r->selfpipe[1] > -1)
+			close(r->selfpipe[1]);
+		if (r->evsock) {
+			for (j = 0; r->evsock[j]; j++)
+				event_free(r->evsock[j]);
+			g_free(r->evsock);
+		}
+		if (r->dnsbase)
+			evdns_base_free(r->dnsbase, 0);
+		if (i && r->base)
+			event_base_free(r->base);
+		g_async_queue_unref(r->queue);
+		pthread_mutex_destroy(&r->lock);
+	}
+
+	g_free(reactors);
+	reactors = NULL;
+	reactorcount = 0;
+}
+
 int server_run(ServerConfig_T *conf)
 {
 	int i;
-	struct event **evsock;
 
 	mainReload = 0;
 
@@ -795,6 +1156,15 @@ int server_run(ServerConfig_T *conf)
 	if (server_setup(conf))
 		return -1;
 
+	/* reverse lookups of client addresses must not block the
+	 * event loop */
+	if (conf->resolveIP && (! MATCH(conf->service_name, "HTTP"))) {
+		for (i = 0; i < reactorcount; i++) {
+			if (! (reactors[i].dnsbase = evdns_base_new(reactors[i].base, 1)))
+				TRACE(TRACE_WARNING, "evdns setup failed; using blocking lookups");
+		}
+	}
+
 	if (strlen(conf->port) || strlen(conf->ssl_port)) {
 
 		if (MATCH(conf->service_name, "HTTP")) {
@@ -821,22 +1191,9 @@ int server_run(ServerConfig_T *conf)
 				}
 			}
 		} else {
-			int k, total;
 			server_create_sockets(conf);
-			total = conf->socketcount + conf->ssl_socketcount;
-			evsock = g_new0(struct event *, total);
-			for (i = 0; i < conf->socketcount; i++) {
-				TRACE(TRACE_DEBUG, "Adding event for plain socket [%d] [%d/%d]", conf->listenSockets[i], i+1, total);
-				evsock[i] = event_new(evbase, conf->listenSockets[i], EV_READ, server_sock_cb, NULL);
-				event_assign(evsock[i], evbase, conf->listenSockets[i], EV_READ, server_sock_cb, evsock[i]);
-				event_add(evsock[i], NULL);
-			}
-			for (k = i, i = 0; i < conf->ssl_socketcount; i++, k++) {
-				TRACE(TRACE_DEBUG, "Adding event for ssl socket [%d] [%d/%d]", conf->ssl_listenSockets[i], k+1, total);
-				evsock[k] = event_new(evbase, conf->ssl_listenSockets[i], EV_READ, server_sock_ssl_cb, NULL);
-				event_assign(evsock[k], evbase, conf->ssl_listenSockets[i], EV_READ, server_sock_ssl_cb, evsock[k]);
-				event_add(evsock[k], NULL);
-			}
+			for (i = 0; i < reactorcount; i++)
+				reactor_listen(&reactors[i]);
 		}
 	}	
 
@@ -847,8 +1204,10 @@ int server_run(ServerConfig_T *conf)
 	
 	server_pidfile(conf);
 
-	if (MATCH(conf->service_name, "IMAP"))
+	if (server_has_queue(conf))
 		dm_queue_heartbeat();
+
+	server_reactors_start();
 #ifdef HAVE_SYSTEMD
 	sd_notify(0, "READY=1");
 #endif
@@ -1096,6 +1455,20 @@ void server_config_load(ServerConfig_T * config, const char * const service)
 	config->resolveIP = (strcasecmp(val, "yes") == 0);
 	TRACE(TRACE_DEBUG, "%sresolving client IP", config->resolveIP ? "" : "not ");
 
+	/* read items: REACTORS */
+	config->reactors = 1;
+	if (MATCH(service, "IMAP")) {
+		config_get_value("REACTORS", service, val);
+		if (MATCH(val, "auto")) {
+			long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			config->reactors = cpus > 0 ? (int)cpus : 1;
+		} else if (strlen(val) && (config->reactors = atoi(val)) <= 0) {
+			TRACE(TRACE_WARNING, "value for REACTORS is invalid: [%s]", val);
+			config->reactors = 1;
+		}
+	}
+	TRACE(TRACE_DEBUG, "%s reactors [%d]", service, config->reactors);
+
 	/* read items: service-BEFORE-SMTP */
 	char *service_before_smtp = g_strconcat(service, "_BEFORE_SMTP", NULL);
 	config_get_value(service_before_smtp, service, val);
@@ -1159,6 +1532,22 @@ void server_config_load(ServerConfig_T * config, const char * const service)
 		TRACE(TRACE_DEBUG, "Cipher string is set to [%s]", config->tls_ciphers);
 	}
 
+	/* read items: TLS_TICKET_KEYFILE */
+	config_get_value("TLS_TICKET_KEYFILE", service, val);
+	if(strlen(val)) {
+		strncpy(config->tls_ticket_keyfile, val, FIELDSIZE-1);
+		TRACE(TRACE_DEBUG, "Ticket key file is set to [%s]", config->tls_ticket_keyfile);
+	}
+
+	/* read items: TLS_TICKET_ROTATION */
+	config_get_value("TLS_TICKET_ROTATION", service, val);
+	if(strlen(val))
+		config->tls_ticket_rotation = atoi(val);
+
+	/* read items: TLS_KTLS */
+	config_get_value("TLS_KTLS", service, val);
+	config->tls_ktls = (strcasecmp(val, "yes") == 0);
+
 	strncpy(config->service_name, service, FIELDSIZE-1);
 
 }
@@ -53,11 +53,21 @@
 int StartCliServer(ServerConfig_T * conf);
 int server_run(ServerConfig_T *conf);
 
+Reactor_T * server_reactor(void);
+Reactor_T * server_reactor_get(int id);
+void server_reactors_init(int count);
+void server_reactors_start(void);
+void server_reactors_reload(void);
+void server_reactors_stop(void);
+void server_reactors_free(void);
+
 void dm_queue_push(void *cb, void *session, void *data);
+void dm_queue_notify(gpointer data);
 void dm_queue_drain(void);
 void dm_queue_heartbeat(void);
 
 void dm_thread_data_push(gpointer session, gpointer cb_enter, gpointer cb_leave, gpointer data);
+void dm_thread_job_push(ClientBase_T *ci, gpointer cb_enter, gpointer cb_leave, gpointer data);
 void dm_thread_data_sendmessage(gpointer data);
 
 void server_showhelp(const char *service, const char *greeting);
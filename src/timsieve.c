@@ -63,6 +63,9 @@ extern ServerConfig_T *server_conf;
 static int tims(ClientSession_T *session);
 static int tims_tokenizer(ClientSession_T *session, char *buffer);
 
+/* tims() return value for a command that finishes on a worker thread */
+#define TIMS_DEFERRED 2
+
 static void send_greeting(ClientSession_T *session)
 {
 	Field_T banner;
@@ -100,10 +103,12 @@ static void tims_handle_input(void *arg)
 				return;
 			}
 			ci_cork(session->ci);
-			if (tims(session) == -3) {
+			if ((l = tims(session)) == -3) {
 				client_session_bailout(&session);
 				return;
 			}
+			if (l == TIMS_DEFERRED) // resumed when the job returns
+				return;
 			ci_uncork(session->ci);
 			client_session_reset_parser(session);
 		}
@@ -192,6 +197,60 @@ int tims_error(ClientSession_T * session, const char *formatstring, ...)
 }
 
 
+typedef struct {
+	ClientSession_T *session;
+	char **sasl; /* proxy, username, password */
+	uint64_t useridnr;
+	int result;
+} TimsLogin_T;
+
+/* worker thread: password hashing must not stall the event loop */
+static void _tims_auth_enter(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	TimsLogin_T *login = (TimsLogin_T *)D->data;
+
+	login->result = auth_validate(login->session->ci, (const char *)login->sasl[1],
+			(const char *)login->sasl[2], &login->useridnr);
+	dm_queue_notify(D);
+}
+
+/* event loop: finish the AUTHENTICATE command */
+static void _tims_auth_leave(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	TimsLogin_T *login = (TimsLogin_T *)D->data;
+	ClientSession_T *session = login->session;
+	ClientBase_T *ci = session->ci;
+	int result = 1;
+
+	if (login->result == 1) {
+		ci_authlog_init(ci, THIS_MODULE, login->sasl[1], AUTHLOG_ACT);
+
+		ci_write(ci, "OK\r\n");
+		session->state = CLIENTSTATE_AUTHENTICATED;
+		session->useridnr = login->useridnr;
+		session->username = g_strdup(login->sasl[1]);
+		session->password = g_strdup(login->sasl[2]);
+
+		client_session_set_timeout(session, server_conf->timeout);
+	} else {
+		ci_authlog_init(ci, THIS_MODULE, login->sasl[1], AUTHLOG_ERR);
+		result = tims_error(session, "NO \"Username or password incorrect.\"\r\n");
+	}
+	g_strfreev(login->sasl);
+	g_free(login);
+
+	if (result == -3) {
+		client_session_bailout(&session);
+		return;
+	}
+	client_session_reset_parser(session);
+	ci_uncork(ci);
+	/* pick up any commands pipelined behind AUTHENTICATE */
+	session->handle_input(session);
+}
+
 int tims_tokenizer(ClientSession_T *session, char *buffer)
 {
 	int command_type = 0;
@@ -348,7 +407,7 @@ int tims(ClientSession_T *session)
 
 		if (strcasecmp(arg, "PLAIN") == 0) {
 			int i = 0;
-			uint64_t useridnr;
+			TimsLogin_T *login;
 			String_T s;
 			List_T L = session->args;
 			if (! p_list_next(L))
@@ -364,30 +423,22 @@ int tims(ClientSession_T *session)
 				return tims_error(session, "NO \"SASL decode error.\"\r\n");
 			for (i = 0; tmp64[i] != NULL; i++)
 				;
-			if (i < 3)
-				tims_error(session, "NO \"Too few encoded SASL arguments.\"\r\n");
+			if (i < 3) {
+				g_strfreev(tmp64);
+				return tims_error(session, "NO \"Too few encoded SASL arguments.\"\r\n");
+			}
 
 			/* The protocol specifies that the base64 encoding
 			 * be made up of three parts: proxy, username, password
 			 * Between them are NULLs, which are conveniently encoded
-			 * by the base64 process... */
-			if (auth_validate(ci, (const char *)tmp64[1], (const char *)tmp64[2], &useridnr) == 1) {
-				ci_authlog_init(ci, THIS_MODULE, tmp64[1], AUTHLOG_ACT);
-
-				ci_write(ci, "OK\r\n");
-				session->state = CLIENTSTATE_AUTHENTICATED;
-				session->useridnr = useridnr;
-				session->username = g_strdup(tmp64[1]);
-				session->password = g_strdup(tmp64[2]);
-
-				client_session_set_timeout(session, server_conf->timeout);
-
-			} else {
-				ci_authlog_init(ci, THIS_MODULE, tmp64[1], AUTHLOG_ERR);
-				g_strfreev(tmp64);
-				return tims_error(session, "NO \"Username or password incorrect.\"\r\n");
-			}
-			g_strfreev(tmp64);
+			 * by the base64 process...
+			 *
+			 * The password is verified on a worker thread. */
+			login = g_new0(TimsLogin_T, 1);
+			login->session = session;
+			login->sasl = tmp64;
+			dm_thread_job_push(ci, _tims_auth_enter, _tims_auth_leave, login);
+			return TIMS_DEFERRED;
 		} else
 			return tims_error(session, "NO \"Authentication scheme not supported.\"\r\n");
 
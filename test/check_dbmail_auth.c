@@ -183,6 +183,88 @@ START_TEST(test_auth_change_password_raw)
 END_TEST
 #endif
 
+#define AUTH_CACHE_ROUNDS 200
+
+static gint64 auth_login_time(ClientBase_T *ci, const char *user, const char *pass, gboolean cached)
+{
+	uint64_t user_idnr = 0;
+	gint64 start;
+	int i;
+
+	start = g_get_monotonic_time();
+	for (i = 0; i < AUTH_CACHE_ROUNDS; i++) {
+		if (! cached)
+			auth_cache_invalidate(0);
+		fail_unless(auth_validate(ci, user, pass, &user_idnr) == 1);
+	}
+	return g_get_monotonic_time() - start;
+}
+
+START_TEST(test_auth_cache)
+{
+	uint64_t user_idnr = 0, check = 0;
+	unsigned hits, misses, hits0, misses0;
+	gint64 slow, fast;
+	char *user = "testauthcache";
+	ClientBase_T *ci = ci_new();
+
+	if (! auth_user_exists(user, &user_idnr))
+		do_add(user, "first", "md5-hash", 0, 0, NULL, NULL);
+	auth_user_exists(user, &user_idnr);
+	fail_unless(user_idnr > 0);
+
+	auth_cache_invalidate(0);
+	auth_cache_stats(&hits0, &misses0);
+
+	fail_unless(auth_validate(ci, user, "first", &check) == 1);
+	fail_unless(check == user_idnr);
+	fail_unless(auth_validate(ci, user, "first", &check) == 1);
+	fail_unless(check == user_idnr);
+	auth_cache_stats(&hits, &misses);
+	fail_unless(hits - hits0 == 1, "second login not served from cache");
+
+	/* failures are never cached */
+	fail_unless(auth_validate(ci, user, "wrong", &check) == 0);
+	fail_unless(auth_validate(ci, user, "wrong", &check) == 0);
+	auth_cache_stats(&hits0, &misses0);
+	fail_unless(hits0 == hits);
+
+	/* a password change drops the user's cached logins */
+	fail_unless(auth_change_password(user_idnr, "second", "") > 0);
+	fail_unless(auth_validate(ci, user, "first", &check) == 0);
+	fail_unless(auth_validate(ci, user, "second", &check) == 1);
+
+	/* a change made by another process is noticed through the auth
+	 * generation, checked at most once a second */
+	db_update("UPDATE %susers SET passwd = 'third', encryption_type = '' "
+			"WHERE user_idnr = %" PRIu64 "", DBPFX, user_idnr);
+	db_update("UPDATE %sgenerations SET generation = generation + 1 "
+			"WHERE name = 'auth'", DBPFX);
+	sleep(1);
+	fail_unless(auth_validate(ci, user, "second", &check) == 0, "stale login served from cache");
+	fail_unless(auth_change_password(user_idnr, "second", "") > 0);
+
+	/* the module itself never consults the cache */
+	auth_cache_stats(&hits0, &misses0);
+	fail_unless(auth_validate_uncached(ci, user, "second", &check) == 1);
+	auth_cache_stats(&hits, &misses);
+	fail_unless(hits == hits0 && misses == misses0);
+
+	slow = auth_login_time(ci, user, "second", FALSE);
+	auth_cache_stats(&hits0, &misses0);
+	fail_unless(hits0 == hits, "invalidated logins served from cache");
+	fast = auth_login_time(ci, user, "second", TRUE);
+	auth_cache_stats(&hits, &misses);
+	fail_unless(hits - hits0 == AUTH_CACHE_ROUNDS, "cached logins missed [%u]", AUTH_CACHE_ROUNDS - (hits - hits0));
+	TRACE(TRACE_INFO, "[%d] logins uncached [%" PRId64 "]us cached [%" PRId64 "]us",
+			AUTH_CACHE_ROUNDS, slow, fast);
+
+	do_delete(user_idnr, user);
+	fail_unless(auth_validate(ci, user, "second", &check) == 0);
+	ci_delete(ci);
+}
+END_TEST
+
 START_TEST(test_auth_cram_md5)
 {
 	Cram_T c;
@@ -218,6 +300,7 @@ Suite *dbmail_common_suite(void)
 	
 	tcase_add_checked_fixture(tc_auth, setup, teardown);
 	tcase_add_test(tc_auth, test_auth_validate);
+	tcase_add_test(tc_auth, test_auth_cache);
 	//tcase_add_test(tc_auth, test_auth_change_password);
 	//tcase_add_test(tc_auth, test_auth_change_password_raw);
 	tcase_add_test(tc_auth, test_auth_cram_md5);
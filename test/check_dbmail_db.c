@@ -39,6 +39,9 @@
 extern char configFile[PATH_MAX];
 extern int quiet;
 extern int reallyquiet;
+extern DBParam_T db_params;
+
+#define DBPFX db_params.pfx
 
 uint64_t useridnr = 0;
 uint64_t useridnr_domain = 0;
@@ -102,6 +105,15 @@ void teardown(void)
 	if (db_findmailbox("testdeletebox",testidnr,&mailbox_id))
 		db_delete_mailbox(mailbox_id,0,0);
 
+	if (db_findmailbox("testappendbox",testidnr,&mailbox_id))
+		db_delete_mailbox(mailbox_id,0,0);
+
+	if (db_findmailbox("testquotabox",testidnr,&mailbox_id))
+		db_delete_mailbox(mailbox_id,0,1);
+
+	if (db_findmailbox("testsummarybox",testidnr,&mailbox_id))
+		db_delete_mailbox(mailbox_id,0,1);
+
 	if (db_findmailbox("testpermissionbox",testidnr,&mailbox_id)) {
 		db_mailbox_set_permission(mailbox_id, IMAPPERM_READWRITE);
 		db_delete_mailbox(mailbox_id,0,0);
@@ -368,6 +380,268 @@ START_TEST(test_db_delete_mailbox)
 }
 END_TEST
 
+START_TEST(test_db_append_msg)
+{
+	uint64_t mailbox_id = 0, msg_idnr = 0;
+	int flags[IMAP_NFLAGS];
+	unsigned before;
+	GList *keywords = NULL;
+	Connection_T c; ResultSet_T r;
+
+	memset(flags, 0, sizeof(flags));
+	flags[IMAP_FLAG_SEEN] = 1;
+	flags[IMAP_FLAG_FLAGGED] = 1;
+	keywords = g_list_append(keywords, "$Forwarded");
+	keywords = g_list_append(keywords, "$Forwarded");
+
+	fail_unless(db_createmailbox("testappendbox", testidnr, &mailbox_id) == DM_SUCCESS);
+
+	before = db_statement_count();
+	fail_unless(db_append_msg(multipart_message, mailbox_id, testidnr,
+				"01-Jan-2010 12:00:00 +0000", &msg_idnr, TRUE,
+				flags, keywords) == DM_SUCCESS, "db_append_msg failed");
+	TRACE(TRACE_INFO, "APPEND used [%u] statements", db_statement_count() - before);
+	fail_unless(msg_idnr > 0);
+
+	c = db_con_get();
+	r = db_query(c, "SELECT m.mailbox_idnr, m.status, m.seen_flag, m.flagged_flag, "
+			"m.deleted_flag, m.recent_flag, p.messagesize "
+			"FROM %smessages m JOIN %sphysmessage p ON m.physmessage_id = p.id "
+			"WHERE m.message_idnr = %" PRIu64 "", DBPFX, DBPFX, msg_idnr);
+	fail_unless(db_result_next(r));
+	fail_unless(db_result_get_u64(r, 0) == mailbox_id);
+	fail_unless(db_result_get_int(r, 1) == MESSAGE_STATUS_SEEN);
+	fail_unless(db_result_get_int(r, 2) == 1);
+	fail_unless(db_result_get_int(r, 3) == 1);
+	fail_unless(db_result_get_int(r, 4) == 0);
+	fail_unless(db_result_get_int(r, 5) == 1);
+	fail_unless(db_result_get_u64(r, 6) > 0);
+
+	r = db_query(c, "SELECT COUNT(*) FROM %skeywords WHERE message_idnr = %" PRIu64 "",
+			DBPFX, msg_idnr);
+	fail_unless(db_result_next(r));
+	fail_unless(db_result_get_int(r, 0) == 1);
+	db_con_close(c);
+
+	g_list_free(keywords);
+}
+END_TEST
+
+START_TEST(test_db_append_msgs)
+{
+	uint64_t mailbox_id = 0;
+	AppendMessage_T appends[3];
+	GList *list = NULL;
+	Connection_T c; ResultSet_T r;
+	int i;
+
+	fail_unless(db_createmailbox("testappendbox", testidnr, &mailbox_id) == DM_SUCCESS);
+
+	memset(appends, 0, sizeof(appends));
+	for (i = 0; i < 3; i++) {
+		appends[i].msgdata = multipart_message;
+		list = g_list_append(list, &appends[i]);
+	}
+	appends[1].flags[IMAP_FLAG_DELETED] = 1;
+	appends[2].internal_date = "01-Jan-2010 12:00:00 +0000";
+
+	fail_unless(db_append_msgs(mailbox_id, testidnr, list, FALSE) == DM_SUCCESS);
+	for (i = 0; i < 3; i++)
+		fail_unless(appends[i].msg_idnr > 0);
+	fail_unless(appends[0].msg_idnr < appends[2].msg_idnr);
+
+	/* one modseq for the whole batch */
+	c = db_con_get();
+	r = db_query(c, "SELECT COUNT(*), COUNT(DISTINCT seq), SUM(deleted_flag), MIN(seq) "
+			"FROM %smessages WHERE mailbox_idnr = %" PRIu64 "", DBPFX, mailbox_id);
+	fail_unless(db_result_next(r));
+	fail_unless(db_result_get_int(r, 0) == 3);
+	fail_unless(db_result_get_int(r, 1) == 1);
+	fail_unless(db_result_get_int(r, 2) == 1);
+	fail_unless(db_result_get_u64(r, 3) > 0);
+
+	/* parts and header cache were stored in the same transaction */
+	db_con_clear(c);
+	r = db_query(c, "SELECT COUNT(DISTINCT p.physmessage_id), COUNT(DISTINCT h.physmessage_id) "
+			"FROM %smessages m JOIN %spartlists p ON p.physmessage_id = m.physmessage_id "
+			"JOIN %sheader h ON h.physmessage_id = m.physmessage_id "
+			"WHERE m.mailbox_idnr = %" PRIu64 "", DBPFX, DBPFX, DBPFX, mailbox_id);
+	fail_unless(db_result_next(r));
+	fail_unless(db_result_get_int(r, 0) == 3);
+	fail_unless(db_result_get_int(r, 1) == 3);
+	db_con_close(c);
+
+	g_list_free(list);
+}
+END_TEST
+
+#define APPEND_ROUNDS 50
+
+START_TEST(test_db_append_msgs_throughput)
+{
+	uint64_t single_box = 0, multi_box = 0, msg_idnr = 0;
+	AppendMessage_T appends[APPEND_ROUNDS];
+	GList *list = NULL;
+	unsigned single_stmts, multi_stmts;
+	gint64 single_time, multi_time;
+	int i;
+
+	fail_unless(db_createmailbox("testappendsingle", testidnr, &single_box) == DM_SUCCESS);
+	fail_unless(db_createmailbox("testappendmulti", testidnr, &multi_box) == DM_SUCCESS);
+
+	/* APPEND, one message at a time */
+	single_stmts = db_statement_count();
+	single_time = g_get_monotonic_time();
+	for (i = 0; i < APPEND_ROUNDS; i++)
+		fail_unless(db_append_msg(multipart_message, single_box, testidnr,
+					NULL, &msg_idnr, FALSE, NULL, NULL) == DM_SUCCESS);
+	single_time = g_get_monotonic_time() - single_time;
+	single_stmts = db_statement_count() - single_stmts;
+
+	/* MULTIAPPEND, all messages in one batch */
+	memset(appends, 0, sizeof(appends));
+	for (i = 0; i < APPEND_ROUNDS; i++) {
+		appends[i].msgdata = multipart_message;
+		list = g_list_append(list, &appends[i]);
+	}
+	multi_stmts = db_statement_count();
+	multi_time = g_get_monotonic_time();
+	fail_unless(db_append_msgs(multi_box, testidnr, list, FALSE) == DM_SUCCESS);
+	multi_time = g_get_monotonic_time() - multi_time;
+	multi_stmts = db_statement_count() - multi_stmts;
+	g_list_free(list);
+
+	TRACE(TRACE_INFO, "[%d] messages: APPEND [%" PRId64 "]us [%u] statements, "
+			"MULTIAPPEND [%" PRId64 "]us [%u] statements",
+			APPEND_ROUNDS, single_time, single_stmts, multi_time, multi_stmts);
+
+	/* the batch shares the modseq, quotum and counter updates */
+	fail_unless(multi_stmts < single_stmts, "MULTIAPPEND used [%u] statements, APPEND [%u]",
+			multi_stmts, single_stmts);
+
+	db_delete_mailbox(single_box, 0, 1);
+	db_delete_mailbox(multi_box, 0, 1);
+}
+END_TEST
+
+START_TEST(test_dm_quota_delta)
+{
+	uint64_t mailbox_id = 0, msg_idnr = 0, copy_idnr = 0;
+	uint64_t before = 0, after = 0, size = 0;
+	Connection_T c; ResultSet_T r;
+
+	/* start from a verified state */
+	fail_unless(dm_quota_rebuild(TRUE) >= 0);
+	fail_unless(dm_quota_rebuild(FALSE) == 0, "quota not consistent after repair");
+
+	fail_unless(db_createmailbox("testquotabox", testidnr, &mailbox_id) == DM_SUCCESS);
+	dm_quota_user_get(testidnr, &before);
+
+	fail_unless(db_append_msg(multipart_message, mailbox_id, testidnr,
+				NULL, &msg_idnr, FALSE, NULL, NULL) == DM_SUCCESS);
+	c = db_con_get();
+	r = db_query(c, "SELECT p.messagesize FROM %smessages m JOIN %sphysmessage p "
+			"ON m.physmessage_id = p.id WHERE m.message_idnr = %" PRIu64 "",
+			DBPFX, DBPFX, msg_idnr);
+	fail_unless(db_result_next(r));
+	size = db_result_get_u64(r, 0);
+	db_con_close(c);
+
+	dm_quota_user_get(testidnr, &after);
+	fail_unless(after == before + size, "append not charged exactly");
+
+	fail_unless(db_copymsg(msg_idnr, mailbox_id, testidnr, &copy_idnr, TRUE) != DM_EQUERY);
+	dm_quota_user_get(testidnr, &after);
+	fail_unless(after == before + 2 * size, "copy not charged exactly");
+
+	/* a delta never drives the counter below zero */
+	c = db_con_get();
+	db_begin_transaction(c);
+	fail_unless(dm_quota_user_delta(c, testidnr, -(int64_t)(after + 1)));
+	r = db_query(c, "SELECT curmail_size FROM %susers WHERE user_idnr = %" PRIu64 "",
+			DBPFX, testidnr);
+	fail_unless(db_result_next(r));
+	fail_unless(db_result_get_u64(r, 0) == 0, "delta drove curmail_size below zero");
+	db_rollback_transaction(c);
+	db_con_close(c);
+
+	fail_unless(dm_quota_rebuild(FALSE) == 0, "incremental quota drifted");
+	fail_unless(db_delete_mailbox(mailbox_id, 0, 1) == DM_SUCCESS);
+	dm_quota_user_get(testidnr, &after);
+	fail_unless(after == before);
+	fail_unless(dm_quota_rebuild(FALSE) == 0, "incremental quota drifted");
+}
+END_TEST
+
+START_TEST(test_db_mailbox_summary)
+{
+	uint64_t mailbox_id = 0, msg_idnr = 0, modseq = 0, modseq2 = 0, after = 0;
+	uint64_t uids[5];
+	int flags[IMAP_NFLAGS];
+	GList *keywords = NULL, *summaries = NULL;
+	MessageSummary *s;
+	int i, n, pages = 0, total = 0;
+
+	memset(flags, 0, sizeof(flags));
+	flags[IMAP_FLAG_SEEN] = 1;
+	keywords = g_list_append(keywords, "$Forwarded");
+	keywords = g_list_append(keywords, "$Junk");
+
+	fail_unless(db_createmailbox("testsummarybox", testidnr, &mailbox_id) == DM_SUCCESS);
+	for (i = 0; i < 5; i++) {
+		fail_unless(db_append_msg(multipart_message, mailbox_id, testidnr, NULL, &msg_idnr,
+					FALSE, i == 0 ? flags : NULL, i == 1 ? keywords : NULL) == DM_SUCCESS);
+		uids[i] = msg_idnr;
+	}
+	g_list_free(keywords);
+
+	/* walk the mailbox two messages at a time */
+	do {
+		GList *l;
+		summaries = NULL;
+		fail_unless(db_mailbox_summary(mailbox_id, after, 0, 2, &modseq, &summaries) == DM_SUCCESS);
+		n = g_list_length(summaries);
+		fail_unless(n <= 2);
+		for (l = summaries; l; l = g_list_next(l)) {
+			s = (MessageSummary *)l->data;
+			fail_unless(s->info.uid == uids[total], "page out of order");
+			fail_unless(s->info.rfcsize > 0);
+			fail_unless(! MSGINFO_FLAG(&s->info, IMAP_FLAG_RECENT), "recent flag exported");
+			if (total == 0)
+				fail_unless(MSGINFO_FLAG(&s->info, IMAP_FLAG_SEEN));
+			if (total == 1)
+				fail_unless(g_list_length(s->info.keywords) == 2, "keywords not merged");
+			else
+				fail_unless(s->info.keywords == NULL);
+			after = s->info.uid;
+			total++;
+		}
+		pages++;
+		db_mailbox_summary_free(summaries);
+	} while (n);
+
+	fail_unless(total == 5, "expected 5 summaries, got %d", total);
+	fail_unless(pages == 4);
+	fail_unless(modseq > 0);
+
+	/* only the changed message shows up after a modseq bump */
+	db_mailbox_seq_update(mailbox_id, uids[2]);
+	summaries = NULL;
+	fail_unless(db_mailbox_summary(mailbox_id, 0, modseq, 100, &modseq2, &summaries) == DM_SUCCESS);
+	fail_unless(modseq2 > modseq);
+	fail_unless(g_list_length(summaries) == 1);
+	s = (MessageSummary *)summaries->data;
+	fail_unless(s->info.uid == uids[2]);
+	db_mailbox_summary_free(summaries);
+
+	summaries = NULL;
+	fail_unless(db_mailbox_summary(0, 0, 0, 100, &modseq, &summaries) == DM_EGENERAL);
+	fail_unless(summaries == NULL);
+
+	fail_unless(db_delete_mailbox(mailbox_id, 0, 1) == DM_SUCCESS);
+}
+END_TEST
+
 /* Insert or update a replycache entry.
  * int db_replycache_register(const char *to, const char *from, const char *handle);
 
@@ -455,6 +729,11 @@ Suite *dbmail_db_suite(void)
 	tcase_add_test(tc_db, test_Connection_executeQuery);
 	tcase_add_test(tc_db, test_db_createmailbox);
 	tcase_add_test(tc_db, test_db_delete_mailbox);
+	tcase_add_test(tc_db, test_db_append_msg);
+	tcase_add_test(tc_db, test_db_append_msgs);
+	tcase_add_test(tc_db, test_db_append_msgs_throughput);
+	tcase_add_test(tc_db, test_dm_quota_delta);
+	tcase_add_test(tc_db, test_db_mailbox_summary);
 	tcase_add_test(tc_db, test_db_replycache);
 	tcase_add_test(tc_db, test_db_mailbox_set_permission);
 	tcase_add_test(tc_db, test_db_mailbox_create_with_parents);
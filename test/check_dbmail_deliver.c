@@ -36,6 +36,8 @@
 
 extern char *multipart_message;
 extern char configFile[PATH_MAX];
+extern DBParam_T db_params;
+#define DBPFX db_params.pfx
 
 /* we need this one because we can't directly link imapd.o */
 int imap_before_smtp = 0;
@@ -123,6 +125,355 @@ START_TEST(test_insert_messages)
 	mempool_close(&pool);
 }
 END_TEST
+
+static int _inbox_count(uint64_t user_idnr, uint64_t *mailbox_idnr)
+{
+	Connection_T c; ResultSet_T r;
+	int count = 0;
+
+	db_find_create_mailbox("INBOX", BOX_DEFAULT, user_idnr, mailbox_idnr);
+	c = db_con_get();
+	r = db_query(c, "SELECT COUNT(*) FROM %smessages WHERE mailbox_idnr = %" PRIu64 "",
+			DBPFX, *mailbox_idnr);
+	if (db_result_next(r))
+		count = db_result_get_int(r, 0);
+	db_con_close(c);
+	return count;
+}
+
+/* the counters stored on the mailbox row */
+static void _mailbox_counters(uint64_t mailbox_idnr, int *exists, int *unseen, int *recent)
+{
+	Connection_T c; ResultSet_T r;
+
+	*exists = *unseen = *recent = -1;
+	c = db_con_get();
+	r = db_query(c, "SELECT exists_count, unseen_count, recent_count FROM %smailboxes "
+			"WHERE mailbox_idnr = %" PRIu64 "", DBPFX, mailbox_idnr);
+	if (db_result_next(r)) {
+		*exists = db_result_get_int(r, 0);
+		*unseen = db_result_get_int(r, 1);
+		*recent = db_result_get_int(r, 2);
+	}
+	db_con_close(c);
+}
+
+static void _deliver_to(List_T *dsnusers, const char *address, uint64_t useridnr)
+{
+	Delivery_T *dsnuser = g_new0(Delivery_T,1);
+	uint64_t *id = g_new0(uint64_t,1);
+	dsnuser_init(dsnuser);
+	*id = useridnr;
+	dsnuser->address = g_strdup(address);
+	dsnuser->userids = g_list_append(dsnuser->userids, id);
+	*dsnusers = p_list_append(*dsnusers, dsnuser);
+}
+
+#define BATCH_RECIPIENTS 1000
+
+START_TEST(test_insert_messages_batch)
+{
+	int i, before1, before2;
+	int exists[2], unseen[2], recent[2];
+	unsigned statements;
+	gint64 elapsed;
+	uint64_t user1, user2, inbox1, inbox2, maxmail1, maxmail2;
+	DbmailMessage *message;
+	Mempool_T pool = mempool_open();
+	List_T d, dsnusers = p_list_new(pool);
+	
+	fail_unless(auth_user_exists("testuser1", &user1));
+	fail_unless(auth_user_exists("testuser2", &user2));
+	before1 = _inbox_count(user1, &inbox1);
+	before2 = _inbox_count(user2, &inbox2);
+	_mailbox_counters(inbox1, &exists[0], &unseen[0], &recent[0]);
+
+	/* no quotum, so every copy fits */
+	auth_getmaxmailsize(user1, &maxmail1);
+	auth_getmaxmailsize(user2, &maxmail2);
+	auth_change_mailboxsize(user1, 0);
+	auth_change_mailboxsize(user2, 0);
+
+	message = dbmail_message_new(NULL);
+	message = dbmail_message_init_with_string(message,multipart_message);
+
+	for (i = 0; i < BATCH_RECIPIENTS; i++)
+		_deliver_to(&dsnusers, (i % 2) ? "testuser2" : "testuser1", (i % 2) ? user2 : user1);
+	
+	statements = db_statement_count();
+	elapsed = g_get_monotonic_time();
+	fail_unless(insert_messages(message, dsnusers) == 0, "insert_messages failed");
+	elapsed = g_get_monotonic_time() - elapsed;
+	statements = db_statement_count() - statements;
+	TRACE(TRACE_INFO, "[%d] recipients delivered in [%" PRId64 "]us using [%u] statements",
+			BATCH_RECIPIENTS, elapsed, statements);
+
+	/* each recipient gets its own result */
+	for (d = p_list_first(dsnusers); d; d = p_list_next(d)) {
+		Delivery_T *dsnuser = (Delivery_T *)p_list_data(d);
+		fail_unless(dsnuser->dsn.class == DSN_CLASS_OK, "delivery to [%s] failed", dsnuser->address);
+	}
+
+	fail_unless(_inbox_count(user1, &inbox1) == before1 + (BATCH_RECIPIENTS / 2));
+	fail_unless(_inbox_count(user2, &inbox2) == before2 + (BATCH_RECIPIENTS / 2));
+
+	/* every inbox shows up in more than one slice of the batch;
+	 * each copy is counted once */
+	_mailbox_counters(inbox1, &exists[1], &unseen[1], &recent[1]);
+	fail_unless(exists[1] - exists[0] == BATCH_RECIPIENTS / 2, "exists_count moved by [%d]", exists[1] - exists[0]);
+	fail_unless(unseen[1] - unseen[0] == BATCH_RECIPIENTS / 2, "unseen_count moved by [%d]", unseen[1] - unseen[0]);
+	fail_unless(recent[1] - recent[0] == BATCH_RECIPIENTS / 2, "recent_count moved by [%d]", recent[1] - recent[0]);
+
+	/* drop the copies again so later deliveries fit the quotum */
+	fail_unless(db_update("DELETE FROM %smessages WHERE physmessage_id = %" PRIu64 "",
+				DBPFX, dbmail_message_get_physid(message)));
+	db_icheck_mailbox_counters(TRUE);
+	dm_quota_rebuild_user(user1);
+	dm_quota_rebuild_user(user2);
+	auth_change_mailboxsize(user1, maxmail1);
+	auth_change_mailboxsize(user2, maxmail2);
+
+	dsnuser_free_list(dsnusers);
+	dbmail_message_free(message);
+	mempool_close(&pool);
+}
+END_TEST
+
+/* re-read the configuration with one DELIVERY setting changed */
+static char * _config_override(const char *key, const char *value)
+{
+	GKeyFile *k = g_key_file_new();
+	char *data, *tmpname = NULL;
+	gsize len;
+	int fd;
+
+	fail_unless(g_key_file_load_from_file(k, configFile, G_KEY_FILE_NONE, NULL));
+	g_key_file_set_value(k, "DELIVERY", key, value);
+	data = g_key_file_to_data(k, &len, NULL);
+	fd = g_file_open_tmp("dbmail-conf-XXXXXX", &tmpname, NULL);
+	fail_unless(fd >= 0);
+	fail_unless(write(fd, data, len) == (ssize_t)len);
+	close(fd);
+	g_free(data);
+	g_key_file_free(k);
+
+	config_read(tmpname);
+	return tmpname;
+}
+
+START_TEST(test_insert_messages_batch_duplicates)
+{
+	int before1, before2;
+	uint64_t user1, user2, inbox1, inbox2;
+	DbmailMessage *message;
+	char *tmpconf, *raw;
+	Mempool_T pool = mempool_open();
+	List_T d, dsnusers = p_list_new(pool);
+
+	fail_unless(auth_user_exists("testuser1", &user1));
+	fail_unless(auth_user_exists("testuser2", &user2));
+	before1 = _inbox_count(user1, &inbox1);
+	before2 = _inbox_count(user2, &inbox2);
+
+	tmpconf = _config_override("suppress_duplicates", "yes");
+
+	raw = g_strdup_printf("From: <sender@example.org>\n"
+			"To: <testuser1@example.org>\n"
+			"Subject: duplicates\n"
+			"Message-Id: <%" PRId64 ".duplicates@example.org>\n"
+			"\n"
+			"body\n", g_get_real_time());
+	message = dbmail_message_new(NULL);
+	message = dbmail_message_init_with_string(message, raw);
+
+	/* the same mailbox three times in one batch */
+	_deliver_to(&dsnusers, "testuser1", user1);
+	_deliver_to(&dsnusers, "testuser1", user1);
+	_deliver_to(&dsnusers, "testuser2", user2);
+	_deliver_to(&dsnusers, "testuser1", user1);
+
+	fail_unless(insert_messages(message, dsnusers) == 0, "insert_messages failed");
+	for (d = p_list_first(dsnusers); d; d = p_list_next(d)) {
+		Delivery_T *dsnuser = (Delivery_T *)p_list_data(d);
+		fail_unless(dsnuser->dsn.class == DSN_CLASS_OK, "delivery to [%s] failed", dsnuser->address);
+	}
+	fail_unless(_inbox_count(user1, &inbox1) == before1 + 1, "duplicate copies in one batch");
+	fail_unless(_inbox_count(user2, &inbox2) == before2 + 1);
+	dsnuser_free_list(dsnusers);
+	dbmail_message_free(message);
+
+	/* and against the stored copies in a later delivery */
+	dsnusers = p_list_new(pool);
+	_deliver_to(&dsnusers, "testuser1", user1);
+	message = dbmail_message_new(NULL);
+	message = dbmail_message_init_with_string(message, raw);
+	fail_unless(insert_messages(message, dsnusers) == 0, "insert_messages failed");
+	fail_unless(_inbox_count(user1, &inbox1) == before1 + 1, "duplicate copy in later delivery");
+
+	config_read(configFile);
+	unlink(tmpconf);
+	g_free(tmpconf);
+	g_free(raw);
+
+	dsnuser_free_list(dsnusers);
+	dbmail_message_free(message);
+	mempool_close(&pool);
+}
+END_TEST
+
+/*
+ * an LMTP session as after LHLO, without a reactor;
+ * replies are written to a pipe
+ */
+static ClientSession_T * lmtp_session_new(int *replies)
+{
+	Mempool_T pool = mempool_open();
+	ClientSession_T *session = mempool_pop(pool, sizeof(ClientSession_T));
+	ClientBase_T *ci = mempool_pop(pool, sizeof(ClientBase_T));
+	int fds[2];
+
+	fail_unless(pipe(fds) == 0);
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	*replies = fds[0];
+
+	ci->pool = pool;
+	ci->sock = mempool_pop(pool, sizeof(client_sock));
+	ci->rx = -1;
+	ci->tx = fds[1];
+	ci->write_buffer = p_string_new(pool, "");
+	pthread_mutex_init(&ci->lock, NULL);
+
+	session->pool = pool;
+	session->ci = ci;
+	session->args = p_list_new(pool);
+	session->from = p_list_new(pool);
+	session->rcpt = p_list_new(pool);
+	session->rbuff = p_string_new(pool, "");
+	session->state = CLIENTSTATE_AUTHENTICATED;
+
+	return session;
+}
+
+static char * lmtp_reply(int replies)
+{
+	char reply[1024];
+	ssize_t l;
+
+	memset(reply, 0, sizeof(reply));
+	l = read(replies, reply, sizeof(reply) - 1);
+	return g_strdup(l > 0 ? reply : "");
+}
+
+/* run one command line the way lmtp_handle_input does */
+static char * lmtp_command(ClientSession_T *session, int replies, const char *line)
+{
+	char buffer[MAX_LINESIZE];
+	int l;
+
+	g_strlcpy(buffer, line, sizeof(buffer));
+	l = lmtp_tokenizer(session, buffer);
+	if (l > 0)
+		lmtp(session);
+	if (l)
+		client_session_reset_parser(session);
+	return lmtp_reply(replies);
+}
+
+/* send data as one BDAT chunk; the octets bypass the tokenizer */
+static char * lmtp_bdat(ClientSession_T *session, int replies, const char *data, size_t len, gboolean last)
+{
+	char buffer[MAX_LINESIZE];
+
+	g_snprintf(buffer, sizeof(buffer), "BDAT %zu%s\r\n", len, last ? " LAST" : "");
+	fail_unless(lmtp_tokenizer(session, buffer) == 0, "BDAT not waiting for its chunk");
+	fail_unless(session->chunk_size == len);
+
+	g_mime_stream_write(session->spool, (char *)data, len);
+	session->chunk_size = 0;
+	session->parser_state = TRUE;
+
+	lmtp(session);
+	client_session_reset_parser(session);
+	return lmtp_reply(replies);
+}
+
+START_TEST(test_lmtp_bdat)
+{
+	ClientSession_T *session;
+	Mempool_T pool;
+	const char *head = "From: <sender@example.org>\r\nSubject: bdat\r\n\r\n";
+	const char *body = "first line\r\nsecond line\r\n";
+	char *r, *big, line[64];
+	int replies, before;
+	size_t biglen = (2 * 1024 * 1024);
+	uint64_t user1, inbox1;
+
+	fail_unless(auth_user_exists("testuser1", &user1));
+	before = _inbox_count(user1, &inbox1);
+
+	session = lmtp_session_new(&replies);
+
+	r = lmtp_command(session, replies, "MAIL FROM:<sender@example.org> BODY=BINARYMIME\r\n");
+	fail_unless(strncmp(r, "250", 3) == 0, "MAIL FROM: [%s]", r);
+	g_free(r);
+	r = lmtp_command(session, replies, "RCPT TO:<testuser1>\r\n");
+	fail_unless(strncmp(r, "250", 3) == 0, "RCPT TO: [%s]", r);
+	g_free(r);
+
+	/* RFC 3030: a BINARYMIME message cannot be sent with DATA */
+	r = lmtp_command(session, replies, "DATA\r\n");
+	fail_unless(strncmp(r, "503", 3) == 0, "DATA after BODY=BINARYMIME: [%s]", r);
+	g_free(r);
+
+	r = lmtp_bdat(session, replies, head, strlen(head), FALSE);
+	fail_unless(strncmp(r, "250", 3) == 0, "BDAT: [%s]", r);
+	g_free(r);
+	r = lmtp_bdat(session, replies, body, strlen(body), TRUE);
+	fail_unless(r[0] == '2' && strstr(r, "<testuser1> OK"), "BDAT LAST: [%s]", r);
+	g_free(r);
+	fail_unless(_inbox_count(user1, &inbox1) == before + 1);
+
+	/* a large message is spooled to a file, not kept in memory */
+	r = lmtp_command(session, replies, "MAIL FROM:<sender@example.org>\r\n");
+	g_free(r);
+	r = lmtp_command(session, replies, "RCPT TO:<testuser1>\r\n");
+	g_free(r);
+
+	big = g_malloc(biglen + 1);
+	memset(big, 'x', biglen);
+	memcpy(big, head, strlen(head));
+	big[biglen] = '\0';
+
+	r = lmtp_command(session, replies, "BDAT 16\r\n");
+	fail_unless(r[0] == '\0');
+	fail_unless(GMIME_IS_STREAM_MEM(session->spool), "small chunk not spooled in memory");
+	g_mime_stream_write(session->spool, big, 16);
+	session->chunk_size = 0;
+	session->parser_state = TRUE;
+	lmtp(session);
+	client_session_reset_parser(session);
+	g_free(lmtp_reply(replies));
+
+	g_snprintf(line, sizeof(line), "BDAT %zu LAST\r\n", biglen - 16);
+	fail_unless(lmtp_tokenizer(session, line) == 0);
+	fail_unless(! GMIME_IS_STREAM_MEM(session->spool), "large chunk spooled in memory");
+	g_mime_stream_write(session->spool, big + 16, biglen - 16);
+	session->chunk_size = 0;
+	session->parser_state = TRUE;
+	lmtp(session);
+	client_session_reset_parser(session);
+	r = lmtp_reply(replies);
+	fail_unless(r[0] == '2', "large BDAT LAST: [%s]", r);
+	g_free(r);
+	fail_unless(_inbox_count(user1, &inbox1) == before + 2);
+	g_free(big);
+
+	close(replies);
+	close(session->ci->tx);
+	pool = session->pool;
+	mempool_close(&pool);
+}
+END_TEST
 /**
  * \brief discards all input coming from instream
  * \param instream FILE stream holding input from a client
@@ -1001,6 +1352,9 @@ Suite *dbmail_deliver_suite(void)
 	suite_add_tcase(s, tc_pipe);
 	tcase_add_checked_fixture(tc_pipe, setup, teardown);
 	tcase_add_test(tc_pipe, test_insert_messages);
+	tcase_add_test(tc_pipe, test_insert_messages_batch);
+	tcase_add_test(tc_pipe, test_insert_messages_batch_duplicates);
+	tcase_add_test(tc_pipe, test_lmtp_bdat);
 
 	TCase *tc_misc = tcase_create("Misc");
 	suite_add_tcase(s, tc_misc);
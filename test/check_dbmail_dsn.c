@@ -250,6 +250,57 @@ START_TEST(test_resolve_userpart_catchall)
 }
 END_TEST
 
+START_TEST(test_resolve_cache)
+{
+	Delivery_T delivery;
+	unsigned hits, misses, hits_before, misses_before, statements;
+	uint64_t generation, generation_before;
+	char *cached = "testcachealias@nonexistantdomain";
+
+	dsnuser_cache_invalidate();
+
+	/* negative results are cached too */
+	dsnuser_init(&delivery);
+	delivery.address = cached;
+	dsnuser_resolve(&delivery);
+	fail_unless(delivery.dsn.class == DSN_CLASS_FAIL);
+	dsnuser_cache_stats(&hits_before, &misses_before);
+
+	dsnuser_init(&delivery);
+	delivery.address = cached;
+	statements = db_statement_count();
+	dsnuser_resolve(&delivery);
+	/* at most the aliases generation query */
+	fail_unless(db_statement_count() - statements <= 1, "cached lookup ran [%u] queries",
+			db_statement_count() - statements);
+	fail_unless(delivery.dsn.class == DSN_CLASS_FAIL);
+	dsnuser_cache_stats(&hits, &misses);
+	fail_unless(hits == hits_before + 1 && misses == misses_before);
+
+	/* adding the alias drops the cached negative result, and
+	 * tells other processes through the generation counter */
+	fail_unless(db_alias_generation(&generation_before) == DM_SUCCESS);
+	auth_addalias(useridnr, cached, 0);
+	fail_unless(db_alias_generation(&generation) == DM_SUCCESS);
+	fail_unless(generation > generation_before, "adding an alias did not bump the generation");
+
+	dsnuser_init(&delivery);
+	delivery.address = cached;
+	dsnuser_resolve(&delivery);
+	fail_unless(delivery.dsn.class == DSN_CLASS_OK);
+	fail_unless(g_list_length(delivery.userids) == 1);
+	fail_unless(*(uint64_t *)g_list_first(delivery.userids)->data == useridnr);
+	g_list_destroy(delivery.userids);
+
+	auth_removealias(useridnr, cached);
+
+	dsnuser_init(&delivery);
+	delivery.address = cached;
+	dsnuser_resolve(&delivery);
+	fail_unless(delivery.dsn.class == DSN_CLASS_FAIL);
+}
+END_TEST
+
 START_TEST(test_tostring)
 {
 	int res;
@@ -321,6 +372,7 @@ Suite *dbmail_dsn_suite(void)
 	tcase_add_test(tc_dsn, test_resolve_username_mailbox);
 	tcase_add_test(tc_dsn, test_resolve_domain_catchall);
 	tcase_add_test(tc_dsn, test_resolve_userpart_catchall);
+	tcase_add_test(tc_dsn, test_resolve_cache);
 	tcase_add_test(tc_dsn, test_tostring);
 	return s;
 }
@@ -189,6 +189,64 @@ START_TEST(test_imap_session_new)
 }
 END_TEST
 
+/*
+ * expunge should use a number of statements that depends on
+ * the number of slices, not the number of messages
+ */
+#define EXPUNGE_COUNT 2000
+START_TEST(test_imap_session_expunge)
+{
+	ImapSession *s;
+	DbmailMessage *message;
+	MailboxState_T M;
+	uint64_t i, userid, boxid, msgid, modseq = 0;
+	unsigned before, used;
+	char expect[64];
+	Mempool_T pool = mempool_open();
+
+	auth_user_exists("testuser1", &userid);
+	db_find_create_mailbox("expunge.TMP", BOX_COMMANDLINE, userid, &boxid);
+
+	message = dbmail_message_new(NULL);
+	message = dbmail_message_init_with_string(message, multipart_message);
+	dbmail_message_store(message);
+	for (i = 0; i < EXPUNGE_COUNT; i++)
+		db_copymsg(message->msg_idnr, boxid, userid, &msgid, TRUE);
+	dbmail_message_free(message);
+	db_update("UPDATE %smessages SET deleted_flag=1 WHERE mailbox_idnr=%" PRIu64 "",
+			DBPFX, boxid);
+
+	s = dbmail_imap_session_new(pool);
+	s->userid = userid;
+	s->command_type = IMAP_COMM_EXPUNGE;
+	/* keep responses in the buffer */
+	s->state = CLIENTSTATE_LOGOUT;
+	s->mailbox = dbmail_mailbox_new(pool, boxid);
+	M = s->mailbox->mbstate = MailboxState_new(NULL, boxid);
+	MailboxState_setPermission(M, IMAPPERM_READWRITE);
+	fail_unless(MailboxState_getExists(M) == EXPUNGE_COUNT);
+
+	before = db_statement_count();
+	fail_unless(dbmail_imap_session_mailbox_expunge(s, NULL, &modseq) == DM_SUCCESS);
+	used = db_statement_count() - before;
+
+	fail_unless(used <= (2 * EXPUNGE_COUNT / 500) + 10,
+			"expunge used [%u] statements", used);
+	fail_unless(modseq > 0);
+	fail_unless(MailboxState_getExists(M) == 0);
+
+	/* highest msn first, so every EXPUNGE is for msn 1 .. n in reverse */
+	snprintf(expect, sizeof(expect), "* %d EXPUNGE\r\n", EXPUNGE_COUNT);
+	fail_unless(strncmp(p_string_str(s->buff), expect, strlen(expect)) == 0);
+	fail_unless(g_str_has_suffix(p_string_str(s->buff), "* 1 EXPUNGE\r\n"));
+
+	MailboxState_free(&M);
+	s->mailbox->mbstate = NULL;
+	db_delete_mailbox(boxid, 0, 0);
+	dbmail_imap_session_delete(&s);
+}
+END_TEST
+
 START_TEST(test_imap_get_structure)
 {
 	DbmailMessage *message;
@@ -1048,6 +1106,7 @@ Suite *dbmail_suite(void)
 	
 	tcase_add_checked_fixture(tc_session, setup, teardown);
 	tcase_add_test(tc_session, test_imap_session_new);
+	tcase_add_test(tc_session, test_imap_session_expunge);
 	tcase_add_test(tc_session, test_imap_get_structure);
 	tcase_add_test(tc_session, test_imap_cleanup_address);
 	tcase_add_test(tc_session, test_internet_address_list_parse_string);
@@ -470,6 +470,53 @@ START_TEST(test_dbmail_mailbox_orderedsubject)
 
 }
 END_TEST
+static void _add_found(DbmailMailbox *mb, uint64_t uid, uint64_t msn)
+{
+	uint64_t *k = g_new0(uint64_t, 1);
+	uint64_t *v = g_new0(uint64_t, 1);
+	*k = uid;
+	*v = msn;
+	g_tree_insert(mb->found, k, v);
+}
+
+START_TEST(test_dbmail_mailbox_esearch)
+{
+	char *res;
+	Mempool_T pool = mempool_open();
+	DbmailMailbox *mb = dbmail_mailbox_new(pool, get_mailbox_id("INBOX"));
+
+	mb->found = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)g_free,(GDestroyNotify)g_free);
+
+	res = dbmail_mailbox_esearch(mb, ESEARCH_COUNT, FALSE);
+	fail_unless(MATCH(res, "COUNT 0"), "esearch failed [%s]", res);
+	g_free(res);
+
+	_add_found(mb, 10, 1);
+	_add_found(mb, 11, 2);
+	_add_found(mb, 12, 3);
+	_add_found(mb, 20, 5);
+	_add_found(mb, 30, 8);
+	_add_found(mb, 31, 9);
+
+	dbmail_mailbox_set_uid(mb, TRUE);
+	res = dbmail_mailbox_esearch(mb, ESEARCH_MIN|ESEARCH_MAX|ESEARCH_COUNT|ESEARCH_ALL, FALSE);
+	fail_unless(MATCH(res, "MIN 10 MAX 31 COUNT 6 ALL 10:12,20,30:31"), "esearch failed [%s]", res);
+	g_free(res);
+
+	dbmail_mailbox_set_uid(mb, FALSE);
+	res = dbmail_mailbox_esearch(mb, ESEARCH_ALL, FALSE);
+	fail_unless(MATCH(res, "ALL 1:3,5,8:9"), "esearch failed [%s]", res);
+	g_free(res);
+
+	res = dbmail_mailbox_esearch(mb, ESEARCH_COUNT, FALSE);
+	fail_unless(MATCH(res, "COUNT 6"), "esearch failed [%s]", res);
+	g_free(res);
+
+	dbmail_mailbox_free(mb);
+	mempool_close(&pool);
+}
+END_TEST
+
 START_TEST(test_dbmail_mailbox_get_set)
 {
 	guint c, d, r;
@@ -620,6 +667,7 @@ Suite *dbmail_mailbox_suite(void)
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_parsed_1);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_parsed_2);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_orderedsubject);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_esearch);
 
 	return s;
 }
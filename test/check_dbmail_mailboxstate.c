@@ -33,8 +33,13 @@
 
 #include <check.h>
 #include "check_dbmail.h"
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#endif
 
 extern char configFile[PATH_MAX];
+extern DBParam_T db_params;
+#define DBPFX db_params.pfx
 
 #define TESTBOX "testbox.TMP"
 uint64_t testboxid = 0;
@@ -53,7 +58,7 @@ static uint64_t get_mailbox_id(const char *name)
 	return id;
 }
 
-static void insert_message(void)
+static uint64_t insert_message(void)
 {
 	uint64_t newmsgidnr = 0;
 	DbmailMessage *message;
@@ -61,6 +66,8 @@ static void insert_message(void)
 	message = dbmail_message_init_with_string(message,multipart_message);
 	dbmail_message_store(message);
 	db_copymsg(message->msg_idnr, testboxid, testuserid, &newmsgidnr, TRUE);
+	dbmail_message_free(message);
+	return newmsgidnr;
 }
 
 void setup(void)
@@ -106,6 +113,166 @@ START_TEST(test_metadata)
 }
 END_TEST
 
+START_TEST(test_counters)
+{
+	uint64_t id1, id2, uidnext;
+	int flags[IMAP_NFLAGS];
+	MailboxState_T M;
+
+	id1 = insert_message();
+	id2 = insert_message();
+
+	M = MailboxState_new(NULL, testboxid);
+	fail_unless(MailboxState_getExists(M) == 2);
+	fail_unless(MailboxState_getUnseen(M) == 2);
+	fail_unless(MailboxState_getRecent(M) == 2);
+	uidnext = MailboxState_getUidnext(M);
+	fail_unless(uidnext == id2 + 1, "uidnext [%" PRIu64 "] != [%" PRIu64 "]", uidnext, id2 + 1);
+
+	/* setting a flag twice counts once */
+	memset(flags, 0, sizeof(flags));
+	flags[IMAP_FLAG_SEEN] = 1;
+	fail_unless(db_set_msgflag(id1, flags, NULL, IMAPFA_ADD, 0, NULL) == 1);
+	fail_unless(db_set_msgflag(id1, flags, NULL, IMAPFA_ADD, 0, NULL) >= 0);
+	MailboxState_count(M);
+	fail_unless(MailboxState_getUnseen(M) == 1, "unseen counter not updated");
+
+	memset(flags, 0, sizeof(flags));
+	flags[IMAP_FLAG_RECENT] = 1;
+	fail_unless(db_set_msgflag(id1, flags, NULL, IMAPFA_REMOVE, 0, NULL) == 1);
+	MailboxState_count(M);
+	fail_unless(MailboxState_getExists(M) == 2);
+	fail_unless(MailboxState_getRecent(M) == 1, "recent counter not updated");
+
+	/* only the flags that actually change are counted */
+	fail_unless(db_set_msgflag(id1, flags, NULL, IMAPFA_REMOVE, 0, NULL) >= 0);
+	memset(flags, 0, sizeof(flags));
+	flags[IMAP_FLAG_SEEN] = 1;
+	flags[IMAP_FLAG_FLAGGED] = 1;
+	fail_unless(db_set_msgflag(id1, flags, NULL, IMAPFA_REPLACE, 0, NULL) == 1);
+	MailboxState_count(M);
+	fail_unless(MailboxState_getUnseen(M) == 1);
+	fail_unless(MailboxState_getRecent(M) == 1);
+	fail_unless(db_icheck_mailbox_counters(FALSE) == 0, "flag counters drifted");
+
+	/* expunged messages leave the counters, but not uidnext */
+	fail_unless(db_set_message_status(id2, MESSAGE_STATUS_DELETE));
+	MailboxState_count(M);
+	fail_unless(MailboxState_getExists(M) == 1);
+	fail_unless(MailboxState_getUnseen(M) == 0);
+	fail_unless(MailboxState_getRecent(M) == 0);
+
+	fail_unless(db_set_message_status(id1, MESSAGE_STATUS_DELETE));
+	MailboxState_count(M);
+	fail_unless(MailboxState_getExists(M) == 0);
+	fail_unless(MailboxState_getUidnext(M) == uidnext, "uidnext reset on empty mailbox");
+
+	/* introduce drift, detect and repair it */
+	db_update("UPDATE %smailboxes SET exists_count = 7, uidnext = 1 "
+			"WHERE mailbox_idnr = %" PRIu64 "", DBPFX, testboxid);
+	fail_unless(db_icheck_mailbox_counters(FALSE) > 0, "drift not detected");
+	fail_unless(db_icheck_mailbox_counters(TRUE) > 0);
+	fail_unless(db_icheck_mailbox_counters(FALSE) == 0, "drift not repaired");
+
+	MailboxState_count(M);
+	fail_unless(MailboxState_getExists(M) == 0);
+	fail_unless(MailboxState_getUidnext(M) == uidnext);
+	MailboxState_free(&M);
+}
+END_TEST
+
+START_TEST(test_count_list)
+{
+	GList *states = NULL;
+	MailboxState_T M, N;
+	uint64_t id, uidnext, inbox = get_mailbox_id("INBOX");
+
+	id = insert_message();
+
+	M = MailboxState_new(NULL, 0);
+	MailboxState_setId(M, testboxid);
+	N = MailboxState_new(NULL, 0);
+	MailboxState_setId(N, inbox);
+	states = g_list_append(states, M);
+	states = g_list_append(states, N);
+
+	fail_unless(MailboxState_countList(states, 0) == DM_SUCCESS);
+	fail_unless(MailboxState_getExists(M) == 1);
+	fail_unless(MailboxState_getUnseen(M) == 1);
+	fail_unless(MailboxState_getRecent(M) == 1);
+	fail_unless(MailboxState_getUidnext(M) > 1);
+	fail_unless(MailboxState_getSeq(M) > 0);
+
+	/* an emptied mailbox keeps its uidnext */
+	uidnext = MailboxState_getUidnext(M);
+	fail_unless(db_set_message_status(id, MESSAGE_STATUS_DELETE));
+	fail_unless(MailboxState_countList(states, 0) == DM_SUCCESS);
+	fail_unless(MailboxState_getExists(M) == 0);
+	fail_unless(MailboxState_getUidnext(M) == uidnext, "uidnext reset on empty mailbox");
+
+	g_list_free(states);
+	MailboxState_free(&M);
+
+	/* must agree with the single mailbox path */
+	M = MailboxState_new(NULL, 0);
+	MailboxState_setId(M, inbox);
+	MailboxState_count(M);
+	fail_unless(MailboxState_getExists(M) == MailboxState_getExists(N));
+	fail_unless(MailboxState_getUnseen(M) == MailboxState_getUnseen(N));
+	fail_unless(MailboxState_getUidnext(M) == MailboxState_getUidnext(N));
+
+	MailboxState_free(&M);
+	MailboxState_free(&N);
+}
+END_TEST
+
+START_TEST(test_shared)
+{
+	int i;
+	unsigned loads;
+	uint64_t uid;
+	GList *ids;
+	MailboxState_T S[5];
+
+	insert_message();
+	insert_message();
+
+	loads = MailboxState_loads();
+	for (i = 0; i < 5; i++)
+		S[i] = MailboxState_new(NULL, testboxid);
+	fail_unless(MailboxState_loads() - loads == 1, "sessions on one mailbox should share one load");
+
+	for (i = 1; i < 5; i++) {
+		fail_unless(MailboxState_getMsginfo(S[i]) == MailboxState_getMsginfo(S[0]));
+		fail_unless(MailboxState_getExists(S[i]) == 2);
+	}
+
+	/* changes are private to the state that makes them */
+	ids = g_tree_keys(MailboxState_getIds(S[0]));
+	uid = *(uint64_t *)ids->data;
+	g_list_free(ids);
+
+	fail_unless(MailboxState_removeUid(S[0], uid) == DM_SUCCESS);
+	fail_unless(MailboxState_getMsginfo(S[0]) != MailboxState_getMsginfo(S[1]));
+	fail_unless(MailboxState_getMsnByUid(S[0], uid) == 0);
+	fail_unless(MailboxState_getMsnByUid(S[1], uid) == 1);
+	fail_unless(g_tree_nnodes(MailboxState_getIds(S[0])) == 1);
+	fail_unless(g_tree_nnodes(MailboxState_getIds(S[1])) == 2);
+
+	for (i = 0; i < 5; i++)
+		if (i != 1) MailboxState_free(&S[i]);
+
+	/* a new seq means a new load */
+	db_mailbox_seq_update(testboxid, 0);
+	loads = MailboxState_loads();
+	S[0] = MailboxState_new(NULL, testboxid);
+	fail_unless(MailboxState_loads() - loads == 1);
+	fail_unless(MailboxState_getMsginfo(S[0]) != MailboxState_getMsginfo(S[1]));
+	MailboxState_free(&S[0]);
+	MailboxState_free(&S[1]);
+}
+END_TEST
+
 static void mailboxstate_destroy(MailboxState_T M)
 {
 	MailboxState_free(&M);
@@ -135,6 +302,292 @@ START_TEST(test_mbxinfo)
 }
 END_TEST
 
+START_TEST(test_rights)
+{
+	unsigned rights = 0;
+	MailboxState_T M = MailboxState_new(NULL, 0);
+	MailboxState_setId(M, testboxid);
+
+	fail_unless(MailboxState_getRights(M, testuserid, 0, &rights) == DM_SUCCESS);
+	fail_unless(rights == ACL_RIGHTS_ALL, "owner should have all rights");
+
+	MailboxState_setPermission(M, IMAPPERM_READWRITE);
+	fail_unless(acl_has_right(M, testuserid, ACL_RIGHT_POST) == TRUE);
+	fail_unless(acl_get_rights(M, testuserid, &rights) == DM_SUCCESS);
+	fail_unless(rights == ACL_RIGHTS_ALL);
+
+	acl_set_rights(testuserid, testboxid, "lr");
+	fail_unless(acl_has_right(M, testuserid, ACL_RIGHT_READ) == TRUE);
+	fail_unless(acl_has_right(M, testuserid, ACL_RIGHT_POST) == FALSE, "stale ACL cache");
+
+	acl_delete_acl(testuserid, testboxid);
+	fail_unless(acl_has_right(M, testuserid, ACL_RIGHT_POST) == TRUE, "stale ACL cache");
+
+	MailboxState_free(&M);
+}
+END_TEST
+
+START_TEST(test_rights_list)
+{
+	unsigned rights = 0, expect = 0;
+	GList *states = NULL;
+	MailboxState_T M = MailboxState_new(NULL, 0);
+	MailboxState_T N = MailboxState_new(NULL, 0);
+	MailboxState_setId(M, testboxid);
+	MailboxState_setId(N, get_mailbox_id("INBOX"));
+	states = g_list_append(states, M);
+	states = g_list_append(states, N);
+
+	fail_unless(MailboxState_countList(states, testuserid) == DM_SUCCESS);
+	fail_unless(MailboxState_getRights(M, testuserid, 0, &rights) == DM_SUCCESS);
+	fail_unless(rights == ACL_RIGHTS_ALL, "owner should have all rights");
+
+	/* an acl on one mailbox restricts the owner there only */
+	acl_set_rights(testuserid, testboxid, "lr");
+	fail_unless(MailboxState_countList(states, testuserid) == DM_SUCCESS);
+	expect = (1 << ACL_RIGHT_LOOKUP) | (1 << ACL_RIGHT_READ);
+	fail_unless(MailboxState_getRights(M, testuserid, 0, &rights) == DM_SUCCESS);
+	fail_unless(rights == expect, "rights [%#x] != [%#x]", rights, expect);
+	fail_unless(MailboxState_getRights(N, testuserid, 0, &rights) == DM_SUCCESS);
+	fail_unless(rights == ACL_RIGHTS_ALL);
+
+	acl_delete_acl(testuserid, testboxid);
+	g_list_free(states);
+	MailboxState_free(&M);
+	MailboxState_free(&N);
+}
+END_TEST
+
+/*
+ * expunge every other message, lowest uid first, and
+ * return the time it took in microseconds
+ */
+static gint64 expunge_time(uint64_t total, uint64_t expunge)
+{
+	uint64_t uid, *msn, *last;
+	gint64 start, elapsed;
+	MailboxState_T M = MailboxState_new(NULL, 0);
+	MailboxState_setPermission(M, IMAPPERM_READWRITE);
+
+	for (uid = 1; uid <= total; uid++) {
+		MessageInfo *info = g_new0(MessageInfo, 1);
+		info->uid = uid;
+		info->status = MESSAGE_STATUS_SEEN;
+		MailboxState_addMsginfo(M, uid, info);
+	}
+	MailboxState_setExists(M, total);
+	fail_unless(MailboxState_getMsnByUid(M, total) == total);
+	last = g_tree_lookup(MailboxState_getIds(M), &total);
+	fail_unless(last && *last == total);
+
+	start = g_get_monotonic_time();
+	for (uid = 1; uid < expunge * 2; uid += 2) {
+		fail_unless(MailboxState_getMsnByUid(M, uid) == (uid + 1) / 2);
+		fail_unless(MailboxState_removeUid(M, uid) == DM_SUCCESS);
+	}
+	elapsed = g_get_monotonic_time() - start;
+
+	fail_unless(MailboxState_getExists(M) == total - expunge);
+	fail_unless(MailboxState_getMsnByUid(M, expunge * 2) == expunge);
+	fail_unless(MailboxState_getMsnByUid(M, total) == total - expunge);
+
+	/* no removal rewrote the stored msn values: the lookups above
+	 * went through the index, the trees are renumbered once below */
+	fail_unless(*last == total, "msn renumbered on removal");
+
+	msn = g_tree_lookup(MailboxState_getIds(M), &total);
+	fail_unless(msn == last);
+	fail_unless(*msn == total - expunge, "renumbering failed");
+	fail_unless(g_tree_nnodes(MailboxState_getMsn(M)) == (gint)(total - expunge));
+
+	MailboxState_free(&M);
+
+	return elapsed;
+}
+
+START_TEST(test_expunge_scaling)
+{
+	gint64 small = expunge_time(100000, 50000);
+	gint64 large = expunge_time(200000, 100000);
+
+	/* timings are only logged: wall-clock asserts fail on busy hosts */
+	TRACE(TRACE_INFO, "expunge 50k/100k [%" PRId64 "]us 100k/200k [%" PRId64 "]us",
+			small, large);
+}
+END_TEST
+
+#define SEQ_THREADS 8
+#define SEQ_ROUNDS 50
+
+static gpointer seq_worker(gpointer data)
+{
+	uint64_t *seqs = (uint64_t *)data;
+	int i;
+	for (i = 0; i < SEQ_ROUNDS; i++)
+		seqs[i] = db_mailbox_seq_update(testboxid, 0);
+	return NULL;
+}
+
+static int seq_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+START_TEST(test_seq_threads)
+{
+	GThread *threads[SEQ_THREADS];
+	uint64_t seqs[SEQ_THREADS * SEQ_ROUNDS];
+	uint64_t first, last, newid = 0;
+	volatile uint64_t mailbox_seq = 0, message_seq = 0;
+	Connection_T c; ResultSet_T r;
+	DbmailMessage *message;
+	int i;
+
+	for (i = 0; i < SEQ_THREADS; i++)
+		threads[i] = g_thread_new("seq", seq_worker, &seqs[i * SEQ_ROUNDS]);
+	for (i = 0; i < SEQ_THREADS; i++)
+		g_thread_join(threads[i]);
+
+	/* every allocation is unique and none are lost */
+	qsort(seqs, SEQ_THREADS * SEQ_ROUNDS, sizeof(uint64_t), seq_cmp);
+	fail_unless(seqs[0] > 0);
+	for (i = 1; i < SEQ_THREADS * SEQ_ROUNDS; i++)
+		fail_unless(seqs[i] == seqs[i-1] + 1, "modseq [%" PRIu64 "] handed out twice or skipped", seqs[i]);
+
+	/* copies stamped with a preallocated seq do not bump the mailbox */
+	message = dbmail_message_new(NULL);
+	message = dbmail_message_init_with_string(message, multipart_message);
+	dbmail_message_store(message);
+
+	first = db_mailbox_seq_update(testboxid, 0);
+	for (i = 0; i < 10; i++)
+		fail_unless(db_copymsg_seq(message->msg_idnr, testboxid, testuserid, &newid, TRUE, first) != DM_EQUERY);
+	last = db_mailbox_seq_update(testboxid, 0);
+	fail_unless(last == first + 1, "batch copy bumped modseq [%" PRIu64 "] times", last - first - 1);
+
+	/* a single copy carries the modseq it allocated */
+	fail_unless(db_copymsg_seq(message->msg_idnr, testboxid, testuserid, &newid, TRUE, 0) != DM_EQUERY);
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT b.seq, m.seq FROM %smailboxes b JOIN %smessages m "
+				"ON m.mailbox_idnr = b.mailbox_idnr WHERE m.message_idnr = %" PRIu64 "",
+				DBPFX, DBPFX, newid);
+		if (db_result_next(r)) {
+			mailbox_seq = db_result_get_u64(r, 0);
+			message_seq = db_result_get_u64(r, 1);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+	fail_unless(mailbox_seq == last + 1, "copy did not allocate a modseq");
+	fail_unless(message_seq == mailbox_seq, "copy stamped with [%" PRIu64 "], mailbox at [%" PRIu64 "]",
+			message_seq, mailbox_seq);
+	dbmail_message_free(message);
+}
+END_TEST
+
+START_TEST(test_compact)
+{
+	uint64_t uid, total = 100;
+	unsigned refs = MailboxState_keyword_refs();
+	GList *keywords = g_list_append(NULL, "$CompactTest");
+	MessageInfo *msginfo;
+	MailboxState_T M;
+
+	M = MailboxState_new(NULL, 0);
+	MailboxState_setPermission(M, IMAPPERM_READWRITE);
+	for (uid = 1; uid <= total; uid++) {
+		MessageInfo *info = g_new0(MessageInfo, 1);
+		info->status = MESSAGE_STATUS_SEEN;
+		MessageInfo_mergeKeywords(info, keywords, IMAPFA_ADD);
+		MailboxState_addMsginfo(M, uid, info);
+	}
+	MailboxState_setExists(M, total);
+	fail_unless(MailboxState_keyword_refs() == refs + 1);
+
+	/* not worth moving yet */
+	for (uid = 1; uid <= 10; uid++)
+		fail_unless(MailboxState_removeUid(M, uid) == DM_SUCCESS);
+	MailboxState_compact(M);
+	fail_unless(MailboxState_getGarbage(M) == 10);
+
+	/* expunged and replaced records are both reclaimed */
+	for (uid = 11; uid <= 60; uid++)
+		fail_unless(MailboxState_removeUid(M, uid) == DM_SUCCESS);
+	for (uid = 91; uid <= total; uid++) {
+		MessageInfo *info = g_new0(MessageInfo, 1);
+		info->status = MESSAGE_STATUS_SEEN;
+		MailboxState_addMsginfo(M, uid, info);
+	}
+	fail_unless(MailboxState_getGarbage(M) == 70);
+
+	MailboxState_compact(M);
+	fail_unless(MailboxState_getGarbage(M) == 0);
+	fail_unless(g_tree_nnodes(MailboxState_getMsginfo(M)) == 40);
+	fail_unless(MailboxState_getMsnByUid(M, 61) == 1);
+	fail_unless(MailboxState_getMsnByUid(M, total) == 40);
+
+	uid = 61;
+	msginfo = g_tree_lookup(MailboxState_getMsginfo(M), &uid);
+	fail_unless(msginfo && g_list_length(msginfo->keywords) == 1, "keywords lost in compaction");
+	fail_unless(MATCH((char *)msginfo->keywords->data, "$CompactTest"));
+
+	/* keywords go away with the last message that carries them */
+	MailboxState_free(&M);
+	fail_unless(MailboxState_keyword_refs() == refs, "keyword leaked");
+	g_list_free(keywords);
+}
+END_TEST
+
+static size_t heap_used(void)
+{
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+START_TEST(test_memory)
+{
+	uint64_t uid, total = 1000000;
+	size_t before, after;
+	const char *kw[] = { "$Forwarded", "$Junk", "NonJunk" };
+	MailboxState_T M;
+
+	before = heap_used();
+
+	M = MailboxState_new(NULL, 0);
+	MailboxState_setPermission(M, IMAPPERM_READWRITE);
+	for (uid = 1; uid <= total; uid++) {
+		MessageInfo *info = g_new0(MessageInfo, 1);
+		GList *keywords = g_list_append(NULL, (gpointer)kw[uid % 3]);
+		info->status = MESSAGE_STATUS_SEEN;
+		info->internaldate = (time_t)uid;
+		MSGINFO_SET_FLAG(info, IMAP_FLAG_SEEN, uid % 2);
+		MessageInfo_mergeKeywords(info, keywords, IMAPFA_ADD);
+		g_list_free(keywords);
+		MailboxState_addMsginfo(M, uid, info);
+	}
+
+	after = heap_used();
+
+	fail_unless(MailboxState_getMsnByUid(M, total) == total);
+	fail_unless(g_tree_nnodes(MailboxState_getMsginfo(M)) == (gint)total);
+
+	if (after > before) {
+		size_t per = (after - before) / total;
+		TRACE(TRACE_INFO, "MailboxState memory per message [%zu] bytes", per);
+		fail_unless(per < 300, "MailboxState uses [%zu] bytes per message", per);
+	}
+
+	MailboxState_free(&M);
+}
+END_TEST
 
 Suite *dbmail_common_suite(void)
 {
@@ -146,7 +599,16 @@ Suite *dbmail_common_suite(void)
 	tcase_add_checked_fixture(tc_state, setup, teardown);
 	tcase_add_test(tc_state, test_createdestroy);
 	tcase_add_test(tc_state, test_metadata);
+	tcase_add_test(tc_state, test_counters);
+	tcase_add_test(tc_state, test_count_list);
 	tcase_add_test(tc_state, test_mbxinfo);
+	tcase_add_test(tc_state, test_shared);
+	tcase_add_test(tc_state, test_rights);
+	tcase_add_test(tc_state, test_rights_list);
+	tcase_add_test(tc_state, test_expunge_scaling);
+	tcase_add_test(tc_state, test_seq_threads);
+	tcase_add_test(tc_state, test_compact);
+	tcase_add_test(tc_state, test_memory);
 
 	return s;
 }
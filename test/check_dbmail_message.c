@@ -33,6 +33,9 @@
 
 #include <check.h>
 #include "check_dbmail.h"
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#endif
 
 extern char configFile[PATH_MAX];
 extern char *multipart_message;
@@ -505,6 +508,192 @@ START_TEST(test_dbmail_message_retrieve)
 
 }
 END_TEST
+static size_t heap_used(void)
+{
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+static char * stream_message(uint64_t physid, size_t max)
+{
+	DbmailMessageStream *S;
+	GString *s = g_string_new("");
+	int r;
+
+	S = dbmail_message_stream_new(physid);
+	fail_unless(S != NULL, "dbmail_message_stream_new failed");
+	while ((r = dbmail_message_stream_read(S, s, s->len + max)) > 0)
+		;
+	fail_unless(r == 0, "dbmail_message_stream_read failed");
+	dbmail_message_stream_free(S);
+
+	return g_string_free(s, FALSE);
+}
+
+START_TEST(test_dbmail_message_stream)
+{
+	DbmailMessage *m, *n;
+	uint64_t physid;
+	char *expect, *result, *s;
+	size_t max[] = { 1, 64, 65536 };
+	unsigned i;
+
+	m = message_init(multipart_message);
+	dbmail_message_store(m);
+	physid = dbmail_message_get_physid(m);
+	dbmail_message_free(m);
+
+	n = dbmail_message_new(NULL);
+	n = dbmail_message_retrieve(n, physid);
+	expect = dbmail_message_to_string(n);
+	dbmail_message_free(n);
+
+	for (i = 0; i < G_N_ELEMENTS(max); i++) {
+		s = stream_message(physid, max[i]);
+		n = message_init(s);
+		result = dbmail_message_to_string(n);
+		COMPARE(expect, result);
+		dbmail_message_free(n);
+		g_free(result);
+		g_free(s);
+	}
+	g_free(expect);
+}
+END_TEST
+
+START_TEST(test_dbmail_message_stream_large)
+{
+	DbmailMessage *m;
+	DbmailMessageStream *S;
+	GString *raw, *chunk;
+	uint64_t physid, total = 0;
+	size_t before, peak = 0;
+	gint64 start, elapsed;
+	int i, j, r;
+
+	/* 25 attachments of 1MB each */
+	raw = g_string_new("From: nobody@example.org\n"
+			"To: nobody@example.org\n"
+			"Subject: large\n"
+			"MIME-Version: 1.0\n"
+			"Content-Type: multipart/mixed; boundary=\"streamtest\"\n"
+			"\n"
+			"preamble\n");
+	for (i = 0; i < 25; i++) {
+		g_string_append_printf(raw, "--streamtest\n"
+				"Content-Type: application/octet-stream\n"
+				"Content-Transfer-Encoding: base64\n"
+				"\n");
+		for (j = 0; j < 16384; j++)
+			g_string_append(raw, "QUJDREVGR0hJSktMTU5PUFFSU1RVVldYWVphYmNkZWZnaGlqa2xtbm9wcXJzdHV2\n");
+	}
+	g_string_append(raw, "--streamtest--\n");
+
+	m = message_init(raw->str);
+	g_string_free(raw, TRUE);
+	dbmail_message_store(m);
+	physid = dbmail_message_get_physid(m);
+	dbmail_message_free(m);
+
+	before = heap_used();
+	start = g_get_monotonic_time();
+
+	S = dbmail_message_stream_new(physid);
+	fail_unless(S != NULL, "dbmail_message_stream_new failed");
+	chunk = g_string_sized_new(65536);
+	do {
+		size_t used;
+		r = dbmail_message_stream_read(S, chunk, 65536);
+		used = heap_used();
+		if (used > before && (used - before) > peak)
+			peak = used - before;
+		total += chunk->len;
+		g_string_truncate(chunk, 0);
+	} while (r > 0);
+	g_string_free(chunk, TRUE);
+	dbmail_message_stream_free(S);
+
+	elapsed = g_get_monotonic_time() - start;
+
+	fail_unless(r == 0, "dbmail_message_stream_read failed");
+	fail_unless(total > 25 * 1024 * 1024, "short stream [%" PRIu64 "]", total);
+
+	TRACE(TRACE_INFO, "streamed [%" PRIu64 "] bytes in [%" PRId64 "] usec, peak heap [%zu] bytes",
+			total, elapsed, peak);
+	fail_unless(peak < 8 * 1024 * 1024, "streaming used [%zu] bytes of heap", peak);
+}
+END_TEST
+
+START_TEST(test_dbmail_message_stream_slices)
+{
+	DbmailMessage *m, *n;
+	DbmailMessageStream *S;
+	GString *raw, *chunk;
+	uint64_t physid;
+	size_t before, peak = 0;
+	char *expect, *result, *s;
+	int j, r;
+
+	/* a single part of 25MB */
+	raw = g_string_new("From: nobody@example.org\n"
+			"To: nobody@example.org\n"
+			"Subject: slices\n"
+			"MIME-Version: 1.0\n"
+			"Content-Type: multipart/mixed; boundary=\"slicetest\"\n"
+			"\n"
+			"--slicetest\n"
+			"Content-Type: application/octet-stream\n"
+			"Content-Transfer-Encoding: base64\n"
+			"\n");
+	for (j = 0; j < 409600; j++)
+		g_string_append(raw, "QUJDREVGR0hJSktMTU5PUFFSU1RVVldYWVphYmNkZWZnaGlqa2xtbm9wcXJzdHV2\n");
+	g_string_append(raw, "--slicetest--\n");
+
+	m = message_init(raw->str);
+	g_string_free(raw, TRUE);
+	dbmail_message_store(m);
+	physid = dbmail_message_get_physid(m);
+	dbmail_message_free(m);
+
+	before = heap_used();
+	S = dbmail_message_stream_new(physid);
+	fail_unless(S != NULL, "dbmail_message_stream_new failed");
+	chunk = g_string_sized_new(65536);
+	do {
+		size_t used;
+		r = dbmail_message_stream_read(S, chunk, 65536);
+		used = heap_used();
+		if (used > before && (used - before) > peak)
+			peak = used - before;
+		g_string_truncate(chunk, 0);
+	} while (r > 0);
+	g_string_free(chunk, TRUE);
+	dbmail_message_stream_free(S);
+
+	fail_unless(r == 0, "dbmail_message_stream_read failed");
+	fail_unless(peak < 8 * 1024 * 1024, "streaming used [%zu] bytes of heap", peak);
+
+	/* the slices add up to the part */
+	n = dbmail_message_new(NULL);
+	n = dbmail_message_retrieve(n, physid);
+	expect = dbmail_message_to_string(n);
+	dbmail_message_free(n);
+
+	s = stream_message(physid, 65536);
+	n = message_init(s);
+	result = dbmail_message_to_string(n);
+	fail_unless(strlen(result) == strlen(expect), "length [%zu] != [%zu]", strlen(result), strlen(expect));
+	fail_unless(strcmp(result, expect) == 0, "sliced stream differs");
+	dbmail_message_free(n);
+	g_free(result);
+	g_free(expect);
+	g_free(s);
+}
+END_TEST
 //DbmailMessage * dbmail_message_init_with_string(DbmailMessage *self, const GString *content);
 START_TEST(test_dbmail_message_init_with_string)
 {
@@ -520,6 +709,34 @@ START_TEST(test_dbmail_message_init_with_string)
 }
 END_TEST
 
+START_TEST(test_dbmail_message_init_with_stream)
+{
+	DbmailMessage *m, *n;
+	GMimeStream *stream;
+	char *a, *b;
+	size_t i, l = strlen(multipart_message);
+
+	/* fed in chunks, the way BDAT data arrives */
+	stream = g_mime_stream_mem_new();
+	for (i = 0; i < l; i += 100)
+		g_mime_stream_write(stream, multipart_message + i, min(100, l - i));
+
+	m = dbmail_message_new(NULL);
+	m = dbmail_message_init_with_stream(m, stream);
+	n = message_init(multipart_message);
+
+	fail_unless(dbmail_message_get_size(m, TRUE) == dbmail_message_get_size(n, TRUE));
+	a = dbmail_message_to_string(m);
+	b = dbmail_message_to_string(n);
+	fail_unless(MATCH(a, b), "init_with_stream differs from init_with_string");
+	g_free(a);
+	g_free(b);
+
+	dbmail_message_free(m);
+	dbmail_message_free(n);
+}
+END_TEST
+
 START_TEST(test_dbmail_message_get_internal_date)
 {
 	DbmailMessage *m;
@@ -828,6 +1045,51 @@ START_TEST(test_dbmail_message_get_header_repeated)
 }
 END_TEST
 
+START_TEST(test_dbmail_message_get_header_decoded)
+{
+	GList *decoded, *cached = NULL;
+	DbmailMessage *m;
+	const char *messages[] = { utf8_long_header, multipart_message, NULL };
+	const char *headers[] = { "Subject", "From", "To", NULL };
+	uint64_t physid;
+	int i, j;
+
+	/* the fallback decodes like the header cache */
+	for (j = 0; messages[j]; j++) {
+		m = dbmail_message_new(NULL);
+		m = dbmail_message_init_with_string(m, messages[j]);
+		dbmail_message_store(m);
+		physid = dbmail_message_get_physid(m);
+
+		for (i = 0; headers[i]; i++) {
+			decoded = dbmail_message_get_header_decoded(m, headers[i]);
+			fail_unless(db_get_cached_header(physid, headers[i], &cached) == DM_SUCCESS);
+			fail_unless(g_list_length(decoded) == g_list_length(cached), "[%s] count differs", headers[i]);
+			if (decoded)
+				fail_unless(MATCH((char *)decoded->data, (char *)cached->data),
+						"[%s] decoded [%s] cached [%s]", headers[i],
+						(char *)decoded->data, (char *)cached->data);
+			g_list_destroy(decoded);
+			g_list_destroy(cached);
+			cached = NULL;
+		}
+		dbmail_message_free(m);
+	}
+
+	/* repeated headers keep message order */
+	m = dbmail_message_new(NULL);
+	m = dbmail_message_init_with_string(m, multipart_message);
+	decoded = dbmail_message_get_header_decoded(m, "Received");
+	fail_unless(g_list_length(decoded) == 3);
+	fail_unless(strstr((char *)decoded->data, "mx.inter7.com") != NULL,
+			"first Received is [%s]", (char *)decoded->data);
+	g_list_destroy(decoded);
+
+	decoded = dbmail_message_get_header_decoded(m, "X-Not-There");
+	fail_unless(decoded == NULL);
+	dbmail_message_free(m);
+}
+END_TEST
 
 START_TEST(test_dbmail_message_construct)
 {
@@ -977,6 +1239,175 @@ int test_db_get_subject(uint64_t physid, char **subject)
         return t;
 }
 
+/* the mimepart ids of a stored message, in part order */
+static char * test_db_get_parts(uint64_t physid)
+{
+	Connection_T c; ResultSet_T r;
+	GString *parts = g_string_new("");
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT part_id FROM %spartlists WHERE physmessage_id = %" PRIu64 " "
+				"ORDER BY part_key, part_depth, part_order", DBPFX, physid);
+		while (db_result_next(r))
+			g_string_append_printf(parts, "%" PRIu64 " ", db_result_get_u64(r, 0));
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return g_string_free(parts, FALSE);
+}
+
+/* test hooks in dm_message.c, not part of the public API */
+extern void dbmail_message_blob_reset(void);
+extern gboolean dbmail_message_blob_wait(void);
+extern void dbmail_message_blob_stats(unsigned *lookups, unsigned *skipped);
+
+/* re-read the configuration with the mimepart dedup settings changed */
+static char * test_blob_config(const char *dedup, const char *filter)
+{
+	GKeyFile *k = g_key_file_new();
+	char *data, *tmpname = NULL;
+	gsize len;
+	int fd;
+
+	fail_unless(g_key_file_load_from_file(k, configFile, G_KEY_FILE_NONE, NULL));
+	g_key_file_set_value(k, "DBMAIL", "hash_algorithm", "sha256");
+	g_key_file_set_value(k, "DBMAIL", "blob_dedup", dedup);
+	g_key_file_set_value(k, "DBMAIL", "blob_filter", filter);
+	g_key_file_set_value(k, "DBMAIL", "blob_filter_size", "1");
+	data = g_key_file_to_data(k, &len, NULL);
+	fd = g_file_open_tmp("dbmail-conf-XXXXXX", &tmpname, NULL);
+	fail_unless(fd >= 0);
+	fail_unless(write(fd, data, len) == (ssize_t)len);
+	close(fd);
+	g_free(data);
+	g_key_file_free(k);
+
+	config_read(tmpname);
+	dbmail_message_blob_reset();
+	return tmpname;
+}
+
+static uint64_t test_blob_store(const char *raw, char **parts)
+{
+	DbmailMessage *m = dbmail_message_new(NULL);
+	uint64_t physid;
+
+	m = dbmail_message_init_with_string(m, raw);
+	fail_unless(dbmail_message_store(m) == 0);
+	physid = dbmail_message_get_physid(m);
+	dbmail_message_free(m);
+
+	*parts = test_db_get_parts(physid);
+	return physid;
+}
+
+START_TEST(test_dbmail_message_blob_dedup)
+{
+	char *tmpconf, *first, *second, *raw;
+	unsigned lookups, skipped;
+
+	/* hash-only: a second copy reuses every stored part */
+	tmpconf = test_blob_config("hash", "no");
+	test_blob_store(multipart_message, &first);
+	test_blob_store(multipart_message, &second);
+	fail_unless(strlen(first) > 0);
+	fail_unless(MATCH(first, second), "parts not shared [%s] [%s]", first, second);
+	g_free(first);
+	g_free(second);
+	unlink(tmpconf);
+	g_free(tmpconf);
+
+	/* with the filter, lookups are done until it is loaded */
+	tmpconf = test_blob_config("hash", "yes");
+	test_blob_store(multipart_message, &first);
+	fail_unless(dbmail_message_blob_wait(), "blob filter failed to load");
+	dbmail_message_blob_stats(&lookups, &skipped);
+	fail_unless(lookups > 0 && skipped == 0);
+
+	/* known parts hit the filter and are still shared */
+	test_blob_store(multipart_message, &second);
+	dbmail_message_blob_stats(&lookups, &skipped);
+	fail_unless(skipped == 0, "known part missed the filter");
+	fail_unless(MATCH(first, second), "parts not shared [%s] [%s]", first, second);
+	g_free(first);
+	g_free(second);
+
+	/* new parts miss it and skip the lookup */
+	raw = g_strdup_printf("From: <sender@example.org>\n"
+			"Subject: blob filter %" PRId64 "\n"
+			"\n"
+			"unique body %" PRId64 "\n", g_get_real_time(), g_get_real_time());
+	test_blob_store(raw, &first);
+	dbmail_message_blob_stats(&lookups, &skipped);
+	fail_unless(skipped >= 2, "new parts hit the filter [%u]", skipped);
+	g_free(first);
+	g_free(raw);
+
+	unlink(tmpconf);
+	g_free(tmpconf);
+	config_read(configFile);
+	dbmail_message_blob_reset();
+}
+END_TEST
+
+START_TEST(test_dbmail_message_cache_bodystructure)
+{
+	Connection_T c; ResultSet_T r;
+	DbmailMessage *m, *n;
+	uint64_t physid;
+	char *structure, *body;
+	volatile int found = 0;
+	GList *lost = NULL;
+
+	m = dbmail_message_new(NULL);
+	m = dbmail_message_init_with_string(m, multipart_message);
+	dbmail_message_store(m);
+	physid = dbmail_message_get_physid(m);
+
+	/* the cache must match what FETCH computes from the stored message */
+	n = dbmail_message_new(NULL);
+	n = dbmail_message_retrieve(n, physid);
+	fail_unless(n != NULL, "retrieve of stored message failed");
+	structure = imap_get_structure(GMIME_MESSAGE(n->content), 1);
+	body = imap_get_structure(GMIME_MESSAGE(n->content), 0);
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT bodystructure, body FROM %sbodystructure "
+				"WHERE physmessage_id = %" PRIu64 "", DBPFX, physid);
+		if (db_result_next(r)) {
+			found = 1;
+			fail_unless(MATCH(db_result_get(r, 0), structure), "bodystructure mismatch");
+			fail_unless(MATCH(db_result_get(r, 1), body), "body mismatch");
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+	fail_unless(found, "bodystructure not cached at store time");
+
+	/* backfill */
+	db_update("DELETE FROM %sbodystructure WHERE physmessage_id = %" PRIu64 "", DBPFX, physid);
+	fail_unless(db_icheck_bodystructure(&lost) == DM_SUCCESS);
+	fail_unless(g_list_length(lost) > 0, "missing bodystructure not detected");
+	db_set_bodystructure(lost);
+	g_list_destroy(lost);
+	lost = NULL;
+	db_icheck_bodystructure(&lost);
+	fail_unless(g_list_length(lost) == 0, "bodystructure backfill failed");
+
+	g_free(structure);
+	g_free(body);
+	dbmail_message_free(n);
+	dbmail_message_free(m);
+}
+END_TEST
+
 START_TEST(test_dbmail_message_utf8_headers)
 {
 	DbmailMessage *m;
@@ -1028,8 +1459,13 @@ Suite *dbmail_message_suite(void)
 	tcase_add_test(tc_message, test_g_mime_object_get_body);
 	tcase_add_test(tc_message, test_dbmail_message_store);
 	tcase_add_test(tc_message, test_dbmail_message_store2);
+	tcase_add_test(tc_message, test_dbmail_message_blob_dedup);
 	tcase_add_test(tc_message, test_dbmail_message_retrieve);
+	tcase_add_test(tc_message, test_dbmail_message_stream);
+	tcase_add_test(tc_message, test_dbmail_message_stream_large);
+	tcase_add_test(tc_message, test_dbmail_message_stream_slices);
 	tcase_add_test(tc_message, test_dbmail_message_init_with_string);
+	tcase_add_test(tc_message, test_dbmail_message_init_with_stream);
 	tcase_add_test(tc_message, test_dbmail_message_to_string);
 	tcase_add_test(tc_message, test_dbmail_message_hdrs_to_string);
 	tcase_add_test(tc_message, test_dbmail_message_body_to_string);
@@ -1041,11 +1477,13 @@ Suite *dbmail_message_suite(void)
 	tcase_add_test(tc_message, test_dbmail_message_8bit);
 	tcase_add_test(tc_message, test_dbmail_message_get_header_addresses);
 	tcase_add_test(tc_message, test_dbmail_message_get_header_repeated);
+	tcase_add_test(tc_message, test_dbmail_message_get_header_decoded);
 	tcase_add_test(tc_message, test_dbmail_message_construct);
 	tcase_add_test(tc_message, test_dbmail_message_get_size);
 	tcase_add_test(tc_message, test_encoding);
 	tcase_add_test(tc_message, test_db_get_message_lines);
 	tcase_add_test(tc_message, test_dbmail_message_utf8_headers);
+	tcase_add_test(tc_message, test_dbmail_message_cache_bodystructure);
 	return s;
 }
 
@@ -244,6 +244,95 @@ START_TEST(test_dbmail_iconv_str_to_db)
 }
 END_TEST
 
+#define ICONV_LOOPS 20000
+
+/* test hook in dm_iconv.c, not part of the public API */
+extern void dbmail_iconv_stats(unsigned *opened, unsigned *reused);
+
+static gpointer iconv_worker(gpointer data)
+{
+	int i, *errors = (int *)data;
+	const char *latin1 = "L\xf6sung f\xfcr \xdcbergabe";
+	const char *expect = "L\xc3\xb6sung f\xc3\xbcr \xc3\x9cbergabe";
+
+	for (i = 0; i < ICONV_LOOPS; i++) {
+		char *u8 = dbmail_iconv_str_to_utf8(latin1, "iso-8859-1");
+		if (! MATCH(u8, expect))
+			(*errors)++;
+		g_free(u8);
+	}
+	return NULL;
+}
+
+/* return conversions per second using nthreads threads */
+static double iconv_rate(int nthreads, int *errors)
+{
+	GThread *threads[8];
+	gint64 start, elapsed;
+	int i;
+
+	start = g_get_monotonic_time();
+	for (i = 0; i < nthreads; i++)
+		threads[i] = g_thread_new("iconv", iconv_worker, &errors[i]);
+	for (i = 0; i < nthreads; i++)
+		g_thread_join(threads[i]);
+	elapsed = max(g_get_monotonic_time() - start, 1);
+
+	return (double)nthreads * ICONV_LOOPS * G_USEC_PER_SEC / elapsed;
+}
+
+START_TEST(test_dbmail_iconv_threads)
+{
+	int errors[8] = { 0 };
+	int i, n = MIN(g_get_num_processors(), 4);
+	unsigned opened, reused, opened2, reused2;
+	double single, multi;
+	char charset[32];
+	const char *latin1 = "L\xf6sung";
+
+	single = iconv_rate(1, errors);
+	multi = iconv_rate(n, errors);
+
+	for (i = 0; i < 8; i++)
+		fail_unless(errors[i] == 0, "conversion failed in thread [%d]", i);
+
+	/* wall-clock rates depend on the host; report them only */
+	TRACE(TRACE_INFO, "iconv conversions/s: 1 thread [%.0f] %d threads [%.0f]", single, n, multi);
+
+	/* more charset pairs than the per-thread cache holds, half of
+	 * them unknown, must not break later conversions */
+	for (i = 0; i < 64; i++) {
+		g_snprintf(charset, sizeof(charset), (i % 2) ? "iso-8859-%d" : "x-unknown-%d", i / 2 % 16 + 1);
+		g_free(dbmail_iconv_str_to_utf8("L\xf6sung", charset));
+	}
+	iconv_worker(&errors[0]);
+	fail_unless(errors[0] == 0, "conversion failed after cache churn");
+
+	/* the converter for a pair is opened once, then reused */
+	dbmail_iconv_stats(&opened, &reused);
+	iconv_worker(&errors[0]);
+	dbmail_iconv_stats(&opened2, &reused2);
+	fail_unless(opened2 - opened <= 1, "converter opened [%u] times", opened2 - opened);
+	fail_unless(reused2 - reused >= ICONV_LOOPS - 1, "converter reused [%u] times", reused2 - reused);
+
+	/* a full cache closes the least recently used converter only */
+	for (i = 0; i < 42; i++) {
+		const char *fmt[] = { "iso-8859-%d", "ISO8859-%d", "ISO_8859-%d" };
+		int part = i / 3 + 2;
+		if (part >= 12)
+			part++;
+		g_snprintf(charset, sizeof(charset), fmt[i % 3], part);
+		g_free(dbmail_iconv_str_to_utf8(latin1, charset));
+		g_free(dbmail_iconv_str_to_utf8(latin1, "iso-8859-1"));
+	}
+	dbmail_iconv_stats(&opened, &reused);
+	g_free(dbmail_iconv_str_to_utf8(latin1, "iso-8859-1"));
+	dbmail_iconv_stats(&opened2, &reused2);
+	fail_unless(opened2 == opened, "recently used converter was closed");
+	fail_unless(reused2 == reused + 1);
+}
+END_TEST
+
 START_TEST(test_dbmail_iconv_decode_address)
 {
 	char *u71 = "=?iso-8859-1?Q?::_=5B_Arrty_=5D_::_=5B_Roy_=28L=29_St=E8phanie_=5D?=  <over.there@hotmail.com>";
@@ -568,6 +657,7 @@ Suite *dbmail_misc_suite(void)
 	tcase_add_test(tc_misc, test_mailbox_remove_namespace);
 	tcase_add_test(tc_misc, test_dbmail_iconv_str_to_db);
 	tcase_add_test(tc_misc, test_dbmail_iconv_decode_address);
+	tcase_add_test(tc_misc, test_dbmail_iconv_threads);
 	tcase_add_test(tc_misc, test_create_unique_id);
 	tcase_add_test(tc_misc, test_g_list_merge);
  	tcase_add_test(tc_misc, test_dm_strtoull);
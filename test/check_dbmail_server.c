@@ -97,6 +97,197 @@ START_TEST(test_dm_sock_score)
 }
 END_TEST
 
+/* a local client on the other end of a socketpair */
+START_TEST(test_ci_compress)
+{
+	int sv[2], i;
+	Mempool_T pool = mempool_open();
+	client_sock *c = mempool_pop(pool, sizeof(client_sock));
+	ClientBase_T *ci;
+	GString *plain = g_string_new("");
+	char wire[65536], out[262144], in[256];
+	ssize_t n;
+	uint64_t tx;
+	z_stream zc, zd;
+
+	fail_unless(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	c->pool = pool;
+	c->sock = sv[0];
+	ci = client_init(c);
+	ci->rx = ci->tx = sv[0];
+	UNBLOCK(sv[0]);
+
+	fail_unless(ci_compress(ci) == DM_SUCCESS);
+	fail_unless(ci_compress(ci) != DM_SUCCESS);
+
+	/* server to client: a FETCH-like response */
+	for (i = 1; i <= 500; i++)
+		g_string_append_printf(plain, "* %d FETCH (UID %d FLAGS (\\Seen) RFC822.SIZE 1234)\r\n", i, i);
+	fail_unless(ci_write(ci, "%s", plain->str) == 1);
+	fail_unless(ci->zbytes_tx == plain->len);
+	fail_unless(ci->bytes_tx < plain->len / 4, "poor compression [%" PRIu64 "/%zu]", ci->bytes_tx, plain->len);
+
+	/* each write is sync flushed: everything can be inflated right away */
+	n = read(sv[1], wire, sizeof(wire));
+	fail_unless(n == (ssize_t)ci->bytes_tx);
+	memset(&zd, 0, sizeof(zd));
+	inflateInit2(&zd, -MAX_WBITS);
+	zd.next_in = (Bytef *)wire;
+	zd.avail_in = n;
+	zd.next_out = (Bytef *)out;
+	zd.avail_out = sizeof(out);
+	inflate(&zd, Z_SYNC_FLUSH);
+	fail_unless(zd.avail_in == 0);
+	fail_unless(sizeof(out) - zd.avail_out == plain->len);
+	fail_unless(strncmp(out, plain->str, plain->len) == 0);
+
+	/* pipelined replies while corked share one flush on uncork */
+	tx = ci->bytes_tx;
+	ci_cork(ci);
+	for (i = 1; i <= 500; i++)
+		fail_unless(ci_write(ci, "* %d FETCH (UID %d FLAGS (\\Seen) RFC822.SIZE 1234)\r\n", i, i) >= 0);
+	ci_uncork(ci);
+	fail_unless(ci_write(ci, NULL) == 1);
+	fail_unless(ci->bytes_tx - tx < plain->len / 4, "poor compression while corked [%" PRIu64 "/%zu]",
+			ci->bytes_tx - tx, plain->len);
+
+	n = read(sv[1], wire, sizeof(wire));
+	fail_unless(n == (ssize_t)(ci->bytes_tx - tx));
+	zd.next_in = (Bytef *)wire;
+	zd.avail_in = n;
+	zd.next_out = (Bytef *)out;
+	zd.avail_out = sizeof(out);
+	inflate(&zd, Z_SYNC_FLUSH);
+	fail_unless(zd.avail_in == 0);
+	fail_unless(sizeof(out) - zd.avail_out == plain->len, "corked replies not flushed on uncork");
+	fail_unless(strncmp(out, plain->str, plain->len) == 0);
+	inflateEnd(&zd);
+
+	/* client to server */
+	memset(&zc, 0, sizeof(zc));
+	deflateInit2(&zc, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+	zc.next_in = (Bytef *)"a1 NOOP\r\n";
+	zc.avail_in = 9;
+	zc.next_out = (Bytef *)wire;
+	zc.avail_out = sizeof(wire);
+	deflate(&zc, Z_SYNC_FLUSH);
+	fail_unless(write(sv[1], wire, sizeof(wire) - zc.avail_out) > 0);
+	deflateEnd(&zc);
+
+	ci_read_cb(ci);
+	memset(in, 0, sizeof(in));
+	fail_unless(ci_readln(ci, in) == 9);
+	fail_unless(strcmp(in, "a1 NOOP\r\n") == 0, "[%s]", in);
+
+	g_string_free(plain, TRUE);
+	close(sv[1]);
+	ci_close(ci);
+	mempool_close(&pool);
+}
+END_TEST
+
+extern struct event_base *evbase;
+
+#define REACTORS 3
+
+START_TEST(test_reactors)
+{
+	int i = 0, tries;
+
+	evthread_use_pthreads();
+	evbase = event_base_new();
+	server_reactors_init(REACTORS);
+	server_reactors_start();
+	for (i = 0; i < REACTORS; i++)
+		fail_unless(server_reactor_get(i)->running, "reactor [%d] not started", i);
+	fail_unless(server_reactor_get(REACTORS) == NULL);
+
+#ifdef EVLOOP_NO_EXIT_ON_EMPTY
+	/* a reload reaches every reactor, on its own thread */
+	server_reactors_reload();
+	for (tries = 0; tries < 100; tries++) {
+		event_base_loop(evbase, EVLOOP_NONBLOCK);
+		for (i = 0; i < REACTORS; i++)
+			if (server_reactor_get(i)->reloads != 1)
+				break;
+		if (i == REACTORS)
+			break;
+		g_usleep(10000);
+	}
+	fail_unless(i == REACTORS, "reactor [%d] missed the reload", i);
+#else
+	(void)tries;
+#endif
+
+	/* every thread is stopped and joined before anything is freed */
+	server_reactors_stop();
+	for (i = 0; i < REACTORS; i++)
+		fail_unless(! server_reactor_get(i)->running, "reactor [%d] still running", i);
+	server_reactors_free();
+	fail_unless(server_reactor_get(0) == NULL);
+
+	event_base_free(evbase);
+	evbase = NULL;
+}
+END_TEST
+
+extern SSL_CTX *tls_context;
+
+static void tls_keyfile(const char *path, const char *secret)
+{
+	fail_unless(g_file_set_contents(path, secret, -1, NULL));
+	if (tls_context)
+		SSL_CTX_free(tls_context);
+	tls_context = tls_init();
+}
+
+START_TEST(test_tls_tickets)
+{
+	ServerConfig_T conf;
+	unsigned char name[16], aes[EVP_MAX_MD_SIZE], mac[EVP_MAX_MD_SIZE];
+	unsigned char aes2[EVP_MAX_MD_SIZE], mac2[EVP_MAX_MD_SIZE];
+	time_t now = time(NULL);
+	char *keyfile = NULL;
+	int fd;
+
+	fd = g_file_open_tmp("dbmail-tickets-XXXXXX", &keyfile, NULL);
+	fail_unless(fd >= 0);
+	close(fd);
+
+	memset(&conf, 0, sizeof(conf));
+	g_strlcpy(conf.service_name, "IMAP", FIELDSIZE);
+	g_strlcpy(conf.tls_ticket_keyfile, keyfile, FIELDSIZE);
+	conf.tls_ticket_rotation = 3600;
+
+	tls_keyfile(keyfile, "0123456789abcdef0123456789abcdef");
+	tls_load_sessions(&conf);
+
+	fail_unless(tls_ticket_keys(name, 1, now, aes, mac) == 1);
+	fail_unless(tls_ticket_keys(name, 0, now, aes2, mac2) == 1);
+	fail_unless(memcmp(aes, aes2, 32) == 0 && memcmp(mac, mac2, 32) == 0);
+
+	/* the previous period is accepted and renewed, older ones are not */
+	fail_unless(tls_ticket_keys(name, 0, now + 3600, aes2, mac2) == 2);
+	fail_unless(memcmp(aes, aes2, 32) == 0 && memcmp(mac, mac2, 32) == 0);
+	fail_unless(tls_ticket_keys(name, 0, now + 7200, aes2, mac2) == 0);
+
+	/* another process reading the same key file */
+	tls_keyfile(keyfile, "0123456789abcdef0123456789abcdef");
+	tls_load_sessions(&conf);
+	fail_unless(tls_ticket_keys(name, 0, now, aes2, mac2) == 1, "ticket keys not shared");
+
+	/* a different secret */
+	tls_keyfile(keyfile, "fedcba9876543210fedcba9876543210");
+	tls_load_sessions(&conf);
+	fail_unless(tls_ticket_keys(name, 0, now, aes2, mac2) == 0, "foreign ticket accepted");
+
+	SSL_CTX_free(tls_context);
+	tls_context = NULL;
+	unlink(keyfile);
+	g_free(keyfile);
+}
+END_TEST
+
 Suite *dbmail_server_suite(void)
 {
 	Suite *s = suite_create("Dbmail Server");
@@ -111,6 +302,9 @@ Suite *dbmail_server_suite(void)
 	tcase_add_checked_fixture(tc_server, setup, teardown);
 	tcase_add_test(tc_server, test_dm_sock_compare);
 	tcase_add_test(tc_server, test_dm_sock_score);
+	tcase_add_test(tc_server, test_ci_compress);
+	tcase_add_test(tc_server, test_reactors);
+	tcase_add_test(tc_server, test_tls_tickets);
 	
 	return s;
 }